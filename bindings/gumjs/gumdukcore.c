@@ -3595,7 +3595,12 @@ gum_duk_message_sink_free (GumDukMessageSink * sink)
   g_slice_free (GumDukMessageSink, sink);
 }
 
-GUMJS_DEFINE_FINALIZER (gum_duk_message_data_finalize)
+/*
+ * Finalizer for ArrayBuffers whose external data we handed over to JS, also
+ * used by the event sink for drained events.
+ */
+int
+_gum_duk_message_data_finalize (duk_context * ctx)
 {
   gpointer data;
 
@@ -3631,7 +3636,7 @@ gum_duk_message_sink_post (GumDukMessageSink * self,
     duk_swap (ctx, -2, -1);
     duk_pop (ctx);
 
-    duk_push_c_function (ctx, gum_duk_message_data_finalize, 1);
+    duk_push_c_function (ctx, _gum_duk_message_data_finalize, 1);
     duk_set_finalizer (ctx, -2);
   }
   else
@@ -192,6 +192,7 @@ G_GNUC_INTERNAL void _gum_duk_core_unpin (GumDukCore * self);
 
 G_GNUC_INTERNAL void _gum_duk_core_post (GumDukCore * self,
     const gchar * message, GBytes * data);
+G_GNUC_INTERNAL int _gum_duk_message_data_finalize (duk_context * ctx);
 
 G_GNUC_INTERNAL void _gum_duk_core_push_job (GumDukCore * self,
     GumScriptJobFunc job_func, gpointer data, GDestroyNotify data_destroy);
@@ -8,6 +8,7 @@
 
 #include "gumdukvalue.h"
 
+#include <gum/gumcompactevent.h>
 #include <gum/gumspinlock.h>
 #include <string.h>
 
@@ -16,28 +17,39 @@ static void gum_duk_event_sink_iface_init (gpointer g_iface,
 static void gum_duk_event_sink_dispose (GObject * obj);
 static void gum_duk_event_sink_finalize (GObject * obj);
 static GumEventType gum_duk_event_sink_query_mask (GumEventSink * sink);
+static gboolean gum_duk_event_sink_query_call_summary (GumEventSink * sink);
 static void gum_duk_event_sink_start (GumEventSink * sink);
 static void gum_duk_event_sink_process (GumEventSink * sink,
     const GumEvent * ev);
+static void gum_duk_event_sink_process_batch (GumEventSink * sink,
+    const GumEvent * events, guint n_events);
+static void gum_duk_event_sink_process_call_summary (GumEventSink * sink,
+    const GumCallCount * counts, guint n_counts);
 static void gum_duk_event_sink_flush (GumEventSink * sink);
 static void gum_duk_event_sink_stop (GumEventSink * sink);
 static gboolean gum_duk_event_sink_stop_when_idle (GumDukEventSink * self);
 static gboolean gum_duk_event_sink_drain (GumDukEventSink * self);
+static void gum_duk_push_events (duk_context * ctx, gpointer events,
+    gsize size);
+static void gum_duk_push_drops (duk_context * ctx, GArray * drops);
 
 struct _GumDukEventSink
 {
   GObject parent;
 
   GumSpinlock lock;
-  GArray * queue;
-  guint queue_capacity;
+  GumEventQueue * queue;
   guint queue_drain_interval;
+  GHashTable * call_summary;
 
   GumDukCore * core;
   GMainContext * main_context;
   GumEventType event_mask;
+  gboolean want_call_summary;
+  gboolean compact;
   GumDukHeapPtr on_receive;
   GumDukHeapPtr on_call_summary;
+  GumDukHeapPtr on_drop;
   GSource * source;
 };
 
@@ -64,8 +76,11 @@ gum_duk_event_sink_iface_init (gpointer g_iface,
   GumEventSinkInterface * iface = g_iface;
 
   iface->query_mask = gum_duk_event_sink_query_mask;
+  iface->query_call_summary = gum_duk_event_sink_query_call_summary;
   iface->start = gum_duk_event_sink_start;
   iface->process = gum_duk_event_sink_process;
+  iface->process_batch = gum_duk_event_sink_process_batch;
+  iface->process_call_summary = gum_duk_event_sink_process_call_summary;
   iface->flush = gum_duk_event_sink_flush;
   iface->stop = gum_duk_event_sink_stop;
 }
@@ -93,6 +108,7 @@ gum_duk_event_sink_release_core (GumDukEventSink * self)
 
     _gum_duk_unprotect (ctx, g_steal_pointer (&self->on_receive));
     _gum_duk_unprotect (ctx, g_steal_pointer (&self->on_call_summary));
+    _gum_duk_unprotect (ctx, g_steal_pointer (&self->on_drop));
 
     _gum_duk_scope_leave (&scope);
   }
@@ -115,7 +131,9 @@ gum_duk_event_sink_finalize (GObject * obj)
 
   g_assert (self->source == NULL);
 
-  g_array_free (self->queue, TRUE);
+  gum_event_queue_free (self->queue);
+  if (self->call_summary != NULL)
+    g_hash_table_unref (self->call_summary);
 
   G_OBJECT_CLASS (gum_duk_event_sink_parent_class)->finalize (obj);
 }
@@ -127,20 +145,30 @@ gum_duk_event_sink_new (duk_context * ctx,
   GumDukEventSink * sink;
 
   sink = g_object_new (GUM_DUK_TYPE_EVENT_SINK, NULL);
-  sink->queue = g_array_sized_new (FALSE, FALSE, sizeof (GumEvent),
-      options->queue_capacity);
-  sink->queue_capacity = options->queue_capacity;
+  sink->queue = gum_event_queue_new (options->queue_capacity,
+      options->queue_policy);
   sink->queue_drain_interval = options->queue_drain_interval;
 
   g_object_ref (options->core->script);
   sink->core = options->core;
   sink->main_context = options->main_context;
   sink->event_mask = options->event_mask;
+  sink->compact = options->compact;
 
   sink->on_receive = options->on_receive;
   _gum_duk_protect (ctx, sink->on_receive);
   sink->on_call_summary = options->on_call_summary;
   _gum_duk_protect (ctx, sink->on_call_summary);
+  sink->on_drop = options->on_drop;
+  _gum_duk_protect (ctx, sink->on_drop);
+
+  /* Nobody will look at the events, so have Stalker count calls for us */
+  if (sink->on_receive == NULL && sink->on_call_summary != NULL &&
+      (sink->event_mask & GUM_CALL) != 0)
+  {
+    sink->event_mask = GUM_CALL;
+    sink->want_call_summary = TRUE;
+  }
 
   return GUM_EVENT_SINK (sink);
 }
@@ -151,6 +179,12 @@ gum_duk_event_sink_query_mask (GumEventSink * sink)
   return GUM_DUK_EVENT_SINK (sink)->event_mask;
 }
 
+static gboolean
+gum_duk_event_sink_query_call_summary (GumEventSink * sink)
+{
+  return GUM_DUK_EVENT_SINK (sink)->want_call_summary;
+}
+
 static void
 gum_duk_event_sink_start (GumEventSink * sink)
 {
@@ -168,9 +202,42 @@ gum_duk_event_sink_process (GumEventSink * sink,
 {
   GumDukEventSink * self = GUM_DUK_EVENT_SINK_CAST (sink);
 
+  gum_event_queue_push (self->queue, ev, 1);
+}
+
+static void
+gum_duk_event_sink_process_batch (GumEventSink * sink,
+                                  const GumEvent * events,
+                                  guint n_events)
+{
+  GumDukEventSink * self = GUM_DUK_EVENT_SINK_CAST (sink);
+
+  gum_event_queue_push (self->queue, events, n_events);
+}
+
+static void
+gum_duk_event_sink_process_call_summary (GumEventSink * sink,
+                                         const GumCallCount * counts,
+                                         guint n_counts)
+{
+  GumDukEventSink * self = GUM_DUK_EVENT_SINK_CAST (sink);
+  guint i;
+
   gum_spinlock_acquire (&self->lock);
-  if (self->queue->len != self->queue_capacity)
-    g_array_append_val (self->queue, *ev);
+
+  if (self->call_summary == NULL)
+    self->call_summary = g_hash_table_new (NULL, NULL);
+
+  for (i = 0; i != n_counts; i++)
+  {
+    const GumCallCount * c = &counts[i];
+    gsize n;
+
+    n = GPOINTER_TO_SIZE (g_hash_table_lookup (self->call_summary, c->target));
+    n += c->count;
+    g_hash_table_insert (self->call_summary, c->target, GSIZE_TO_POINTER (n));
+  }
+
   gum_spinlock_release (&self->lock);
 }
 
@@ -206,6 +273,8 @@ gum_duk_event_sink_stop_when_idle (GumDukEventSink * self)
 {
   gum_duk_event_sink_drain (self);
 
+  gum_event_queue_close (self->queue);
+
   g_object_ref (self);
 
   g_source_destroy (self->source);
@@ -223,40 +292,43 @@ static gboolean
 gum_duk_event_sink_drain (GumDukEventSink * self)
 {
   GumDukCore * core = self->core;
-  gpointer buffer_data;
-  guint len, size;
+  gpointer events;
+  guint len;
+  GHashTable * frequencies;
+  GArray * drops;
   GumDukScope scope;
   duk_context * ctx;
 
   if (core == NULL)
     return FALSE;
 
-  len = self->queue->len;
-  if (len == 0)
-    return TRUE;
-  size = len * sizeof (GumEvent);
+  gum_spinlock_acquire (&self->lock);
+  frequencies = g_steal_pointer (&self->call_summary);
+  gum_spinlock_release (&self->lock);
 
-  ctx = _gum_duk_scope_enter (&scope, core);
+  events = gum_event_queue_drain (self->queue, &len);
 
-  buffer_data = duk_push_fixed_buffer (ctx, size);
-  memcpy (buffer_data, self->queue->data, size);
+  drops = gum_event_queue_collect_drops (self->queue);
+  if (self->on_drop == NULL || drops->len == 0)
+    g_clear_pointer (&drops, g_array_unref);
 
-  gum_spinlock_acquire (&self->lock);
-  g_array_remove_range (self->queue, 0, len);
-  gum_spinlock_release (&self->lock);
+  if (len == 0 && frequencies == NULL && drops == NULL)
+    return TRUE;
+
+  ctx = _gum_duk_scope_enter (&scope, core);
 
   if (self->on_call_summary != NULL)
   {
-    GHashTable * frequencies;
     GumCallEvent * ev;
     guint i;
     GHashTableIter iter;
     gpointer target, count;
     gchar target_str[32];
 
-    frequencies = g_hash_table_new (NULL, NULL);
+    if (frequencies == NULL)
+      frequencies = g_hash_table_new (NULL, NULL);
 
-    ev = buffer_data;
+    ev = events;
     for (i = 0; i != len; i++)
     {
       if (ev->type == GUM_CALL)
@@ -284,23 +356,48 @@ gum_duk_event_sink_drain (GumDukEventSink * self)
       duk_put_prop_string (ctx, -2, target_str);
     }
 
-    g_hash_table_unref (frequencies);
-
     _gum_duk_scope_call (&scope, 1);
     duk_pop (ctx);
   }
 
-  if (self->on_receive != NULL)
+  if (frequencies != NULL)
+    g_hash_table_unref (frequencies);
+
+  if (self->on_receive != NULL && len != 0)
   {
-    duk_push_heapptr (ctx, self->on_receive);
+    gsize size;
+
+    if (self->compact)
+    {
+      gpointer compact_events;
+
+      compact_events = gum_compact_events_encode (events, len, &size);
+      g_free (events);
+      events = compact_events;
+    }
+    else
+    {
+      size = len * sizeof (GumEvent);
+    }
 
-    duk_push_buffer_object (ctx, -2, 0, size, DUK_BUFOBJ_ARRAYBUFFER);
+    duk_push_heapptr (ctx, self->on_receive);
+    gum_duk_push_events (ctx, events, size);
 
     _gum_duk_scope_call (&scope, 1);
-    duk_pop_2 (ctx);
+    duk_pop (ctx);
   }
   else
   {
+    g_free (events);
+  }
+
+  if (drops != NULL)
+  {
+    duk_push_heapptr (ctx, self->on_drop);
+    gum_duk_push_drops (ctx, drops);
+    g_array_unref (drops);
+
+    _gum_duk_scope_call (&scope, 1);
     duk_pop (ctx);
   }
 
@@ -308,3 +405,45 @@ gum_duk_event_sink_drain (GumDukEventSink * self)
 
   return TRUE;
 }
+
+/*
+ * Hands the drained events to JS as-is, leaving it to the ArrayBuffer's
+ * finalizer to free them.
+ */
+static void
+gum_duk_push_events (duk_context * ctx,
+                     gpointer events,
+                     gsize size)
+{
+  duk_push_external_buffer (ctx);
+  duk_config_buffer (ctx, -1, events, size);
+
+  duk_push_buffer_object (ctx, -1, 0, size, DUK_BUFOBJ_ARRAYBUFFER);
+
+  duk_swap (ctx, -2, -1);
+  duk_pop (ctx);
+
+  duk_push_c_function (ctx, _gum_duk_message_data_finalize, 1);
+  duk_set_finalizer (ctx, -2);
+}
+
+static void
+gum_duk_push_drops (duk_context * ctx,
+                    GArray * drops)
+{
+  guint i;
+  gchar thread_id_str[32];
+
+  duk_push_object (ctx);
+
+  for (i = 0; i != drops->len; i++)
+  {
+    const GumEventQueueDrop * drop =
+        &g_array_index (drops, GumEventQueueDrop, i);
+
+    sprintf (thread_id_str, "%" G_GSIZE_MODIFIER "u",
+        (gsize) drop->thread_id);
+    duk_push_uint (ctx, drop->count);
+    duk_put_prop_string (ctx, -2, thread_id_str);
+  }
+}
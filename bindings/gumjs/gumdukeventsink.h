@@ -8,6 +8,7 @@
 #define __GUM_DUK_EVENT_SINK_H__
 
 #include "gumdukcore.h"
+#include "gumeventqueue.h"
 
 #include <gum/gumeventsink.h>
 
@@ -25,11 +26,14 @@ struct _GumDukEventSinkOptions
   GumDukCore * core;
   GMainContext * main_context;
   GumEventType event_mask;
+  gboolean compact;
   guint queue_capacity;
+  GumEventQueuePolicy queue_policy;
   guint queue_drain_interval;
 
   GumDukHeapPtr on_receive;
   GumDukHeapPtr on_call_summary;
+  GumDukHeapPtr on_drop;
 };
 
 G_GNUC_INTERNAL GumEventSink * gum_duk_event_sink_new (duk_context * ctx,
@@ -9,6 +9,8 @@
 #include "gumdukeventsink.h"
 #include "gumdukmacros.h"
 
+#include <gum/gumcompactevent.h>
+
 #define GUM_DUK_TYPE_CALLBACK_TRANSFORMER \
     (gum_duk_callback_transformer_get_type ())
 #define GUM_DUK_CALLBACK_TRANSFORMER_CAST(obj) \
@@ -70,9 +72,15 @@ static gboolean gum_duk_stalker_on_flush_timer_tick (GumDukStalker * self);
 GUMJS_DECLARE_GETTER (gumjs_stalker_get_trust_threshold)
 GUMJS_DECLARE_SETTER (gumjs_stalker_set_trust_threshold)
 
+GUMJS_DECLARE_GETTER (gumjs_stalker_get_event_buffer_capacity)
+GUMJS_DECLARE_SETTER (gumjs_stalker_set_event_buffer_capacity)
+
 GUMJS_DECLARE_GETTER (gumjs_stalker_get_queue_capacity)
 GUMJS_DECLARE_SETTER (gumjs_stalker_set_queue_capacity)
 
+GUMJS_DECLARE_GETTER (gumjs_stalker_get_queue_overflow_policy)
+GUMJS_DECLARE_SETTER (gumjs_stalker_set_queue_overflow_policy)
+
 GUMJS_DECLARE_GETTER (gumjs_stalker_get_queue_drain_interval)
 GUMJS_DECLARE_SETTER (gumjs_stalker_set_queue_drain_interval)
 
@@ -139,6 +147,8 @@ static GumDukProbeArgs * gum_duk_stalker_obtain_probe_args (
 static void gum_duk_stalker_release_probe_args (GumDukStalker * self,
     GumDukProbeArgs * args);
 
+static void gum_push_event_row (duk_context * ctx, const GumEvent * ev,
+    gboolean annotate, gboolean stringify, GumDukCore * core);
 static void gum_push_pointer (duk_context * ctx, gpointer value,
     gboolean stringify, GumDukCore * core);
 
@@ -149,11 +159,21 @@ static const GumDukPropertyEntry gumjs_stalker_values[] =
     gumjs_stalker_get_trust_threshold,
     gumjs_stalker_set_trust_threshold
   },
+  {
+    "eventBufferCapacity",
+    gumjs_stalker_get_event_buffer_capacity,
+    gumjs_stalker_set_event_buffer_capacity
+  },
   {
     "queueCapacity",
     gumjs_stalker_get_queue_capacity,
     gumjs_stalker_set_queue_capacity
   },
+  {
+    "queueOverflowPolicy",
+    gumjs_stalker_get_queue_overflow_policy,
+    gumjs_stalker_set_queue_overflow_policy
+  },
   {
     "queueDrainInterval",
     gumjs_stalker_get_queue_drain_interval,
@@ -167,11 +187,11 @@ static const duk_function_list_entry gumjs_stalker_functions[] =
 {
   { "flush", gumjs_stalker_flush, 0 },
   { "garbageCollect", gumjs_stalker_garbage_collect, 0 },
-  { "_follow", gumjs_stalker_follow, 5 },
+  { "_follow", gumjs_stalker_follow, 7 },
   { "unfollow", gumjs_stalker_unfollow, 1 },
   { "addCallProbe", gumjs_stalker_add_call_probe, 2 },
   { "removeCallProbe", gumjs_stalker_remove_call_probe, 1 },
-  { "_parse", gumjs_stalker_parse, 3 },
+  { "_parse", gumjs_stalker_parse, 4 },
 
   { NULL, NULL, 0 }
 };
@@ -200,6 +220,7 @@ _gum_duk_stalker_init (GumDukStalker * self,
 
   self->stalker = NULL;
   self->queue_capacity = 16384;
+  self->queue_overflow_policy = GUM_EVENT_QUEUE_DROP_NEWEST;
   self->queue_drain_interval = 250;
 
   self->flush_timer = NULL;
@@ -385,6 +406,27 @@ GUMJS_DEFINE_SETTER (gumjs_stalker_set_trust_threshold)
   return 0;
 }
 
+GUMJS_DEFINE_GETTER (gumjs_stalker_get_event_buffer_capacity)
+{
+  GumStalker * stalker = _gum_duk_stalker_get (gumjs_module_from_args (args));
+
+  duk_push_number (ctx, gum_stalker_get_event_buffer_capacity (stalker));
+  return 1;
+}
+
+GUMJS_DEFINE_SETTER (gumjs_stalker_set_event_buffer_capacity)
+{
+  GumStalker * stalker;
+  guint capacity;
+
+  stalker = _gum_duk_stalker_get (gumjs_module_from_args (args));
+
+  _gum_duk_args_parse (args, "u", &capacity);
+
+  gum_stalker_set_event_buffer_capacity (stalker, capacity);
+  return 0;
+}
+
 GUMJS_DEFINE_GETTER (gumjs_stalker_get_queue_capacity)
 {
   GumDukStalker * self = gumjs_module_from_args (args);
@@ -401,6 +443,31 @@ GUMJS_DEFINE_SETTER (gumjs_stalker_set_queue_capacity)
   return 0;
 }
 
+GUMJS_DEFINE_GETTER (gumjs_stalker_get_queue_overflow_policy)
+{
+  GumDukStalker * self = gumjs_module_from_args (args);
+
+  duk_push_string (ctx,
+      gum_event_queue_policy_to_string (self->queue_overflow_policy));
+  return 1;
+}
+
+GUMJS_DEFINE_SETTER (gumjs_stalker_set_queue_overflow_policy)
+{
+  GumDukStalker * self = gumjs_module_from_args (args);
+  const gchar * policy;
+
+  _gum_duk_args_parse (args, "s", &policy);
+
+  if (!gum_event_queue_policy_from_string (policy,
+      &self->queue_overflow_policy))
+  {
+    _gum_duk_throw (ctx, "expected 'drop-newest', 'drop-oldest' or 'block'");
+  }
+
+  return 0;
+}
+
 GUMJS_DEFINE_GETTER (gumjs_stalker_get_queue_drain_interval)
 {
   GumDukStalker * self = gumjs_module_from_args (args);
@@ -457,10 +524,12 @@ GUMJS_DEFINE_FUNCTION (gumjs_stalker_follow)
   so.core = core;
   so.main_context = gum_script_scheduler_get_js_context (core->scheduler);
   so.queue_capacity = module->queue_capacity;
+  so.queue_policy = module->queue_overflow_policy;
   so.queue_drain_interval = module->queue_drain_interval;
 
-  _gum_duk_args_parse (args, "ZF?uF?F?", &thread_id, &transformer_callback,
-      &so.event_mask, &so.on_receive, &so.on_call_summary);
+  _gum_duk_args_parse (args, "ZF?uF?F?F?t", &thread_id, &transformer_callback,
+      &so.event_mask, &so.on_receive, &so.on_call_summary, &so.on_drop,
+      &so.compact);
 
   if (transformer_callback != NULL)
   {
@@ -567,135 +636,58 @@ GUMJS_DEFINE_FUNCTION (gumjs_stalker_parse)
   GumDukStalker * module;
   GumDukCore * core;
   GumDukHeapPtr events_value;
-  gboolean annotate, stringify;
-  const GumEvent * events;
-  duk_size_t size, count;
+  gboolean annotate, stringify, compact;
+  const guint8 * data;
+  duk_size_t size;
   duk_uarridx_t row_index;
-  const GumEvent * ev;
 
   module = gumjs_module_from_args (args);
   core = module->core;
 
-  _gum_duk_args_parse (args, "Vtt", &events_value, &annotate, &stringify);
+  _gum_duk_args_parse (args, "Vttt", &events_value, &annotate, &stringify,
+      &compact);
 
-  events = duk_get_buffer_data (ctx, 0, &size);
-  if (events == NULL)
+  data = duk_get_buffer_data (ctx, 0, &size);
+  if (data == NULL)
     _gum_duk_throw (ctx, "expected an ArrayBuffer");
 
-  if (size % sizeof (GumEvent) != 0)
-    _gum_duk_throw (ctx, "invalid buffer shape");
-
-  count = size / sizeof (GumEvent);
-
   duk_push_array (ctx);
 
-  for (ev = events, row_index = 0; row_index != count; ev++, row_index++)
+  if (compact)
   {
-    duk_uarridx_t column_index = 0;
+    const guint8 * end = data + size;
+    GumCompactEventCursor cursor;
 
-    duk_push_array (ctx);
+    gum_compact_event_cursor_init (&cursor);
 
-    switch (ev->type)
+    for (row_index = 0; data != end; row_index++)
     {
-      case GUM_CALL:
-      {
-        const GumCallEvent * call = &ev->call;
-
-        if (annotate)
-        {
-          duk_push_string (ctx, "call");
-          duk_put_prop_index (ctx, -2, column_index++);
-        }
-
-        gum_push_pointer (ctx, call->location, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
-
-        gum_push_pointer (ctx, call->target, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
-
-        duk_push_int (ctx, call->depth);
-        duk_put_prop_index (ctx, -2, column_index++);
-
-        break;
-      }
-      case GUM_RET:
-      {
-        const GumRetEvent * ret = &ev->ret;
-
-        if (annotate)
-        {
-          duk_push_string (ctx, "ret");
-          duk_put_prop_index (ctx, -2, column_index++);
-        }
-
-        gum_push_pointer (ctx, ret->location, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
-
-        gum_push_pointer (ctx, ret->target, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
-
-        duk_push_int (ctx, ret->depth);
-        duk_put_prop_index (ctx, -2, column_index++);
-
-        break;
-      }
-      case GUM_EXEC:
-      {
-        const GumExecEvent * exec = &ev->exec;
-
-        if (annotate)
-        {
-          duk_push_string (ctx, "exec");
-          duk_put_prop_index (ctx, -2, column_index++);
-        }
-
-        gum_push_pointer (ctx, exec->location, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
-
-        break;
-      }
-      case GUM_BLOCK:
-      {
-        const GumBlockEvent * block = &ev->block;
-
-        if (annotate)
-        {
-          duk_push_string (ctx, "block");
-          duk_put_prop_index (ctx, -2, column_index++);
-        }
-
-        gum_push_pointer (ctx, block->begin, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
-
-        gum_push_pointer (ctx, block->end, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
+      GumEvent ev;
 
-        break;
-      }
-      case GUM_COMPILE:
-      {
-        const GumCompileEvent * compile = &ev->compile;
+      if (!gum_compact_event_decode (&cursor, &data, end, &ev))
+        _gum_duk_throw (ctx, "invalid event data");
 
-        if (annotate)
-        {
-          duk_push_string (ctx, "compile");
-          duk_put_prop_index (ctx, -2, column_index++);
-        }
+      gum_push_event_row (ctx, &ev, annotate, stringify, core);
+      duk_put_prop_index (ctx, -2, row_index);
+    }
+  }
+  else
+  {
+    const GumEvent * ev;
+    duk_size_t count;
 
-        gum_push_pointer (ctx, compile->begin, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
+    if (size % sizeof (GumEvent) != 0)
+      _gum_duk_throw (ctx, "invalid buffer shape");
 
-        gum_push_pointer (ctx, compile->end, stringify, core);
-        duk_put_prop_index (ctx, -2, column_index++);
+    count = size / sizeof (GumEvent);
 
-        break;
-      }
-      default:
-        _gum_duk_throw (ctx, "invalid event type");
-        return 0;
+    for (ev = (const GumEvent *) data, row_index = 0;
+        row_index != count;
+        ev++, row_index++)
+    {
+      gum_push_event_row (ctx, ev, annotate, stringify, core);
+      duk_put_prop_index (ctx, -2, row_index);
     }
-
-    duk_put_prop_index (ctx, -2, row_index);
   }
 
   return 1;
@@ -1230,6 +1222,117 @@ gum_duk_stalker_release_probe_args (GumDukStalker * self,
     gum_duk_probe_args_release (args);
 }
 
+static void
+gum_push_event_row (duk_context * ctx,
+                    const GumEvent * ev,
+                    gboolean annotate,
+                    gboolean stringify,
+                    GumDukCore * core)
+{
+  duk_uarridx_t column_index = 0;
+
+  duk_push_array (ctx);
+
+  switch (ev->type)
+  {
+    case GUM_CALL:
+    {
+      const GumCallEvent * call = &ev->call;
+
+      if (annotate)
+      {
+        duk_push_string (ctx, "call");
+        duk_put_prop_index (ctx, -2, column_index++);
+      }
+
+      gum_push_pointer (ctx, call->location, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      gum_push_pointer (ctx, call->target, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      duk_push_int (ctx, call->depth);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      break;
+    }
+    case GUM_RET:
+    {
+      const GumRetEvent * ret = &ev->ret;
+
+      if (annotate)
+      {
+        duk_push_string (ctx, "ret");
+        duk_put_prop_index (ctx, -2, column_index++);
+      }
+
+      gum_push_pointer (ctx, ret->location, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      gum_push_pointer (ctx, ret->target, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      duk_push_int (ctx, ret->depth);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      break;
+    }
+    case GUM_EXEC:
+    {
+      const GumExecEvent * exec = &ev->exec;
+
+      if (annotate)
+      {
+        duk_push_string (ctx, "exec");
+        duk_put_prop_index (ctx, -2, column_index++);
+      }
+
+      gum_push_pointer (ctx, exec->location, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      break;
+    }
+    case GUM_BLOCK:
+    {
+      const GumBlockEvent * block = &ev->block;
+
+      if (annotate)
+      {
+        duk_push_string (ctx, "block");
+        duk_put_prop_index (ctx, -2, column_index++);
+      }
+
+      gum_push_pointer (ctx, block->begin, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      gum_push_pointer (ctx, block->end, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      break;
+    }
+    case GUM_COMPILE:
+    {
+      const GumCompileEvent * compile = &ev->compile;
+
+      if (annotate)
+      {
+        duk_push_string (ctx, "compile");
+        duk_put_prop_index (ctx, -2, column_index++);
+      }
+
+      gum_push_pointer (ctx, compile->begin, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      gum_push_pointer (ctx, compile->end, stringify, core);
+      duk_put_prop_index (ctx, -2, column_index++);
+
+      break;
+    }
+    default:
+      _gum_duk_throw (ctx, "invalid event type");
+  }
+}
+
 static void
 gum_push_pointer (duk_context * ctx,
                   gpointer value,
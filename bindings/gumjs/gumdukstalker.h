@@ -10,6 +10,7 @@
 #include "gumdukcodewriter.h"
 #include "gumdukcore.h"
 #include "gumdukinstruction.h"
+#include "gumeventqueue.h"
 
 G_BEGIN_DECLS
 
@@ -24,6 +25,7 @@ struct _GumDukStalker
 
   GumStalker * stalker;
   guint queue_capacity;
+  GumEventQueuePolicy queue_overflow_policy;
   guint queue_drain_interval;
 
   GSource * flush_timer;
@@ -0,0 +1,486 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#include "gumeventqueue.h"
+
+#include <gum/gumspinlock.h>
+#include <gum/gumtls.h>
+#include <string.h>
+
+typedef struct _GumEventProducer GumEventProducer;
+
+/*
+ * Events are queued in one ring buffer per producing thread, so the only
+ * thing producers share is the consumer on the other end. The producer owns
+ * `head`, the consumer owns `tail`, except that with the drop-oldest policy
+ * a producer may also move `tail` forward to make room.
+ */
+struct _GumEventQueue
+{
+  guint capacity;
+  GumEventQueuePolicy policy;
+  GumTlsKey producer_key;
+
+  GumSpinlock producers_lock;
+  GPtrArray * producers;
+
+  GMutex consumer_lock;
+  GumThreadId consumer_thread_id;
+  volatile gboolean closed;
+};
+
+struct _GumEventProducer
+{
+  volatile gint ref_count;
+  volatile gboolean exited;
+  volatile gboolean orphaned;
+
+  GumThreadId thread_id;
+  GumEvent * events;
+  guint mask;
+  volatile gint head;
+  volatile gint tail;
+  volatile gint dropped;
+  guint dropped_reported;
+};
+
+static GumEventProducer * gum_event_queue_get_producer (GumEventQueue * self);
+static void gum_event_queue_retire_exited_producers (GumEventQueue * self);
+static gboolean gum_event_queue_make_room (GumEventQueue * self,
+    GumEventProducer * producer);
+static guint gum_event_producer_copy_out (GumEventProducer * self,
+    GumEvent * dst, guint max_events);
+static GumEventProducer * gum_event_producer_ref (
+    GumEventProducer * producer);
+static void gum_event_producer_unref (GumEventProducer * producer);
+static void gum_event_producers_release (GSList * producers);
+
+/*
+ * The producers created by the current thread, each holding a reference, so
+ * that we find out when the thread exits and its producers can be retired.
+ */
+static GPrivate gum_event_producers_private =
+    G_PRIVATE_INIT ((GDestroyNotify) gum_event_producers_release);
+
+/*
+ * The calling thread is taken to be the one that will drain the queue, so
+ * that it never blocks on its own events, even before the first drain.
+ */
+GumEventQueue *
+gum_event_queue_new (guint capacity,
+                     GumEventQueuePolicy policy)
+{
+  GumEventQueue * queue;
+  guint rounded_capacity;
+
+  rounded_capacity = 1;
+  while (rounded_capacity < capacity)
+    rounded_capacity <<= 1;
+
+  queue = g_slice_new0 (GumEventQueue);
+  queue->capacity = rounded_capacity;
+  queue->policy = policy;
+  queue->producer_key = gum_tls_key_new ();
+
+  gum_spinlock_init (&queue->producers_lock);
+  queue->producers = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) gum_event_producer_unref);
+
+  g_mutex_init (&queue->consumer_lock);
+  queue->consumer_thread_id = gum_process_get_current_thread_id ();
+
+  return queue;
+}
+
+void
+gum_event_queue_free (GumEventQueue * queue)
+{
+  guint i;
+
+  for (i = 0; i != queue->producers->len; i++)
+  {
+    GumEventProducer * producer = g_ptr_array_index (queue->producers, i);
+
+    g_atomic_int_set (&producer->orphaned, TRUE);
+  }
+
+  g_mutex_clear (&queue->consumer_lock);
+
+  g_ptr_array_unref (queue->producers);
+
+  gum_tls_key_free (queue->producer_key);
+
+  g_slice_free (GumEventQueue, queue);
+}
+
+/*
+ * Called by the threads we are tracing. Never takes a lock once the calling
+ * thread has queued its first event.
+ */
+void
+gum_event_queue_push (GumEventQueue * self,
+                      const GumEvent * events,
+                      guint n_events)
+{
+  GumEventProducer * producer;
+  guint head, i;
+
+  producer = gum_event_queue_get_producer (self);
+
+  head = producer->head;
+
+  for (i = 0; i != n_events; i++)
+  {
+    guint tail = g_atomic_int_get (&producer->tail);
+
+    if (head - tail == self->capacity &&
+        !gum_event_queue_make_room (self, producer))
+    {
+      g_atomic_int_add (&producer->dropped, n_events - i);
+      break;
+    }
+
+    producer->events[head & producer->mask] = events[i];
+    head++;
+    g_atomic_int_set (&producer->head, head);
+  }
+}
+
+/*
+ * Merges what every producer has queued into one buffer owned by the caller,
+ * returning NULL if there was nothing.
+ *
+ * Producers are only ever removed with the consumer lock held, so while we
+ * hold it their indices stay put, and the producers lock only needs to be
+ * taken to read the array, which new producers may be growing.
+ */
+gpointer
+gum_event_queue_drain (GumEventQueue * self,
+                       guint * n_events)
+{
+  GumEvent * buffer;
+  guint n_producers, capacity, n, i;
+
+  g_mutex_lock (&self->consumer_lock);
+
+  gum_spinlock_acquire (&self->producers_lock);
+
+  n_producers = self->producers->len;
+
+  capacity = 0;
+  for (i = 0; i != n_producers; i++)
+  {
+    GumEventProducer * producer = g_ptr_array_index (self->producers, i);
+
+    capacity += (guint) g_atomic_int_get (&producer->head) -
+        (guint) g_atomic_int_get (&producer->tail);
+  }
+
+  gum_spinlock_release (&self->producers_lock);
+
+  buffer = NULL;
+  n = 0;
+  if (capacity != 0)
+  {
+    /* Events queued after we counted are left for the next drain */
+    buffer = g_new (GumEvent, capacity);
+
+    for (i = 0; i != n_producers && n != capacity; i++)
+    {
+      GumEventProducer * producer;
+
+      gum_spinlock_acquire (&self->producers_lock);
+      producer = g_ptr_array_index (self->producers, i);
+      gum_spinlock_release (&self->producers_lock);
+
+      n += gum_event_producer_copy_out (producer, buffer + n, capacity - n);
+    }
+  }
+
+  g_mutex_unlock (&self->consumer_lock);
+
+  if (n == 0)
+  {
+    g_free (buffer);
+    buffer = NULL;
+  }
+
+  *n_events = n;
+
+  return buffer;
+}
+
+/*
+ * Returns how many events each producer has lost since the previous call,
+ * leaving out those that didn't lose any. Producers whose thread has exited
+ * are freed here once drained, so this should be called after every drain.
+ */
+GArray *
+gum_event_queue_collect_drops (GumEventQueue * self)
+{
+  GArray * drops;
+  guint i;
+
+  drops = g_array_new (FALSE, FALSE, sizeof (GumEventQueueDrop));
+
+  g_mutex_lock (&self->consumer_lock);
+  gum_spinlock_acquire (&self->producers_lock);
+
+  for (i = 0; i != self->producers->len; i++)
+  {
+    GumEventProducer * producer = g_ptr_array_index (self->producers, i);
+    guint dropped;
+
+    dropped = (guint) g_atomic_int_get (&producer->dropped);
+    if (dropped != producer->dropped_reported)
+    {
+      GumEventQueueDrop drop;
+
+      drop.thread_id = producer->thread_id;
+      drop.count = dropped - producer->dropped_reported;
+      g_array_append_val (drops, drop);
+
+      producer->dropped_reported = dropped;
+    }
+  }
+
+  gum_event_queue_retire_exited_producers (self);
+
+  gum_spinlock_release (&self->producers_lock);
+  g_mutex_unlock (&self->consumer_lock);
+
+  return drops;
+}
+
+/*
+ * Stops producers from blocking on a full queue, as nobody is going to drain
+ * it anymore.
+ */
+void
+gum_event_queue_close (GumEventQueue * self)
+{
+  g_atomic_int_set (&self->closed, TRUE);
+}
+
+gboolean
+gum_event_queue_policy_from_string (const gchar * str,
+                                    GumEventQueuePolicy * policy)
+{
+  if (strcmp (str, "drop-newest") == 0)
+    *policy = GUM_EVENT_QUEUE_DROP_NEWEST;
+  else if (strcmp (str, "drop-oldest") == 0)
+    *policy = GUM_EVENT_QUEUE_DROP_OLDEST;
+  else if (strcmp (str, "block") == 0)
+    *policy = GUM_EVENT_QUEUE_BLOCK;
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+const gchar *
+gum_event_queue_policy_to_string (GumEventQueuePolicy policy)
+{
+  switch (policy)
+  {
+    case GUM_EVENT_QUEUE_DROP_NEWEST:
+      return "drop-newest";
+    case GUM_EVENT_QUEUE_DROP_OLDEST:
+      return "drop-oldest";
+    case GUM_EVENT_QUEUE_BLOCK:
+      return "block";
+    default:
+      g_assert_not_reached ();
+  }
+
+  return NULL;
+}
+
+static GumEventProducer *
+gum_event_queue_get_producer (GumEventQueue * self)
+{
+  GumEventProducer * producer;
+  GSList * producers, * cur, * next;
+
+  producer = gum_tls_key_get_value (self->producer_key);
+  if (producer != NULL)
+    return producer;
+
+  producer = g_slice_new0 (GumEventProducer);
+  producer->ref_count = 1;
+  producer->thread_id = gum_process_get_current_thread_id ();
+  producer->events = g_new (GumEvent, self->capacity);
+  producer->mask = self->capacity - 1;
+
+  gum_spinlock_acquire (&self->producers_lock);
+  g_ptr_array_add (self->producers, producer);
+  gum_spinlock_release (&self->producers_lock);
+
+  gum_tls_key_set_value (self->producer_key, producer);
+
+  producers = g_private_get (&gum_event_producers_private);
+  for (cur = producers; cur != NULL; cur = next)
+  {
+    GumEventProducer * other = cur->data;
+
+    next = cur->next;
+
+    if (g_atomic_int_get (&other->orphaned))
+    {
+      producers = g_slist_delete_link (producers, cur);
+      gum_event_producer_unref (other);
+    }
+  }
+  producers = g_slist_prepend (producers, gum_event_producer_ref (producer));
+  g_private_set (&gum_event_producers_private, producers);
+
+  return producer;
+}
+
+/*
+ * Frees the producers whose thread has exited, once everything they queued
+ * has been consumed and their drops have been reported. Must be called with
+ * both the consumer and the producers lock held.
+ */
+static void
+gum_event_queue_retire_exited_producers (GumEventQueue * self)
+{
+  guint i;
+
+  i = 0;
+  while (i != self->producers->len)
+  {
+    GumEventProducer * producer = g_ptr_array_index (self->producers, i);
+
+    if (g_atomic_int_get (&producer->exited) &&
+        g_atomic_int_get (&producer->head) ==
+            g_atomic_int_get (&producer->tail) &&
+        (guint) g_atomic_int_get (&producer->dropped) ==
+            producer->dropped_reported)
+    {
+      g_ptr_array_remove_index_fast (self->producers, i);
+    }
+    else
+    {
+      i++;
+    }
+  }
+}
+
+/*
+ * Called when the producer's ring is full. Returns FALSE if the event should
+ * be dropped instead.
+ */
+static gboolean
+gum_event_queue_make_room (GumEventQueue * self,
+                           GumEventProducer * producer)
+{
+  guint head = producer->head;
+
+  switch (self->policy)
+  {
+    case GUM_EVENT_QUEUE_DROP_NEWEST:
+      return FALSE;
+    case GUM_EVENT_QUEUE_DROP_OLDEST:
+    {
+      guint tail = g_atomic_int_get (&producer->tail);
+
+      /* The consumer might be making room as we speak, in which case
+       * we lose the race but not the event */
+      if (head - tail == self->capacity &&
+          g_atomic_int_compare_and_exchange (&producer->tail, tail, tail + 1))
+      {
+        g_atomic_int_inc (&producer->dropped);
+      }
+
+      return TRUE;
+    }
+    case GUM_EVENT_QUEUE_BLOCK:
+    {
+      /* Waiting for ourselves would never end */
+      if (producer->thread_id == self->consumer_thread_id)
+        return FALSE;
+
+      while (head - (guint) g_atomic_int_get (&producer->tail) ==
+          self->capacity)
+      {
+        if (g_atomic_int_get (&self->closed))
+          return FALSE;
+
+        g_thread_yield ();
+      }
+
+      return TRUE;
+    }
+    default:
+      g_assert_not_reached ();
+  }
+
+  return FALSE;
+}
+
+/*
+ * Copies out and consumes up to `max_events` of the oldest queued events.
+ * With the drop-oldest policy the producer may overwrite those while we are
+ * copying them, which we detect by it having moved `tail`, and retry.
+ */
+static guint
+gum_event_producer_copy_out (GumEventProducer * self,
+                             GumEvent * dst,
+                             guint max_events)
+{
+  guint tail, n, offset, first;
+
+  do
+  {
+    tail = g_atomic_int_get (&self->tail);
+    n = MIN ((guint) g_atomic_int_get (&self->head) - tail, max_events);
+
+    offset = tail & self->mask;
+    first = MIN (n, self->mask + 1 - offset);
+
+    memcpy (dst, self->events + offset, first * sizeof (GumEvent));
+    memcpy (dst + first, self->events, (n - first) * sizeof (GumEvent));
+  }
+  while (!g_atomic_int_compare_and_exchange (&self->tail, tail, tail + n));
+
+  return n;
+}
+
+static GumEventProducer *
+gum_event_producer_ref (GumEventProducer * producer)
+{
+  g_atomic_int_inc (&producer->ref_count);
+
+  return producer;
+}
+
+static void
+gum_event_producer_unref (GumEventProducer * producer)
+{
+  if (!g_atomic_int_dec_and_test (&producer->ref_count))
+    return;
+
+  g_free (producer->events);
+
+  g_slice_free (GumEventProducer, producer);
+}
+
+static void
+gum_event_producers_release (GSList * producers)
+{
+  GSList * cur;
+
+  for (cur = producers; cur != NULL; cur = cur->next)
+  {
+    GumEventProducer * producer = cur->data;
+
+    g_atomic_int_set (&producer->exited, TRUE);
+    gum_event_producer_unref (producer);
+  }
+
+  g_slist_free (producers);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#ifndef __GUM_EVENT_QUEUE_H__
+#define __GUM_EVENT_QUEUE_H__
+
+#include <gum/gumevent.h>
+#include <gum/gumprocess.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GumEventQueue GumEventQueue;
+typedef struct _GumEventQueueDrop GumEventQueueDrop;
+
+typedef enum {
+  GUM_EVENT_QUEUE_DROP_NEWEST,
+  GUM_EVENT_QUEUE_DROP_OLDEST,
+  GUM_EVENT_QUEUE_BLOCK
+} GumEventQueuePolicy;
+
+struct _GumEventQueueDrop
+{
+  GumThreadId thread_id;
+  guint count;
+};
+
+G_GNUC_INTERNAL GumEventQueue * gum_event_queue_new (guint capacity,
+    GumEventQueuePolicy policy);
+G_GNUC_INTERNAL void gum_event_queue_free (GumEventQueue * queue);
+
+G_GNUC_INTERNAL void gum_event_queue_push (GumEventQueue * self,
+    const GumEvent * events, guint n_events);
+G_GNUC_INTERNAL gpointer gum_event_queue_drain (GumEventQueue * self,
+    guint * n_events);
+G_GNUC_INTERNAL GArray * gum_event_queue_collect_drops (GumEventQueue * self);
+G_GNUC_INTERNAL void gum_event_queue_close (GumEventQueue * self);
+
+G_GNUC_INTERNAL gboolean gum_event_queue_policy_from_string (
+    const gchar * str, GumEventQueuePolicy * policy);
+G_GNUC_INTERNAL const gchar * gum_event_queue_policy_to_string (
+    GumEventQueuePolicy policy);
+
+G_END_DECLS
+
+#endif
@@ -9,6 +9,7 @@
 #include "gumv8scope.h"
 #include "gumv8value.h"
 
+#include <gum/gumcompactevent.h>
 #include <gum/gumspinlock.h>
 #include <string.h>
 
@@ -19,15 +20,18 @@ struct _GumV8EventSink
   GObject parent;
 
   GumSpinlock lock;
-  GArray * queue;
-  guint queue_capacity;
+  GumEventQueue * queue;
   guint queue_drain_interval;
+  GHashTable * call_summary;
 
   GumV8Core * core;
   GMainContext * main_context;
   GumEventType event_mask;
+  gboolean want_call_summary;
+  gboolean compact;
   GumPersistent<Function>::type * on_receive;
   GumPersistent<Function>::type * on_call_summary;
+  GumPersistent<Function>::type * on_drop;
   GSource * source;
 };
 
@@ -36,13 +40,20 @@ static void gum_v8_event_sink_iface_init (gpointer g_iface,
 static void gum_v8_event_sink_dispose (GObject * obj);
 static void gum_v8_event_sink_finalize (GObject * obj);
 static GumEventType gum_v8_event_sink_query_mask (GumEventSink * sink);
+static gboolean gum_v8_event_sink_query_call_summary (GumEventSink * sink);
 static void gum_v8_event_sink_start (GumEventSink * sink);
 static void gum_v8_event_sink_process (GumEventSink * sink,
     const GumEvent * ev);
+static void gum_v8_event_sink_process_batch (GumEventSink * sink,
+    const GumEvent * events, guint n_events);
+static void gum_v8_event_sink_process_call_summary (GumEventSink * sink,
+    const GumCallCount * counts, guint n_counts);
 static void gum_v8_event_sink_flush (GumEventSink * sink);
 static void gum_v8_event_sink_stop (GumEventSink * sink);
 static gboolean gum_v8_event_sink_stop_when_idle (GumV8EventSink * self);
 static gboolean gum_v8_event_sink_drain (GumV8EventSink * self);
+static Local<Object> gum_v8_event_sink_drops_to_object (
+    GumV8EventSink * self, GArray * drops);
 
 G_DEFINE_TYPE_EXTENDED (GumV8EventSink,
                         gum_v8_event_sink,
@@ -67,8 +78,11 @@ gum_v8_event_sink_iface_init (gpointer g_iface,
   auto iface = (GumEventSinkInterface *) g_iface;
 
   iface->query_mask = gum_v8_event_sink_query_mask;
+  iface->query_call_summary = gum_v8_event_sink_query_call_summary;
   iface->start = gum_v8_event_sink_start;
   iface->process = gum_v8_event_sink_process;
+  iface->process_batch = gum_v8_event_sink_process_batch;
+  iface->process_call_summary = gum_v8_event_sink_process_call_summary;
   iface->flush = gum_v8_event_sink_flush;
   iface->stop = gum_v8_event_sink_stop;
 }
@@ -96,6 +110,9 @@ gum_v8_event_sink_release_core (GumV8EventSink * self)
 
     delete self->on_call_summary;
     self->on_call_summary = nullptr;
+
+    delete self->on_drop;
+    self->on_drop = nullptr;
   }
 
   g_object_unref (script);
@@ -116,7 +133,9 @@ gum_v8_event_sink_finalize (GObject * obj)
 
   g_assert (self->source == NULL);
 
-  g_array_free (self->queue, TRUE);
+  gum_event_queue_free (self->queue);
+  if (self->call_summary != NULL)
+    g_hash_table_unref (self->call_summary);
 
   G_OBJECT_CLASS (gum_v8_event_sink_parent_class)->finalize (obj);
 }
@@ -128,15 +147,15 @@ gum_v8_event_sink_new (const GumV8EventSinkOptions * options)
 
   auto sink = GUM_V8_EVENT_SINK (
       g_object_new (GUM_V8_TYPE_EVENT_SINK, NULL));
-  sink->queue = g_array_sized_new (FALSE, FALSE, sizeof (GumEvent),
-      options->queue_capacity);
-  sink->queue_capacity = options->queue_capacity;
+  sink->queue = gum_event_queue_new (options->queue_capacity,
+      options->queue_policy);
   sink->queue_drain_interval = options->queue_drain_interval;
 
   g_object_ref (options->core->script);
   sink->core = options->core;
   sink->main_context = options->main_context;
   sink->event_mask = options->event_mask;
+  sink->compact = options->compact;
   if (!options->on_receive.IsEmpty ())
   {
     sink->on_receive =
@@ -147,6 +166,19 @@ gum_v8_event_sink_new (const GumV8EventSinkOptions * options)
     sink->on_call_summary =
         new GumPersistent<Function>::type (isolate, options->on_call_summary);
   }
+  if (!options->on_drop.IsEmpty ())
+  {
+    sink->on_drop =
+        new GumPersistent<Function>::type (isolate, options->on_drop);
+  }
+
+  /* Nobody will look at the events, so have Stalker count calls for us */
+  if (sink->on_receive == nullptr && sink->on_call_summary != nullptr &&
+      (sink->event_mask & GUM_CALL) != 0)
+  {
+    sink->event_mask = GUM_CALL;
+    sink->want_call_summary = TRUE;
+  }
 
   return GUM_EVENT_SINK (sink);
 }
@@ -157,6 +189,12 @@ gum_v8_event_sink_query_mask (GumEventSink * sink)
   return GUM_V8_EVENT_SINK (sink)->event_mask;
 }
 
+static gboolean
+gum_v8_event_sink_query_call_summary (GumEventSink * sink)
+{
+  return GUM_V8_EVENT_SINK (sink)->want_call_summary;
+}
+
 static void
 gum_v8_event_sink_start (GumEventSink * sink)
 {
@@ -174,9 +212,42 @@ gum_v8_event_sink_process (GumEventSink * sink,
 {
   auto self = GUM_V8_EVENT_SINK_CAST (sink);
 
+  gum_event_queue_push (self->queue, ev, 1);
+}
+
+static void
+gum_v8_event_sink_process_batch (GumEventSink * sink,
+                                 const GumEvent * events,
+                                 guint n_events)
+{
+  auto self = GUM_V8_EVENT_SINK_CAST (sink);
+
+  gum_event_queue_push (self->queue, events, n_events);
+}
+
+static void
+gum_v8_event_sink_process_call_summary (GumEventSink * sink,
+                                        const GumCallCount * counts,
+                                        guint n_counts)
+{
+  auto self = GUM_V8_EVENT_SINK_CAST (sink);
+
   gum_spinlock_acquire (&self->lock);
-  if (self->queue->len != self->queue_capacity)
-    g_array_append_val (self->queue, *ev);
+
+  if (self->call_summary == NULL)
+    self->call_summary = g_hash_table_new (NULL, NULL);
+
+  for (guint i = 0; i != n_counts; i++)
+  {
+    auto c = &counts[i];
+
+    auto count = GPOINTER_TO_SIZE (
+        g_hash_table_lookup (self->call_summary, c->target));
+    count += c->count;
+    g_hash_table_insert (self->call_summary, c->target,
+        GSIZE_TO_POINTER (count));
+  }
+
   gum_spinlock_release (&self->lock);
 }
 
@@ -210,6 +281,8 @@ gum_v8_event_sink_stop_when_idle (GumV8EventSink * self)
 {
   gum_v8_event_sink_drain (self);
 
+  gum_event_queue_close (self->queue);
+
   g_object_ref (self);
 
   g_source_destroy (self->source);
@@ -226,30 +299,31 @@ gum_v8_event_sink_stop_when_idle (GumV8EventSink * self)
 static gboolean
 gum_v8_event_sink_drain (GumV8EventSink * self)
 {
-  gpointer buffer = NULL;
-  guint len, size;
+  guint len;
+  gsize size;
+  GHashTable * frequencies = NULL;
+  GArray * drops = NULL;
 
   if (self->core == NULL)
     return FALSE;
 
-  len = self->queue->len;
+  auto buffer = gum_event_queue_drain (self->queue, &len);
   size = len * sizeof (GumEvent);
-  if (len != 0)
-  {
-    buffer = g_memdup (self->queue->data, size);
 
-    gum_spinlock_acquire (&self->lock);
-    g_array_remove_range (self->queue, 0, len);
-    gum_spinlock_release (&self->lock);
-  }
+  drops = gum_event_queue_collect_drops (self->queue);
+  if (self->on_drop == nullptr || drops->len == 0)
+    g_clear_pointer (&drops, g_array_unref);
 
-  if (buffer != NULL)
+  if (self->on_call_summary != nullptr)
   {
-    GHashTable * frequencies = NULL;
+    gum_spinlock_acquire (&self->lock);
+    frequencies = (GHashTable *) g_steal_pointer (&self->call_summary);
+    gum_spinlock_release (&self->lock);
 
-    if (self->on_call_summary != nullptr)
+    if (buffer != NULL)
     {
-      frequencies = g_hash_table_new (NULL, NULL);
+      if (frequencies == NULL)
+        frequencies = g_hash_table_new (NULL, NULL);
 
       auto ev = (GumCallEvent *) buffer;
       for (guint i = 0; i != len; i++)
@@ -266,7 +340,10 @@ gum_v8_event_sink_drain (GumV8EventSink * self)
         ev++;
       }
     }
+  }
 
+  if (buffer != NULL || frequencies != NULL || drops != NULL)
+  {
     ScriptScope scope (self->core->script);
     auto isolate = self->core->isolate;
     auto context = isolate->GetCurrentContext ();
@@ -299,8 +376,19 @@ gum_v8_event_sink_drain (GumV8EventSink * self)
         scope.ProcessAnyPendingException ();
     }
 
-    if (self->on_receive != nullptr)
+    if (self->on_receive != nullptr && buffer != NULL)
     {
+      if (self->compact)
+      {
+        gsize compact_size;
+        auto compact_buffer = gum_compact_events_encode (
+            (const GumEvent *) buffer, len, &compact_size);
+        g_free (buffer);
+
+        buffer = compact_buffer;
+        size = compact_size;
+      }
+
       auto on_receive = Local<Function>::New (isolate, *self->on_receive);
       Local<Value> argv[] = {
         ArrayBuffer::New (isolate, buffer, size,
@@ -314,7 +402,41 @@ gum_v8_event_sink_drain (GumV8EventSink * self)
     {
       g_free (buffer);
     }
+
+    if (drops != NULL)
+    {
+      Local<Value> argv[] = {
+        gum_v8_event_sink_drops_to_object (self, drops)
+      };
+      g_array_unref (drops);
+
+      auto on_drop = Local<Function>::New (isolate, *self->on_drop);
+      auto result = on_drop->Call (context, recv, G_N_ELEMENTS (argv), argv);
+      if (result.IsEmpty ())
+        scope.ProcessAnyPendingException ();
+    }
   }
 
   return TRUE;
 }
+
+static Local<Object>
+gum_v8_event_sink_drops_to_object (GumV8EventSink * self,
+                                   GArray * drops)
+{
+  auto isolate = self->core->isolate;
+
+  auto counts = Object::New (isolate);
+  for (guint i = 0; i != drops->len; i++)
+  {
+    auto drop = &g_array_index (drops, GumEventQueueDrop, i);
+
+    gchar thread_id_str[32];
+    sprintf (thread_id_str, "%" G_GSIZE_MODIFIER "u",
+        (gsize) drop->thread_id);
+    _gum_v8_object_set (counts, thread_id_str,
+        Number::New (isolate, drop->count), self->core);
+  }
+
+  return counts;
+}
@@ -7,6 +7,7 @@
 #ifndef __GUM_V8_EVENT_SINK_H__
 #define __GUM_V8_EVENT_SINK_H__
 
+#include "gumeventqueue.h"
 #include "gumv8core.h"
 
 #include <gum/gumeventsink.h>
@@ -21,10 +22,13 @@ struct GumV8EventSinkOptions
   GumV8Core * core;
   GMainContext * main_context;
   GumEventType event_mask;
+  gboolean compact;
   guint queue_capacity;
+  GumEventQueuePolicy queue_policy;
   guint queue_drain_interval;
   v8::Handle<v8::Function> on_receive;
   v8::Handle<v8::Function> on_call_summary;
+  v8::Handle<v8::Function> on_drop;
 };
 
 G_GNUC_INTERNAL GumEventSink * gum_v8_event_sink_new (
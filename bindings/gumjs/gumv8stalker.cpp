@@ -10,6 +10,8 @@
 #include "gumv8macros.h"
 #include "gumv8scope.h"
 
+#include <gum/gumcompactevent.h>
+
 #define GUMJS_MODULE_NAME Stalker
 
 #define GUM_V8_TYPE_CALLBACK_TRANSFORMER \
@@ -62,9 +64,15 @@ static gboolean gum_v8_stalker_on_flush_timer_tick (GumV8Stalker * self);
 GUMJS_DECLARE_GETTER (gumjs_stalker_get_trust_threshold)
 GUMJS_DECLARE_SETTER (gumjs_stalker_set_trust_threshold)
 
+GUMJS_DECLARE_GETTER (gumjs_stalker_get_event_buffer_capacity)
+GUMJS_DECLARE_SETTER (gumjs_stalker_set_event_buffer_capacity)
+
 GUMJS_DECLARE_GETTER (gumjs_stalker_get_queue_capacity)
 GUMJS_DECLARE_SETTER (gumjs_stalker_set_queue_capacity)
 
+GUMJS_DECLARE_GETTER (gumjs_stalker_get_queue_overflow_policy)
+GUMJS_DECLARE_SETTER (gumjs_stalker_set_queue_overflow_policy)
+
 GUMJS_DECLARE_GETTER (gumjs_stalker_get_queue_drain_interval)
 GUMJS_DECLARE_SETTER (gumjs_stalker_set_queue_drain_interval)
 
@@ -121,6 +129,8 @@ static GumV8InstructionValue * gum_v8_stalker_obtain_instruction (
 static void gum_v8_stalker_release_instruction (GumV8Stalker * self,
     GumV8InstructionValue * value);
 
+static Local<Array> gum_make_event_row (const GumEvent * ev,
+    gboolean annotate, gboolean stringify, GumV8Core * core);
 static Local<Value> gum_make_pointer (gpointer value, gboolean stringify,
     GumV8Core * core);
 
@@ -131,11 +141,21 @@ static const GumV8Property gumjs_stalker_values[] =
     gumjs_stalker_get_trust_threshold,
     gumjs_stalker_set_trust_threshold
   },
+  {
+    "eventBufferCapacity",
+    gumjs_stalker_get_event_buffer_capacity,
+    gumjs_stalker_set_event_buffer_capacity
+  },
   {
     "queueCapacity",
     gumjs_stalker_get_queue_capacity,
     gumjs_stalker_set_queue_capacity
   },
+  {
+    "queueOverflowPolicy",
+    gumjs_stalker_get_queue_overflow_policy,
+    gumjs_stalker_set_queue_overflow_policy
+  },
   {
     "queueDrainInterval",
     gumjs_stalker_get_queue_drain_interval,
@@ -182,6 +202,7 @@ _gum_v8_stalker_init (GumV8Stalker * self,
 
   self->stalker = NULL;
   self->queue_capacity = 16384;
+  self->queue_overflow_policy = GUM_EVENT_QUEUE_DROP_NEWEST;
   self->queue_drain_interval = 250;
 
   self->flush_timer = NULL;
@@ -367,6 +388,24 @@ GUMJS_DEFINE_SETTER (gumjs_stalker_set_trust_threshold)
   gum_stalker_set_trust_threshold (stalker, threshold);
 }
 
+GUMJS_DEFINE_GETTER (gumjs_stalker_get_event_buffer_capacity)
+{
+  auto stalker = _gum_v8_stalker_get (module);
+
+  info.GetReturnValue ().Set (gum_stalker_get_event_buffer_capacity (stalker));
+}
+
+GUMJS_DEFINE_SETTER (gumjs_stalker_set_event_buffer_capacity)
+{
+  auto stalker = _gum_v8_stalker_get (module);
+
+  guint capacity;
+  if (!_gum_v8_uint_get (value, &capacity, core))
+    return;
+
+  gum_stalker_set_event_buffer_capacity (stalker, capacity);
+}
+
 GUMJS_DEFINE_GETTER (gumjs_stalker_get_queue_capacity)
 {
   info.GetReturnValue ().Set (module->queue_capacity);
@@ -381,6 +420,27 @@ GUMJS_DEFINE_SETTER (gumjs_stalker_set_queue_capacity)
   module->queue_capacity = capacity;
 }
 
+GUMJS_DEFINE_GETTER (gumjs_stalker_get_queue_overflow_policy)
+{
+  info.GetReturnValue ().Set (_gum_v8_string_new_ascii (isolate,
+      gum_event_queue_policy_to_string (module->queue_overflow_policy)));
+}
+
+GUMJS_DEFINE_SETTER (gumjs_stalker_set_queue_overflow_policy)
+{
+  if (value->IsString ())
+  {
+    String::Utf8Value str_value (isolate, value);
+
+    if (gum_event_queue_policy_from_string (*str_value,
+        &module->queue_overflow_policy))
+      return;
+  }
+
+  _gum_v8_throw_ascii_literal (isolate,
+      "expected 'drop-newest', 'drop-oldest' or 'block'");
+}
+
 GUMJS_DEFINE_GETTER (gumjs_stalker_get_queue_drain_interval)
 {
   info.GetReturnValue ().Set (module->queue_drain_interval);
@@ -421,10 +481,12 @@ GUMJS_DEFINE_FUNCTION (gumjs_stalker_follow)
   so.core = core;
   so.main_context = gum_script_scheduler_get_js_context (core->scheduler);
   so.queue_capacity = module->queue_capacity;
+  so.queue_policy = module->queue_overflow_policy;
   so.queue_drain_interval = module->queue_drain_interval;
 
-  if (!_gum_v8_args_parse (args, "ZF?uF?F?", &thread_id, &transformer_callback,
-      &so.event_mask, &so.on_receive, &so.on_call_summary))
+  if (!_gum_v8_args_parse (args, "ZF?uF?F?F?t", &thread_id,
+      &transformer_callback, &so.event_mask, &so.on_receive,
+      &so.on_call_summary, &so.on_drop, &so.compact))
     return;
 
   GumStalkerTransformer * transformer = NULL;
@@ -507,8 +569,9 @@ GUMJS_DEFINE_FUNCTION (gumjs_stalker_remove_call_probe)
 GUMJS_DEFINE_FUNCTION (gumjs_stalker_parse)
 {
   Local<Value> events_value;
-  gboolean annotate, stringify;
-  if (!_gum_v8_args_parse (args, "Vtt", &events_value, &annotate, &stringify))
+  gboolean annotate, stringify, compact;
+  if (!_gum_v8_args_parse (args, "Vttt", &events_value, &annotate, &stringify,
+      &compact))
     return;
 
   if (!events_value->IsArrayBuffer ())
@@ -518,142 +581,60 @@ GUMJS_DEFINE_FUNCTION (gumjs_stalker_parse)
   }
 
   auto events_contents = events_value.As<ArrayBuffer> ()->GetContents ();
-  const GumEvent * events = (const GumEvent *) events_contents.Data ();
+  auto data = (const guint8 *) events_contents.Data ();
   size_t size = events_contents.ByteLength ();
-  if (size % sizeof (GumEvent) != 0)
-  {
-    _gum_v8_throw_ascii_literal (isolate, "invalid buffer shape");
-    return;
-  }
-
-  size_t count = size / sizeof (GumEvent);
 
-  auto rows = Array::New (isolate, (int) count);
+  Local<Array> rows;
 
-  const GumEvent * ev;
-  size_t row_index;
-  for (ev = events, row_index = 0;
-      row_index != count;
-      ev++, row_index++)
+  if (compact)
   {
-    Local<Array> row;
-    guint column_index = 0;
+    rows = Array::New (isolate);
 
-    switch (ev->type)
+    GumCompactEventCursor cursor;
+    gum_compact_event_cursor_init (&cursor);
+
+    const guint8 * end = data + size;
+    uint32_t row_index = 0;
+    while (data != end)
     {
-      case GUM_CALL:
+      GumEvent ev;
+      if (!gum_compact_event_decode (&cursor, &data, end, &ev))
       {
-        const GumCallEvent * call = &ev->call;
-
-        if (annotate)
-        {
-          row = Array::New (isolate, 4);
-          row->Set (column_index++, _gum_v8_string_new_ascii (isolate, "call"));
-        }
-        else
-        {
-          row = Array::New (isolate, 3);
-        }
-
-        row->Set (column_index++,
-            gum_make_pointer (call->location, stringify, core));
-        row->Set (column_index++,
-            gum_make_pointer (call->target, stringify, core));
-        row->Set (column_index++, Integer::New (isolate, call->depth));
-
-        break;
+        _gum_v8_throw_ascii_literal (isolate, "invalid event data");
+        return;
       }
-      case GUM_RET:
-      {
-        const GumRetEvent * ret = &ev->ret;
-
-        if (annotate)
-        {
-          row = Array::New (isolate, 4);
-          row->Set (column_index++, _gum_v8_string_new_ascii (isolate, "ret"));
-        }
-        else
-        {
-          row = Array::New (isolate, 3);
-        }
-
-        row->Set (column_index++,
-            gum_make_pointer (ret->location, stringify, core));
-        row->Set (column_index++,
-            gum_make_pointer (ret->target, stringify, core));
-        row->Set (column_index++, Integer::New (isolate, ret->depth));
 
-        break;
-      }
-      case GUM_EXEC:
-      {
-        const GumExecEvent * exec = &ev->exec;
-
-        if (annotate)
-        {
-          row = Array::New (isolate, 2);
-          row->Set (column_index++, _gum_v8_string_new_ascii (isolate, "exec"));
-        }
-        else
-        {
-          row = Array::New (isolate, 1);
-        }
+      rows->Set (row_index++,
+          gum_make_event_row (&ev, annotate, stringify, core));
+    }
+  }
+  else
+  {
+    if (size % sizeof (GumEvent) != 0)
+    {
+      _gum_v8_throw_ascii_literal (isolate, "invalid buffer shape");
+      return;
+    }
 
-        row->Set (column_index++,
-            gum_make_pointer (exec->location, stringify, core));
+    size_t count = size / sizeof (GumEvent);
 
-        break;
-      }
-      case GUM_BLOCK:
-      {
-        const GumBlockEvent * block = &ev->block;
-
-        if (annotate)
-        {
-          row = Array::New (isolate, 3);
-          row->Set (column_index++,
-              _gum_v8_string_new_ascii (isolate, "block"));
-        }
-        else
-        {
-          row = Array::New (isolate, 2);
-        }
-
-        row->Set (column_index++,
-            gum_make_pointer (block->begin, stringify, core));
-        row->Set (column_index++,
-            gum_make_pointer (block->end, stringify, core));
+    rows = Array::New (isolate, (int) count);
 
-        break;
-      }
-      case GUM_COMPILE:
+    const GumEvent * ev;
+    size_t row_index;
+    for (ev = (const GumEvent *) data, row_index = 0;
+        row_index != count;
+        ev++, row_index++)
+    {
+      auto row = gum_make_event_row (ev, annotate, stringify, core);
+      if (row.IsEmpty ())
       {
-        const GumCompileEvent * compile = &ev->compile;
-
-        if (annotate)
-        {
-          row = Array::New (isolate, 3);
-          row->Set (column_index++,
-              _gum_v8_string_new_ascii (isolate, "compile"));
-        }
-        else
-        {
-          row = Array::New (isolate, 2);
-        }
-
-        row->Set (column_index++,
-            gum_make_pointer (compile->begin, stringify, core));
-        row->Set (column_index++,
-            gum_make_pointer (compile->end, stringify, core));
-
-        break;
-      }
-      default:
         _gum_v8_throw_ascii_literal (isolate, "invalid event type");
         return;
-    }
+      }
 
-    rows->Set ((uint32_t) row_index, row);
+      rows->Set ((uint32_t) row_index, row);
+    }
   }
 
   info.GetReturnValue ().Set (rows);
@@ -1032,6 +1013,132 @@ gum_v8_stalker_release_instruction (GumV8Stalker * self,
   }
 }
 
+static Local<Array>
+gum_make_event_row (const GumEvent * ev,
+                    gboolean annotate,
+                    gboolean stringify,
+                    GumV8Core * core)
+{
+  auto isolate = core->isolate;
+  Local<Array> row;
+  guint column_index = 0;
+
+  switch (ev->type)
+  {
+    case GUM_CALL:
+    {
+      const GumCallEvent * call = &ev->call;
+
+      if (annotate)
+      {
+        row = Array::New (isolate, 4);
+        row->Set (column_index++, _gum_v8_string_new_ascii (isolate, "call"));
+      }
+      else
+      {
+        row = Array::New (isolate, 3);
+      }
+
+      row->Set (column_index++,
+          gum_make_pointer (call->location, stringify, core));
+      row->Set (column_index++,
+          gum_make_pointer (call->target, stringify, core));
+      row->Set (column_index++, Integer::New (isolate, call->depth));
+
+      break;
+    }
+    case GUM_RET:
+    {
+      const GumRetEvent * ret = &ev->ret;
+
+      if (annotate)
+      {
+        row = Array::New (isolate, 4);
+        row->Set (column_index++, _gum_v8_string_new_ascii (isolate, "ret"));
+      }
+      else
+      {
+        row = Array::New (isolate, 3);
+      }
+
+      row->Set (column_index++,
+          gum_make_pointer (ret->location, stringify, core));
+      row->Set (column_index++,
+          gum_make_pointer (ret->target, stringify, core));
+      row->Set (column_index++, Integer::New (isolate, ret->depth));
+
+      break;
+    }
+    case GUM_EXEC:
+    {
+      const GumExecEvent * exec = &ev->exec;
+
+      if (annotate)
+      {
+        row = Array::New (isolate, 2);
+        row->Set (column_index++, _gum_v8_string_new_ascii (isolate, "exec"));
+      }
+      else
+      {
+        row = Array::New (isolate, 1);
+      }
+
+      row->Set (column_index++,
+          gum_make_pointer (exec->location, stringify, core));
+
+      break;
+    }
+    case GUM_BLOCK:
+    {
+      const GumBlockEvent * block = &ev->block;
+
+      if (annotate)
+      {
+        row = Array::New (isolate, 3);
+        row->Set (column_index++,
+            _gum_v8_string_new_ascii (isolate, "block"));
+      }
+      else
+      {
+        row = Array::New (isolate, 2);
+      }
+
+      row->Set (column_index++,
+          gum_make_pointer (block->begin, stringify, core));
+      row->Set (column_index++,
+          gum_make_pointer (block->end, stringify, core));
+
+      break;
+    }
+    case GUM_COMPILE:
+    {
+      const GumCompileEvent * compile = &ev->compile;
+
+      if (annotate)
+      {
+        row = Array::New (isolate, 3);
+        row->Set (column_index++,
+            _gum_v8_string_new_ascii (isolate, "compile"));
+      }
+      else
+      {
+        row = Array::New (isolate, 2);
+      }
+
+      row->Set (column_index++,
+          gum_make_pointer (compile->begin, stringify, core));
+      row->Set (column_index++,
+          gum_make_pointer (compile->end, stringify, core));
+
+      break;
+    }
+    default:
+      return Local<Array> ();
+  }
+
+  return row;
+}
+
 static Local<Value>
 gum_make_pointer (gpointer value,
                   gboolean stringify,
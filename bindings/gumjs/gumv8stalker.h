@@ -7,6 +7,7 @@
 #ifndef __GUM_V8_STALKER_H__
 #define __GUM_V8_STALKER_H__
 
+#include "gumeventqueue.h"
 #include "gumv8codewriter.h"
 #include "gumv8core.h"
 #include "gumv8instruction.h"
@@ -21,6 +22,7 @@ struct GumV8Stalker
 
   GumStalker * stalker;
   guint queue_capacity;
+  GumEventQueuePolicy queue_overflow_policy;
   guint queue_drain_interval;
 
   GSource * flush_timer;
@@ -435,11 +435,15 @@ Object.defineProperties(Stalker, {
         events = {},
         onReceive = null,
         onCallSummary = null,
+        onDrop = null,
+        format = 'raw',
       } = options;
 
       if (events === null || typeof events !== 'object')
         throw new Error('events must be an object');
 
+      const compact = parseEventFormat(format);
+
       const eventMask = Object.keys(events).reduce((result, name) => {
         const value = stalkerEventType[name];
         if (value === undefined)
@@ -452,7 +456,7 @@ Object.defineProperties(Stalker, {
         return enabled ? (result | value) : result;
       }, 0);
 
-      Stalker._follow(threadId, transform, eventMask, onReceive, onCallSummary);
+      Stalker._follow(threadId, transform, eventMask, onReceive, onCallSummary, onDrop, compact);
     }
   },
   parse: {
@@ -460,14 +464,23 @@ Object.defineProperties(Stalker, {
     value: function (events, options = {}) {
       const {
         annotate = true,
-        stringify = false
+        stringify = false,
+        format = 'raw'
       } = options;
 
-      return Stalker._parse(events, annotate, stringify);
+      return Stalker._parse(events, annotate, stringify, parseEventFormat(format));
     }
   }
 });
 
+function parseEventFormat(format) {
+  if (format === 'raw')
+    return false;
+  if (format === 'compact')
+    return true;
+  throw new Error('format must be either raw or compact');
+}
+
 Object.defineProperty(Instruction, 'parse', {
   enumerable: true,
   value: function (target) {
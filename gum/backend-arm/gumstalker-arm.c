@@ -41,6 +41,36 @@ gum_stalker_exclude (GumStalker * self,
 {
 }
 
+void
+gum_stalker_remove_exclusion (GumStalker * self,
+                              const GumMemoryRange * range)
+{
+}
+
+void
+gum_stalker_exclude_module (GumStalker * self,
+                            const gchar * name)
+{
+}
+
+void
+gum_stalker_remove_module_exclusion (GumStalker * self,
+                                     const gchar * name)
+{
+}
+
+void
+gum_stalker_include (GumStalker * self,
+                     const GumMemoryRange * range)
+{
+}
+
+void
+gum_stalker_include_module (GumStalker * self,
+                            const gchar * name)
+{
+}
+
 gint
 gum_stalker_get_trust_threshold (GumStalker * self)
 {
@@ -53,6 +83,116 @@ gum_stalker_set_trust_threshold (GumStalker * self,
 {
 }
 
+guint
+gum_stalker_get_ic_entries (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_ic_entries (GumStalker * self,
+                            guint n)
+{
+}
+
+guint
+gum_stalker_get_trace_threshold (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_trace_threshold (GumStalker * self,
+                                 guint threshold)
+{
+}
+
+guint
+gum_stalker_get_event_buffer_capacity (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_event_buffer_capacity (GumStalker * self,
+                                       guint capacity)
+{
+}
+
+void
+gum_stalker_set_coverage_bitmap (GumStalker * self,
+                                 guint8 * bitmap,
+                                 gsize size)
+{
+}
+
+gsize
+gum_stalker_get_code_budget (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_code_budget (GumStalker * self,
+                             gsize budget)
+{
+}
+
+gsize
+gum_stalker_get_thread_code_budget (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_thread_code_budget (GumStalker * self,
+                                    gsize budget)
+{
+}
+
+gboolean
+gum_stalker_get_code_write_protection (GumStalker * self)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_set_code_write_protection (GumStalker * self,
+                                       gboolean enabled)
+{
+}
+
+gboolean
+gum_stalker_get_block_counting (GumStalker * self)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_set_block_counting (GumStalker * self,
+                                gboolean enabled)
+{
+}
+
+void
+gum_stalker_invalidate (GumStalker * self,
+                        const GumMemoryRange * range)
+{
+}
+
+void
+gum_stalker_invalidate_for_thread (GumStalker * self,
+                                   GumThreadId thread_id,
+                                   const GumMemoryRange * range)
+{
+}
+
+GArray *
+gum_stalker_collect_block_counts (GumStalker * self)
+{
+  return g_array_new (FALSE, FALSE, sizeof (GumBlockCount));
+}
+
 void
 gum_stalker_flush (GumStalker * self)
 {
@@ -13,6 +13,7 @@
 #include "gumarm64writer.h"
 #include "gummemory.h"
 #include "gummetalhash.h"
+#include "gummodulemap.h"
 #include "gumspinlock.h"
 #include "gumtls.h"
 
@@ -452,6 +453,86 @@ gum_stalker_exclude (GumStalker * self,
   g_array_append_val (self->exclusions, *range);
 }
 
+void
+gum_stalker_remove_exclusion (GumStalker * self,
+                              const GumMemoryRange * range)
+{
+  guint i;
+
+  for (i = 0; i != self->exclusions->len; i++)
+  {
+    GumMemoryRange * r = &g_array_index (self->exclusions, GumMemoryRange, i);
+
+    if (r->base_address == range->base_address && r->size == range->size)
+    {
+      g_array_remove_index_fast (self->exclusions, i);
+      break;
+    }
+  }
+}
+
+/*
+ * Only modules already loaded are picked up here, unlike on x86 where
+ * modules loaded later on are tracked as well.
+ */
+void
+gum_stalker_exclude_module (GumStalker * self,
+                            const gchar * name)
+{
+  GumModuleMap * map;
+  GArray * modules;
+  guint i;
+
+  map = gum_module_map_new ();
+  modules = gum_module_map_get_values (map);
+
+  for (i = 0; i != modules->len; i++)
+  {
+    const GumModuleDetails * d = &g_array_index (modules, GumModuleDetails, i);
+
+    if (strcmp (d->name, name) == 0)
+      g_array_append_val (self->exclusions, *d->range);
+  }
+
+  g_object_unref (map);
+}
+
+void
+gum_stalker_remove_module_exclusion (GumStalker * self,
+                                     const gchar * name)
+{
+  GumModuleMap * map;
+  GArray * modules;
+  guint i;
+
+  map = gum_module_map_new ();
+  modules = gum_module_map_get_values (map);
+
+  for (i = 0; i != modules->len; i++)
+  {
+    const GumModuleDetails * d = &g_array_index (modules, GumModuleDetails, i);
+
+    if (strcmp (d->name, name) == 0)
+      gum_stalker_remove_exclusion (self, d->range);
+  }
+
+  g_object_unref (map);
+}
+
+/* Inclusive mode is only implemented on x86 for now */
+
+void
+gum_stalker_include (GumStalker * self,
+                     const GumMemoryRange * range)
+{
+}
+
+void
+gum_stalker_include_module (GumStalker * self,
+                            const gchar * name)
+{
+}
+
 gint
 gum_stalker_get_trust_threshold (GumStalker * self)
 {
@@ -465,6 +546,118 @@ gum_stalker_set_trust_threshold (GumStalker * self,
   self->trust_threshold = trust_threshold;
 }
 
+guint
+gum_stalker_get_ic_entries (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_ic_entries (GumStalker * self,
+                            guint n)
+{
+}
+
+guint
+gum_stalker_get_trace_threshold (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_trace_threshold (GumStalker * self,
+                                 guint threshold)
+{
+}
+
+guint
+gum_stalker_get_event_buffer_capacity (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_event_buffer_capacity (GumStalker * self,
+                                       guint capacity)
+{
+}
+
+void
+gum_stalker_set_coverage_bitmap (GumStalker * self,
+                                 guint8 * bitmap,
+                                 gsize size)
+{
+}
+
+gsize
+gum_stalker_get_code_budget (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_code_budget (GumStalker * self,
+                             gsize budget)
+{
+}
+
+gsize
+gum_stalker_get_thread_code_budget (GumStalker * self)
+{
+  return 0;
+}
+
+void
+gum_stalker_set_thread_code_budget (GumStalker * self,
+                                    gsize budget)
+{
+}
+
+gboolean
+gum_stalker_get_code_write_protection (GumStalker * self)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_set_code_write_protection (GumStalker * self,
+                                       gboolean enabled)
+{
+}
+
+gboolean
+gum_stalker_get_block_counting (GumStalker * self)
+{
+  return FALSE;
+}
+
+void
+gum_stalker_set_block_counting (GumStalker * self,
+                                gboolean enabled)
+{
+}
+
+void
+gum_stalker_invalidate (GumStalker * self,
+                        const GumMemoryRange * range)
+{
+  gum_stalker_invalidate_caches (self);
+}
+
+void
+gum_stalker_invalidate_for_thread (GumStalker * self,
+                                   GumThreadId thread_id,
+                                   const GumMemoryRange * range)
+{
+  gum_stalker_invalidate_caches (self);
+}
+
+GArray *
+gum_stalker_collect_block_counts (GumStalker * self)
+{
+  return g_array_new (FALSE, FALSE, sizeof (GumBlockCount));
+}
+
 void
 gum_stalker_flush (GumStalker * self)
 {
@@ -251,8 +251,9 @@ gum_emit_enter_thunk (GumX86Writer * cw)
   gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XCX,
       GUM_REG_XBP, GUM_FRAME_OFFSET_NEXT_HOP);
 
-  gum_x86_writer_put_call_address_with_aligned_arguments (cw, GUM_CALL_CAPI,
-      GUM_ADDRESS (_gum_function_context_begin_invocation), 4,
+  gum_x86_writer_put_call_reg_offset_ptr_with_aligned_arguments (cw,
+      GUM_CALL_CAPI, GUM_REG_XBX,
+      G_STRUCT_OFFSET (GumFunctionContext, begin_invocation), 4,
       GUM_ARG_REGISTER, GUM_REG_XBX,
       GUM_ARG_REGISTER, GUM_REG_XSI,
       GUM_ARG_REGISTER, GUM_REG_XDX,
@@ -9,16 +9,16 @@
 
 #include "gumstalker.h"
 
+#include "gumcodeallocator.h"
 #include "gummetalhash.h"
+#include "gummodulemap.h"
 #include "gumx86reader.h"
 #include "gumx86writer.h"
+#include "gumexceptor.h"
 #include "gummemory.h"
 #include "gumx86relocator.h"
 #include "gumspinlock.h"
 #include "gumtls.h"
-#ifdef G_OS_WIN32
-# include "gumexceptor.h"
-#endif
 
 #include <stdlib.h>
 #include <string.h>
@@ -33,14 +33,93 @@
 #define GUM_DATA_ALIGNMENT                     8
 #define GUM_CODE_SLAB_SIZE_IN_PAGES         1024
 #define GUM_EXEC_BLOCK_MIN_SIZE             2048
+#define GUM_INVALIDATION_STUB_SIZE           128
+#define GUM_INVALIDATION_STUBS_PER_CHUNK       8
+#define GUM_EVENT_BUFFER_MAX_CAPACITY    (1 << 20)
+#define GUM_FLAGS_LIVENESS_MAX_INSNS          64
+
+#define GUM_IC_MIN_ENTRIES                     2
+#define GUM_IC_MAX_ENTRIES                    32
+#define GUM_IC_MEGAMORPHIC_MISSES             16
+#define GUM_IC_TABLE_SIZE                   4096
+#define GUM_TRACE_MAX_BLOCKS                   8
+#define GUM_CALL_COUNTS_CAPACITY            4096
+#define GUM_CALL_COUNTS_MAX_TARGETS \
+    (GUM_CALL_COUNTS_CAPACITY - (GUM_CALL_COUNTS_CAPACITY / 4))
+#define GUM_CALL_COUNTS_DRAIN_INTERVAL      4096
+#define GUM_ENTRY_HOOK_REDIRECT_SIZE           5
+#define GUM_ENTRY_HOOK_SLICE_SIZE            256
+#define GUM_MAX_NATIVE_RETURNS                16
+#define GUM_NATIVE_RETURN_STUB_SIZE            8
+#define GUM_X86_JMP_MAX_DISTANCE            (G_MAXINT32 - 16384)
+#if GLIB_SIZEOF_VOID_P == 8
+# define GUM_IC_ENTRY_SIZE_LOG2                4
+#else
+# define GUM_IC_ENTRY_SIZE_LOG2                3
+#endif
+
+#define GUM_CODE_PAGES_CAPACITY          (1 << 16)
+#define GUM_DIRTY_CODE_PAGES_CAPACITY         256
+#define GUM_CODE_PAGE_KNOWN                  (1U << 16)
+#define GUM_CODE_PAGE_PROTECTED              (1U << 17)
+#define GUM_CODE_PAGE_DIRTY                  (1U << 18)
+
+#define GUM_X86_EFLAGS_STATUS_WRITE_OF \
+    (X86_EFLAGS_MODIFY_OF | X86_EFLAGS_RESET_OF | X86_EFLAGS_UNDEFINED_OF)
+#define GUM_X86_EFLAGS_STATUS_WRITE_SF \
+    (X86_EFLAGS_MODIFY_SF | X86_EFLAGS_RESET_SF | X86_EFLAGS_UNDEFINED_SF)
+#define GUM_X86_EFLAGS_STATUS_WRITE_ZF \
+    (X86_EFLAGS_MODIFY_ZF | X86_EFLAGS_UNDEFINED_ZF)
+#define GUM_X86_EFLAGS_STATUS_WRITE_AF \
+    (X86_EFLAGS_MODIFY_AF | X86_EFLAGS_RESET_AF | X86_EFLAGS_UNDEFINED_AF)
+#define GUM_X86_EFLAGS_STATUS_WRITE_PF \
+    (X86_EFLAGS_MODIFY_PF | X86_EFLAGS_RESET_PF | X86_EFLAGS_UNDEFINED_PF)
+#define GUM_X86_EFLAGS_STATUS_WRITE_CF \
+    (X86_EFLAGS_MODIFY_CF | X86_EFLAGS_RESET_CF | X86_EFLAGS_SET_CF | \
+     X86_EFLAGS_UNDEFINED_CF)
+#define GUM_X86_STATUS_FLAGS_ALL             ((1 << 6) - 1)
+
+/* For the DWARF unwind info describing our native return stubs */
+#if GLIB_SIZEOF_VOID_P == 8
+# define GUM_DWARF_REG_SP                      7
+# define GUM_DWARF_REG_RA                     16
+#elif defined (HAVE_DARWIN)
+# define GUM_DWARF_REG_SP                      5
+# define GUM_DWARF_REG_RA                      8
+#else
+# define GUM_DWARF_REG_SP                      4
+# define GUM_DWARF_REG_RA                      8
+#endif
+#define GUM_DW_CFA_EXPRESSION               0x10
+#define GUM_DW_CFA_DEF_CFA                  0x0c
+#define GUM_DW_OP_ADDR                      0x03
+#define GUM_UNWIND_CIE_SIZE                   16
+#define GUM_UNWIND_FDE_SIZE \
+    ((12 + 3 * sizeof (gpointer) + sizeof (gpointer) - 1) & \
+        ~(sizeof (gpointer) - 1))
+#define GUM_UNWIND_FDE_STRIDE (GUM_UNWIND_FDE_SIZE + sizeof (guint32))
+
+#ifndef G_OS_WIN32
+/* Provided by the unwinder: libgcc_s, or libunwind on Apple OSes */
+extern void __register_frame (void * fde);
+extern void __deregister_frame (void * fde);
+#endif
 
 typedef struct _GumInfectContext GumInfectContext;
 typedef struct _GumDisinfectContext GumDisinfectContext;
-
+typedef struct _GumCodePage GumCodePage;
+typedef struct _GumDirtyCodePage GumDirtyCodePage;
+typedef struct _GumCodeMapping GumCodeMapping;
+typedef struct _GumFindCodeMappingContext GumFindCodeMappingContext;
+typedef struct _GumHookExportsContext GumHookExportsContext;
+
+typedef struct _GumModuleRule GumModuleRule;
+typedef struct _GumEntryHook GumEntryHook;
 typedef struct _GumCallProbe GumCallProbe;
 typedef struct _GumSlab GumSlab;
 
 typedef struct _GumExecFrame GumExecFrame;
+typedef struct _GumNativeReturn GumNativeReturn;
 typedef struct _GumExecCtx GumExecCtx;
 typedef void (* GumExecHelperWriteFunc) (GumExecCtx * ctx, GumX86Writer * cw);
 typedef struct _GumExecBlock GumExecBlock;
@@ -53,6 +132,9 @@ typedef struct _GumGeneratorContext GumGeneratorContext;
 typedef struct _GumCalloutEntry GumCalloutEntry;
 typedef struct _GumInstruction GumInstruction;
 typedef struct _GumBranchTarget GumBranchTarget;
+typedef struct _GumIcSite GumIcSite;
+typedef struct _GumIcEntry GumIcEntry;
+typedef struct _GumCallCountSlot GumCallCountSlot;
 
 typedef guint GumVirtualizationRequirements;
 
@@ -66,8 +148,42 @@ struct _GumStalker
   GSList * contexts;
   GumTlsKey exec_ctx;
 
+  GMutex exclusion_mutex;
+  GumSpinlock exclusion_lock;
   GArray * exclusions;
+  GArray * excluded_modules;
+  GArray * inclusions;
+  GArray * included_modules;
+  volatile gboolean any_inclusions;
+  guint n_unresolved_modules;
+  GArray * exclusion_index;
+  GumModuleMap * module_map;
+  GHashTable * foreign_pages;
+  GMutex entry_hook_mutex;
+  GumCodeAllocator entry_hook_allocator;
+  GumCodeSlice * entry_thunk;
+  GHashTable * entry_hooks;
+  GSList * unloaded_entry_hooks;
+  volatile gboolean any_entry_hooks;
+  volatile gboolean entry_hooks_pending;
   gint trust_threshold;
+  guint ic_entries;
+  guint trace_threshold;
+  guint event_buffer_capacity;
+  guint8 * coverage_bitmap;
+  gsize coverage_bitmap_size;
+  gboolean code_write_protection;
+  GumExceptor * code_write_exceptor;
+  gboolean block_counting;
+  GMutex code_page_lock;
+  GumCodePage * code_pages;
+  GArray * code_mappings;
+  GumDirtyCodePage * dirty_code_pages;
+  volatile gint dirty_code_pages_head;
+  gsize code_budget;
+  gsize thread_code_budget;
+  volatile gsize total_code_size;
+  volatile gint code_budget_epoch;
   volatile gboolean any_probes_attached;
   volatile gint last_probe_id;
   GumSpinlock probe_lock;
@@ -96,6 +212,73 @@ struct _GumDisinfectContext
   gboolean success;
 };
 
+/*
+ * Pages we have compiled code from. The table is only ever added to, with
+ * the lock held, so that the exception handler can look pages up without it.
+ */
+struct _GumCodePage
+{
+  gpointer volatile address;
+  volatile gint state;
+};
+
+/*
+ * Pages written to since we protected them, waiting to be picked up by each
+ * thread at its next entrygate.
+ */
+struct _GumDirtyCodePage
+{
+  volatile gint seq;
+  gpointer volatile address;
+};
+
+struct _GumCodeMapping
+{
+  GumMemoryRange range;
+  GumPageProtection prot;
+};
+
+struct _GumFindCodeMappingContext
+{
+  GumAddress address;
+  GumCodeMapping mapping;
+  gboolean found;
+};
+
+struct _GumHookExportsContext
+{
+  GumStalker * stalker;
+  const gchar * module_name;
+  GumAddress module_base;
+  GPtrArray * hooks;
+};
+
+struct _GumModuleRule
+{
+  gchar * name;
+  GumMemoryRange range;
+  gboolean resolved;
+  gboolean hooked;
+};
+
+/*
+ * Redirects an exported function of an included module to the shared entry
+ * thunk, so threads running natively get pulled back in when they call it.
+ */
+struct _GumEntryHook
+{
+  GumStalker * stalker;
+  gpointer function;
+  const gchar * module_name;
+  GumAddress module_base;
+  gboolean active;
+  GumCodeSlice * slice;
+  gpointer on_enter;
+  gpointer trampoline;
+  guint8 overwritten_prologue[32];
+  guint overwritten_prologue_len;
+};
+
 struct _GumCallProbe
 {
   GumProbeId id;
@@ -118,6 +301,18 @@ struct _GumExecFrame
   gpointer code_address;
 };
 
+/*
+ * A return address on the application stack that we pointed at one of our
+ * native return stubs when handing control to code outside the included
+ * ranges. The stub is the one at the same index, and its unwind info tells
+ * the unwinder to look for the caller at `real_address`.
+ */
+struct _GumNativeReturn
+{
+  gpointer * slot;
+  gpointer real_address;
+};
+
 enum _GumExecCtxState
 {
   GUM_EXEC_CTX_ACTIVE,
@@ -129,6 +324,7 @@ struct _GumExecCtx
 {
   volatile guint state;
   volatile gboolean invalidate_pending;
+  volatile gboolean range_invalidation_pending;
 
   GumStalker * stalker;
   GumThreadId thread_id;
@@ -138,14 +334,42 @@ struct _GumExecCtx
 
   GumStalkerTransformer * transformer;
   gboolean calling_transformer;
+  gboolean compiling_trace;
   GQueue callout_entries;
   GumSpinlock callout_lock;
   GumEventSink * sink;
   gboolean sink_started;
   GumEventType sink_mask;
   void (* sink_process_impl) (GumEventSink * self, const GumEvent * ev);
+  void (* sink_process_batch_impl) (GumEventSink * self,
+      const GumEvent * events, guint n_events);
   GumEvent tmp_event;
 
+  GumEvent * event_buffer;
+  gsize event_buffer_size;
+  gsize event_buffer_head;
+  gsize event_buffer_tail;
+  GumSpinlock event_buffer_lock;
+  gboolean event_buffer_draining;
+
+  GumCallCountSlot * call_counts;
+  guint * call_count_indices;
+  gsize * call_counts_reported;
+  GumCallCount * call_count_deltas;
+  volatile gint n_call_counts;
+  guint call_counts_countdown;
+  GumSpinlock call_counts_lock;
+
+  gsize coverage_prev_loc;
+
+  GArray * pending_invalidations;
+  GumSpinlock invalidation_lock;
+  guint dirty_code_pages_tail;
+
+  GumExecBlock * counted_blocks;
+  GHashTable * retired_block_counts;
+  GumSpinlock counted_blocks_lock;
+
   gboolean unfollow_called_while_still_following;
   GumExecBlock * current_block;
   GumExecFrame * current_frame;
@@ -158,9 +382,21 @@ struct _GumExecCtx
 
   gpointer thunks;
   gpointer infect_thunk;
+  gpointer native_return_thunk;
+  guint8 * native_return_stubs;
+  GumNativeReturn native_returns[GUM_MAX_NATIVE_RETURNS];
+  guint n_native_returns;
+  guint8 * native_return_unwind_info;
 
   GumSlab * code_slab;
   GumSlab first_code_slab;
+  GumSlab * retired_slabs;
+  guint code_generation;
+  gsize code_size;
+  gboolean code_budget_exceeded;
+  gint code_budget_epoch;
+  gpointer free_invalidation_stubs;
+  gpointer retired_invalidation_stubs;
   gpointer last_prolog_minimal;
   gpointer last_epilog_minimal;
   gpointer last_prolog_full;
@@ -168,6 +404,9 @@ struct _GumExecCtx
   gpointer last_stack_push;
   gpointer last_stack_pop_and_go;
   GumMetalHashTable * mappings;
+
+  GumIcEntry * ic_table;
+  gpointer ic_table_lookup;
 };
 
 struct _GumExecBlock
@@ -184,6 +423,9 @@ struct _GumExecBlock
   guint8 state;
   gint recycle_count;
   gboolean has_call_to_excluded_range;
+  guint trace_countdown;
+  guint64 execution_count;
+  GumExecBlock * next_counted;
 
 #ifdef G_OS_WIN32
   DWORD previous_dr0;
@@ -222,6 +464,9 @@ struct _GumGeneratorContext
   gpointer continuation_real_address;
   GumPrologType opened_prolog;
   guint accumulated_stack_delta;
+  guint64 dead_flags;
+  gpointer basic_block_start;
+  guint trace_blocks_left;
 };
 
 struct _GumInstruction
@@ -266,6 +511,37 @@ struct _GumBranchTarget
   guint8 scale;
 };
 
+/*
+ * Emitted inline right before the lookup code of each indirect branch site,
+ * followed by its entries. The generated code bumps the hit count, the miss
+ * count is kept by gum_exec_block_backpatch_inline_cache().
+ */
+struct _GumIcSite
+{
+  guint32 hits;
+  guint32 misses;
+  guint32 n_entries;
+  gpointer miss_handler;
+  gpointer resolve_address;
+};
+
+struct _GumIcEntry
+{
+  gpointer real_start;
+  gpointer code_start;
+};
+
+/*
+ * One entry of the open-addressed table that call sites bump in call-summary
+ * mode. Entries never move once claimed, so their addresses can be baked into
+ * the generated code.
+ */
+struct _GumCallCountSlot
+{
+  gpointer target;
+  gsize count;
+};
+
 enum _GumVirtualizationRequirements
 {
   GUM_REQUIRE_NOTHING         = 0,
@@ -288,6 +564,9 @@ enum _GumVirtualizationRequirements
     (sizeof (GumCpuContext) + sizeof (gpointer))
 #define GUM_THUNK_ARGLIST_STACK_RESERVE 64 /* x64 ABI compatibility */
 
+/* Event buffer slots must never straddle the end of the buffer */
+G_STATIC_ASSERT ((sizeof (GumEvent) & (sizeof (GumEvent) - 1)) == 0);
+
 static void gum_stalker_dispose (GObject * object);
 static void gum_stalker_finalize (GObject * object);
 
@@ -301,24 +580,133 @@ static void gum_stalker_disinfect (GumThreadId thread_id,
 
 static void gum_stalker_free_probe_array (gpointer data);
 
+static void gum_stalker_add_module_rule (GumStalker * self, GArray * rules,
+    const gchar * name);
+static void gum_module_rule_clear (GumModuleRule * module);
+static gboolean gum_stalker_is_excluding (GumStalker * self,
+    gconstpointer address);
+static void gum_stalker_refresh_module_rules (GumStalker * self);
+static gboolean gum_module_map_has_same_modules (GumModuleMap * map,
+    GArray * modules);
+static gboolean gum_stalker_resolve_module_rules (GumStalker * self,
+    GArray * rules, GArray * modules);
+static void gum_stalker_rebuild_exclusion_index (GumStalker * self);
+static GArray * gum_stalker_build_exclusion_index (GumStalker * self);
+static void gum_append_resolved_module_rules (GArray * ranges,
+    GArray * rules);
+static void gum_append_memory_range (GArray * ranges, GumAddress begin,
+    GumAddress end);
+static void gum_memory_ranges_sort_and_merge (GArray * ranges);
+static gint gum_memory_range_compare_base (const GumMemoryRange * lhs,
+    const GumMemoryRange * rhs);
+static gint gum_memory_range_compare_to_key (const GumAddress * key_ptr,
+    const GumMemoryRange * range);
+
+static void gum_stalker_ensure_entry_hooks (GumStalker * self);
+static gboolean gum_stalker_hook_export (const GumExportDetails * details,
+    gpointer user_data);
+static GumEntryHook * gum_entry_hook_new (GumStalker * stalker,
+    gpointer function);
+static void gum_entry_hook_free (GumEntryHook * hook);
+static void gum_entry_hook_activate (GumEntryHook * hook);
+static void gum_entry_hook_deactivate (GumEntryHook * hook);
+static void gum_entry_hook_write_redirect (gpointer prologue,
+    GumEntryHook * hook);
+static void gum_entry_hook_write_prologue (gpointer prologue,
+    GumEntryHook * hook);
+static void gum_stalker_remove_entry_hooks (GumStalker * self);
+static void gum_stalker_maybe_remove_entry_hooks (GumStalker * self);
+static void gum_stalker_forget_unloaded_entry_hooks (GumStalker * self,
+    GumModuleMap * map);
+static GumEntryHook * gum_stalker_lookup_entry_hook (GumStalker * self,
+    gconstpointer address);
+static gpointer gum_entry_hook_enter (GumEntryHook * hook, gpointer * sp);
+static void gum_stalker_write_native_transition (GumX86Writer * cw,
+    GumAddress func);
+
 static GumExecCtx * gum_stalker_create_exec_ctx (GumStalker * self,
     GumThreadId thread_id, GumStalkerTransformer * transformer,
     GumEventSink * sink);
 static GumExecCtx * gum_stalker_get_exec_ctx (GumStalker * self);
 static void gum_stalker_invalidate_caches (GumStalker * self);
+static void gum_stalker_protect_code (GumStalker * self, gconstpointer begin,
+    gconstpointer end);
+static gboolean gum_stalker_is_code_protected (GumStalker * self,
+    gconstpointer begin, gconstpointer end);
+static void gum_stalker_unprotect_all_code (GumStalker * self);
+static GumCodePage * gum_stalker_lookup_code_page (GumStalker * self,
+    gconstpointer address);
+static GumCodePage * gum_stalker_insert_code_page (GumStalker * self,
+    gconstpointer address, gint state);
+static GumPageProtection gum_stalker_query_code_protection (GumStalker * self,
+    gconstpointer page);
+static gboolean gum_find_code_mapping (const GumRangeDetails * details,
+    gpointer user_data);
+static gboolean gum_stalker_on_code_write (GumExceptionDetails * details,
+    gpointer user_data);
+static void gum_stalker_mark_code_dirty (GumStalker * self,
+    gpointer page);
+static void gum_stalker_invalidate_range (GumStalker * self,
+    gboolean any_thread, GumThreadId thread_id, const GumMemoryRange * range);
+static GHashTable * gum_block_counts_new (void);
+static void gum_block_counts_add (GHashTable * counts, gpointer begin,
+    gpointer end, guint64 count);
+static void gum_block_counts_add_all (GHashTable * counts,
+    GHashTable * other);
+static void gum_block_counts_add_blocks (GHashTable * counts,
+    GumExecBlock * blocks);
+static guint gum_block_count_hash (gconstpointer key);
+static gboolean gum_block_count_equal (gconstpointer a, gconstpointer b);
+static void gum_block_count_free (GumBlockCount * bc);
+static gint gum_compare_block_counts (gconstpointer a, gconstpointer b);
+
+static void gum_exec_ctx_request_invalidation (GumExecCtx * ctx,
+    const GumMemoryRange * range);
+static void gum_exec_ctx_process_pending_invalidations (GumExecCtx * ctx);
+static void gum_exec_ctx_collect_dirty_code (GumExecCtx * ctx);
 
 static void gum_exec_ctx_prepare_for_unfollow (GumExecCtx * ctx);
+static void gum_exec_ctx_drain_events (GumExecCtx * ctx);
+static gboolean gum_exec_ctx_try_drain_events (GumExecCtx * ctx);
+static void gum_exec_ctx_emit_event (GumExecCtx * ctx, const GumEvent * ev);
+static void gum_exec_ctx_drain_call_counts (GumExecCtx * ctx);
+static GumCallCountSlot * gum_exec_ctx_obtain_call_count (GumExecCtx * ctx,
+    gpointer target);
 static void gum_exec_ctx_dispose_callouts (GumExecCtx * ctx);
 static void gum_exec_ctx_free (GumExecCtx * ctx);
+static void gum_exec_ctx_free_slabs (GumExecCtx * ctx, GumSlab * slabs);
+static void gum_exec_ctx_recycle_code (GumExecCtx * ctx);
+static void gum_exec_ctx_account_code (GumExecCtx * ctx, gsize size);
 static void gum_exec_ctx_unfollow (GumExecCtx * ctx, gpointer resume_at);
 static gboolean gum_exec_ctx_has_executed (GumExecCtx * ctx);
 static gpointer GUM_THUNK gum_exec_ctx_replace_current_block_with (
     GumExecCtx * ctx, gpointer start_address);
+static void gum_exec_ctx_leave_for_native (GumExecCtx * ctx,
+    gpointer start_address);
+static gpointer gum_exec_ctx_return_from_native (GumExecCtx * ctx,
+    gpointer * sp);
+static void gum_exec_ctx_restore_native_returns (GumExecCtx * ctx,
+    gconstpointer sp);
+static void gum_exec_ctx_drop_stale_native_returns (GumExecCtx * ctx,
+    gconstpointer sp);
+static gpointer gum_exec_ctx_get_native_return_stub (GumExecCtx * ctx,
+    guint index);
+static void gum_exec_ctx_write_native_return_stubs (GumExecCtx * ctx,
+    GumX86Writer * cw);
+#ifndef G_OS_WIN32
+static void gum_exec_ctx_register_native_return_unwind_info (GumExecCtx * ctx);
+static void gum_exec_ctx_unregister_native_return_unwind_info (
+    GumExecCtx * ctx);
+#endif
 static void gum_exec_ctx_create_thunks (GumExecCtx * ctx);
 static void gum_exec_ctx_destroy_thunks (GumExecCtx * ctx);
 
 static GumExecBlock * gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
     gpointer real_address, gpointer * code_address);
+static guint64 gum_exec_ctx_analyze_flags_liveness (GumExecCtx * ctx,
+    gconstpointer code);
+static guint gum_x86_insn_get_flags_read (const cs_insn * insn);
+static guint gum_x86_insn_get_flags_written (const cs_insn * insn);
 
 static void gum_stalker_invoke_callout (GumCpuContext * cpu_context,
     GumCalloutEntry * entry);
@@ -327,6 +715,10 @@ static void gum_exec_ctx_write_prolog (GumExecCtx * ctx, GumPrologType type,
     GumX86Writer * cw);
 static void gum_exec_ctx_write_epilog (GumExecCtx * ctx, GumPrologType type,
     GumX86Writer * cw);
+static void gum_exec_ctx_write_ic_prolog (GumExecCtx * ctx,
+    gboolean preserve_flags, GumX86Writer * cw);
+static void gum_exec_ctx_write_ic_epilog (GumExecCtx * ctx,
+    gboolean preserve_flags, GumX86Writer * cw);
 
 static void gum_exec_ctx_ensure_inline_helpers_reachable (GumExecCtx * ctx);
 static void gum_exec_ctx_write_minimal_prolog_helper (GumExecCtx * ctx,
@@ -370,6 +762,13 @@ static GumExecBlock * gum_exec_block_obtain (GumExecCtx * ctx,
     gpointer real_address, gpointer * code_address);
 static gboolean gum_exec_block_is_full (GumExecBlock * block);
 static void gum_exec_block_commit (GumExecBlock * block);
+static void gum_exec_block_invalidate (GumExecBlock * block);
+static void gum_exec_block_relink_invalidated (GumExecBlock * block,
+    gpointer stub);
+static gpointer gum_exec_ctx_alloc_invalidation_stub (GumExecCtx * ctx);
+static void gum_exec_ctx_reuse_invalidation_stubs (GumExecCtx * ctx);
+static gboolean gum_exec_ctx_may_form_traces (GumExecCtx * ctx);
+static void gum_exec_block_form_trace (GumExecBlock * block);
 
 static void gum_exec_block_backpatch_call (GumExecBlock * block,
     gpointer code_start, GumPrologType opened_prolog, gpointer ret_real_address,
@@ -378,6 +777,14 @@ static void gum_exec_block_backpatch_jmp (GumExecBlock * block,
     gpointer code_start, GumPrologType opened_prolog);
 static void gum_exec_block_backpatch_ret (GumExecBlock * block,
     gpointer code_start);
+static void gum_exec_block_backpatch_inline_cache (GumExecBlock * block,
+    GumIcSite * site);
+static gpointer gum_exec_ctx_obtain_ic_table_lookup (GumExecCtx * ctx);
+static void gum_exec_ctx_write_ic_table_lookup (GumExecCtx * ctx,
+    GumX86Writer * cw);
+static GumIcSite * gum_exec_block_write_inline_cache_code (
+    GumExecBlock * block, const GumBranchTarget * target,
+    GumGeneratorContext * gc);
 
 static GumVirtualizationRequirements gum_exec_block_virtualize_branch_insn (
     GumExecBlock * block, GumGeneratorContext * gc);
@@ -408,14 +815,26 @@ static void gum_exec_block_write_sysenter_continuation_code (
 static void gum_exec_block_write_call_event_code (GumExecBlock * block,
     const GumBranchTarget * target, GumGeneratorContext * gc,
     GumCodeContext cc);
+static void gum_exec_block_write_call_count_code (GumExecBlock * block,
+    const GumBranchTarget * target, GumGeneratorContext * gc,
+    GumCodeContext cc);
 static void gum_exec_block_write_ret_event_code (GumExecBlock * block,
     GumGeneratorContext * gc, GumCodeContext cc);
 static void gum_exec_block_write_exec_event_code (GumExecBlock * block,
     GumGeneratorContext * gc, GumCodeContext cc);
 static void gum_exec_block_write_block_event_code (GumExecBlock * block,
     GumGeneratorContext * gc, GumCodeContext cc);
+static gboolean gum_exec_block_write_buffered_event_code (GumExecBlock * block,
+    GumEventType type, const GumBranchTarget * target, gconstpointer beach,
+    GumGeneratorContext * gc);
 static void gum_exec_block_write_unfollow_check_code (GumExecBlock * block,
     GumGeneratorContext * gc, GumCodeContext cc);
+static void gum_exec_block_write_coverage_code (GumExecBlock * block,
+    GumGeneratorContext * gc);
+static void gum_exec_block_write_trace_countdown_code (GumExecBlock * block,
+    GumGeneratorContext * gc);
+static void gum_exec_block_write_execution_count_code (GumExecBlock * block,
+    GumGeneratorContext * gc);
 
 static void gum_exec_block_write_call_probe_code (GumExecBlock * block,
     const GumBranchTarget * target, GumGeneratorContext * gc);
@@ -436,8 +855,26 @@ static gboolean gum_stalker_on_exception (GumExceptionDetails * details,
     gpointer user_data);
 #endif
 
+static void gum_stalker_reset_counters (void);
+
 G_DEFINE_TYPE (GumStalker, gum_stalker, G_TYPE_OBJECT)
 
+/*
+ * Blocks are compiled and stored per GumExecCtx, as the generated code
+ * embeds absolute addresses of its context. total_compiles and
+ * total_slab_pages therefore grow with the number of threads following the
+ * same code, which is what thread_pool_performance measures. Enabling the
+ * counters resets them, so each measurement starts from zero.
+ */
+static gboolean counters_enabled = FALSE;
+static guint total_transitions = 0;
+static volatile gint total_compiles = 0;
+static volatile gint total_slab_pages = 0;
+static volatile gint total_block_bytes = 0;
+static volatile gint total_code_recycles = 0;
+static volatile gint total_ic_promotions = 0;
+static volatile gint total_traces = 0;
+
 gboolean
 gum_stalker_is_supported (void)
 {
@@ -456,8 +893,29 @@ gum_stalker_class_init (GumStalkerClass * klass)
 static void
 gum_stalker_init (GumStalker * self)
 {
+  g_mutex_init (&self->exclusion_mutex);
+  gum_spinlock_init (&self->exclusion_lock);
   self->exclusions = g_array_new (FALSE, FALSE, sizeof (GumMemoryRange));
+  self->excluded_modules = g_array_new (FALSE, FALSE,
+      sizeof (GumModuleRule));
+  g_array_set_clear_func (self->excluded_modules,
+      (GDestroyNotify) gum_module_rule_clear);
+  self->inclusions = g_array_new (FALSE, FALSE, sizeof (GumMemoryRange));
+  self->included_modules = g_array_new (FALSE, FALSE, sizeof (GumModuleRule));
+  g_array_set_clear_func (self->included_modules,
+      (GDestroyNotify) gum_module_rule_clear);
+  self->exclusion_index = g_array_new (FALSE, FALSE, sizeof (GumMemoryRange));
+  self->foreign_pages = g_hash_table_new (NULL, NULL);
+  g_mutex_init (&self->entry_hook_mutex);
+  gum_code_allocator_init (&self->entry_hook_allocator,
+      GUM_ENTRY_HOOK_SLICE_SIZE);
+  self->entry_hooks = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) gum_entry_hook_free);
   self->trust_threshold = 1;
+  self->ic_entries = GUM_IC_MIN_ENTRIES;
+
+  g_mutex_init (&self->code_page_lock);
+  self->code_mappings = g_array_new (FALSE, FALSE, sizeof (GumCodeMapping));
 
   gum_spinlock_init (&self->probe_lock);
   self->probe_target_by_id =
@@ -526,9 +984,11 @@ gum_stalker_init (GumStalker * self)
 static void
 gum_stalker_dispose (GObject * object)
 {
-#if defined (G_OS_WIN32) && GLIB_SIZEOF_VOID_P == 4
   GumStalker * self = GUM_STALKER (object);
 
+  gum_stalker_set_code_write_protection (self, FALSE);
+
+#if defined (G_OS_WIN32) && GLIB_SIZEOF_VOID_P == 4
   if (self->exceptor != NULL)
   {
     gum_exceptor_remove (self->exceptor, gum_stalker_on_exception, self);
@@ -548,7 +1008,28 @@ gum_stalker_finalize (GObject * object)
   g_hash_table_unref (self->probe_array_by_address);
   g_hash_table_unref (self->probe_target_by_id);
 
+  g_free (self->dirty_code_pages);
+  g_free (self->code_pages);
+  g_array_free (self->code_mappings, TRUE);
+  g_mutex_clear (&self->code_page_lock);
+
+  gum_stalker_remove_entry_hooks (self);
+  g_hash_table_unref (self->entry_hooks);
+  g_slist_free_full (self->unloaded_entry_hooks,
+      (GDestroyNotify) gum_entry_hook_free);
+  if (self->entry_thunk != NULL)
+    gum_code_slice_free (self->entry_thunk);
+  gum_code_allocator_free (&self->entry_hook_allocator);
+  g_mutex_clear (&self->entry_hook_mutex);
+
+  g_clear_object (&self->module_map);
+  g_hash_table_unref (self->foreign_pages);
+  g_array_free (self->exclusion_index, TRUE);
+  g_array_free (self->included_modules, TRUE);
+  g_array_free (self->inclusions, TRUE);
+  g_array_free (self->excluded_modules, TRUE);
   g_array_free (self->exclusions, TRUE);
+  g_mutex_clear (&self->exclusion_mutex);
 
   g_assert (self->contexts == NULL);
   gum_tls_key_free (self->exec_ctx);
@@ -567,547 +1048,2521 @@ void
 gum_stalker_exclude (GumStalker * self,
                      const GumMemoryRange * range)
 {
+  g_mutex_lock (&self->exclusion_mutex);
+
+  gum_spinlock_acquire (&self->exclusion_lock);
   g_array_append_val (self->exclusions, *range);
-}
+  gum_spinlock_release (&self->exclusion_lock);
 
-gint
-gum_stalker_get_trust_threshold (GumStalker * self)
-{
-  return self->trust_threshold;
-}
+  gum_stalker_rebuild_exclusion_index (self);
 
-void
-gum_stalker_set_trust_threshold (GumStalker * self,
-                                 gint trust_threshold)
-{
-  self->trust_threshold = trust_threshold;
+  g_mutex_unlock (&self->exclusion_mutex);
 }
 
+/*
+ * Undoes an earlier gum_stalker_exclude() of the exact same range. Blocks
+ * already compiled keep treating calls into it as excluded until they get
+ * recompiled, e.g. through gum_stalker_invalidate().
+ */
 void
-gum_stalker_flush (GumStalker * self)
+gum_stalker_remove_exclusion (GumStalker * self,
+                              const GumMemoryRange * range)
 {
-  GSList * sinks, * cur;
+  gboolean removed = FALSE;
+  guint i;
 
-  GUM_STALKER_LOCK (self);
+  g_mutex_lock (&self->exclusion_mutex);
 
-  sinks = NULL;
-  for (cur = self->contexts; cur != NULL; cur = cur->next)
+  gum_spinlock_acquire (&self->exclusion_lock);
+
+  for (i = 0; i != self->exclusions->len; i++)
   {
-    GumExecCtx * ctx = cur->data;
+    GumMemoryRange * r = &g_array_index (self->exclusions, GumMemoryRange, i);
 
-    sinks = g_slist_prepend (sinks, g_object_ref (ctx->sink));
+    if (r->base_address == range->base_address && r->size == range->size)
+    {
+      g_array_remove_index_fast (self->exclusions, i);
+      removed = TRUE;
+      break;
+    }
   }
 
-  GUM_STALKER_UNLOCK (self);
+  gum_spinlock_release (&self->exclusion_lock);
 
-  for (cur = sinks; cur != NULL; cur = cur->next)
-  {
-    GumEventSink * sink = cur->data;
+  if (removed)
+    gum_stalker_rebuild_exclusion_index (self);
 
-    gum_event_sink_flush (sink);
-  }
+  g_mutex_unlock (&self->exclusion_mutex);
+}
 
-  g_slist_free_full (sinks, g_object_unref);
+/*
+ * Excludes the module named `name`, whether it is already loaded or not. If
+ * it isn't, we look for it again whenever a call into code outside all known
+ * modules gets compiled, so it is picked up once loaded.
+ */
+void
+gum_stalker_exclude_module (GumStalker * self,
+                            const gchar * name)
+{
+  gum_stalker_add_module_rule (self, self->excluded_modules, name);
 }
 
+/*
+ * Undoes an earlier gum_stalker_exclude_module() of the module named `name`.
+ * Like gum_stalker_remove_exclusion(), blocks already compiled are left
+ * alone.
+ */
 void
-gum_stalker_stop (GumStalker * self)
+gum_stalker_remove_module_exclusion (GumStalker * self,
+                                     const gchar * name)
 {
-  gboolean rescan_needed;
-  GSList * cur;
+  GArray * rules = self->excluded_modules;
+  gboolean removed = FALSE;
+  guint i;
 
-  gum_spinlock_acquire (&self->probe_lock);
-  g_hash_table_remove_all (self->probe_target_by_id);
-  g_hash_table_remove_all (self->probe_array_by_address);
-  self->any_probes_attached = FALSE;
-  gum_spinlock_release (&self->probe_lock);
+  g_mutex_lock (&self->exclusion_mutex);
 
-  GUM_STALKER_LOCK (self);
+  gum_spinlock_acquire (&self->exclusion_lock);
 
-  do
+  for (i = 0; i != rules->len; i++)
   {
-    rescan_needed = FALSE;
+    GumModuleRule * m = &g_array_index (rules, GumModuleRule, i);
 
-    for (cur = self->contexts; cur != NULL; cur = cur->next)
+    if (strcmp (m->name, name) == 0)
     {
-      GumExecCtx * ctx = (GumExecCtx *) cur->data;
-      if (ctx->state == GUM_EXEC_CTX_ACTIVE)
-      {
-        GumThreadId thread_id = ctx->thread_id;
-
-        GUM_STALKER_UNLOCK (self);
-        gum_stalker_unfollow (self, thread_id);
-        GUM_STALKER_LOCK (self);
-
-        rescan_needed = TRUE;
-        break;
-      }
+      if (!m->resolved)
+        self->n_unresolved_modules--;
+      g_array_remove_index_fast (rules, i);
+      removed = TRUE;
+      break;
     }
   }
-  while (rescan_needed);
 
-  GUM_STALKER_UNLOCK (self);
+  gum_spinlock_release (&self->exclusion_lock);
 
-  gum_stalker_garbage_collect (self);
+  if (removed)
+    gum_stalker_rebuild_exclusion_index (self);
+
+  g_mutex_unlock (&self->exclusion_mutex);
 }
 
-gboolean
-gum_stalker_garbage_collect (GumStalker * self)
+/*
+ * Switches to inclusive mode, where only code inside the included ranges and
+ * modules is instrumented. Everything else is treated as excluded and runs
+ * natively: branches into it are handed over at runtime, with calls getting
+ * a return address that brings the thread back in once the native code
+ * returns.
+ */
+void
+gum_stalker_include (GumStalker * self,
+                     const GumMemoryRange * range)
 {
-  GSList * keep = NULL, * cur;
-  gboolean pending_garbage;
-
-  GUM_STALKER_LOCK (self);
+  g_mutex_lock (&self->exclusion_mutex);
 
-  for (cur = self->contexts; cur != NULL; cur = cur->next)
-  {
-    GumExecCtx * ctx = (GumExecCtx *) cur->data;
-    if (ctx->state == GUM_EXEC_CTX_DESTROY_PENDING)
-      gum_exec_ctx_free (ctx);
-    else
-      keep = g_slist_prepend (keep, ctx);
-  }
+  gum_spinlock_acquire (&self->exclusion_lock);
+  g_array_append_val (self->inclusions, *range);
+  self->any_inclusions = TRUE;
+  gum_spinlock_release (&self->exclusion_lock);
 
-  g_slist_free (self->contexts);
-  self->contexts = keep;
+  gum_stalker_rebuild_exclusion_index (self);
 
-  pending_garbage = keep != NULL;
+  g_mutex_unlock (&self->exclusion_mutex);
+}
 
-  GUM_STALKER_UNLOCK (self);
+/*
+ * Like gum_stalker_include(), but for a module that may not be loaded yet.
+ * Native code calling one of its exported functions is caught through entry
+ * hooks, installed the first time a followed thread leaves the module.
+ */
+void
+gum_stalker_include_module (GumStalker * self,
+                            const gchar * name)
+{
+  self->any_inclusions = TRUE;
 
-  return pending_garbage;
+  gum_stalker_add_module_rule (self, self->included_modules, name);
 }
 
-#ifdef _MSC_VER
+static void
+gum_stalker_add_module_rule (GumStalker * self,
+                             GArray * rules,
+                             const gchar * name)
+{
+  GumModuleRule module;
 
-#define RETURN_ADDRESS_POINTER_FROM_FIRST_ARGUMENT(arg)   \
-    ((gpointer *) ((volatile guint8 *) &arg - sizeof (gpointer)))
+  module.name = g_strdup (name);
+  module.range.base_address = 0;
+  module.range.size = 0;
+  module.resolved = FALSE;
+  module.hooked = FALSE;
 
-void
-gum_stalker_follow_me (GumStalker * self,
-                       GumStalkerTransformer * transformer,
-                       GumEventSink * sink)
-{
-  volatile gpointer * ret_addr_ptr;
+  g_mutex_lock (&self->exclusion_mutex);
 
-  ret_addr_ptr = RETURN_ADDRESS_POINTER_FROM_FIRST_ARGUMENT (self);
+  gum_spinlock_acquire (&self->exclusion_lock);
+  g_array_append_val (rules, module);
+  self->n_unresolved_modules++;
+  gum_spinlock_release (&self->exclusion_lock);
 
-  _gum_stalker_do_follow_me (self, transformer, sink, ret_addr_ptr);
+  /* Switching to inclusive mode changes the index even if nothing resolves */
+  gum_stalker_rebuild_exclusion_index (self);
+
+  g_mutex_unlock (&self->exclusion_mutex);
+
+  gum_stalker_refresh_module_rules (self);
 }
 
-#endif
+static void
+gum_module_rule_clear (GumModuleRule * module)
+{
+  g_free (module->name);
+}
 
-void
-_gum_stalker_do_follow_me (GumStalker * self,
-                           GumStalkerTransformer * transformer,
-                           GumEventSink * sink,
-                           volatile gpointer * ret_addr_ptr)
+static gboolean
+gum_stalker_is_excluding (GumStalker * self,
+                          gconstpointer address)
 {
-  GumExecCtx * ctx;
-  gpointer code_address;
+  GumAddress a = GUM_ADDRESS (address);
+  gpointer page;
+  gboolean excluded, refresh_needed;
 
-  ctx = gum_stalker_create_exec_ctx (self, gum_process_get_current_thread_id (),
-      transformer, sink);
-  gum_tls_key_set_value (self->exec_ctx, ctx);
+  page = GSIZE_TO_POINTER (a & ~((GumAddress) self->page_size - 1));
 
-  ctx->current_block = gum_exec_ctx_obtain_block_for (ctx, *ret_addr_ptr,
-      &code_address);
+  gum_spinlock_acquire (&self->exclusion_lock);
 
-  if (ctx->state == GUM_EXEC_CTX_UNFOLLOW_PENDING)
-  {
-    gum_exec_ctx_prepare_for_unfollow (ctx);
-    gum_exec_ctx_unfollow (ctx, *ret_addr_ptr);
-    return;
-  }
+  excluded = bsearch (&a, self->exclusion_index->data,
+      self->exclusion_index->len, sizeof (GumMemoryRange),
+      (GCompareFunc) gum_memory_range_compare_to_key) != NULL;
 
-  gum_event_sink_start (sink);
-  ctx->sink_started = TRUE;
+  /* In inclusive mode a module not loaded yet is excluded until it is */
+  refresh_needed = (!excluded || self->any_inclusions) &&
+      self->n_unresolved_modules != 0 &&
+      (self->module_map == NULL ||
+          gum_module_map_find (self->module_map, a) == NULL) &&
+      !g_hash_table_contains (self->foreign_pages, page);
 
-  *ret_addr_ptr = code_address;
+  gum_spinlock_release (&self->exclusion_lock);
+
+  if (!refresh_needed)
+    return excluded;
+
+  gum_stalker_refresh_module_rules (self);
+
+  gum_spinlock_acquire (&self->exclusion_lock);
+
+  excluded = bsearch (&a, self->exclusion_index->data,
+      self->exclusion_index->len, sizeof (GumMemoryRange),
+      (GCompareFunc) gum_memory_range_compare_to_key) != NULL;
+
+  if (gum_module_map_find (self->module_map, a) == NULL)
+    g_hash_table_add (self->foreign_pages, page);
+
+  gum_spinlock_release (&self->exclusion_lock);
+
+  return excluded;
 }
 
-void
-gum_stalker_unfollow_me (GumStalker * self)
+/*
+ * Takes a fresh snapshot of the loaded modules and resolves any excluded or
+ * included modules that have shown up since. The snapshot is taken without
+ * holding any lock, as enumerating modules may need the loader's lock, and
+ * whoever holds that might be a thread busy compiling code. Pages found to
+ * be outside all modules are only forgotten if the set of modules changed,
+ * and the index is only rebuilt if a rule got resolved or lost its module.
+ */
+static void
+gum_stalker_refresh_module_rules (GumStalker * self)
 {
-  GumExecCtx * ctx;
+  GumModuleMap * map, * stale_map;
+  GArray * modules;
+  gboolean rules_changed, any_included;
 
-  ctx = gum_stalker_get_exec_ctx (self);
-  if (ctx == NULL)
-    return;
+  map = gum_module_map_new ();
+  modules = gum_module_map_get_values (map);
 
-  if (ctx->calling_transformer)
+  g_mutex_lock (&self->exclusion_mutex);
+
+  gum_spinlock_acquire (&self->exclusion_lock);
+
+  rules_changed = gum_stalker_resolve_module_rules (self,
+      self->excluded_modules, modules, NULL);
+  if (gum_stalker_resolve_module_rules (self, self->included_modules, modules,
+      &any_included))
   {
-    ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
-    return;
+    rules_changed = TRUE;
   }
+  if (any_included)
+    self->entry_hooks_pending = TRUE;
 
-  gum_exec_ctx_prepare_for_unfollow (ctx);
-
-  if (ctx->current_block != NULL &&
-      ctx->current_block->has_call_to_excluded_range)
+  if (self->module_map == NULL ||
+      !gum_module_map_has_same_modules (self->module_map, modules))
   {
-    ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
+    stale_map = self->module_map;
+    self->module_map = map;
+    g_hash_table_remove_all (self->foreign_pages);
   }
   else
   {
-    g_assert (ctx->unfollow_called_while_still_following);
+    stale_map = map;
+  }
 
-    gum_tls_key_set_value (self->exec_ctx, NULL);
+  gum_spinlock_release (&self->exclusion_lock);
 
-    GUM_STALKER_LOCK (self);
-    self->contexts = g_slist_remove (self->contexts, ctx);
-    GUM_STALKER_UNLOCK (self);
+  if (rules_changed)
+    gum_stalker_rebuild_exclusion_index (self);
 
-    gum_exec_ctx_free (ctx);
-  }
-}
+  g_mutex_unlock (&self->exclusion_mutex);
 
-gboolean
-gum_stalker_is_following_me (GumStalker * self)
-{
-  return gum_stalker_get_exec_ctx (self) != NULL;
+  g_clear_object (&stale_map);
 }
 
-void
-gum_stalker_follow (GumStalker * self,
-                    GumThreadId thread_id,
-                    GumStalkerTransformer * transformer,
-                    GumEventSink * sink)
+static gboolean
+gum_module_map_has_same_modules (GumModuleMap * map,
+                                 GArray * modules)
 {
-  if (thread_id == gum_process_get_current_thread_id ())
-  {
-    gum_stalker_follow_me (self, transformer, sink);
-  }
-  else
+  GArray * current;
+  guint i;
+
+  current = gum_module_map_get_values (map);
+  if (current->len != modules->len)
+    return FALSE;
+
+  for (i = 0; i != modules->len; i++)
   {
-    GumInfectContext ctx;
-    ctx.stalker = self;
-    ctx.transformer = transformer;
-    ctx.sink = sink;
-    gum_process_modify_thread (thread_id, gum_stalker_infect, &ctx);
+    const GumMemoryRange * a =
+        g_array_index (current, GumModuleDetails, i).range;
+    const GumMemoryRange * b =
+        g_array_index (modules, GumModuleDetails, i).range;
+
+    if (a->base_address != b->base_address || a->size != b->size)
+      return FALSE;
   }
+
+  return TRUE;
 }
 
-void
-gum_stalker_unfollow (GumStalker * self,
-                      GumThreadId thread_id)
+/*
+ * Returns whether any rule got resolved or lost its module, and stores
+ * whether any got resolved in `any_resolved` if given. Must be called with
+ * the lock held.
+ */
+static gboolean
+gum_stalker_resolve_module_rules (GumStalker * self,
+                                  GArray * rules,
+                                  GArray * modules,
+                                  gboolean * any_resolved)
 {
-  if (thread_id == gum_process_get_current_thread_id ())
-  {
-    gum_stalker_unfollow_me (self);
-  }
-  else
-  {
-    GSList * cur;
+  gboolean changed = FALSE;
+  guint i, j;
 
-    GUM_STALKER_LOCK (self);
+  if (any_resolved != NULL)
+    *any_resolved = FALSE;
 
-    for (cur = self->contexts; cur != NULL; cur = cur->next)
+  for (i = 0; i != rules->len; i++)
+  {
+    GumModuleRule * m = &g_array_index (rules, GumModuleRule, i);
+
+    if (m->resolved)
     {
-      GumExecCtx * ctx = (GumExecCtx *) cur->data;
-      if (ctx->thread_id == thread_id && ctx->state == GUM_EXEC_CTX_ACTIVE)
+      gboolean still_loaded = FALSE;
+
+      for (j = 0; j != modules->len && !still_loaded; j++)
       {
-        gum_exec_ctx_prepare_for_unfollow (ctx);
+        const GumModuleDetails * d =
+            &g_array_index (modules, GumModuleDetails, j);
 
-        if (gum_exec_ctx_has_executed (ctx))
-        {
-          ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
-        }
-        else
-        {
-          GumDisinfectContext dc;
-          dc.stalker = self;
-          dc.exec_ctx = ctx;
-          dc.success = FALSE;
-          gum_process_modify_thread (thread_id, gum_stalker_disinfect, &dc);
-          if (!dc.success)
-            ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
-        }
+        still_loaded = d->range->base_address == m->range.base_address &&
+            strcmp (d->name, m->name) == 0;
+      }
 
+      if (still_loaded)
+        continue;
+
+      /* Unloaded since, so forget where it was and look for it again */
+      m->resolved = FALSE;
+      m->hooked = FALSE;
+      self->n_unresolved_modules++;
+      changed = TRUE;
+    }
+
+    for (j = 0; j != modules->len; j++)
+    {
+      const GumModuleDetails * d =
+          &g_array_index (modules, GumModuleDetails, j);
+
+      if (strcmp (d->name, m->name) == 0)
+      {
+        m->range = *d->range;
+        m->resolved = TRUE;
+        self->n_unresolved_modules--;
+        if (any_resolved != NULL)
+          *any_resolved = TRUE;
+        changed = TRUE;
         break;
       }
     }
-
-    GUM_STALKER_UNLOCK (self);
   }
+
+  return changed;
 }
 
+/*
+ * Swaps in a freshly built index, so that threads looking up exclusions
+ * only wait for the swap itself. Must be called with the exclusion mutex
+ * held, and without holding the lock.
+ */
 static void
-gum_stalker_infect (GumThreadId thread_id,
-                    GumCpuContext * cpu_context,
-                    gpointer user_data)
+gum_stalker_rebuild_exclusion_index (GumStalker * self)
 {
-  GumInfectContext * infect_context = (GumInfectContext *) user_data;
-  GumStalker * self = infect_context->stalker;
-  GumExecCtx * ctx;
-  const guint max_syscall_size = 2;
-  gpointer code_address;
-  GumX86Writer cw;
+  GArray * index, * old_index;
 
-  ctx = gum_stalker_create_exec_ctx (self, thread_id,
-      infect_context->transformer, infect_context->sink);
+  index = gum_stalker_build_exclusion_index (self);
 
-  ctx->current_block = gum_exec_ctx_obtain_block_for (ctx,
-      GSIZE_TO_POINTER (GUM_CPU_CONTEXT_XIP (cpu_context)), &code_address);
-  GUM_CPU_CONTEXT_XIP (cpu_context) =
-      GPOINTER_TO_SIZE (ctx->infect_thunk) + max_syscall_size;
+  gum_spinlock_acquire (&self->exclusion_lock);
+  old_index = self->exclusion_index;
+  self->exclusion_index = index;
+  gum_spinlock_release (&self->exclusion_lock);
 
-  gum_x86_writer_init (&cw, ctx->infect_thunk);
+  g_array_free (old_index, TRUE);
+}
 
-  /*
-   * In case the thread is in a Linux system call we should allow it to be
-   * restarted by bringing along the syscall instruction.
-   */
-  gum_x86_writer_put_bytes (&cw,
-      ctx->current_block->real_begin - max_syscall_size, max_syscall_size);
+/*
+ * Merges the excluded ranges and modules into a sorted list of disjoint
+ * ranges that can be binary searched. In inclusive mode the gaps between the
+ * included ranges and modules are added as well. The rules only change with
+ * the exclusion mutex held, so holding it is enough to read them.
+ */
+static GArray *
+gum_stalker_build_exclusion_index (GumStalker * self)
+{
+  GArray * index;
 
-  gum_exec_ctx_write_prolog (ctx, GUM_PROLOG_MINIMAL, &cw);
-  gum_x86_writer_put_call_address_with_aligned_arguments (&cw, GUM_CALL_CAPI,
-      GUM_ADDRESS (gum_tls_key_set_value), 2,
-      GUM_ARG_ADDRESS, GUM_ADDRESS (self->exec_ctx),
-      GUM_ARG_ADDRESS, GUM_ADDRESS (ctx));
-  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_MINIMAL, &cw);
+  index = g_array_new (FALSE, FALSE, sizeof (GumMemoryRange));
 
-  gum_x86_writer_put_jmp_address (&cw, GUM_ADDRESS (code_address));
+  if (self->any_inclusions)
+  {
+    GArray * included;
+    GumAddress cur;
+    guint i;
 
-  gum_x86_writer_clear (&cw);
+    included = g_array_new (FALSE, FALSE, sizeof (GumMemoryRange));
+    g_array_append_vals (included, self->inclusions->data,
+        self->inclusions->len);
+    gum_append_resolved_module_rules (included, self->included_modules);
+    gum_memory_ranges_sort_and_merge (included);
 
-  gum_event_sink_start (infect_context->sink);
+    cur = 0;
+    for (i = 0; i != included->len; i++)
+    {
+      GumMemoryRange * r = &g_array_index (included, GumMemoryRange, i);
+
+      if (r->base_address > cur)
+        gum_append_memory_range (index, cur, r->base_address);
+      cur = r->base_address + r->size;
+    }
+    if (cur < G_MAXSIZE)
+      gum_append_memory_range (index, cur, G_MAXSIZE);
+
+    g_array_free (included, TRUE);
+  }
+
+  g_array_append_vals (index, self->exclusions->data, self->exclusions->len);
+  gum_append_resolved_module_rules (index, self->excluded_modules);
+
+  gum_memory_ranges_sort_and_merge (index);
+
+  return index;
 }
 
 static void
-gum_stalker_disinfect (GumThreadId thread_id,
-                       GumCpuContext * cpu_context,
-                       gpointer user_data)
+gum_append_resolved_module_rules (GArray * ranges,
+                                  GArray * rules)
 {
-  GumDisinfectContext * disinfect_context = (GumDisinfectContext *) user_data;
-  GumStalker * self = disinfect_context->stalker;
-  GumExecCtx * ctx = disinfect_context->exec_ctx;
-  gboolean infection_not_active_yet;
+  guint i;
 
-  infection_not_active_yet =
-      GUM_CPU_CONTEXT_XIP (cpu_context) == GPOINTER_TO_SIZE (ctx->infect_thunk);
-  if (infection_not_active_yet)
+  for (i = 0; i != rules->len; i++)
   {
-    GUM_CPU_CONTEXT_XIP (cpu_context) =
-        GPOINTER_TO_SIZE (ctx->current_block->real_begin);
-
-    self->contexts = g_slist_remove (self->contexts, ctx);
-    gum_exec_ctx_free (ctx);
+    GumModuleRule * m = &g_array_index (rules, GumModuleRule, i);
 
-    disinfect_context->success = TRUE;
+    if (m->resolved)
+      g_array_append_val (ranges, m->range);
   }
 }
 
-GumProbeId
-gum_stalker_add_call_probe (GumStalker * self,
-                            gpointer target_address,
-                            GumCallProbeCallback callback,
-                            gpointer data,
-                            GDestroyNotify notify)
+static void
+gum_append_memory_range (GArray * ranges,
+                         GumAddress begin,
+                         GumAddress end)
 {
-  GumCallProbe probe;
-  GArray * probes;
+  GumMemoryRange r;
 
-  probe.id = g_atomic_int_add (&self->last_probe_id, 1) + 1;
-  probe.callback = callback;
-  probe.user_data = data;
-  probe.user_notify = notify;
+  r.base_address = begin;
+  r.size = end - begin;
 
-  gum_spinlock_acquire (&self->probe_lock);
+  g_array_append_val (ranges, r);
+}
 
-  g_hash_table_insert (self->probe_target_by_id, GSIZE_TO_POINTER (probe.id),
-      target_address);
+static void
+gum_memory_ranges_sort_and_merge (GArray * ranges)
+{
+  guint n, i;
 
-  probes = (GArray *)
-      g_hash_table_lookup (self->probe_array_by_address, target_address);
-  if (probes == NULL)
+  g_array_sort (ranges, (GCompareFunc) gum_memory_range_compare_base);
+
+  n = 0;
+  for (i = 0; i != ranges->len; i++)
   {
-    probes = g_array_sized_new (FALSE, FALSE, sizeof (GumCallProbe), 4);
-    g_hash_table_insert (self->probe_array_by_address, target_address, probes);
-  }
+    GumMemoryRange * r = &g_array_index (ranges, GumMemoryRange, i);
 
-  g_array_append_val (probes, probe);
+    if (n != 0)
+    {
+      GumMemoryRange * prev = &g_array_index (ranges, GumMemoryRange, n - 1);
+      GumAddress prev_end = prev->base_address + prev->size;
 
-  self->any_probes_attached = TRUE;
+      if (r->base_address <= prev_end)
+      {
+        GumAddress end = r->base_address + r->size;
 
-  gum_spinlock_release (&self->probe_lock);
+        if (end > prev_end)
+          prev->size = end - prev->base_address;
+        continue;
+      }
+    }
 
-  gum_stalker_invalidate_caches (self);
+    g_array_index (ranges, GumMemoryRange, n++) = *r;
+  }
 
-  return probe.id;
+  g_array_set_size (ranges, n);
 }
 
-void
-gum_stalker_remove_call_probe (GumStalker * self,
-                               GumProbeId id)
+static gint
+gum_memory_range_compare_base (const GumMemoryRange * lhs,
+                               const GumMemoryRange * rhs)
 {
-  gpointer target_address;
+  if (lhs->base_address < rhs->base_address)
+    return -1;
+  else if (lhs->base_address > rhs->base_address)
+    return 1;
+  else
+    return 0;
+}
 
-  gum_spinlock_acquire (&self->probe_lock);
+static gint
+gum_memory_range_compare_to_key (const GumAddress * key_ptr,
+                                 const GumMemoryRange * range)
+{
+  GumAddress key = *key_ptr;
 
-  target_address =
-      g_hash_table_lookup (self->probe_target_by_id, GSIZE_TO_POINTER (id));
-  if (target_address != NULL)
-  {
-    GArray * probes;
-    gint match_index = -1;
-    guint i;
-    GumCallProbe * probe;
+  if (key < range->base_address)
+    return -1;
+  else if (key >= range->base_address + range->size)
+    return 1;
+  else
+    return 0;
+}
 
-    g_hash_table_remove (self->probe_target_by_id, GSIZE_TO_POINTER (id));
+/*
+ * Hooks the exported functions of included modules resolved since we last
+ * got here. This happens when a followed thread is about to run native code,
+ * as that code may call back into the included modules.
+ */
+static void
+gum_stalker_ensure_entry_hooks (GumStalker * self)
+{
+  GumModuleMap * map;
+  GArray * rules;
+  GumHookExportsContext hc;
+  guint i;
 
-    probes = (GArray *)
-        g_hash_table_lookup (self->probe_array_by_address, target_address);
-    g_assert (probes != NULL);
+  if (!self->entry_hooks_pending)
+    return;
 
-    for (i = 0; i != probes->len; i++)
+  g_mutex_lock (&self->entry_hook_mutex);
+
+  map = gum_module_map_new ();
+  gum_stalker_forget_unloaded_entry_hooks (self, map);
+
+  rules = g_array_new (FALSE, FALSE, sizeof (GumModuleRule));
+  g_array_set_clear_func (rules, (GDestroyNotify) gum_module_rule_clear);
+
+  gum_spinlock_acquire (&self->exclusion_lock);
+  self->entry_hooks_pending = FALSE;
+  for (i = 0; i != self->included_modules->len; i++)
+  {
+    GumModuleRule * m =
+        &g_array_index (self->included_modules, GumModuleRule, i);
+
+    if (m->resolved && !m->hooked)
     {
-      if (g_array_index (probes, GumCallProbe, i).id == id)
-      {
-        match_index = i;
-        break;
-      }
+      GumModuleRule r = *m;
+
+      r.name = g_strdup (m->name);
+      g_array_append_val (rules, r);
+      m->hooked = TRUE;
     }
-    g_assert (match_index != -1);
+  }
+  gum_spinlock_release (&self->exclusion_lock);
 
-    probe = &g_array_index (probes, GumCallProbe, match_index);
-    if (probe->user_notify != NULL)
-      probe->user_notify (probe->user_data);
-    g_array_remove_index (probes, match_index);
+  if (rules->len != 0 && self->entry_thunk == NULL)
+  {
+    GumX86Writer cw;
 
-    if (probes->len == 0)
-      g_hash_table_remove (self->probe_array_by_address, target_address);
+    self->entry_thunk =
+        gum_code_allocator_alloc_slice (&self->entry_hook_allocator);
 
-    self->any_probes_attached =
-        g_hash_table_size (self->probe_array_by_address) != 0;
+    gum_x86_writer_init (&cw, self->entry_thunk->data);
+    gum_stalker_write_native_transition (&cw,
+        GUM_ADDRESS (gum_entry_hook_enter));
+    gum_x86_writer_clear (&cw);
   }
 
-  gum_spinlock_release (&self->probe_lock);
+  hc.stalker = self;
+  hc.hooks = g_ptr_array_new ();
 
-  gum_stalker_invalidate_caches (self);
+  for (i = 0; i != rules->len; i++)
+  {
+    GumModuleRule * r = &g_array_index (rules, GumModuleRule, i);
+    const GumModuleDetails * d;
+
+    d = gum_module_map_find (map, r->range.base_address);
+    if (d == NULL || strcmp (d->name, r->name) != 0)
+      continue;
+
+    hc.module_name = g_intern_string (d->name);
+    hc.module_base = d->range->base_address;
+    gum_module_enumerate_exports (r->name, gum_stalker_hook_export, &hc);
+  }
+
+  gum_code_allocator_commit (&self->entry_hook_allocator);
+
+  /* Set first so nobody compiles from a prologue we are busy patching */
+  if (hc.hooks->len != 0)
+    self->any_entry_hooks = TRUE;
+
+  for (i = 0; i != hc.hooks->len; i++)
+    gum_entry_hook_activate (g_ptr_array_index (hc.hooks, i));
+
+  g_ptr_array_unref (hc.hooks);
+  g_array_unref (rules);
+  g_object_unref (map);
+
+  g_mutex_unlock (&self->entry_hook_mutex);
 }
 
-static void
-gum_stalker_free_probe_array (gpointer data)
+static gboolean
+gum_stalker_hook_export (const GumExportDetails * details,
+                         gpointer user_data)
 {
-  GArray * probes = (GArray *) data;
-  guint i;
+  GumHookExportsContext * hc = user_data;
+  GumEntryHook * hook;
 
-  for (i = 0; i != probes->len; i++)
+  if (details->type != GUM_EXPORT_FUNCTION)
+    return TRUE;
+
+  hook = gum_entry_hook_new (hc->stalker, GSIZE_TO_POINTER (details->address));
+  if (hook != NULL)
   {
-    GumCallProbe * probe = &g_array_index (probes, GumCallProbe, i);
-    if (probe->user_notify != NULL)
-      probe->user_notify (probe->user_data);
+    hook->module_name = hc->module_name;
+    hook->module_base = hc->module_base;
+    g_ptr_array_add (hc->hooks, hook);
   }
 
-  g_array_free (probes, TRUE);
+  return TRUE;
 }
 
-static GumExecCtx *
-gum_stalker_create_exec_ctx (GumStalker * self,
-                             GumThreadId thread_id,
-                             GumStalkerTransformer * transformer,
-                             GumEventSink * sink)
+/*
+ * Prepares a hook without activating it. It is registered right away though,
+ * as translating from its trampoline is fine whether the redirect is in
+ * place yet or not. A hook deactivated earlier is handed back for reuse.
+ */
+static GumEntryHook *
+gum_entry_hook_new (GumStalker * stalker,
+                    gpointer function)
+{
+  GumEntryHook * hook;
+  GumCodeSlice * slice;
+  GumX86Writer cw;
+  GumX86Relocator rl;
+  GumAddress hook_ptr;
+  guint reloc_bytes;
+
+  hook = gum_stalker_lookup_entry_hook (stalker, function);
+  if (hook != NULL)
+    return hook->active ? NULL : hook;
+
+  if (!gum_x86_relocator_can_relocate (function, GUM_ENTRY_HOOK_REDIRECT_SIZE,
+      NULL))
+    return NULL;
+
+#if GLIB_SIZEOF_VOID_P == 4
+  slice = gum_code_allocator_alloc_slice (&stalker->entry_hook_allocator);
+#else
+  {
+    GumAddressSpec spec;
+
+    spec.near_address = function;
+    spec.max_distance = GUM_X86_JMP_MAX_DISTANCE;
+    slice = gum_code_allocator_try_alloc_slice_near (
+        &stalker->entry_hook_allocator, &spec, 0);
+    if (slice == NULL)
+      return NULL;
+  }
+#endif
+
+  hook = g_slice_new (GumEntryHook);
+  hook->stalker = stalker;
+  hook->function = function;
+  hook->module_name = NULL;
+  hook->module_base = 0;
+  hook->active = FALSE;
+  hook->slice = slice;
+
+  gum_x86_writer_init (&cw, slice->data);
+  gum_x86_relocator_init (&rl, function, &cw);
+
+  hook_ptr = GUM_ADDRESS (gum_x86_writer_cur (&cw));
+  gum_x86_writer_put_bytes (&cw, (guint8 *) &hook, sizeof (GumEntryHook *));
+
+  hook->on_enter = gum_x86_writer_cur (&cw);
+  gum_x86_writer_put_push_near_ptr (&cw, hook_ptr);
+  gum_x86_writer_put_jmp_address (&cw,
+      GUM_ADDRESS (stalker->entry_thunk->data));
+
+  hook->trampoline = gum_x86_writer_cur (&cw);
+
+  do
+  {
+    reloc_bytes = gum_x86_relocator_read_one (&rl, NULL);
+    g_assert (reloc_bytes != 0);
+  }
+  while (reloc_bytes < GUM_ENTRY_HOOK_REDIRECT_SIZE);
+  gum_x86_relocator_write_all (&rl);
+
+  if (!gum_x86_relocator_eoi (&rl))
+  {
+    gum_x86_writer_put_jmp_address (&cw,
+        GUM_ADDRESS (function) + reloc_bytes);
+  }
+
+  gum_x86_writer_flush (&cw);
+  g_assert (gum_x86_writer_offset (&cw) <= slice->size);
+
+  g_assert (reloc_bytes <= sizeof (hook->overwritten_prologue));
+  hook->overwritten_prologue_len = reloc_bytes;
+  memcpy (hook->overwritten_prologue, function, reloc_bytes);
+
+  gum_x86_relocator_clear (&rl);
+  gum_x86_writer_clear (&cw);
+
+  gum_spinlock_acquire (&stalker->exclusion_lock);
+  g_hash_table_insert (stalker->entry_hooks, function, hook);
+  gum_spinlock_release (&stalker->exclusion_lock);
+
+  return hook;
+}
+
+static void
+gum_entry_hook_free (GumEntryHook * hook)
+{
+  gum_code_slice_free (hook->slice);
+
+  g_slice_free (GumEntryHook, hook);
+}
+
+static void
+gum_entry_hook_activate (GumEntryHook * hook)
+{
+  gum_memory_patch_code (hook->function, hook->overwritten_prologue_len,
+      (GumMemoryPatchApplyFunc) gum_entry_hook_write_redirect, hook);
+  hook->active = TRUE;
+}
+
+static void
+gum_entry_hook_deactivate (GumEntryHook * hook)
+{
+  if (!hook->active)
+    return;
+
+  gum_memory_patch_code (hook->function, hook->overwritten_prologue_len,
+      (GumMemoryPatchApplyFunc) gum_entry_hook_write_prologue, hook);
+  hook->active = FALSE;
+}
+
+static void
+gum_entry_hook_write_redirect (gpointer prologue,
+                               GumEntryHook * hook)
+{
+  GumX86Writer cw;
+  guint padding;
+
+  gum_x86_writer_init (&cw, prologue);
+  cw.pc = GPOINTER_TO_SIZE (hook->function);
+  gum_x86_writer_put_jmp_address (&cw, GUM_ADDRESS (hook->on_enter));
+  gum_x86_writer_flush (&cw);
+  g_assert (gum_x86_writer_offset (&cw) <= GUM_ENTRY_HOOK_REDIRECT_SIZE);
+
+  padding = hook->overwritten_prologue_len - gum_x86_writer_offset (&cw);
+  for (; padding != 0; padding--)
+    gum_x86_writer_put_nop (&cw);
+  gum_x86_writer_clear (&cw);
+}
+
+static void
+gum_entry_hook_write_prologue (gpointer prologue,
+                               GumEntryHook * hook)
+{
+  memcpy (prologue, hook->overwritten_prologue,
+      hook->overwritten_prologue_len);
+}
+
+/*
+ * Puts the original prologues back once no thread is being followed, so
+ * native code stops taking the detour. The hooks themselves are kept until
+ * we are finalized, as a thread may still be passing through one of them,
+ * and get reactivated if a followed thread leaves for native code again.
+ */
+static void
+gum_stalker_remove_entry_hooks (GumStalker * self)
+{
+  GumModuleMap * map;
+  GHashTableIter iter;
+  GumEntryHook * hook;
+  guint i;
+
+  g_mutex_lock (&self->entry_hook_mutex);
+
+  if (!self->any_entry_hooks)
+    goto beach;
+
+  map = gum_module_map_new ();
+  gum_stalker_forget_unloaded_entry_hooks (self, map);
+  g_object_unref (map);
+
+  g_hash_table_iter_init (&iter, self->entry_hooks);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &hook))
+    gum_entry_hook_deactivate (hook);
+  self->any_entry_hooks = FALSE;
+
+  gum_spinlock_acquire (&self->exclusion_lock);
+  for (i = 0; i != self->included_modules->len; i++)
+  {
+    GumModuleRule * m =
+        &g_array_index (self->included_modules, GumModuleRule, i);
+
+    if (m->hooked)
+    {
+      m->hooked = FALSE;
+      self->entry_hooks_pending = TRUE;
+    }
+  }
+  gum_spinlock_release (&self->exclusion_lock);
+
+beach:
+  g_mutex_unlock (&self->entry_hook_mutex);
+}
+
+static void
+gum_stalker_maybe_remove_entry_hooks (GumStalker * self)
+{
+  gboolean any_contexts;
+
+  if (!self->any_entry_hooks)
+    return;
+
+  GUM_STALKER_LOCK (self);
+  any_contexts = self->contexts != NULL;
+  GUM_STALKER_UNLOCK (self);
+
+  if (!any_contexts)
+    gum_stalker_remove_entry_hooks (self);
+}
+
+/*
+ * Drops the hooks of functions whose module has been unloaded since, as
+ * putting their prologue back would mean writing to memory that may not be
+ * mapped anymore. Their slices are kept until we are finalized. Must be
+ * called with the entry hook mutex held.
+ */
+static void
+gum_stalker_forget_unloaded_entry_hooks (GumStalker * self,
+                                         GumModuleMap * map)
+{
+  GHashTableIter iter;
+  GumEntryHook * hook;
+
+  gum_spinlock_acquire (&self->exclusion_lock);
+
+  g_hash_table_iter_init (&iter, self->entry_hooks);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &hook))
+  {
+    const GumModuleDetails * d;
+
+    d = gum_module_map_find (map, GUM_ADDRESS (hook->function));
+    if (d != NULL && d->range->base_address == hook->module_base &&
+        strcmp (d->name, hook->module_name) == 0)
+    {
+      continue;
+    }
+
+    g_hash_table_iter_steal (&iter);
+    self->unloaded_entry_hooks =
+        g_slist_prepend (self->unloaded_entry_hooks, hook);
+  }
+
+  gum_spinlock_release (&self->exclusion_lock);
+}
+
+static GumEntryHook *
+gum_stalker_lookup_entry_hook (GumStalker * self,
+                               gconstpointer address)
+{
+  GumEntryHook * hook;
+
+  gum_spinlock_acquire (&self->exclusion_lock);
+  hook = g_hash_table_lookup (self->entry_hooks, address);
+  gum_spinlock_release (&self->exclusion_lock);
+
+  return hook;
+}
+
+/*
+ * Called from the shared entry thunk when a hooked function gets called by
+ * code running natively, with `sp` pointing at the caller's return address.
+ * Returns where to continue: the function's translated code if the calling
+ * thread is one we are following and it left for native code through us, or
+ * the trampoline running its original prologue otherwise. Threads inside a
+ * relocated call or a callout have `current_block` set and run natively, as
+ * pulling them back in would leave our own code on the stack beneath them.
+ */
+static gpointer
+gum_entry_hook_enter (GumEntryHook * hook,
+                      gpointer * sp)
 {
-  guint base_size;
   GumExecCtx * ctx;
 
-  base_size = sizeof (GumExecCtx) / self->page_size;
-  if (sizeof (GumExecCtx) % self->page_size != 0)
-    base_size++;
+  ctx = gum_stalker_get_exec_ctx (hook->stalker);
+  if (ctx == NULL || ctx->calling_transformer || ctx->current_block != NULL)
+    return hook->trampoline;
 
-  ctx = (GumExecCtx *)
-      gum_alloc_n_pages (base_size + GUM_CODE_SLAB_SIZE_IN_PAGES + 1,
-          GUM_PAGE_RWX);
-  ctx->state = GUM_EXEC_CTX_ACTIVE;
-  ctx->invalidate_pending = FALSE;
+  if (ctx->state == GUM_EXEC_CTX_UNFOLLOW_PENDING)
+  {
+    gum_exec_ctx_unfollow (ctx, hook->trampoline);
+    return hook->trampoline;
+  }
 
-  ctx->code_slab = &ctx->first_code_slab;
-  ctx->first_code_slab.data = ((guint8 *) ctx) + (base_size * self->page_size);
-  ctx->first_code_slab.offset = 0;
-  ctx->first_code_slab.size = GUM_CODE_SLAB_SIZE_IN_PAGES * self->page_size;
-  ctx->first_code_slab.next = NULL;
-  ctx->last_prolog_minimal = NULL;
-  ctx->last_epilog_minimal = NULL;
-  ctx->last_prolog_full = NULL;
-  ctx->last_epilog_full = NULL;
-  ctx->last_stack_push = NULL;
-  ctx->last_stack_pop_and_go = NULL;
+  if (ctx->state != GUM_EXEC_CTX_ACTIVE)
+    return hook->trampoline;
 
-  ctx->frames = (GumExecFrame *) (ctx->code_slab->data + ctx->code_slab->size);
-  ctx->first_frame = (GumExecFrame *) (ctx->code_slab->data +
-      ctx->code_slab->size + self->page_size - sizeof (GumExecFrame));
-  ctx->current_frame = ctx->first_frame;
+  gum_exec_ctx_drop_stale_native_returns (ctx, sp);
+  ctx->app_stack = sp;
 
-  ctx->mappings = gum_metal_hash_table_new (NULL, NULL);
+  return gum_exec_ctx_replace_current_block_with (ctx, hook->function);
+}
 
-  ctx->resume_at = NULL;
-  ctx->return_at = NULL;
-  ctx->app_stack = NULL;
+/*
+ * Entered with a pointer-sized argument at the top of the stack. It is passed
+ * to `func` along with the application's stack pointer just above it, and
+ * `func`'s return value replaces it before we restore the state and `ret`
+ * there, so `func` gets to decide where execution continues.
+ */
+static void
+gum_stalker_write_native_transition (GumX86Writer * cw,
+                                     GumAddress func)
+{
+  guint8 fxsave[] = {
+    0x0f, 0xae, 0x04, 0x24 /* fxsave [esp] */
+  };
+  guint8 fxrstor[] = {
+    0x0f, 0xae, 0x0c, 0x24 /* fxrstor [esp] */
+  };
 
-  ctx->stalker = g_object_ref (self);
-  ctx->thread_id = thread_id;
+  gum_x86_writer_put_pushfx (cw);
+  gum_x86_writer_put_cld (cw); /* C ABI mandates this */
+  gum_x86_writer_put_pushax (cw);
 
-  gum_x86_writer_init (&ctx->code_writer, NULL);
-  gum_x86_relocator_init (&ctx->relocator, NULL, &ctx->code_writer);
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XBX, GUM_REG_XSP);
+  gum_x86_writer_put_and_reg_u32 (cw, GUM_REG_XSP, (guint32) ~(16 - 1));
+  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, 512);
+  gum_x86_writer_put_bytes (cw, fxsave, sizeof (fxsave));
 
-  if (transformer != NULL)
-    ctx->transformer = g_object_ref (transformer);
-  else
-    ctx->transformer = gum_stalker_transformer_make_default ();
-  ctx->calling_transformer = FALSE;
-  g_queue_init (&ctx->callout_entries);
-  gum_spinlock_init (&ctx->callout_lock);
-  ctx->sink = (GumEventSink *) g_object_ref (sink);
-  ctx->sink_mask = gum_event_sink_query_mask (sink);
-  ctx->sink_process_impl = GUM_EVENT_SINK_GET_IFACE (sink)->process;
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XCX,
+      GUM_REG_XBX, sizeof (GumCpuContext));
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XDX,
+      GUM_REG_XBX, sizeof (GumCpuContext) + sizeof (gpointer));
+  gum_x86_writer_put_call_address_with_aligned_arguments (cw, GUM_CALL_CAPI,
+      func, 2,
+      GUM_ARG_REGISTER, GUM_REG_XCX,
+      GUM_ARG_REGISTER, GUM_REG_XDX);
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw,
+      GUM_REG_XBX, sizeof (GumCpuContext),
+      GUM_REG_XAX);
+
+  gum_x86_writer_put_bytes (cw, fxrstor, sizeof (fxrstor));
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XSP, GUM_REG_XBX);
+  gum_x86_writer_put_popax (cw);
+  gum_x86_writer_put_popfx (cw);
+  gum_x86_writer_put_ret (cw);
+}
+
+gint
+gum_stalker_get_trust_threshold (GumStalker * self)
+{
+  return self->trust_threshold;
+}
+
+void
+gum_stalker_set_trust_threshold (GumStalker * self,
+                                 gint trust_threshold)
+{
+  self->trust_threshold = trust_threshold;
+}
+
+guint
+gum_stalker_get_ic_entries (GumStalker * self)
+{
+  return self->ic_entries;
+}
+
+void
+gum_stalker_set_ic_entries (GumStalker * self,
+                            guint n)
+{
+  self->ic_entries = CLAMP (n, GUM_IC_MIN_ENTRIES, GUM_IC_MAX_ENTRIES);
+}
+
+guint
+gum_stalker_get_trace_threshold (GumStalker * self)
+{
+  return self->trace_threshold;
+}
+
+/*
+ * Once a block ending with a conditional branch has been executed this many
+ * times, it gets recompiled as a trace with its fall-through successors laid
+ * out inline. Zero disables trace formation.
+ */
+void
+gum_stalker_set_trace_threshold (GumStalker * self,
+                                 guint threshold)
+{
+  self->trace_threshold = threshold;
+}
+
+guint
+gum_stalker_get_event_buffer_capacity (GumStalker * self)
+{
+  return self->event_buffer_capacity;
+}
+
+void
+gum_stalker_set_event_buffer_capacity (GumStalker * self,
+                                       guint capacity)
+{
+  if (capacity != 0)
+  {
+    capacity = MIN (capacity, GUM_EVENT_BUFFER_MAX_CAPACITY);
+    capacity = 1 << g_bit_storage (capacity - 1);
+  }
+
+  self->event_buffer_capacity = capacity;
+}
+
+void
+gum_stalker_set_coverage_bitmap (GumStalker * self,
+                                 guint8 * bitmap,
+                                 gsize size)
+{
+  g_return_if_fail (bitmap == NULL ||
+      (size != 0 && (size & (size - 1)) == 0));
+
+  self->coverage_bitmap = bitmap;
+  self->coverage_bitmap_size = (bitmap != NULL) ? size : 0;
+
+  gum_stalker_invalidate_caches (self);
+}
+
+gsize
+gum_stalker_get_code_budget (GumStalker * self)
+{
+  return self->code_budget;
+}
+
+void
+gum_stalker_set_code_budget (GumStalker * self,
+                             gsize budget)
+{
+  self->code_budget = budget;
+}
+
+gsize
+gum_stalker_get_thread_code_budget (GumStalker * self)
+{
+  return self->thread_code_budget;
+}
+
+void
+gum_stalker_set_thread_code_budget (GumStalker * self,
+                                    gsize budget)
+{
+  self->thread_code_budget = budget;
+}
+
+gboolean
+gum_stalker_get_code_write_protection (GumStalker * self)
+{
+  return self->code_write_protection;
+}
+
+void
+gum_stalker_set_code_write_protection (GumStalker * self,
+                                       gboolean enabled)
+{
+  if (enabled == self->code_write_protection)
+    return;
+
+  if (enabled)
+  {
+    /* Kept until we are finalized, as the handler may still be running */
+    if (self->code_pages == NULL)
+    {
+      self->code_pages = g_new0 (GumCodePage, GUM_CODE_PAGES_CAPACITY);
+      self->dirty_code_pages =
+          g_new0 (GumDirtyCodePage, GUM_DIRTY_CODE_PAGES_CAPACITY);
+    }
+
+    self->code_write_exceptor = gum_exceptor_obtain ();
+    gum_exceptor_add (self->code_write_exceptor, gum_stalker_on_code_write,
+        self);
+  }
+
+  self->code_write_protection = enabled;
+
+  if (!enabled)
+  {
+    gum_stalker_unprotect_all_code (self);
+
+    gum_exceptor_remove (self->code_write_exceptor, gum_stalker_on_code_write,
+        self);
+    g_object_unref (self->code_write_exceptor);
+    self->code_write_exceptor = NULL;
+  }
+}
+
+gboolean
+gum_stalker_get_block_counting (GumStalker * self)
+{
+  return self->block_counting;
+}
+
+/*
+ * Blocks compiled from now on bump a 64-bit counter each time they are
+ * entered. Use gum_stalker_collect_block_counts() to read them. This
+ * requires a non-negative trust threshold, and disables trace formation.
+ */
+void
+gum_stalker_set_block_counting (GumStalker * self,
+                                gboolean enabled)
+{
+  self->block_counting = enabled;
+}
+
+void
+gum_stalker_invalidate (GumStalker * self,
+                        const GumMemoryRange * range)
+{
+  gum_stalker_invalidate_range (self, TRUE, 0, range);
+}
+
+void
+gum_stalker_invalidate_for_thread (GumStalker * self,
+                                   GumThreadId thread_id,
+                                   const GumMemoryRange * range)
+{
+  gum_stalker_invalidate_range (self, FALSE, thread_id, range);
+}
+
+/*
+ * Returns a GArray of GumBlockCount for every counted block of every thread
+ * being followed, hottest first. Each range appears once, with the counts of
+ * all threads summed, including those of blocks that have since been
+ * invalidated and recompiled, or thrown away when the code budget was
+ * exceeded. The threads keep running while we do this, so counts may be
+ * slightly behind, and on 32-bit they may even be torn.
+ */
+GArray *
+gum_stalker_collect_block_counts (GumStalker * self)
+{
+  GArray * counts;
+  GHashTable * merged;
+  GHashTableIter iter;
+  GumBlockCount * bc;
+  GSList * cur;
+
+  merged = gum_block_counts_new ();
+
+  GUM_STALKER_LOCK (self);
+
+  for (cur = self->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = cur->data;
+
+    gum_spinlock_acquire (&ctx->counted_blocks_lock);
+
+    if (ctx->retired_block_counts != NULL)
+      gum_block_counts_add_all (merged, ctx->retired_block_counts);
+    gum_block_counts_add_blocks (merged, ctx->counted_blocks);
+
+    gum_spinlock_release (&ctx->counted_blocks_lock);
+  }
+
+  GUM_STALKER_UNLOCK (self);
+
+  counts = g_array_sized_new (FALSE, FALSE, sizeof (GumBlockCount),
+      g_hash_table_size (merged));
+
+  g_hash_table_iter_init (&iter, merged);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &bc, NULL))
+    g_array_append_val (counts, *bc);
+
+  g_hash_table_unref (merged);
+
+  g_array_sort (counts, gum_compare_block_counts);
+
+  return counts;
+}
+
+static GHashTable *
+gum_block_counts_new (void)
+{
+  return g_hash_table_new_full (gum_block_count_hash, gum_block_count_equal,
+      (GDestroyNotify) gum_block_count_free, NULL);
+}
+
+static void
+gum_block_counts_add (GHashTable * counts,
+                      gpointer begin,
+                      gpointer end,
+                      guint64 count)
+{
+  GumBlockCount key, * bc;
+
+  key.begin = begin;
+  key.end = end;
+
+  bc = g_hash_table_lookup (counts, &key);
+  if (bc == NULL)
+  {
+    bc = g_slice_new (GumBlockCount);
+    bc->begin = begin;
+    bc->end = end;
+    bc->count = 0;
+
+    g_hash_table_add (counts, bc);
+  }
+
+  bc->count += count;
+}
+
+static void
+gum_block_counts_add_all (GHashTable * counts,
+                          GHashTable * other)
+{
+  GHashTableIter iter;
+  GumBlockCount * bc;
+
+  g_hash_table_iter_init (&iter, other);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &bc, NULL))
+    gum_block_counts_add (counts, bc->begin, bc->end, bc->count);
+}
+
+static void
+gum_block_counts_add_blocks (GHashTable * counts,
+                             GumExecBlock * blocks)
+{
+  GumExecBlock * block;
+
+  /*
+   * An invalidated block stays on the list next to its replacement, but its
+   * entry now jumps elsewhere, so its count is final and we can simply add
+   * the two together.
+   */
+  for (block = blocks; block != NULL; block = block->next_counted)
+  {
+    gum_block_counts_add (counts, block->real_begin, block->real_end,
+        block->execution_count);
+  }
+}
+
+static guint
+gum_block_count_hash (gconstpointer key)
+{
+  const GumBlockCount * bc = key;
+
+  return g_direct_hash (bc->begin) ^ g_direct_hash (bc->end);
+}
+
+static gboolean
+gum_block_count_equal (gconstpointer a,
+                       gconstpointer b)
+{
+  const GumBlockCount * bc_a = a;
+  const GumBlockCount * bc_b = b;
+
+  return bc_a->begin == bc_b->begin && bc_a->end == bc_b->end;
+}
+
+static void
+gum_block_count_free (GumBlockCount * bc)
+{
+  g_slice_free (GumBlockCount, bc);
+}
+
+static gint
+gum_compare_block_counts (gconstpointer a,
+                          gconstpointer b)
+{
+  const GumBlockCount * bc_a = a;
+  const GumBlockCount * bc_b = b;
+
+  if (bc_a->count > bc_b->count)
+    return -1;
+  else if (bc_a->count < bc_b->count)
+    return 1;
+  else
+    return 0;
+}
+
+void
+gum_stalker_flush (GumStalker * self)
+{
+  GSList * sinks, * cur;
+
+  GUM_STALKER_LOCK (self);
+
+  sinks = NULL;
+  for (cur = self->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = cur->data;
+
+    gum_exec_ctx_try_drain_events (ctx);
+    gum_exec_ctx_drain_call_counts (ctx);
+
+    sinks = g_slist_prepend (sinks, g_object_ref (ctx->sink));
+  }
+
+  GUM_STALKER_UNLOCK (self);
+
+  for (cur = sinks; cur != NULL; cur = cur->next)
+  {
+    GumEventSink * sink = cur->data;
+
+    gum_event_sink_flush (sink);
+  }
+
+  g_slist_free_full (sinks, g_object_unref);
+}
+
+void
+gum_stalker_stop (GumStalker * self)
+{
+  gboolean rescan_needed;
+  GSList * cur;
+
+  gum_spinlock_acquire (&self->probe_lock);
+  g_hash_table_remove_all (self->probe_target_by_id);
+  g_hash_table_remove_all (self->probe_array_by_address);
+  self->any_probes_attached = FALSE;
+  gum_spinlock_release (&self->probe_lock);
+
+  GUM_STALKER_LOCK (self);
+
+  do
+  {
+    rescan_needed = FALSE;
+
+    for (cur = self->contexts; cur != NULL; cur = cur->next)
+    {
+      GumExecCtx * ctx = (GumExecCtx *) cur->data;
+      if (ctx->state == GUM_EXEC_CTX_ACTIVE)
+      {
+        GumThreadId thread_id = ctx->thread_id;
+
+        GUM_STALKER_UNLOCK (self);
+        gum_stalker_unfollow (self, thread_id);
+        GUM_STALKER_LOCK (self);
+
+        rescan_needed = TRUE;
+        break;
+      }
+    }
+  }
+  while (rescan_needed);
+
+  GUM_STALKER_UNLOCK (self);
+
+  gum_stalker_garbage_collect (self);
+}
+
+gboolean
+gum_stalker_garbage_collect (GumStalker * self)
+{
+  GSList * keep = NULL, * cur;
+  gboolean pending_garbage;
+
+  GUM_STALKER_LOCK (self);
+
+  for (cur = self->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+    if (ctx->state == GUM_EXEC_CTX_DESTROY_PENDING)
+      gum_exec_ctx_free (ctx);
+    else
+      keep = g_slist_prepend (keep, ctx);
+  }
+
+  g_slist_free (self->contexts);
+  self->contexts = keep;
+
+  pending_garbage = keep != NULL;
+
+  GUM_STALKER_UNLOCK (self);
+
+  if (!pending_garbage)
+    gum_stalker_maybe_remove_entry_hooks (self);
+
+  return pending_garbage;
+}
+
+#ifdef _MSC_VER
+
+#define RETURN_ADDRESS_POINTER_FROM_FIRST_ARGUMENT(arg)   \
+    ((gpointer *) ((volatile guint8 *) &arg - sizeof (gpointer)))
+
+void
+gum_stalker_follow_me (GumStalker * self,
+                       GumStalkerTransformer * transformer,
+                       GumEventSink * sink)
+{
+  volatile gpointer * ret_addr_ptr;
+
+  ret_addr_ptr = RETURN_ADDRESS_POINTER_FROM_FIRST_ARGUMENT (self);
+
+  _gum_stalker_do_follow_me (self, transformer, sink, ret_addr_ptr);
+}
+
+#endif
+
+void
+_gum_stalker_do_follow_me (GumStalker * self,
+                           GumStalkerTransformer * transformer,
+                           GumEventSink * sink,
+                           volatile gpointer * ret_addr_ptr)
+{
+  GumExecCtx * ctx;
+  gpointer code_address;
+
+  ctx = gum_stalker_create_exec_ctx (self, gum_process_get_current_thread_id (),
+      transformer, sink);
+  gum_tls_key_set_value (self->exec_ctx, ctx);
+
+  ctx->current_block = gum_exec_ctx_obtain_block_for (ctx, *ret_addr_ptr,
+      &code_address);
+
+  if (ctx->state == GUM_EXEC_CTX_UNFOLLOW_PENDING)
+  {
+    gum_exec_ctx_prepare_for_unfollow (ctx);
+    gum_exec_ctx_unfollow (ctx, *ret_addr_ptr);
+    return;
+  }
+
+  gum_event_sink_start (sink);
+  ctx->sink_started = TRUE;
+
+  *ret_addr_ptr = code_address;
+}
+
+void
+gum_stalker_unfollow_me (GumStalker * self)
+{
+  GumExecCtx * ctx;
+
+  ctx = gum_stalker_get_exec_ctx (self);
+  if (ctx == NULL)
+    return;
+
+  if (ctx->calling_transformer)
+  {
+    ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
+    return;
+  }
+
+  gum_exec_ctx_prepare_for_unfollow (ctx);
+
+  if (ctx->current_block != NULL &&
+      ctx->current_block->has_call_to_excluded_range)
+  {
+    ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
+  }
+  else if (!ctx->unfollow_called_while_still_following)
+  {
+    /*
+     * Called from native code we handed the thread over to in inclusive
+     * mode. Its frames may still hold addresses in our thunks that we don't
+     * know about, e.g. copies of a return address we hijacked, so leave
+     * freeing it to gum_stalker_garbage_collect().
+     */
+    g_assert (ctx->current_block == NULL);
+
+    gum_exec_ctx_unfollow (ctx, NULL);
+  }
+  else
+  {
+    gum_exec_ctx_restore_native_returns (ctx, &ctx);
+
+    gum_tls_key_set_value (self->exec_ctx, NULL);
+
+    GUM_STALKER_LOCK (self);
+    self->contexts = g_slist_remove (self->contexts, ctx);
+    GUM_STALKER_UNLOCK (self);
+
+    gum_exec_ctx_free (ctx);
+
+    gum_stalker_maybe_remove_entry_hooks (self);
+  }
+}
+
+gboolean
+gum_stalker_is_following_me (GumStalker * self)
+{
+  return gum_stalker_get_exec_ctx (self) != NULL;
+}
+
+void
+gum_stalker_follow (GumStalker * self,
+                    GumThreadId thread_id,
+                    GumStalkerTransformer * transformer,
+                    GumEventSink * sink)
+{
+  if (thread_id == gum_process_get_current_thread_id ())
+  {
+    gum_stalker_follow_me (self, transformer, sink);
+  }
+  else
+  {
+    GumInfectContext ctx;
+    ctx.stalker = self;
+    ctx.transformer = transformer;
+    ctx.sink = sink;
+    gum_process_modify_thread (thread_id, gum_stalker_infect, &ctx);
+  }
+}
+
+void
+gum_stalker_unfollow (GumStalker * self,
+                      GumThreadId thread_id)
+{
+  if (thread_id == gum_process_get_current_thread_id ())
+  {
+    gum_stalker_unfollow_me (self);
+  }
+  else
+  {
+    GSList * cur;
+
+    GUM_STALKER_LOCK (self);
+
+    for (cur = self->contexts; cur != NULL; cur = cur->next)
+    {
+      GumExecCtx * ctx = (GumExecCtx *) cur->data;
+      if (ctx->thread_id == thread_id && ctx->state == GUM_EXEC_CTX_ACTIVE)
+      {
+        gum_exec_ctx_prepare_for_unfollow (ctx);
+
+        if (gum_exec_ctx_has_executed (ctx))
+        {
+          ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
+        }
+        else
+        {
+          GumDisinfectContext dc;
+          dc.stalker = self;
+          dc.exec_ctx = ctx;
+          dc.success = FALSE;
+          gum_process_modify_thread (thread_id, gum_stalker_disinfect, &dc);
+          if (!dc.success)
+            ctx->state = GUM_EXEC_CTX_UNFOLLOW_PENDING;
+        }
+
+        break;
+      }
+    }
+
+    GUM_STALKER_UNLOCK (self);
+
+    gum_stalker_maybe_remove_entry_hooks (self);
+  }
+}
+
+static void
+gum_stalker_infect (GumThreadId thread_id,
+                    GumCpuContext * cpu_context,
+                    gpointer user_data)
+{
+  GumInfectContext * infect_context = (GumInfectContext *) user_data;
+  GumStalker * self = infect_context->stalker;
+  GumExecCtx * ctx;
+  const guint max_syscall_size = 2;
+  gpointer code_address;
+  GumX86Writer cw;
+
+  ctx = gum_stalker_create_exec_ctx (self, thread_id,
+      infect_context->transformer, infect_context->sink);
+
+  ctx->current_block = gum_exec_ctx_obtain_block_for (ctx,
+      GSIZE_TO_POINTER (GUM_CPU_CONTEXT_XIP (cpu_context)), &code_address);
+  GUM_CPU_CONTEXT_XIP (cpu_context) =
+      GPOINTER_TO_SIZE (ctx->infect_thunk) + max_syscall_size;
+
+  gum_x86_writer_init (&cw, ctx->infect_thunk);
+
+  /*
+   * In case the thread is in a Linux system call we should allow it to be
+   * restarted by bringing along the syscall instruction.
+   */
+  gum_x86_writer_put_bytes (&cw,
+      ctx->current_block->real_begin - max_syscall_size, max_syscall_size);
+
+  gum_exec_ctx_write_prolog (ctx, GUM_PROLOG_MINIMAL, &cw);
+  gum_x86_writer_put_call_address_with_aligned_arguments (&cw, GUM_CALL_CAPI,
+      GUM_ADDRESS (gum_tls_key_set_value), 2,
+      GUM_ARG_ADDRESS, GUM_ADDRESS (self->exec_ctx),
+      GUM_ARG_ADDRESS, GUM_ADDRESS (ctx));
+  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_MINIMAL, &cw);
+
+  gum_x86_writer_put_jmp_address (&cw, GUM_ADDRESS (code_address));
+
+  gum_x86_writer_clear (&cw);
+
+  gum_event_sink_start (infect_context->sink);
+}
+
+static void
+gum_stalker_disinfect (GumThreadId thread_id,
+                       GumCpuContext * cpu_context,
+                       gpointer user_data)
+{
+  GumDisinfectContext * disinfect_context = (GumDisinfectContext *) user_data;
+  GumStalker * self = disinfect_context->stalker;
+  GumExecCtx * ctx = disinfect_context->exec_ctx;
+  gboolean infection_not_active_yet;
+
+  infection_not_active_yet =
+      GUM_CPU_CONTEXT_XIP (cpu_context) == GPOINTER_TO_SIZE (ctx->infect_thunk);
+  if (infection_not_active_yet)
+  {
+    GUM_CPU_CONTEXT_XIP (cpu_context) =
+        GPOINTER_TO_SIZE (ctx->current_block->real_begin);
+
+    self->contexts = g_slist_remove (self->contexts, ctx);
+    gum_exec_ctx_free (ctx);
+
+    disinfect_context->success = TRUE;
+  }
+}
+
+GumProbeId
+gum_stalker_add_call_probe (GumStalker * self,
+                            gpointer target_address,
+                            GumCallProbeCallback callback,
+                            gpointer data,
+                            GDestroyNotify notify)
+{
+  GumCallProbe probe;
+  GArray * probes;
+
+  probe.id = g_atomic_int_add (&self->last_probe_id, 1) + 1;
+  probe.callback = callback;
+  probe.user_data = data;
+  probe.user_notify = notify;
+
+  gum_spinlock_acquire (&self->probe_lock);
+
+  g_hash_table_insert (self->probe_target_by_id, GSIZE_TO_POINTER (probe.id),
+      target_address);
+
+  probes = (GArray *)
+      g_hash_table_lookup (self->probe_array_by_address, target_address);
+  if (probes == NULL)
+  {
+    probes = g_array_sized_new (FALSE, FALSE, sizeof (GumCallProbe), 4);
+    g_hash_table_insert (self->probe_array_by_address, target_address, probes);
+  }
+
+  g_array_append_val (probes, probe);
+
+  self->any_probes_attached = TRUE;
+
+  gum_spinlock_release (&self->probe_lock);
+
+  gum_stalker_invalidate_caches (self);
+
+  return probe.id;
+}
+
+void
+gum_stalker_remove_call_probe (GumStalker * self,
+                               GumProbeId id)
+{
+  gpointer target_address;
+
+  gum_spinlock_acquire (&self->probe_lock);
+
+  target_address =
+      g_hash_table_lookup (self->probe_target_by_id, GSIZE_TO_POINTER (id));
+  if (target_address != NULL)
+  {
+    GArray * probes;
+    gint match_index = -1;
+    guint i;
+    GumCallProbe * probe;
+
+    g_hash_table_remove (self->probe_target_by_id, GSIZE_TO_POINTER (id));
+
+    probes = (GArray *)
+        g_hash_table_lookup (self->probe_array_by_address, target_address);
+    g_assert (probes != NULL);
+
+    for (i = 0; i != probes->len; i++)
+    {
+      if (g_array_index (probes, GumCallProbe, i).id == id)
+      {
+        match_index = i;
+        break;
+      }
+    }
+    g_assert (match_index != -1);
+
+    probe = &g_array_index (probes, GumCallProbe, match_index);
+    if (probe->user_notify != NULL)
+      probe->user_notify (probe->user_data);
+    g_array_remove_index (probes, match_index);
+
+    if (probes->len == 0)
+      g_hash_table_remove (self->probe_array_by_address, target_address);
+
+    self->any_probes_attached =
+        g_hash_table_size (self->probe_array_by_address) != 0;
+  }
+
+  gum_spinlock_release (&self->probe_lock);
+
+  gum_stalker_invalidate_caches (self);
+}
+
+static void
+gum_stalker_free_probe_array (gpointer data)
+{
+  GArray * probes = (GArray *) data;
+  guint i;
+
+  for (i = 0; i != probes->len; i++)
+  {
+    GumCallProbe * probe = &g_array_index (probes, GumCallProbe, i);
+    if (probe->user_notify != NULL)
+      probe->user_notify (probe->user_data);
+  }
+
+  g_array_free (probes, TRUE);
+}
+
+static GumExecCtx *
+gum_stalker_create_exec_ctx (GumStalker * self,
+                             GumThreadId thread_id,
+                             GumStalkerTransformer * transformer,
+                             GumEventSink * sink)
+{
+  guint base_size;
+  GumExecCtx * ctx;
+
+  base_size = sizeof (GumExecCtx) / self->page_size;
+  if (sizeof (GumExecCtx) % self->page_size != 0)
+    base_size++;
+
+  ctx = (GumExecCtx *)
+      gum_alloc_n_pages (base_size + GUM_CODE_SLAB_SIZE_IN_PAGES + 1,
+          GUM_PAGE_RWX);
+  ctx->state = GUM_EXEC_CTX_ACTIVE;
+  ctx->invalidate_pending = FALSE;
+
+  ctx->code_slab = &ctx->first_code_slab;
+  ctx->first_code_slab.data = ((guint8 *) ctx) + (base_size * self->page_size);
+  ctx->first_code_slab.offset = 0;
+  ctx->first_code_slab.size = GUM_CODE_SLAB_SIZE_IN_PAGES * self->page_size;
+  ctx->first_code_slab.next = NULL;
+  ctx->retired_slabs = NULL;
+  ctx->code_generation = 0;
+  ctx->code_size = 0;
+  ctx->code_budget_exceeded = FALSE;
+  ctx->code_budget_epoch = g_atomic_int_get (&self->code_budget_epoch);
+  ctx->free_invalidation_stubs = NULL;
+  ctx->retired_invalidation_stubs = NULL;
+  ctx->last_prolog_minimal = NULL;
+  ctx->last_epilog_minimal = NULL;
+  ctx->last_prolog_full = NULL;
+  ctx->last_epilog_full = NULL;
+  ctx->last_stack_push = NULL;
+  ctx->last_stack_pop_and_go = NULL;
+
+  if (counters_enabled)
+    g_atomic_int_add (&total_slab_pages, GUM_CODE_SLAB_SIZE_IN_PAGES);
+
+  ctx->frames = (GumExecFrame *) (ctx->code_slab->data + ctx->code_slab->size);
+  ctx->first_frame = (GumExecFrame *) (ctx->code_slab->data +
+      ctx->code_slab->size + self->page_size - sizeof (GumExecFrame));
+  ctx->current_frame = ctx->first_frame;
+
+  ctx->mappings = gum_metal_hash_table_new (NULL, NULL);
+
+  ctx->ic_table = NULL;
+  ctx->ic_table_lookup = NULL;
+
+  ctx->resume_at = NULL;
+  ctx->return_at = NULL;
+  ctx->app_stack = NULL;
+  ctx->n_native_returns = 0;
+
+  ctx->stalker = g_object_ref (self);
+  ctx->thread_id = thread_id;
+
+  gum_x86_writer_init (&ctx->code_writer, NULL);
+  gum_x86_relocator_init (&ctx->relocator, NULL, &ctx->code_writer);
+
+  if (transformer != NULL)
+    ctx->transformer = g_object_ref (transformer);
+  else
+    ctx->transformer = gum_stalker_transformer_make_default ();
+  ctx->calling_transformer = FALSE;
+  ctx->compiling_trace = FALSE;
+  g_queue_init (&ctx->callout_entries);
+  gum_spinlock_init (&ctx->callout_lock);
+  ctx->sink = (GumEventSink *) g_object_ref (sink);
+  ctx->sink_mask = gum_event_sink_query_mask (sink);
+  ctx->sink_process_impl = GUM_EVENT_SINK_GET_IFACE (sink)->process;
+  ctx->sink_process_batch_impl =
+      GUM_EVENT_SINK_GET_IFACE (sink)->process_batch;
+
+  if (self->event_buffer_capacity != 0 &&
+      (ctx->sink_mask & (GUM_CALL | GUM_RET | GUM_EXEC | GUM_BLOCK)) != 0)
+  {
+    ctx->event_buffer = g_new (GumEvent, self->event_buffer_capacity);
+    ctx->event_buffer_size = self->event_buffer_capacity * sizeof (GumEvent);
+  }
+  else
+  {
+    ctx->event_buffer = NULL;
+    ctx->event_buffer_size = 0;
+  }
+  ctx->event_buffer_head = 0;
+  ctx->event_buffer_tail = 0;
+  gum_spinlock_init (&ctx->event_buffer_lock);
+  ctx->event_buffer_draining = FALSE;
+
+  if ((ctx->sink_mask & GUM_CALL) != 0 &&
+      gum_event_sink_query_call_summary (sink))
+  {
+    ctx->call_counts = g_new0 (GumCallCountSlot, GUM_CALL_COUNTS_CAPACITY);
+    ctx->call_count_indices = g_new (guint, GUM_CALL_COUNTS_MAX_TARGETS);
+    ctx->call_counts_reported = g_new (gsize, GUM_CALL_COUNTS_MAX_TARGETS);
+    ctx->call_count_deltas = g_new (GumCallCount, GUM_CALL_COUNTS_MAX_TARGETS);
+  }
+  else
+  {
+    ctx->call_counts = NULL;
+    ctx->call_count_indices = NULL;
+    ctx->call_counts_reported = NULL;
+    ctx->call_count_deltas = NULL;
+  }
+  ctx->n_call_counts = 0;
+  ctx->call_counts_countdown = GUM_CALL_COUNTS_DRAIN_INTERVAL;
+  gum_spinlock_init (&ctx->call_counts_lock);
+
+  ctx->coverage_prev_loc = 0;
+
+  ctx->range_invalidation_pending = FALSE;
+  ctx->pending_invalidations =
+      g_array_new (FALSE, FALSE, sizeof (GumMemoryRange));
+  gum_spinlock_init (&ctx->invalidation_lock);
+  ctx->dirty_code_pages_tail =
+      (guint) g_atomic_int_get (&self->dirty_code_pages_head);
+
+  ctx->counted_blocks = NULL;
+  ctx->retired_block_counts = NULL;
+  gum_spinlock_init (&ctx->counted_blocks_lock);
+
+  gum_exec_ctx_create_thunks (ctx);
+
+  GUM_STALKER_LOCK (self);
+  self->contexts = g_slist_prepend (self->contexts, ctx);
+  GUM_STALKER_UNLOCK (self);
+
+  gum_exec_ctx_ensure_inline_helpers_reachable (ctx);
+
+  return ctx;
+}
+
+static GumExecCtx *
+gum_stalker_get_exec_ctx (GumStalker * self)
+{
+  return (GumExecCtx *) gum_tls_key_get_value (self->exec_ctx);
+}
+
+static void
+gum_stalker_invalidate_caches (GumStalker * self)
+{
+  GSList * cur;
+
+  GUM_STALKER_LOCK (self);
+
+  for (cur = self->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+
+    ctx->invalidate_pending = TRUE;
+  }
+
+  GUM_STALKER_UNLOCK (self);
+}
+
+static void
+gum_stalker_invalidate_range (GumStalker * self,
+                              gboolean any_thread,
+                              GumThreadId thread_id,
+                              const GumMemoryRange * range)
+{
+  GSList * cur;
+
+  GUM_STALKER_LOCK (self);
+
+  for (cur = self->contexts; cur != NULL; cur = cur->next)
+  {
+    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+
+    if (any_thread || ctx->thread_id == thread_id)
+      gum_exec_ctx_request_invalidation (ctx, range);
+  }
+
+  GUM_STALKER_UNLOCK (self);
+}
+
+/*
+ * Write-protects the writable pages spanned by [begin, end) so that we get to
+ * know when the code we compiled from them is modified. Pages that are not
+ * writable to begin with are left alone, and so are pages that don't fit in
+ * the table. Blocks from such pages keep relying on their snapshots.
+ */
+static void
+gum_stalker_protect_code (GumStalker * self,
+                          gconstpointer begin,
+                          gconstpointer end)
+{
+  gsize page_mask = self->page_size - 1;
+  const guint8 * page;
+
+  g_mutex_lock (&self->code_page_lock);
+
+  for (page = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (begin) & ~page_mask);
+      page < (const guint8 *) end;
+      page += self->page_size)
+  {
+    GumCodePage * cp;
+    gint state, protected_state;
+    GumPageProtection prot;
+
+    cp = gum_stalker_lookup_code_page (self, page);
+    if (cp == NULL)
+    {
+      cp = gum_stalker_insert_code_page (self, page, GUM_CODE_PAGE_KNOWN |
+          gum_stalker_query_code_protection (self, page));
+      if (cp == NULL)
+        break;
+    }
+
+    state = g_atomic_int_get (&cp->state);
+    if ((state & GUM_PAGE_WRITE) == 0 ||
+        (state & GUM_CODE_PAGE_PROTECTED) != 0)
+      continue;
+
+    /*
+     * Flag it before the protection kicks in, so that the handler knows the
+     * fault is ours. Should the handler get to it before we are done, it will
+     * have restored the protection already, or is about to, so we do it too.
+     */
+    protected_state = (state | GUM_CODE_PAGE_PROTECTED) & ~GUM_CODE_PAGE_DIRTY;
+    g_atomic_int_set (&cp->state, protected_state);
+
+    prot = state & GUM_PAGE_RWX;
+    if (!gum_try_mprotect ((gpointer) page, self->page_size,
+        prot & ~GUM_PAGE_WRITE))
+    {
+      g_atomic_int_compare_and_exchange (&cp->state, protected_state, state);
+    }
+    else if (g_atomic_int_get (&cp->state) != protected_state)
+    {
+      gum_try_mprotect ((gpointer) page, self->page_size, prot);
+    }
+  }
+
+  g_mutex_unlock (&self->code_page_lock);
+}
+
+/*
+ * Tells whether every page spanned by [begin, end) is currently protected,
+ * so that any write to it would reach us.
+ */
+static gboolean
+gum_stalker_is_code_protected (GumStalker * self,
+                               gconstpointer begin,
+                               gconstpointer end)
+{
+  gsize page_mask = self->page_size - 1;
+  const guint8 * page;
+
+  for (page = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (begin) & ~page_mask);
+      page < (const guint8 *) end;
+      page += self->page_size)
+  {
+    GumCodePage * cp;
+
+    cp = gum_stalker_lookup_code_page (self, page);
+    if (cp == NULL ||
+        (g_atomic_int_get (&cp->state) & GUM_CODE_PAGE_PROTECTED) == 0)
+    {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+static void
+gum_stalker_unprotect_all_code (GumStalker * self)
+{
+  guint i;
+
+  if (self->code_pages == NULL)
+    return;
+
+  g_mutex_lock (&self->code_page_lock);
+
+  for (i = 0; i != GUM_CODE_PAGES_CAPACITY; i++)
+  {
+    GumCodePage * cp = &self->code_pages[i];
+    gpointer page;
+    gint state;
+
+    page = g_atomic_pointer_get (&cp->address);
+    if (page == NULL)
+      continue;
+
+    do
+    {
+      state = g_atomic_int_get (&cp->state);
+      if ((state & GUM_CODE_PAGE_PROTECTED) == 0)
+        break;
+    }
+    while (!g_atomic_int_compare_and_exchange (&cp->state, state,
+        (state & ~GUM_CODE_PAGE_PROTECTED) | GUM_CODE_PAGE_DIRTY));
+
+    if ((state & GUM_CODE_PAGE_PROTECTED) != 0)
+      gum_try_mprotect (page, self->page_size, state & GUM_PAGE_RWX);
+  }
+
+  g_array_set_size (self->code_mappings, 0);
+
+  g_mutex_unlock (&self->code_page_lock);
+}
+
+static guint
+gum_stalker_hash_code_page (GumStalker * self,
+                            gconstpointer address)
+{
+  return (guint) (GPOINTER_TO_SIZE (address) / self->page_size) * 2654435761U;
+}
+
+/*
+ * Safe to call without the lock, which is what the exception handler does.
+ */
+static GumCodePage *
+gum_stalker_lookup_code_page (GumStalker * self,
+                              gconstpointer address)
+{
+  guint mask = GUM_CODE_PAGES_CAPACITY - 1;
+  guint index, n;
+
+  if (self->code_pages == NULL)
+    return NULL;
+
+  index = gum_stalker_hash_code_page (self, address) & mask;
+  for (n = 0; n != GUM_CODE_PAGES_CAPACITY; n++)
+  {
+    GumCodePage * cp = &self->code_pages[index];
+    gpointer cur;
+
+    cur = g_atomic_pointer_get (&cp->address);
+    if (cur == address)
+      return cp;
+    if (cur == NULL)
+      return NULL;
+
+    index = (index + 1) & mask;
+  }
+
+  return NULL;
+}
+
+/*
+ * Must be called with the lock held, and only for pages not in the table
+ * yet. Returns NULL once the table is full.
+ */
+static GumCodePage *
+gum_stalker_insert_code_page (GumStalker * self,
+                              gconstpointer address,
+                              gint state)
+{
+  guint mask = GUM_CODE_PAGES_CAPACITY - 1;
+  guint index, n;
+
+  index = gum_stalker_hash_code_page (self, address) & mask;
+  for (n = 0; n != GUM_CODE_PAGES_CAPACITY; n++)
+  {
+    GumCodePage * cp = &self->code_pages[index];
+
+    if (g_atomic_pointer_get (&cp->address) == NULL)
+    {
+      g_atomic_int_set (&cp->state, state);
+      g_atomic_pointer_set (&cp->address, (gpointer) address);
+      return cp;
+    }
+
+    index = (index + 1) & mask;
+  }
+
+  return NULL;
+}
+
+/*
+ * Looks up the protection of the mapping containing `page`. Enumerating the
+ * ranges is expensive, so we only do it once per mapping. Must be called with
+ * the lock held.
+ */
+static GumPageProtection
+gum_stalker_query_code_protection (GumStalker * self,
+                                   gconstpointer page)
+{
+  GumAddress address = GUM_ADDRESS (page);
+  GumFindCodeMappingContext fc;
+  guint i;
+
+  for (i = 0; i != self->code_mappings->len; i++)
+  {
+    const GumCodeMapping * mapping =
+        &g_array_index (self->code_mappings, GumCodeMapping, i);
+    const GumMemoryRange * range = &mapping->range;
+
+    if (address >= range->base_address &&
+        address < range->base_address + range->size)
+    {
+      return mapping->prot;
+    }
+  }
+
+  fc.address = address;
+  fc.found = FALSE;
+  gum_process_enumerate_ranges (GUM_PAGE_NO_ACCESS, gum_find_code_mapping,
+      &fc);
+  if (!fc.found)
+    return GUM_PAGE_NO_ACCESS;
+
+  g_array_append_val (self->code_mappings, fc.mapping);
+
+  return fc.mapping.prot;
+}
+
+static gboolean
+gum_find_code_mapping (const GumRangeDetails * details,
+                       gpointer user_data)
+{
+  GumFindCodeMappingContext * fc = user_data;
+  const GumMemoryRange * range = details->range;
+
+  if (fc->address >= range->base_address &&
+      fc->address < range->base_address + range->size)
+  {
+    fc->mapping.range = *range;
+    fc->mapping.prot = details->prot;
+    fc->found = TRUE;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+ * Runs in the context of the faulting thread, which may hold any lock, so
+ * all we do is restore the protection and record the page as dirty. Each
+ * thread invalidates its blocks at its next entrygate.
+ */
+static gboolean
+gum_stalker_on_code_write (GumExceptionDetails * details,
+                           gpointer user_data)
+{
+  GumStalker * self = GUM_STALKER (user_data);
+  gpointer page;
+  GumCodePage * cp;
+  gint state;
+
+  if (details->type != GUM_EXCEPTION_ACCESS_VIOLATION ||
+      details->memory.operation != GUM_MEMOP_WRITE)
+    return FALSE;
+
+  page = GSIZE_TO_POINTER (GPOINTER_TO_SIZE (details->memory.address) &
+      ~((gsize) self->page_size - 1));
+
+  cp = gum_stalker_lookup_code_page (self, page);
+  if (cp == NULL)
+    return FALSE;
+
+  do
+  {
+    state = g_atomic_int_get (&cp->state);
+
+    /*
+     * Unless another thread beat us to it, in which case the write simply
+     * gets retried, the fault isn't ours to handle.
+     */
+    if ((state & GUM_CODE_PAGE_PROTECTED) == 0)
+      return (state & GUM_CODE_PAGE_DIRTY) != 0;
+  }
+  while (!g_atomic_int_compare_and_exchange (&cp->state, state,
+      (state & ~GUM_CODE_PAGE_PROTECTED) | GUM_CODE_PAGE_DIRTY));
+
+  gum_stalker_mark_code_dirty (self, page);
+
+  gum_try_mprotect (page, self->page_size, state & GUM_PAGE_RWX);
+
+  return TRUE;
+}
+
+static void
+gum_stalker_mark_code_dirty (GumStalker * self,
+                             gpointer page)
+{
+  guint seq;
+  GumDirtyCodePage * slot;
+
+  seq = (guint) g_atomic_int_add (&self->dirty_code_pages_head, 1);
+
+  slot = &self->dirty_code_pages[seq & (GUM_DIRTY_CODE_PAGES_CAPACITY - 1)];
+  g_atomic_pointer_set (&slot->address, page);
+  g_atomic_int_set (&slot->seq, seq + 1);
+}
+
+static void
+gum_exec_ctx_request_invalidation (GumExecCtx * ctx,
+                                   const GumMemoryRange * range)
+{
+  gum_spinlock_acquire (&ctx->invalidation_lock);
+  g_array_append_val (ctx->pending_invalidations, *range);
+  ctx->range_invalidation_pending = TRUE;
+  gum_spinlock_release (&ctx->invalidation_lock);
+}
+
+/*
+ * Only ever called by the thread owning the context, from an entrygate, so
+ * it is not executing any of the code we are about to patch. Requests made
+ * by the thread itself, e.g. from a callout, wait for its next entrygate too.
+ */
+static void
+gum_exec_ctx_process_pending_invalidations (GumExecCtx * ctx)
+{
+  GumMetalHashTableIter iter;
+  GumExecBlock * block;
+
+  gum_spinlock_acquire (&ctx->invalidation_lock);
+
+  gum_metal_hash_table_iter_init (&iter, ctx->mappings);
+  while (gum_metal_hash_table_iter_next (&iter, NULL, (gpointer *) &block))
+  {
+    guint i;
+
+    for (i = 0; i != ctx->pending_invalidations->len; i++)
+    {
+      const GumMemoryRange * r = &g_array_index (ctx->pending_invalidations,
+          GumMemoryRange, i);
+      GumAddress begin = GUM_ADDRESS (block->real_begin);
+      GumAddress end = GUM_ADDRESS (block->real_end);
+
+      if (begin < r->base_address + r->size && r->base_address < end)
+      {
+        gum_metal_hash_table_iter_remove (&iter);
+        gum_exec_block_invalidate (block);
+        break;
+      }
+    }
+  }
+
+  g_array_set_size (ctx->pending_invalidations, 0);
+  ctx->range_invalidation_pending = FALSE;
+
+  gum_spinlock_release (&ctx->invalidation_lock);
+}
+
+/*
+ * Turns the pages written to since our last visit into invalidation requests
+ * for our own blocks. Records still being written are left for next time.
+ * Should we have fallen so far behind that records got overwritten, we don't
+ * know which pages they were about, and invalidate everything.
+ */
+static void
+gum_exec_ctx_collect_dirty_code (GumExecCtx * ctx)
+{
+  GumStalker * stalker = ctx->stalker;
+  guint head, tail;
+  GumMemoryRange range;
+
+  head = (guint) g_atomic_int_get (&stalker->dirty_code_pages_head);
+  tail = ctx->dirty_code_pages_tail;
+
+  while (tail != head)
+  {
+    GumDirtyCodePage * slot = &stalker->dirty_code_pages[
+        tail & (GUM_DIRTY_CODE_PAGES_CAPACITY - 1)];
+
+    if ((guint) g_atomic_int_get (&slot->seq) != tail + 1)
+      break;
+
+    range.base_address = GUM_ADDRESS (g_atomic_pointer_get (&slot->address));
+    range.size = stalker->page_size;
+    gum_exec_ctx_request_invalidation (ctx, &range);
+
+    tail++;
+  }
+
+  head = (guint) g_atomic_int_get (&stalker->dirty_code_pages_head);
+  if (head - tail > GUM_DIRTY_CODE_PAGES_CAPACITY)
+  {
+    range.base_address = 0;
+    range.size = G_MAXSIZE;
+    gum_exec_ctx_request_invalidation (ctx, &range);
+
+    tail = head;
+  }
+
+  ctx->dirty_code_pages_tail = tail;
+}
+
+static void
+gum_exec_ctx_prepare_for_unfollow (GumExecCtx * ctx)
+{
+  gum_exec_ctx_dispose_callouts (ctx);
+
+  gum_exec_ctx_drain_events (ctx);
+  gum_exec_ctx_drain_call_counts (ctx);
+
+  if (ctx->sink_started)
+  {
+    gum_event_sink_stop (ctx->sink);
+
+    ctx->sink_started = FALSE;
+  }
+}
+
+/*
+ * Hands everything appended to the event buffer over to the sink, waiting for
+ * any drain already in progress on another thread to finish first.
+ */
+static void
+gum_exec_ctx_drain_events (GumExecCtx * ctx)
+{
+  while (!gum_exec_ctx_try_drain_events (ctx))
+    g_thread_yield ();
+}
+
+/*
+ * Hands everything appended to the event buffer over to the sink, in at most
+ * two contiguous runs if the sink takes batches. The owning thread is the
+ * only producer, but we may be called from both that thread and
+ * gum_stalker_flush(). Only one of them drains at a time, and the other gets
+ * FALSE back instead of waiting.
+ *
+ * The sink is called without holding the lock, as it may block until its
+ * consumer catches up, and that consumer may be the one calling
+ * gum_stalker_flush(). The events being delivered stay put until we move
+ * `event_buffer_tail` past them.
+ */
+static gboolean
+gum_exec_ctx_try_drain_events (GumExecCtx * ctx)
+{
+  gsize head, tail, mask;
+
+  if (ctx->event_buffer == NULL)
+    return TRUE;
+
+  gum_spinlock_acquire (&ctx->event_buffer_lock);
+  if (ctx->event_buffer_draining)
+  {
+    gum_spinlock_release (&ctx->event_buffer_lock);
+    return FALSE;
+  }
+  ctx->event_buffer_draining = TRUE;
+  gum_spinlock_release (&ctx->event_buffer_lock);
+
+  head = GPOINTER_TO_SIZE (g_atomic_pointer_get (&ctx->event_buffer_head));
+  mask = ctx->event_buffer_size - 1;
+
+  tail = ctx->event_buffer_tail;
+  while (tail != head)
+  {
+    gsize offset, size;
+    const GumEvent * events;
+
+    offset = tail & mask;
+    size = MIN (head - tail, ctx->event_buffer_size - offset);
+    events = (const GumEvent *) ((guint8 *) ctx->event_buffer + offset);
+
+    if (ctx->sink_process_batch_impl != NULL)
+    {
+      ctx->sink_process_batch_impl (ctx->sink, events,
+          size / sizeof (GumEvent));
+    }
+    else
+    {
+      const GumEvent * ev, * end;
 
-  gum_exec_ctx_create_thunks (ctx);
+      end = events + (size / sizeof (GumEvent));
+      for (ev = events; ev != end; ev++)
+        ctx->sink_process_impl (ctx->sink, ev);
+    }
 
-  GUM_STALKER_LOCK (self);
-  self->contexts = g_slist_prepend (self->contexts, ctx);
-  GUM_STALKER_UNLOCK (self);
+    tail += size;
+  }
 
-  gum_exec_ctx_ensure_inline_helpers_reachable (ctx);
+  gum_spinlock_acquire (&ctx->event_buffer_lock);
+  g_atomic_pointer_set (&ctx->event_buffer_tail, tail);
+  ctx->event_buffer_draining = FALSE;
+  gum_spinlock_release (&ctx->event_buffer_lock);
 
-  return ctx;
+  return TRUE;
 }
 
-static GumExecCtx *
-gum_stalker_get_exec_ctx (GumStalker * self)
+/*
+ * Used by the slow paths of the owning thread. Appending to the event buffer
+ * instead of calling the sink right away keeps the events in order, and lets
+ * them be delivered in batches along with the ones from the generated code.
+ */
+static void
+gum_exec_ctx_emit_event (GumExecCtx * ctx,
+                         const GumEvent * ev)
 {
-  return (GumExecCtx *) gum_tls_key_get_value (self->exec_ctx);
+  gsize head, tail;
+
+  if (ctx->event_buffer == NULL)
+  {
+    ctx->sink_process_impl (ctx->sink, ev);
+    return;
+  }
+
+  head = ctx->event_buffer_head;
+  tail = GPOINTER_TO_SIZE (g_atomic_pointer_get (&ctx->event_buffer_tail));
+  if (head - tail == ctx->event_buffer_size)
+    gum_exec_ctx_drain_events (ctx);
+
+  *((GumEvent *) ((guint8 *) ctx->event_buffer +
+      (head & (ctx->event_buffer_size - 1)))) = *ev;
+
+  g_atomic_pointer_set (&ctx->event_buffer_head, head + sizeof (GumEvent));
 }
 
+/*
+ * Hands the sink how much each call target's counter has moved since the
+ * last time. Like gum_exec_ctx_drain_events() this may run on any thread,
+ * while the owning thread keeps bumping the counters.
+ */
 static void
-gum_stalker_invalidate_caches (GumStalker * self)
+gum_exec_ctx_drain_call_counts (GumExecCtx * ctx)
 {
-  GSList * cur;
+  guint n, i, n_deltas;
 
-  GUM_STALKER_LOCK (self);
+  if (ctx->call_counts == NULL)
+    return;
 
-  for (cur = self->contexts; cur != NULL; cur = cur->next)
+  gum_spinlock_acquire (&ctx->call_counts_lock);
+
+  n = g_atomic_int_get (&ctx->n_call_counts);
+  n_deltas = 0;
+
+  for (i = 0; i != n; i++)
   {
-    GumExecCtx * ctx = (GumExecCtx *) cur->data;
+    GumCallCountSlot * slot = &ctx->call_counts[ctx->call_count_indices[i]];
+    gsize count, delta;
 
-    ctx->invalidate_pending = TRUE;
+    count = *((volatile gsize *) &slot->count);
+    delta = count - ctx->call_counts_reported[i];
+    if (delta == 0)
+      continue;
+
+    ctx->call_count_deltas[n_deltas].target = slot->target;
+    ctx->call_count_deltas[n_deltas].count = delta;
+    n_deltas++;
+
+    ctx->call_counts_reported[i] = count;
   }
 
-  GUM_STALKER_UNLOCK (self);
+  if (n_deltas != 0)
+  {
+    gum_event_sink_process_call_summary (ctx->sink, ctx->call_count_deltas,
+        n_deltas);
+  }
+
+  gum_spinlock_release (&ctx->call_counts_lock);
 }
 
-static void
-gum_exec_ctx_prepare_for_unfollow (GumExecCtx * ctx)
+/*
+ * Finds or claims the call-summary slot for `target`. Only the owning thread
+ * claims slots. Returns NULL once the table is too full to probe cheaply, in
+ * which case callers fall back to emitting GUM_CALL events.
+ */
+static GumCallCountSlot *
+gum_exec_ctx_obtain_call_count (GumExecCtx * ctx,
+                                gpointer target)
 {
-  gum_exec_ctx_dispose_callouts (ctx);
+  const guint mask = GUM_CALL_COUNTS_CAPACITY - 1;
+  GumCallCountSlot * slot;
+  guint n, i;
 
-  if (ctx->sink_started)
+  i = (GPOINTER_TO_SIZE (target) >> 4) & mask;
+  while (TRUE)
   {
-    gum_event_sink_stop (ctx->sink);
+    slot = &ctx->call_counts[i];
 
-    ctx->sink_started = FALSE;
+    if (slot->target == target)
+      return slot;
+
+    if (slot->target == NULL)
+      break;
+
+    i = (i + 1) & mask;
   }
+
+  n = ctx->n_call_counts;
+  if (n == GUM_CALL_COUNTS_MAX_TARGETS)
+    return NULL;
+
+  slot->target = target;
+  ctx->call_count_indices[n] = i;
+  ctx->call_counts_reported[n] = 0;
+  g_atomic_int_set (&ctx->n_call_counts, n + 1);
+
+  return slot;
 }
 
 static void
@@ -1150,20 +3605,31 @@ gum_exec_ctx_finalize_callouts (GumExecCtx * ctx)
 static void
 gum_exec_ctx_free (GumExecCtx * ctx)
 {
-  GumSlab * slab;
-
   gum_metal_hash_table_unref (ctx->mappings);
+  g_free (ctx->ic_table);
 
-  slab = ctx->code_slab;
-  while (slab != &ctx->first_code_slab)
-  {
-    GumSlab * next = slab->next;
-    gum_free_pages (slab);
-    slab = next;
-  }
+  gum_exec_ctx_free_slabs (ctx, ctx->retired_slabs);
+  gum_exec_ctx_free_slabs (ctx, ctx->code_slab);
+
+  g_atomic_pointer_add (&ctx->stalker->total_code_size,
+      -(gssize) ctx->code_size);
 
   gum_exec_ctx_destroy_thunks (ctx);
 
+  gum_exec_ctx_drain_events (ctx);
+  g_free (ctx->event_buffer);
+
+  gum_exec_ctx_drain_call_counts (ctx);
+  g_free (ctx->call_count_deltas);
+  g_free (ctx->call_counts_reported);
+  g_free (ctx->call_count_indices);
+  g_free (ctx->call_counts);
+
+  if (ctx->retired_block_counts != NULL)
+    g_hash_table_unref (ctx->retired_block_counts);
+
+  g_array_free (ctx->pending_invalidations, TRUE);
+
   g_object_unref (ctx->sink);
   gum_exec_ctx_finalize_callouts (ctx);
   g_object_unref (ctx->transformer);
@@ -1176,12 +3642,149 @@ gum_exec_ctx_free (GumExecCtx * ctx)
   gum_free_pages (ctx);
 }
 
+static void
+gum_exec_ctx_free_slabs (GumExecCtx * ctx,
+                         GumSlab * slabs)
+{
+  GumSlab * slab = slabs;
+
+  while (slab != NULL)
+  {
+    GumSlab * next = slab->next;
+
+    if (slab != &ctx->first_code_slab)
+      gum_free_pages (slab);
+
+    slab = next;
+  }
+}
+
+/*
+ * Starts over with an empty code cache once the budget has been exceeded.
+ *
+ * We don't keep track of the links between blocks, so evicting individual
+ * blocks is not an option. Instead we abandon the whole generation. We are
+ * called from an entrygate, and the caller will only execute what is left of
+ * its transfer code before jumping to a block of the new generation. Blocks
+ * of the new generation never link back to the old one, so by the time we
+ * reach the next entrygate it is safe to free the retired slabs.
+ */
+static void
+gum_exec_ctx_recycle_code (GumExecCtx * ctx)
+{
+  GumStalker * stalker = ctx->stalker;
+  GumSlab * slab, * cur;
+  gboolean first_slab_retired;
+
+  if (counters_enabled)
+    g_atomic_int_inc (&total_code_recycles);
+
+  first_slab_retired = FALSE;
+  for (cur = ctx->code_slab; cur != NULL; cur = cur->next)
+  {
+    if (cur == &ctx->first_code_slab)
+      first_slab_retired = TRUE;
+  }
+
+  if (first_slab_retired)
+  {
+    slab = gum_alloc_n_pages (GUM_CODE_SLAB_SIZE_IN_PAGES, GUM_PAGE_RWX);
+    if (counters_enabled)
+      g_atomic_int_add (&total_slab_pages, GUM_CODE_SLAB_SIZE_IN_PAGES);
+    slab->data = (guint8 *) (slab + 1);
+    slab->size = (GUM_CODE_SLAB_SIZE_IN_PAGES * stalker->page_size)
+        - sizeof (GumSlab);
+  }
+  else
+  {
+    slab = &ctx->first_code_slab;
+  }
+  slab->offset = 0;
+  slab->next = NULL;
+
+  ctx->retired_slabs = ctx->code_slab;
+  ctx->code_slab = slab;
+  ctx->code_generation++;
+
+  /* Any stubs left are in the retired slabs */
+  ctx->free_invalidation_stubs = NULL;
+  ctx->retired_invalidation_stubs = NULL;
+
+  /* The blocks are about to go away, so keep what they counted */
+  gum_spinlock_acquire (&ctx->counted_blocks_lock);
+  if (ctx->counted_blocks != NULL)
+  {
+    if (ctx->retired_block_counts == NULL)
+      ctx->retired_block_counts = gum_block_counts_new ();
+    gum_block_counts_add_blocks (ctx->retired_block_counts,
+        ctx->counted_blocks);
+  }
+  ctx->counted_blocks = NULL;
+  gum_spinlock_release (&ctx->counted_blocks_lock);
+
+  gum_metal_hash_table_remove_all (ctx->mappings);
+  ctx->current_frame = ctx->first_frame;
+
+  g_atomic_pointer_add (&stalker->total_code_size, -(gssize) ctx->code_size);
+  ctx->code_size = 0;
+  ctx->code_budget_exceeded = FALSE;
+  ctx->code_budget_epoch = g_atomic_int_get (&stalker->code_budget_epoch);
+
+  ctx->last_prolog_minimal = NULL;
+  ctx->last_epilog_minimal = NULL;
+  ctx->last_prolog_full = NULL;
+  ctx->last_epilog_full = NULL;
+  ctx->last_stack_push = NULL;
+  ctx->last_stack_pop_and_go = NULL;
+  gum_exec_ctx_ensure_inline_helpers_reachable (ctx);
+
+  if (ctx->ic_table != NULL)
+    memset (ctx->ic_table, 0, GUM_IC_TABLE_SIZE * sizeof (GumIcEntry));
+  ctx->ic_table_lookup = NULL;
+}
+
+/*
+ * Charges a committed block to its thread and to the stalker-wide total.
+ *
+ * When the total goes over the global budget, the other threads' code counts
+ * just as much as ours, so we bump the budget epoch. Each thread notices at
+ * its next entrygate and starts a new generation too. Threads that don't run
+ * keep their code until they do, as it may still be executing.
+ */
+static void
+gum_exec_ctx_account_code (GumExecCtx * ctx,
+                           gsize size)
+{
+  GumStalker * stalker = ctx->stalker;
+  gsize total_size;
+
+  ctx->code_size += size;
+  total_size = (gsize) g_atomic_pointer_add (&stalker->total_code_size,
+      size) + size;
+
+  if (stalker->thread_code_budget != 0 &&
+      ctx->code_size > stalker->thread_code_budget)
+  {
+    ctx->code_budget_exceeded = TRUE;
+  }
+
+  if (stalker->code_budget != 0 && total_size > stalker->code_budget)
+  {
+    ctx->code_budget_exceeded = TRUE;
+
+    if (total_size - size <= stalker->code_budget)
+      g_atomic_int_inc (&stalker->code_budget_epoch);
+  }
+}
+
 static void
 gum_exec_ctx_unfollow (GumExecCtx * ctx,
                        gpointer resume_at)
 {
   ctx->resume_at = resume_at;
 
+  gum_exec_ctx_restore_native_returns (ctx, &ctx);
+
   gum_tls_key_set_value (ctx->stalker->exec_ctx, NULL);
   ctx->current_block = NULL;
   ctx->state = GUM_EXEC_CTX_DESTROY_PENDING;
@@ -1193,9 +3796,6 @@ gum_exec_ctx_has_executed (GumExecCtx * ctx)
   return ctx->resume_at != NULL;
 }
 
-static gboolean counters_enabled = FALSE;
-static guint total_transitions = 0;
-
 #define GUM_ENTRYGATE(name) \
   gum_exec_ctx_replace_current_block_from_##name
 #define GUM_DEFINE_ENTRYGATE(name) \
@@ -1213,6 +3813,8 @@ static guint total_transitions = 0;
   }
 #define GUM_PRINT_ENTRYGATE_COUNTER(name) \
   g_printerr ("\t" G_STRINGIFY (name) "s: %u\n", total_##name##s)
+#define GUM_RESET_ENTRYGATE_COUNTER(name) \
+  total_##name##s = 0
 
 #if GLIB_SIZEOF_VOID_P == 4 && !defined (HAVE_QNX)
 GUM_DEFINE_ENTRYGATE (sysenter_slow_path)
@@ -1235,13 +3837,37 @@ GUM_DEFINE_ENTRYGATE (jmp_cond_jcxz)
 
 GUM_DEFINE_ENTRYGATE (jmp_continuation)
 
+GUM_DEFINE_ENTRYGATE (invalidated_block)
+
 static gpointer GUM_THUNK
 gum_exec_ctx_replace_current_block_with (GumExecCtx * ctx,
                                          gpointer start_address)
 {
+  gint epoch;
+
   if (counters_enabled)
     total_transitions++;
 
+  if (ctx->retired_slabs != NULL)
+  {
+    gum_exec_ctx_free_slabs (ctx, ctx->retired_slabs);
+    ctx->retired_slabs = NULL;
+  }
+
+  if (ctx->retired_invalidation_stubs != NULL)
+    gum_exec_ctx_reuse_invalidation_stubs (ctx);
+
+  epoch = g_atomic_int_get (&ctx->stalker->code_budget_epoch);
+  if (ctx->code_budget_epoch != epoch)
+  {
+    ctx->code_budget_epoch = epoch;
+    if (ctx->code_size != 0)
+      ctx->code_budget_exceeded = TRUE;
+  }
+
+  if (ctx->code_budget_exceeded)
+    gum_exec_ctx_recycle_code (ctx);
+
   if (ctx->invalidate_pending)
   {
     gum_metal_hash_table_remove_all (ctx->mappings);
@@ -1249,6 +3875,32 @@ gum_exec_ctx_replace_current_block_with (GumExecCtx * ctx,
     ctx->invalidate_pending = FALSE;
   }
 
+  if (ctx->dirty_code_pages_tail !=
+      (guint) g_atomic_int_get (&ctx->stalker->dirty_code_pages_head))
+  {
+    gum_exec_ctx_collect_dirty_code (ctx);
+  }
+
+  if (ctx->range_invalidation_pending)
+    gum_exec_ctx_process_pending_invalidations (ctx);
+
+  if (ctx->call_counts != NULL && --ctx->call_counts_countdown == 0)
+  {
+    gum_exec_ctx_drain_call_counts (ctx);
+    ctx->call_counts_countdown = GUM_CALL_COUNTS_DRAIN_INTERVAL;
+  }
+
+  /*
+   * Hot code stops coming through here once its blocks are linked, so this
+   * leaves large batches for the sink, while keeping events from sitting in
+   * the buffer of a thread that has moved on to code it hasn't seen before.
+   */
+  if (ctx->event_buffer != NULL && ctx->event_buffer_head !=
+      GPOINTER_TO_SIZE (g_atomic_pointer_get (&ctx->event_buffer_tail)))
+  {
+    gum_exec_ctx_try_drain_events (ctx);
+  }
+
   if (start_address == gum_stalker_unfollow_me)
   {
     ctx->unfollow_called_while_still_following = TRUE;
@@ -1259,6 +3911,11 @@ gum_exec_ctx_replace_current_block_with (GumExecCtx * ctx,
   {
     gum_exec_ctx_unfollow (ctx, start_address);
   }
+  else if (ctx->stalker->any_inclusions &&
+      gum_stalker_is_excluding (ctx->stalker, start_address))
+  {
+    gum_exec_ctx_leave_for_native (ctx, start_address);
+  }
   else
   {
     ctx->current_block = gum_exec_ctx_obtain_block_for (ctx, start_address,
@@ -1274,6 +3931,113 @@ gum_exec_ctx_replace_current_block_with (GumExecCtx * ctx,
   return ctx->resume_at;
 }
 
+/*
+ * In inclusive mode, code outside the included ranges runs natively. When
+ * entering it through a call we can tell from the shadow stack, we point its
+ * return address at one of our native return stubs so that we get control
+ * back once it returns. Any calls it makes into included modules are caught
+ * by the entry hooks.
+ */
+static void
+gum_exec_ctx_leave_for_native (GumExecCtx * ctx,
+                               gpointer start_address)
+{
+  gpointer * slot = ctx->app_stack;
+
+  gum_exec_ctx_drop_stale_native_returns (ctx, slot + 1);
+
+  if (ctx->native_return_stubs != NULL &&
+      ctx->n_native_returns != GUM_MAX_NATIVE_RETURNS &&
+      ctx->current_frame != ctx->first_frame &&
+      *slot == ctx->current_frame->real_address)
+  {
+    GumNativeReturn * ret = &ctx->native_returns[ctx->n_native_returns];
+
+    ret->slot = slot;
+    ret->real_address = ctx->current_frame->real_address;
+    *slot = gum_exec_ctx_get_native_return_stub (ctx, ctx->n_native_returns);
+    ctx->n_native_returns++;
+
+    ctx->current_frame++;
+  }
+
+  gum_stalker_ensure_entry_hooks (ctx->stalker);
+
+  ctx->current_block = NULL;
+  ctx->resume_at = start_address;
+}
+
+/*
+ * Called from the native return thunk, with `sp` being the stack pointer
+ * right after the native code returned to one of our stubs.
+ */
+static gpointer
+gum_exec_ctx_return_from_native (GumExecCtx * ctx,
+                                 gpointer * sp)
+{
+  gpointer * slot = sp - 1;
+  GumNativeReturn * ret;
+
+  gum_exec_ctx_drop_stale_native_returns (ctx, slot);
+
+  g_assert (ctx->n_native_returns != 0);
+  ret = &ctx->native_returns[ctx->n_native_returns - 1];
+  g_assert (ret->slot == slot);
+  ctx->n_native_returns--;
+
+  ctx->app_stack = sp;
+
+  return gum_exec_ctx_replace_current_block_with (ctx, ret->real_address);
+}
+
+/*
+ * Puts back the return addresses we hijacked, so the thread's native frames
+ * return straight to the code that called them once we are gone. Anything
+ * recorded beneath `sp` is left alone, as those frames are gone already.
+ */
+static void
+gum_exec_ctx_restore_native_returns (GumExecCtx * ctx,
+                                     gconstpointer sp)
+{
+  guint i;
+
+  gum_exec_ctx_drop_stale_native_returns (ctx, sp);
+
+  for (i = 0; i != ctx->n_native_returns; i++)
+  {
+    GumNativeReturn * ret = &ctx->native_returns[i];
+
+    if (*ret->slot == gum_exec_ctx_get_native_return_stub (ctx, i))
+      *ret->slot = ret->real_address;
+  }
+
+  ctx->n_native_returns = 0;
+}
+
+/*
+ * Forgets hijacked return addresses whose slot lies beneath `sp`. Their
+ * frames were unwound without returning through us, e.g. by a longjmp() or
+ * a C++ exception, and the memory may have been reused since.
+ */
+static void
+gum_exec_ctx_drop_stale_native_returns (GumExecCtx * ctx,
+                                        gconstpointer sp)
+{
+  while (ctx->n_native_returns != 0 &&
+      (gconstpointer) ctx->native_returns[ctx->n_native_returns - 1].slot < sp)
+  {
+    ctx->n_native_returns--;
+  }
+}
+
+static gpointer
+gum_exec_ctx_get_native_return_stub (GumExecCtx * ctx,
+                                     guint index)
+{
+  /* Skip the padding so unwinders looking up `pc - 1` stay inside the stub */
+  return ctx->native_return_stubs + (index * GUM_NATIVE_RETURN_STUB_SIZE) + 1;
+}
+
 static void
 gum_exec_ctx_create_thunks (GumExecCtx * ctx)
 {
@@ -1284,17 +4048,158 @@ gum_exec_ctx_create_thunks (GumExecCtx * ctx)
   ctx->thunks = gum_alloc_n_pages (1, GUM_PAGE_RWX);
   gum_x86_writer_init (&cw, ctx->thunks);
 
+  ctx->native_return_thunk = gum_x86_writer_cur (&cw);
+  gum_x86_writer_put_lea_reg_reg_offset (&cw, GUM_REG_XSP,
+      GUM_REG_XSP, -((gssize) sizeof (gpointer)));
+  gum_x86_writer_put_push_reg (&cw, GUM_REG_XAX);
+  gum_x86_writer_put_mov_reg_address (&cw, GUM_REG_XAX, GUM_ADDRESS (ctx));
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (&cw,
+      GUM_REG_XSP, sizeof (gpointer),
+      GUM_REG_XAX);
+  gum_x86_writer_put_pop_reg (&cw, GUM_REG_XAX);
+  gum_stalker_write_native_transition (&cw,
+      GUM_ADDRESS (gum_exec_ctx_return_from_native));
+
+  gum_exec_ctx_write_native_return_stubs (ctx, &cw);
+
   ctx->infect_thunk = gum_x86_writer_cur (&cw);
 
   gum_x86_writer_clear (&cw);
+
+#ifndef G_OS_WIN32
+  gum_exec_ctx_register_native_return_unwind_info (ctx);
+#endif
 }
 
 static void
 gum_exec_ctx_destroy_thunks (GumExecCtx * ctx)
 {
+#ifndef G_OS_WIN32
+  gum_exec_ctx_unregister_native_return_unwind_info (ctx);
+#endif
+
   gum_free_pages (ctx->thunks);
 }
 
+/*
+ * One stub per hijacked return address, each with its own unwind info that
+ * points the unwinder at the real return address. On Windows there is no
+ * way to express that in the unwind info, so we don't hijack any return
+ * addresses there, and native code returning to included code is simply
+ * not followed.
+ */
+static void
+gum_exec_ctx_write_native_return_stubs (GumExecCtx * ctx,
+                                        GumX86Writer * cw)
+{
+#ifndef G_OS_WIN32
+  guint i;
+
+  ctx->native_return_stubs = gum_x86_writer_cur (cw);
+
+  for (i = 0; i != GUM_MAX_NATIVE_RETURNS; i++)
+  {
+    guint end = (i + 1) * GUM_NATIVE_RETURN_STUB_SIZE;
+
+    gum_x86_writer_put_nop (cw);
+    gum_x86_writer_put_jmp_address (cw,
+        GUM_ADDRESS (ctx->native_return_thunk));
+    gum_x86_writer_flush (cw);
+
+    while ((guint8 *) gum_x86_writer_cur (cw) - ctx->native_return_stubs <
+        end)
+    {
+      gum_x86_writer_put_nop (cw);
+    }
+    g_assert ((guint8 *) gum_x86_writer_cur (cw) - ctx->native_return_stubs ==
+        end);
+  }
+#else
+  ctx->native_return_stubs = NULL;
+#endif
+}
+
+#ifndef G_OS_WIN32
+
+/*
+ * Describes each stub as a frame whose caller is the included code that made
+ * the call, so exceptions and backtraces make it through native code that is
+ * yet to return to us. The CIE has the CFA be the stack pointer, i.e. what
+ * the caller's stack pointer is once the call returns, and each FDE has the
+ * return address read from its GumNativeReturn. Every FDE is followed by a
+ * zero terminator and registered on its own, as some unwinders only take a
+ * single FDE at a time.
+ */
+static void
+gum_exec_ctx_register_native_return_unwind_info (GumExecCtx * ctx)
+{
+  guint8 * cie, * fde;
+  guint i;
+
+  cie = g_malloc0 (GUM_UNWIND_CIE_SIZE +
+      (GUM_MAX_NATIVE_RETURNS * GUM_UNWIND_FDE_STRIDE));
+  ctx->native_return_unwind_info = cie;
+
+  *((guint32 *) cie) = GUM_UNWIND_CIE_SIZE - sizeof (guint32);
+  cie[8] = 1; /* version */
+  cie[9] = '\0'; /* augmentation */
+  cie[10] = 1; /* code alignment factor */
+  cie[11] = 0x80 - sizeof (gpointer); /* data alignment factor, SLEB128 */
+  cie[12] = GUM_DWARF_REG_RA;
+  cie[13] = GUM_DW_CFA_DEF_CFA;
+  cie[14] = GUM_DWARF_REG_SP;
+  cie[15] = 0;
+
+  fde = cie + GUM_UNWIND_CIE_SIZE;
+  for (i = 0; i != GUM_MAX_NATIVE_RETURNS; i++)
+  {
+    guint8 * p = fde + (2 * sizeof (guint32));
+    gpointer pc_begin, ra_location;
+    gsize pc_range;
+
+    pc_begin = ctx->native_return_stubs + (i * GUM_NATIVE_RETURN_STUB_SIZE);
+    pc_range = GUM_NATIVE_RETURN_STUB_SIZE;
+    ra_location = &ctx->native_returns[i].real_address;
+
+    *((guint32 *) fde) = GUM_UNWIND_FDE_SIZE - sizeof (guint32);
+    *((guint32 *) (fde + sizeof (guint32))) = (fde + sizeof (guint32)) - cie;
+
+    memcpy (p, &pc_begin, sizeof (gpointer));
+    p += sizeof (gpointer);
+    memcpy (p, &pc_range, sizeof (gsize));
+    p += sizeof (gsize);
+
+    *p++ = GUM_DW_CFA_EXPRESSION;
+    *p++ = GUM_DWARF_REG_RA;
+    *p++ = 1 + sizeof (gpointer);
+    *p++ = GUM_DW_OP_ADDR;
+    memcpy (p, &ra_location, sizeof (gpointer));
+
+    __register_frame (fde);
+
+    fde += GUM_UNWIND_FDE_STRIDE;
+  }
+}
+
+static void
+gum_exec_ctx_unregister_native_return_unwind_info (GumExecCtx * ctx)
+{
+  guint8 * fde;
+  guint i;
+
+  fde = ctx->native_return_unwind_info + GUM_UNWIND_CIE_SIZE;
+  for (i = 0; i != GUM_MAX_NATIVE_RETURNS; i++)
+  {
+    __deregister_frame (fde);
+
+    fde += GUM_UNWIND_FDE_STRIDE;
+  }
+
+  g_free (ctx->native_return_unwind_info);
+}
+
+#endif
+
 #if ENABLE_DEBUG
 
 static void
@@ -1358,11 +4263,14 @@ gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
                                gpointer * code_address)
 {
   GumExecBlock * block;
+  GumEntryHook * hook;
+  gpointer input_address;
   GumX86Writer * cw;
   GumX86Relocator * rl;
   GumGeneratorContext gc;
   GumStalkerIterator iterator;
   gboolean all_labels_resolved;
+  gboolean counting;
 
   if (ctx->stalker->trust_threshold >= 0)
   {
@@ -1370,6 +4278,9 @@ gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
     if (block != NULL)
     {
       if (block->recycle_count >= ctx->stalker->trust_threshold ||
+          (ctx->stalker->code_write_protection &&
+            gum_stalker_is_code_protected (ctx->stalker, block->real_begin,
+                block->real_end)) ||
           memcmp (real_address, block->real_snapshot,
             block->real_end - block->real_begin) == 0)
       {
@@ -1386,14 +4297,32 @@ gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
   block = gum_exec_block_new (ctx);
   *code_address = block->code_begin;
 
+  if (counters_enabled)
+    g_atomic_int_inc (&total_compiles);
+
   if (ctx->stalker->trust_threshold >= 0)
     gum_metal_hash_table_insert (ctx->mappings, real_address, block);
 
+  if (ctx->stalker->code_write_protection)
+  {
+    gum_stalker_protect_code (ctx->stalker, real_address,
+        (guint8 *) real_address + 1);
+  }
+
+  /*
+   * Functions we have hooked for inclusive mode have their prologue
+   * overwritten, so we translate the trampoline's copy instead.
+   */
+  hook = NULL;
+  if (ctx->stalker->any_entry_hooks)
+    hook = gum_stalker_lookup_entry_hook (ctx->stalker, real_address);
+  input_address = (hook != NULL) ? hook->trampoline : real_address;
+
   cw = &ctx->code_writer;
   rl = &ctx->relocator;
 
   gum_x86_writer_reset (cw, block->code_begin);
-  gum_x86_relocator_reset (rl, real_address, cw);
+  gum_x86_relocator_reset (rl, input_address, cw);
 
   gc.instruction = NULL;
   gc.relocator = rl;
@@ -1401,11 +4330,25 @@ gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
   gc.continuation_real_address = NULL;
   gc.opened_prolog = GUM_PROLOG_NONE;
   gc.accumulated_stack_delta = 0;
+  gc.dead_flags = 0;
+  gc.basic_block_start = input_address;
+  gc.trace_blocks_left = ctx->compiling_trace ? GUM_TRACE_MAX_BLOCKS - 1 : 0;
+
+  if (ctx->stalker->coverage_bitmap != NULL || ctx->event_buffer != NULL)
+    gc.dead_flags = gum_exec_ctx_analyze_flags_liveness (ctx, input_address);
 
 #if ENABLE_DEBUG
   printf ("\n\n***\n\nCreating block for %p:\n", real_address);
 #endif
 
+  counting = ctx->stalker->block_counting &&
+      ctx->stalker->trust_threshold >= 0;
+  if (counting)
+    gum_exec_block_write_execution_count_code (block, &gc);
+
+  if (ctx->stalker->coverage_bitmap != NULL)
+    gum_exec_block_write_coverage_code (block, &gc);
+
   iterator.exec_context = ctx;
   iterator.exec_block = block;
   iterator.generator_context = &gc;
@@ -1441,13 +4384,37 @@ gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
 
   block->code_end = (guint8 *) gum_x86_writer_cur (cw);
 
-  block->real_begin = (guint8 *) rl->input_start;
-  block->real_end = (guint8 *) rl->input_cur;
+  if (hook != NULL)
+  {
+    block->real_begin = real_address;
+    block->real_end = block->real_begin + hook->overwritten_prologue_len;
+  }
+  else
+  {
+    block->real_begin = (guint8 *) rl->input_start;
+    block->real_end = (guint8 *) rl->input_cur;
+  }
 
   gum_exec_block_commit (block);
 
+  if (counting)
+  {
+    gum_spinlock_acquire (&ctx->counted_blocks_lock);
+    block->next_counted = ctx->counted_blocks;
+    ctx->counted_blocks = block;
+    gum_spinlock_release (&ctx->counted_blocks_lock);
+  }
+
+  if (ctx->stalker->code_write_protection)
+  {
+    gum_stalker_protect_code (ctx->stalker, block->real_begin,
+        block->real_end);
+  }
+
   if ((ctx->sink_mask & GUM_COMPILE) != 0)
   {
+    gum_exec_ctx_drain_events (ctx);
+
     ctx->tmp_event.type = GUM_COMPILE;
     ctx->tmp_event.compile.begin = block->real_begin;
     ctx->tmp_event.compile.end = block->real_end;
@@ -1458,6 +4425,160 @@ gum_exec_ctx_obtain_block_for (GumExecCtx * ctx,
   return block;
 }
 
+/*
+ * Backward liveness pass over the straight-line code starting at `code`.
+ * Bit N of the result is set if the status flags are overwritten before
+ * being read by the code following the start of the Nth instruction, in
+ * which case instrumentation placed there can clobber them without saving
+ * and restoring them first. Whatever follows the analyzed range is assumed
+ * to read all of them.
+ */
+static guint64
+gum_exec_ctx_analyze_flags_liveness (GumExecCtx * ctx,
+                                     gconstpointer code)
+{
+  csh capstone = ctx->relocator.capstone;
+  cs_insn * insn;
+  const uint8_t * cur;
+  guint8 reads[GUM_FLAGS_LIVENESS_MAX_INSNS];
+  guint8 writes[GUM_FLAGS_LIVENESS_MAX_INSNS];
+  guint n, live;
+  guint64 dead;
+
+  insn = cs_malloc (capstone);
+
+  cur = code;
+
+  for (n = 0; n != GUM_FLAGS_LIVENESS_MAX_INSNS; n++)
+  {
+    size_t size = 16;
+    uint64_t address = GPOINTER_TO_SIZE (cur);
+
+    if (!cs_disasm_iter (capstone, &cur, &size, &address, insn))
+      break;
+
+    reads[n] = gum_x86_insn_get_flags_read (insn);
+    writes[n] = gum_x86_insn_get_flags_written (insn);
+
+    if (insn->id == X86_INS_CALL || insn->id == X86_INS_JMP ||
+        insn->id == X86_INS_RET || insn->id == X86_INS_RETF ||
+        insn->id == X86_INS_JECXZ || insn->id == X86_INS_JRCXZ ||
+        gum_x86_reader_insn_is_jcc (insn))
+    {
+      n++;
+      break;
+    }
+  }
+
+  cs_free (insn, 1);
+
+  live = GUM_X86_STATUS_FLAGS_ALL;
+  dead = 0;
+
+  while (n != 0)
+  {
+    n--;
+
+    live = (live & ~writes[n]) | reads[n];
+    if (live == 0)
+      dead |= G_GUINT64_CONSTANT (1) << n;
+  }
+
+  return dead;
+}
+
+static guint
+gum_x86_insn_get_flags_read (const cs_insn * insn)
+{
+  static const guint64 flag_reads[] = {
+    X86_EFLAGS_TEST_OF,
+    X86_EFLAGS_TEST_SF,
+    X86_EFLAGS_TEST_ZF,
+    X86_EFLAGS_TEST_AF,
+    X86_EFLAGS_TEST_PF,
+    X86_EFLAGS_TEST_CF,
+  };
+  guint64 eflags = insn->detail->x86.eflags;
+  guint result, i;
+
+  switch (insn->id)
+  {
+    case X86_INS_PUSHF:
+    case X86_INS_PUSHFD:
+    case X86_INS_PUSHFQ:
+    case X86_INS_LAHF:
+    case X86_INS_SYSCALL:
+    case X86_INS_SYSENTER:
+    case X86_INS_INT:
+    case X86_INS_INT3:
+    case X86_INS_INTO:
+      return GUM_X86_STATUS_FLAGS_ALL;
+    default:
+      break;
+  }
+
+  result = 0;
+  for (i = 0; i != G_N_ELEMENTS (flag_reads); i++)
+  {
+    if ((eflags & flag_reads[i]) != 0)
+      result |= 1 << i;
+  }
+
+  return result;
+}
+
+static guint
+gum_x86_insn_get_flags_written (const cs_insn * insn)
+{
+  static const guint64 flag_writes[] = {
+    GUM_X86_EFLAGS_STATUS_WRITE_OF,
+    GUM_X86_EFLAGS_STATUS_WRITE_SF,
+    GUM_X86_EFLAGS_STATUS_WRITE_ZF,
+    GUM_X86_EFLAGS_STATUS_WRITE_AF,
+    GUM_X86_EFLAGS_STATUS_WRITE_PF,
+    GUM_X86_EFLAGS_STATUS_WRITE_CF,
+  };
+  const cs_x86 * x86 = &insn->detail->x86;
+  guint result, i;
+
+  switch (insn->id)
+  {
+    case X86_INS_SHL:
+    case X86_INS_SAL:
+    case X86_INS_SHR:
+    case X86_INS_SAR:
+    case X86_INS_ROL:
+    case X86_INS_ROR:
+    case X86_INS_RCL:
+    case X86_INS_RCR:
+    case X86_INS_SHLD:
+    case X86_INS_SHRD:
+    {
+      const cs_x86_op * count = &x86->operands[x86->op_count - 1];
+
+      /* A zero count leaves the flags untouched */
+      if (x86->op_count >= 2 &&
+          (count->type != X86_OP_IMM || (count->imm & 0x1f) == 0))
+      {
+        return 0;
+      }
+
+      break;
+    }
+    default:
+      break;
+  }
+
+  result = 0;
+  for (i = 0; i != G_N_ELEMENTS (flag_writes); i++)
+  {
+    if ((x86->eflags & flag_writes[i]) != 0)
+      result |= 1 << i;
+  }
+
+  return result;
+}
+
 gboolean
 gum_stalker_iterator_next (GumStalkerIterator * self,
                            const cs_insn ** insn)
@@ -1477,8 +4598,13 @@ gum_stalker_iterator_next (GumStalkerIterator * self,
     if (skip_implicitly_requested)
     {
       gum_x86_relocator_skip_one_no_label (rl);
+
+      /* Our liveness results assumed the original code */
+      gc->dead_flags = 0;
     }
 
+    gc->dead_flags >>= 1;
+
 #if ENABLE_DEBUG
     {
       guint8 * begin = block->code_end;
@@ -1504,8 +4630,10 @@ gum_stalker_iterator_next (GumStalkerIterator * self,
       if (!call_is_to_excluded_range)
         return FALSE;
     }
-    else if (gum_x86_relocator_eob (rl))
+    else if (gum_x86_relocator_eob (rl) &&
+        gc->basic_block_start != instruction->end)
     {
+      /* Unless we're laying out the fall-through block as part of a trace */
       return FALSE;
     }
   }
@@ -1605,7 +4733,21 @@ gum_exec_ctx_emit_call_event (GumExecCtx * ctx,
   call->target = target;
   call->depth = ctx->first_frame - ctx->current_frame;
 
-  ctx->sink_process_impl (ctx->sink, &ev);
+  gum_exec_ctx_emit_event (ctx, &ev);
+}
+
+static void
+gum_exec_ctx_count_call (GumExecCtx * ctx,
+                         gpointer location,
+                         gpointer target)
+{
+  GumCallCountSlot * slot;
+
+  slot = gum_exec_ctx_obtain_call_count (ctx, target);
+  if (slot != NULL)
+    slot->count++;
+  else
+    gum_exec_ctx_emit_call_event (ctx, location, target);
 }
 
 static void
@@ -1621,7 +4763,7 @@ gum_exec_ctx_emit_ret_event (GumExecCtx * ctx,
   ret->target = *((gpointer *) ctx->app_stack);
   ret->depth = ctx->first_frame - ctx->current_frame;
 
-  ctx->sink_process_impl (ctx->sink, &ev);
+  gum_exec_ctx_emit_event (ctx, &ev);
 }
 
 static void
@@ -1635,7 +4777,7 @@ gum_exec_ctx_emit_exec_event (GumExecCtx * ctx,
 
   exec->location = location;
 
-  ctx->sink_process_impl (ctx->sink, &ev);
+  gum_exec_ctx_emit_event (ctx, &ev);
 }
 
 static void
@@ -1651,7 +4793,7 @@ gum_exec_ctx_emit_block_event (GumExecCtx * ctx,
   block->begin = begin;
   block->end = end;
 
-  ctx->sink_process_impl (ctx->sink, &ev);
+  gum_exec_ctx_emit_event (ctx, &ev);
 }
 
 void
@@ -1729,18 +4871,7 @@ gum_exec_ctx_write_prolog (GumExecCtx * ctx,
     }
     case GUM_PROLOG_IC:
     {
-      gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
-          GUM_REG_XSP, -GUM_RED_ZONE_SIZE);
-      gum_x86_writer_put_pushfx (cw);
-      gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
-      gum_x86_writer_put_push_reg (cw, GUM_REG_XBX);
-      gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XBX, GUM_REG_XSP);
-
-      gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XAX, GUM_REG_XSP,
-          3 * sizeof (gpointer) + GUM_RED_ZONE_SIZE);
-      gum_x86_writer_put_mov_near_ptr_reg (cw, GUM_ADDRESS (&ctx->app_stack),
-          GUM_REG_XAX);
-
+      gum_exec_ctx_write_ic_prolog (ctx, TRUE, cw);
       break;
     }
     default:
@@ -1775,12 +4906,7 @@ gum_exec_ctx_write_epilog (GumExecCtx * ctx,
     }
     case GUM_PROLOG_IC:
     {
-      gum_x86_writer_put_pop_reg (cw, GUM_REG_XBX);
-      gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-      gum_x86_writer_put_popfx (cw);
-      gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XSP,
-          GUM_ADDRESS (&ctx->app_stack));
-
+      gum_exec_ctx_write_ic_epilog (ctx, TRUE, cw);
       break;
     }
     default:
@@ -1791,6 +4917,49 @@ gum_exec_ctx_write_epilog (GumExecCtx * ctx,
   }
 }
 
+/*
+ * When the flags are dead we still reserve their slot, so the frame layout
+ * stays the same and registers can be loaded from it like before.
+ */
+static void
+gum_exec_ctx_write_ic_prolog (GumExecCtx * ctx,
+                              gboolean preserve_flags,
+                              GumX86Writer * cw)
+{
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, -GUM_RED_ZONE_SIZE);
+  if (preserve_flags)
+  {
+    gum_x86_writer_put_pushfx (cw);
+  }
+  else
+  {
+    gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+        GUM_REG_XSP, -((gint) sizeof (gpointer)));
+  }
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XBX);
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XBX, GUM_REG_XSP);
+
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XAX, GUM_REG_XSP,
+      3 * sizeof (gpointer) + GUM_RED_ZONE_SIZE);
+  gum_x86_writer_put_mov_near_ptr_reg (cw, GUM_ADDRESS (&ctx->app_stack),
+      GUM_REG_XAX);
+}
+
+static void
+gum_exec_ctx_write_ic_epilog (GumExecCtx * ctx,
+                              gboolean preserve_flags,
+                              GumX86Writer * cw)
+{
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XBX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  if (preserve_flags)
+    gum_x86_writer_put_popfx (cw);
+  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XSP,
+      GUM_ADDRESS (&ctx->app_stack));
+}
+
 static void
 gum_exec_ctx_ensure_inline_helpers_reachable (GumExecCtx * ctx)
 {
@@ -2432,91 +5601,287 @@ gum_exec_ctx_load_real_register_from_ic_frame_into (GumExecCtx * ctx,
   }
   else
   {
-    gum_x86_writer_put_mov_reg_reg (cw, target_register, source_register);
+    gum_x86_writer_put_mov_reg_reg (cw, target_register, source_register);
+  }
+}
+
+static GumExecBlock *
+gum_exec_block_new (GumExecCtx * ctx)
+{
+  GumSlab * slab = ctx->code_slab;
+
+  if (slab->size - slab->offset >= GUM_EXEC_BLOCK_MIN_SIZE)
+  {
+    GumExecBlock * block = (GumExecBlock *) (slab->data + slab->offset);
+
+    block->ctx = ctx;
+    block->slab = slab;
+
+    block->code_begin = GUM_ALIGN_POINTER (guint8 *,
+        slab->data + slab->offset + sizeof (GumExecBlock),
+        GUM_CODE_ALIGNMENT);
+    block->code_end = block->code_begin;
+
+    block->state = GUM_EXEC_NORMAL;
+    block->recycle_count = 0;
+    block->has_call_to_excluded_range = FALSE;
+    block->trace_countdown = ctx->stalker->trace_threshold;
+    block->execution_count = 0;
+    block->next_counted = NULL;
+
+    slab->offset += block->code_begin - (slab->data + slab->offset);
+
+    return block;
+  }
+
+  if (ctx->stalker->trust_threshold < 0)
+  {
+    /* Blocks are never reused, so the ones in this slab are all dead */
+    ctx->code_slab->offset = 0;
+
+    g_atomic_pointer_add (&ctx->stalker->total_code_size,
+        -(gssize) ctx->code_size);
+    ctx->code_size = 0;
+
+    return gum_exec_block_new (ctx);
+  }
+
+  slab = gum_alloc_n_pages (GUM_CODE_SLAB_SIZE_IN_PAGES, GUM_PAGE_RWX);
+  if (counters_enabled)
+    g_atomic_int_add (&total_slab_pages, GUM_CODE_SLAB_SIZE_IN_PAGES);
+  slab->data = (guint8 *) (slab + 1);
+  slab->offset = 0;
+  slab->size = (GUM_CODE_SLAB_SIZE_IN_PAGES * ctx->stalker->page_size)
+      - sizeof (GumSlab);
+  slab->next = ctx->code_slab;
+  ctx->code_slab = slab;
+
+  gum_exec_ctx_ensure_inline_helpers_reachable (ctx);
+
+  return gum_exec_block_new (ctx);
+}
+
+static GumExecBlock *
+gum_exec_block_obtain (GumExecCtx * ctx,
+                       gpointer real_address,
+                       gpointer * code_address)
+{
+  GumExecBlock * block;
+
+  block = gum_metal_hash_table_lookup (ctx->mappings, real_address);
+  if (block != NULL)
+    *code_address = block->code_begin;
+
+  return block;
+}
+
+static gboolean
+gum_exec_block_is_full (GumExecBlock * block)
+{
+  guint8 * slab_end = block->slab->data + block->slab->size;
+  return slab_end - block->code_end < GUM_EXEC_BLOCK_MIN_SIZE;
+}
+
+static void
+gum_exec_block_commit (GumExecBlock * block)
+{
+  guint real_size;
+  guint8 * aligned_end;
+
+  real_size = block->real_end - block->real_begin;
+  block->real_snapshot = block->code_end;
+  memcpy (block->real_snapshot, block->real_begin, real_size);
+  block->slab->offset += real_size;
+
+  aligned_end = GUM_ALIGN_POINTER (guint8 *, block->real_snapshot + real_size,
+      GUM_DATA_ALIGNMENT);
+  block->slab->offset += aligned_end - block->code_begin;
+
+  gum_exec_ctx_account_code (block->ctx, aligned_end - (guint8 *) block);
+
+  if (counters_enabled)
+  {
+    g_atomic_int_add (&total_block_bytes,
+        aligned_end - (guint8 *) block);
+  }
+}
+
+/*
+ * Other blocks may have been backpatched to branch straight to this one, and
+ * inline caches and return continuations may refer to it too. We don't keep
+ * track of these incoming links, so instead of recycling the block we turn
+ * its entry into a forwarder. The first time it is reached we look up (or
+ * compile) its replacement and re-point the forwarder straight at it.
+ */
+static void
+gum_exec_block_invalidate (GumExecBlock * block)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = &ctx->code_writer;
+  gpointer stub;
+
+  stub = gum_exec_ctx_alloc_invalidation_stub (ctx);
+
+  gum_x86_writer_reset (cw, stub);
+
+  gum_exec_ctx_write_prolog (ctx, GUM_PROLOG_MINIMAL, cw);
+  gum_x86_writer_put_call_address_with_aligned_arguments (cw, GUM_CALL_CAPI,
+      GUM_ADDRESS (gum_exec_block_relink_invalidated), 2,
+      GUM_ARG_ADDRESS, GUM_ADDRESS (block),
+      GUM_ARG_ADDRESS, GUM_ADDRESS (stub));
+  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_MINIMAL, cw);
+  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&ctx->resume_at));
+
+  gum_x86_writer_flush (cw);
+  g_assert (gum_x86_writer_offset (cw) <= GUM_INVALIDATION_STUB_SIZE);
+
+  gum_x86_writer_reset (cw, block->code_begin);
+  gum_x86_writer_put_jmp_address (cw, GUM_ADDRESS (stub));
+  gum_x86_writer_flush (cw);
+}
+
+/*
+ * Once the forwarder has been re-pointed, nothing branches to the stub
+ * anymore. We are still executing it though, so it only becomes free for
+ * reuse at the next entrygate.
+ */
+static void
+gum_exec_block_relink_invalidated (GumExecBlock * block,
+                                   gpointer stub)
+{
+  GumExecCtx * ctx = block->ctx;
+  guint generation = ctx->code_generation;
+  GumExecBlock * target;
+  GumX86Writer * cw;
+
+  GUM_ENTRYGATE (invalidated_block) (ctx, block->real_begin);
+
+  target = ctx->current_block;
+  if (ctx->state != GUM_EXEC_CTX_ACTIVE || target == NULL ||
+      target->recycle_count < ctx->stalker->trust_threshold)
+    return;
+
+  cw = &ctx->code_writer;
+  gum_x86_writer_reset (cw, block->code_begin);
+  gum_x86_writer_put_jmp_address (cw, GUM_ADDRESS (target->code_begin));
+  gum_x86_writer_flush (cw);
+
+  /* Unless the entrygate just retired the slab it lives in */
+  if (ctx->code_generation == generation)
+  {
+    *((gpointer *) stub) = ctx->retired_invalidation_stubs;
+    ctx->retired_invalidation_stubs = stub;
   }
 }
 
-static GumExecBlock *
-gum_exec_block_new (GumExecCtx * ctx)
+/*
+ * Invalidation stubs only forward to gum_exec_block_relink_invalidated(), so
+ * they are small and short-lived. Rather than wasting a whole block on each,
+ * we carve them out of the code slab a chunk at a time and keep the free ones
+ * on a list, linked through their first word.
+ */
+static gpointer
+gum_exec_ctx_alloc_invalidation_stub (GumExecCtx * ctx)
 {
-  GumSlab * slab = ctx->code_slab;
+  gpointer stub;
 
-  if (slab->size - slab->offset >= GUM_EXEC_BLOCK_MIN_SIZE)
+  if (ctx->free_invalidation_stubs == NULL)
   {
-    GumExecBlock * block = (GumExecBlock *) (slab->data + slab->offset);
-
-    block->ctx = ctx;
-    block->slab = slab;
-
-    block->code_begin = GUM_ALIGN_POINTER (guint8 *,
-        slab->data + slab->offset + sizeof (GumExecBlock),
-        GUM_CODE_ALIGNMENT);
-    block->code_end = block->code_begin;
-
-    block->state = GUM_EXEC_NORMAL;
-    block->recycle_count = 0;
-    block->has_call_to_excluded_range = FALSE;
+    GumExecBlock * chunk;
+    guint8 * cur;
+    guint i;
 
-    slab->offset += block->code_begin - (slab->data + slab->offset);
+    chunk = gum_exec_block_new (ctx);
 
-    return block;
-  }
+    cur = chunk->code_begin;
+    for (i = 0; i != GUM_INVALIDATION_STUBS_PER_CHUNK; i++)
+    {
+      *((gpointer *) cur) = ctx->free_invalidation_stubs;
+      ctx->free_invalidation_stubs = cur;
 
-  if (ctx->stalker->trust_threshold < 0)
-  {
-    ctx->code_slab->offset = 0;
+      cur += GUM_INVALIDATION_STUB_SIZE;
+    }
 
-    return gum_exec_block_new (ctx);
+    chunk->code_end = cur;
+    chunk->real_begin = NULL;
+    chunk->real_end = NULL;
+    gum_exec_block_commit (chunk);
   }
 
-  slab = gum_alloc_n_pages (GUM_CODE_SLAB_SIZE_IN_PAGES, GUM_PAGE_RWX);
-  slab->data = (guint8 *) (slab + 1);
-  slab->offset = 0;
-  slab->size = (GUM_CODE_SLAB_SIZE_IN_PAGES * ctx->stalker->page_size)
-      - sizeof (GumSlab);
-  slab->next = ctx->code_slab;
-  ctx->code_slab = slab;
-
-  gum_exec_ctx_ensure_inline_helpers_reachable (ctx);
+  stub = ctx->free_invalidation_stubs;
+  ctx->free_invalidation_stubs = *((gpointer *) stub);
 
-  return gum_exec_block_new (ctx);
+  return stub;
 }
 
-static GumExecBlock *
-gum_exec_block_obtain (GumExecCtx * ctx,
-                       gpointer real_address,
-                       gpointer * code_address)
+static void
+gum_exec_ctx_reuse_invalidation_stubs (GumExecCtx * ctx)
 {
-  GumExecBlock * block;
+  gpointer stub, next;
 
-  block = gum_metal_hash_table_lookup (ctx->mappings, real_address);
-  if (block != NULL)
-    *code_address = block->code_begin;
+  for (stub = ctx->retired_invalidation_stubs; stub != NULL; stub = next)
+  {
+    next = *((gpointer *) stub);
 
-  return block;
+    *((gpointer *) stub) = ctx->free_invalidation_stubs;
+    ctx->free_invalidation_stubs = stub;
+  }
+
+  ctx->retired_invalidation_stubs = NULL;
 }
 
 static gboolean
-gum_exec_block_is_full (GumExecBlock * block)
+gum_exec_ctx_may_form_traces (GumExecCtx * ctx)
 {
-  guint8 * slab_end = block->slab->data + block->slab->size;
-  return slab_end - block->code_end < GUM_EXEC_BLOCK_MIN_SIZE;
+  GumStalker * stalker = ctx->stalker;
+
+  /*
+   * Transformers, coverage and block counting expect to see one basic block
+   * at a time.
+   */
+  return stalker->trace_threshold != 0 &&
+      stalker->trust_threshold >= 0 &&
+      stalker->coverage_bitmap == NULL &&
+      !stalker->block_counting &&
+      GUM_IS_DEFAULT_STALKER_TRANSFORMER (ctx->transformer);
 }
 
+/*
+ * Recompiles a hot block as a trace and redirects its head there. We're
+ * called from within the old block, which gets to finish this iteration.
+ */
 static void
-gum_exec_block_commit (GumExecBlock * block)
+gum_exec_block_form_trace (GumExecBlock * block)
 {
-  guint real_size;
-  guint8 * aligned_end;
+  GumExecCtx * ctx = block->ctx;
+  GumExecBlock * trace;
+  gpointer code_address;
+  GumX86Writer * cw;
 
-  real_size = block->real_end - block->real_begin;
-  block->real_snapshot = block->code_end;
-  memcpy (block->real_snapshot, block->real_begin, real_size);
-  block->slab->offset += real_size;
+  block->trace_countdown = G_MAXUINT;
 
-  aligned_end = GUM_ALIGN_POINTER (guint8 *, block->real_snapshot + real_size,
-      GUM_DATA_ALIGNMENT);
-  block->slab->offset += aligned_end - block->code_begin;
+  if (ctx->state != GUM_EXEC_CTX_ACTIVE ||
+      gum_metal_hash_table_lookup (ctx->mappings, block->real_begin) != block)
+  {
+    return;
+  }
+
+  gum_metal_hash_table_remove (ctx->mappings, block->real_begin);
+
+  ctx->compiling_trace = TRUE;
+  trace = gum_exec_ctx_obtain_block_for (ctx, block->real_begin,
+      &code_address);
+  ctx->compiling_trace = FALSE;
+
+  trace->recycle_count = block->recycle_count;
+
+  cw = &ctx->code_writer;
+  gum_x86_writer_reset (cw, block->code_begin);
+  gum_x86_writer_put_jmp_address (cw, GUM_ADDRESS (trace->code_begin));
+  gum_x86_writer_flush (cw);
+
+  if (counters_enabled)
+    g_atomic_int_inc (&total_traces);
 }
 
 static void
@@ -2637,10 +6002,12 @@ gum_exec_block_backpatch_ret (GumExecBlock * block,
 
 static void
 gum_exec_block_backpatch_inline_cache (GumExecBlock * block,
-                                       gpointer * ic_entries)
+                                       GumIcSite * site)
 {
   gboolean just_unfollowed;
   GumExecCtx * ctx;
+  GumIcEntry * entries, * slot;
+  guint i;
 
   just_unfollowed = block == NULL;
   if (just_unfollowed)
@@ -2648,19 +6015,111 @@ gum_exec_block_backpatch_inline_cache (GumExecBlock * block,
 
   ctx = block->ctx;
 
-  if (ctx->state == GUM_EXEC_CTX_ACTIVE &&
-      block->recycle_count >= ctx->stalker->trust_threshold)
-  {
-    guint offset;
+  if (ctx->state != GUM_EXEC_CTX_ACTIVE ||
+      block->recycle_count < ctx->stalker->trust_threshold)
+    return;
 
-    offset = (ic_entries[0] == NULL) ? 0 : 2;
+  site->misses++;
 
-    if (ic_entries[offset + 0] == NULL)
+  entries = (GumIcEntry *) (site + 1);
+  for (i = 0; i != site->n_entries; i++)
+  {
+    if (entries[i].real_start == NULL)
     {
-      ic_entries[offset + 0] = block->real_begin;
-      ic_entries[offset + 1] = block->code_begin;
+      entries[i].code_start = block->code_begin;
+      entries[i].real_start = block->real_begin;
+      return;
     }
   }
+
+  /*
+   * Megamorphic site: once it keeps missing we send its misses through the
+   * per-context hash table before giving up and resolving dynamically.
+   */
+  if (site->miss_handler == site->resolve_address)
+  {
+    if (site->misses < site->n_entries + GUM_IC_MEGAMORPHIC_MISSES)
+      return;
+
+    if (counters_enabled)
+      g_atomic_int_inc (&total_ic_promotions);
+
+    site->miss_handler = gum_exec_ctx_obtain_ic_table_lookup (ctx);
+  }
+
+  slot = &ctx->ic_table[((GPOINTER_TO_SIZE (block->real_begin) >> 4) ^
+      GPOINTER_TO_SIZE (block->real_begin)) & (GUM_IC_TABLE_SIZE - 1)];
+  slot->code_start = block->code_begin;
+  slot->real_start = block->real_begin;
+}
+
+static gpointer
+gum_exec_ctx_obtain_ic_table_lookup (GumExecCtx * ctx)
+{
+  GumExecBlock * block;
+  GumX86Writer * cw = &ctx->code_writer;
+
+  if (ctx->ic_table_lookup != NULL)
+    return ctx->ic_table_lookup;
+
+  if (ctx->ic_table == NULL)
+    ctx->ic_table = g_new0 (GumIcEntry, GUM_IC_TABLE_SIZE);
+
+  block = gum_exec_block_new (ctx);
+
+  gum_x86_writer_reset (cw, block->code_begin);
+  gum_exec_ctx_write_ic_table_lookup (ctx, cw);
+  gum_x86_writer_flush (cw);
+
+  block->code_end = gum_x86_writer_cur (cw);
+  block->real_begin = block->code_begin;
+  block->real_end = block->code_begin;
+  gum_exec_block_commit (block);
+
+  ctx->ic_table_lookup = block->code_begin;
+
+  return ctx->ic_table_lookup;
+}
+
+/*
+ * Entered from an inline cache miss with the IC prolog open and XCX pushed,
+ * XAX pointing at the GumIcSite and XBX holding the branch target.
+ */
+static void
+gum_exec_ctx_write_ic_table_lookup (GumExecCtx * ctx,
+                                    GumX86Writer * cw)
+{
+  gconstpointer miss = cw->code + 1;
+
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
+
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XAX, GUM_REG_XBX);
+  gum_x86_writer_put_shr_reg_u8 (cw, GUM_REG_XAX, 4);
+  gum_x86_writer_put_xor_reg_reg (cw, GUM_REG_XAX, GUM_REG_XBX);
+  gum_x86_writer_put_and_reg_u32 (cw, GUM_REG_XAX, GUM_IC_TABLE_SIZE - 1);
+  gum_x86_writer_put_shl_reg_u8 (cw, GUM_REG_XAX, GUM_IC_ENTRY_SIZE_LOG2);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX,
+      GUM_ADDRESS (ctx->ic_table));
+  gum_x86_writer_put_add_reg_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
+
+  gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw, GUM_REG_XAX,
+      G_STRUCT_OFFSET (GumIcEntry, real_start), GUM_REG_XBX);
+  gum_x86_writer_put_jcc_short_label (cw, X86_INS_JNE, miss, GUM_UNLIKELY);
+
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XAX, GUM_REG_XAX,
+      G_STRUCT_OFFSET (GumIcEntry, code_start));
+  gum_x86_writer_put_mov_near_ptr_reg (cw, GUM_ADDRESS (&ctx->resume_at),
+      GUM_REG_XAX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_inc_reg_ptr (cw, GUM_PTR_DWORD, GUM_REG_XAX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_IC, cw);
+  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&ctx->resume_at));
+
+  gum_x86_writer_put_label (cw, miss);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_jmp_reg_offset_ptr (cw, GUM_REG_XAX,
+      G_STRUCT_OFFSET (GumIcSite, resolve_address));
 }
 
 static GumVirtualizationRequirements
@@ -2736,7 +6195,12 @@ gum_exec_block_virtualize_branch_insn (GumExecBlock * block,
   {
     gboolean target_is_excluded = FALSE;
 
-    if ((block->ctx->sink_mask & GUM_CALL) != 0)
+    if (block->ctx->call_counts != NULL)
+    {
+      gum_exec_block_write_call_count_code (block, &target, gc,
+          GUM_CODE_INTERRUPTIBLE);
+    }
+    else if ((block->ctx->sink_mask & GUM_CALL) != 0)
     {
       gum_exec_block_write_call_event_code (block, &target, gc,
           GUM_CODE_INTERRUPTIBLE);
@@ -2745,21 +6209,15 @@ gum_exec_block_virtualize_branch_insn (GumExecBlock * block,
     if (block->ctx->stalker->any_probes_attached)
       gum_exec_block_write_call_probe_code (block, &target, gc);
 
-    if (!target.is_indirect && target.base == X86_REG_INVALID)
+    /*
+     * In inclusive mode we hand over through leave_for_native() instead, so
+     * native code never runs with our code's return addresses beneath it.
+     */
+    if (!target.is_indirect && target.base == X86_REG_INVALID &&
+        !block->ctx->stalker->any_inclusions)
     {
-      GArray * exclusions = block->ctx->stalker->exclusions;
-      guint i;
-
-      for (i = 0; i != exclusions->len; i++)
-      {
-        GumMemoryRange * r = &g_array_index (exclusions, GumMemoryRange, i);
-        if (GUM_MEMORY_RANGE_INCLUDES (r,
-            GUM_ADDRESS (target.absolute_address)))
-        {
-          target_is_excluded = TRUE;
-          break;
-        }
-      }
+      target_is_excluded = gum_stalker_is_excluding (block->ctx->stalker,
+          target.absolute_address);
     }
 
     if (target_is_excluded)
@@ -2814,6 +6272,12 @@ gum_exec_block_virtualize_branch_insn (GumExecBlock * block,
 
       gum_exec_block_close_prolog (block, gc);
 
+      if (!block->ctx->compiling_trace &&
+          gum_exec_ctx_may_form_traces (block->ctx))
+      {
+        gum_exec_block_write_trace_countdown_code (block, gc);
+      }
+
       gum_x86_writer_put_jcc_near_label (cw, gum_negate_jcc (insn->ci->id),
           is_false, GUM_NO_HINT);
     }
@@ -2839,14 +6303,27 @@ gum_exec_block_virtualize_branch_insn (GumExecBlock * block,
 
     if (is_conditional)
     {
-      GumBranchTarget cond_target = { 0, };
+      gum_x86_writer_put_label (cw, is_false);
+
+      if (gc->trace_blocks_left != 0)
+      {
+        /*
+         * Fall through into the next block, which turns the transfer above
+         * into a side exit.
+         */
+        gc->trace_blocks_left--;
+        gc->basic_block_start = insn->end;
+      }
+      else
+      {
+        GumBranchTarget cond_target = { 0, };
 
-      cond_target.is_indirect = FALSE;
-      cond_target.absolute_address = insn->end;
+        cond_target.is_indirect = FALSE;
+        cond_target.absolute_address = insn->end;
 
-      gum_x86_writer_put_label (cw, is_false);
-      gum_exec_block_write_jmp_transfer_code (block, &cond_target,
-          cond_entry_func, gc);
+        gum_exec_block_write_jmp_transfer_code (block, &cond_target,
+            cond_entry_func, gc);
+      }
     }
   }
 
@@ -2973,6 +6450,79 @@ gum_exec_block_virtualize_wow64_transition (GumExecBlock * block,
 
 #endif
 
+/*
+ * Expects the IC prolog to be open. Leaves it closed, with the code that
+ * follows being the slow path taken on a miss.
+ */
+static GumIcSite *
+gum_exec_block_write_inline_cache_code (GumExecBlock * block,
+                                        const GumBranchTarget * target,
+                                        GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer look_in_cache = cw->code + 1;
+  gconstpointer next_entry = cw->code + 2;
+  gconstpointer found = cw->code + 3;
+  gpointer null_ptr = NULL;
+  GumIcSite * site;
+  guint n_entries, size, i;
+
+  n_entries = ctx->stalker->ic_entries;
+  size = sizeof (GumIcSite) + ((n_entries + 1) * sizeof (GumIcEntry));
+
+  gum_x86_writer_put_jmp_near_label (cw, look_in_cache);
+
+  while (GPOINTER_TO_SIZE (gum_x86_writer_cur (cw)) % sizeof (gpointer) != 0)
+    gum_x86_writer_put_breakpoint (cw);
+
+  site = gum_x86_writer_cur (cw);
+  for (i = 0; i != size; i += sizeof (gpointer))
+    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
+
+  gum_x86_writer_put_label (cw, look_in_cache);
+
+  gum_exec_ctx_write_push_branch_target_address (ctx, target, gc);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XBX);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
+
+  /* The entries are filled in order and always end with an empty one */
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+      GUM_ADDRESS (site + 1));
+  gum_x86_writer_put_label (cw, next_entry);
+  gum_x86_writer_put_mov_reg_reg_ptr (cw, GUM_REG_XCX, GUM_REG_XAX);
+  gum_x86_writer_put_cmp_reg_reg (cw, GUM_REG_XCX, GUM_REG_XBX);
+  gum_x86_writer_put_jcc_short_label (cw, X86_INS_JE, found, GUM_LIKELY);
+  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XAX, sizeof (GumIcEntry));
+  gum_x86_writer_put_test_reg_reg (cw, GUM_REG_XCX, GUM_REG_XCX);
+  gum_x86_writer_put_jcc_short_label (cw, X86_INS_JNE, next_entry,
+      GUM_LIKELY);
+
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX, GUM_ADDRESS (site));
+  gum_x86_writer_put_jmp_reg_offset_ptr (cw, GUM_REG_XAX,
+      G_STRUCT_OFFSET (GumIcSite, miss_handler));
+
+  gum_x86_writer_put_label (cw, found);
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XAX, GUM_REG_XAX,
+      G_STRUCT_OFFSET (GumIcEntry, code_start));
+  gum_x86_writer_put_mov_near_ptr_reg (cw, GUM_ADDRESS (&ctx->resume_at),
+      GUM_REG_XAX);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX, GUM_ADDRESS (site));
+  gum_x86_writer_put_inc_reg_ptr (cw, GUM_PTR_DWORD, GUM_REG_XAX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_IC, cw);
+  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&ctx->resume_at));
+
+  site->n_entries = n_entries;
+  site->resolve_address = gum_x86_writer_cur (cw);
+  site->miss_handler = site->resolve_address;
+
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_exec_block_close_prolog (block, gc);
+
+  return site;
+}
+
 static void
 gum_exec_block_write_call_invoke_code (GumExecBlock * block,
                                        const GumBranchTarget * target,
@@ -2982,14 +6532,11 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
   gpointer call_code_start;
   GumPrologType opened_prolog;
   gboolean can_backpatch_statically;
-  gpointer * ic_entries = NULL;
+  GumIcSite * ic_site = NULL;
   GumExecCtxReplaceCurrentBlockFunc entry_func;
   gconstpointer push_application_retaddr = cw->code + 1;
   gconstpointer perform_stack_push = cw->code + 2;
-  gconstpointer look_in_cache = cw->code + 3;
-  gconstpointer try_second = cw->code + 4;
-  gconstpointer resolve_dynamically = cw->code + 5;
-  gconstpointer beach = cw->code + 6;
+  gconstpointer beach = cw->code + 3;
   gpointer ret_real_address, ret_code_address;
 
   call_code_start = cw->code;
@@ -3002,10 +6549,6 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
   if (block->ctx->stalker->trust_threshold >= 0 &&
       !can_backpatch_statically)
   {
-    gpointer null_ptr = NULL;
-    gpointer ic1_real, ic1_code;
-    gpointer ic2_real, ic2_code;
-
     if (opened_prolog == GUM_PROLOG_NONE)
     {
       gum_exec_block_open_prolog (block, GUM_PROLOG_IC, gc);
@@ -3030,49 +6573,12 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
       gc->accumulated_stack_delta += sizeof (gpointer);
     }
 
-    gum_x86_writer_put_jmp_short_label (cw, look_in_cache);
-
-    ic_entries = gum_x86_writer_cur (cw);
-    ic1_real = ic_entries;
-    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
-    ic1_code = gum_x86_writer_cur (cw);
-    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
-    ic2_real = gum_x86_writer_cur (cw);
-    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
-    ic2_code = gum_x86_writer_cur (cw);
-    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
-
-    gum_x86_writer_put_label (cw, look_in_cache);
-
-    gum_exec_ctx_write_push_branch_target_address (block->ctx, target, gc);
-
-    gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-        GUM_ADDRESS (ic1_real));
-    gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw, GUM_REG_XSP, 0, GUM_REG_XAX);
-    gum_x86_writer_put_jcc_short_label (cw, X86_INS_JNE, try_second,
-        GUM_NO_HINT);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-    gum_exec_ctx_write_epilog (block->ctx, GUM_PROLOG_IC, cw);
-    gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (ic1_code));
-
-    gum_x86_writer_put_label (cw, try_second);
-    gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-        GUM_ADDRESS (ic2_real));
-    gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw, GUM_REG_XSP, 0, GUM_REG_XAX);
-    gum_x86_writer_put_jcc_short_label (cw, X86_INS_JNE, resolve_dynamically,
-        GUM_NO_HINT);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-    gum_exec_ctx_write_epilog (block->ctx, GUM_PROLOG_IC, cw);
-    gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (ic2_code));
-
-    gum_x86_writer_put_label (cw, resolve_dynamically);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-    gum_exec_block_close_prolog (block, gc);
+    ic_site = gum_exec_block_write_inline_cache_code (block, target, gc);
   }
 
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
 
-  if (ic_entries == NULL)
+  if (ic_site == NULL)
   {
     gum_x86_writer_put_call_near_label (cw, push_application_retaddr);
 
@@ -3176,12 +6682,12 @@ gum_exec_block_write_call_invoke_code (GumExecBlock * block,
         GUM_ARG_ADDRESS, GUM_ADDRESS (ret_code_address));
   }
 
-  if (ic_entries != NULL)
+  if (ic_site != NULL)
   {
     gum_x86_writer_put_call_address_with_aligned_arguments (cw, GUM_CALL_CAPI,
         GUM_ADDRESS (gum_exec_block_backpatch_inline_cache), 2,
         GUM_ARG_REGISTER, GUM_REG_XAX,
-        GUM_ARG_ADDRESS, GUM_ADDRESS (ic_entries));
+        GUM_ARG_ADDRESS, GUM_ADDRESS (ic_site));
   }
 
   /* Execute the generated code */
@@ -3200,10 +6706,7 @@ gum_exec_block_write_jmp_transfer_code (GumExecBlock * block,
   guint8 * code_start;
   GumPrologType opened_prolog;
   gboolean can_backpatch_statically;
-  gpointer * ic_entries = NULL;
-  gconstpointer look_in_cache = cw->code + 1;
-  gconstpointer try_second = cw->code + 2;
-  gconstpointer resolve_dynamically = cw->code + 3;
+  GumIcSite * ic_site = NULL;
 
   code_start = cw->code;
   opened_prolog = gc->opened_prolog;
@@ -3215,51 +6718,10 @@ gum_exec_block_write_jmp_transfer_code (GumExecBlock * block,
   if (block->ctx->stalker->trust_threshold >= 0 &&
       !can_backpatch_statically)
   {
-    gpointer null_ptr = NULL;
-    gpointer ic1_real, ic1_code;
-    gpointer ic2_real, ic2_code;
-
     gum_exec_block_close_prolog (block, gc);
-
-    gum_x86_writer_put_jmp_short_label (cw, look_in_cache);
-
-    ic_entries = gum_x86_writer_cur (cw);
-    ic1_real = ic_entries;
-    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
-    ic1_code = gum_x86_writer_cur (cw);
-    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
-    ic2_real = gum_x86_writer_cur (cw);
-    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
-    ic2_code = gum_x86_writer_cur (cw);
-    gum_x86_writer_put_bytes (cw, (guint8 *) &null_ptr, sizeof (null_ptr));
-
-    gum_x86_writer_put_label (cw, look_in_cache);
     gum_exec_block_open_prolog (block, GUM_PROLOG_IC, gc);
 
-    gum_exec_ctx_write_push_branch_target_address (block->ctx, target, gc);
-
-    gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-        GUM_ADDRESS (ic1_real));
-    gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw, GUM_REG_XSP, 0, GUM_REG_XAX);
-    gum_x86_writer_put_jcc_short_label (cw, X86_INS_JNE, try_second,
-        GUM_NO_HINT);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-    gum_exec_ctx_write_epilog (block->ctx, GUM_PROLOG_IC, cw);
-    gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (ic1_code));
-
-    gum_x86_writer_put_label (cw, try_second);
-    gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
-        GUM_ADDRESS (ic2_real));
-    gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw, GUM_REG_XSP, 0, GUM_REG_XAX);
-    gum_x86_writer_put_jcc_short_label (cw, X86_INS_JNE, resolve_dynamically,
-        GUM_NO_HINT);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-    gum_exec_ctx_write_epilog (block->ctx, GUM_PROLOG_IC, cw);
-    gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (ic2_code));
-
-    gum_x86_writer_put_label (cw, resolve_dynamically);
-    gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
-    gum_exec_block_close_prolog (block, gc);
+    ic_site = gum_exec_block_write_inline_cache_code (block, target, gc);
   }
 
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
@@ -3290,12 +6752,12 @@ gum_exec_block_write_jmp_transfer_code (GumExecBlock * block,
         GUM_ARG_ADDRESS, GUM_ADDRESS (opened_prolog));
   }
 
-  if (ic_entries != NULL)
+  if (ic_site != NULL)
   {
     gum_x86_writer_put_call_address_with_aligned_arguments (cw, GUM_CALL_CAPI,
         GUM_ADDRESS (gum_exec_block_backpatch_inline_cache), 2,
         GUM_ARG_REGISTER, GUM_REG_XAX,
-        GUM_ARG_ADDRESS, GUM_ADDRESS (ic_entries));
+        GUM_ARG_ADDRESS, GUM_ADDRESS (ic_site));
   }
 
   gum_exec_block_close_prolog (block, gc);
@@ -3303,16 +6765,69 @@ gum_exec_block_write_jmp_transfer_code (GumExecBlock * block,
   gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&block->ctx->resume_at));
 }
 
-static void
-gum_exec_block_write_ret_transfer_code (GumExecBlock * block,
-                                        GumGeneratorContext * gc)
-{
-  GumX86Writer * cw = gc->code_writer;
+static void
+gum_exec_block_write_ret_transfer_code (GumExecBlock * block,
+                                        GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+  cs_x86 * x86 = &gc->instruction->ci->detail->x86;
+  gconstpointer resolve_dynamically = cw->code + 1;
+  guint stack_delta = GUM_RED_ZONE_SIZE + 3 * sizeof (gpointer);
+  guint n_pop_bytes = 0;
+
+  gum_exec_block_close_prolog (block, gc);
+
+  if (x86->op_count != 0)
+    n_pop_bytes = x86->operands[0].imm;
+
+  /*
+   * Fast path: the return address matches the frame at the top of our
+   * shadow stack, so we can go straight to the translated code without
+   * taking the detour through the pop-and-go helper and the original ret.
+   */
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, -GUM_RED_ZONE_SIZE);
+  gum_x86_writer_put_pushfx (cw);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
+
+  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
+      GUM_ADDRESS (&ctx->current_frame));
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XCX,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumExecFrame, real_address));
+  gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw,
+      GUM_REG_XSP, stack_delta,
+      GUM_REG_XCX);
+  gum_x86_writer_put_jcc_short_label (cw, X86_INS_JNE,
+      resolve_dynamically, GUM_UNLIKELY);
+
+  gum_x86_writer_put_mov_reg_reg_offset_ptr (cw, GUM_REG_XCX,
+      GUM_REG_XAX, G_STRUCT_OFFSET (GumExecFrame, code_address));
+  gum_x86_writer_put_mov_near_ptr_reg (cw,
+      GUM_ADDRESS (&ctx->return_at), GUM_REG_XCX);
+
+  /* Pop from our stack */
+  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XAX, sizeof (GumExecFrame));
+  gum_x86_writer_put_mov_near_ptr_reg (cw,
+      GUM_ADDRESS (&ctx->current_frame), GUM_REG_XAX);
 
-  gum_exec_block_close_prolog (block, gc);
+  /* Perform the ret ourselves */
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_popfx (cw);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP, GUM_REG_XSP,
+      GUM_RED_ZONE_SIZE + sizeof (gpointer) + n_pop_bytes);
+  gum_x86_writer_put_jmp_near_ptr (cw, GUM_ADDRESS (&ctx->return_at));
+
+  /*
+   * Slow path: let the helper resync our stack and resolve the target
+   */
+  gum_x86_writer_put_label (cw, resolve_dynamically);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_popfx (cw);
 
-  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
-      GUM_REG_XSP, -GUM_RED_ZONE_SIZE);
   gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
   gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX,
       GUM_ADDRESS (gc->instruction->begin));
@@ -3432,6 +6947,11 @@ gum_exec_block_write_call_event_code (GumExecBlock * block,
                                       GumCodeContext cc)
 {
   GumX86Writer * cw = gc->code_writer;
+  gconstpointer beach = cw->code + 1;
+  gboolean buffered;
+
+  buffered = gum_exec_block_write_buffered_event_code (block, GUM_CALL, target,
+      beach, gc);
 
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
 
@@ -3445,6 +6965,135 @@ gum_exec_block_write_call_event_code (GumExecBlock * block,
       GUM_ARG_REGISTER, GUM_REG_XDX);
 
   gum_exec_block_write_unfollow_check_code (block, gc, cc);
+
+  if (buffered)
+  {
+    gum_exec_block_close_prolog (block, gc);
+    gum_x86_writer_put_label (cw, beach);
+  }
+}
+
+/*
+ * Bumps the call-summary counter of the call's target. Direct calls have
+ * their slot resolved right here and get a flag-free increment. The table
+ * lives on the heap, possibly out of RIP-relative reach, so the slot is
+ * addressed through a register. Indirect calls probe the table inline, only
+ * dropping into C for targets not seen before.
+ */
+static void
+gum_exec_block_write_call_count_code (GumExecBlock * block,
+                                      const GumBranchTarget * target,
+                                      GumGeneratorContext * gc,
+                                      GumCodeContext cc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer probe = cw->code + 1;
+  gconstpointer hit = cw->code + 2;
+  gconstpointer miss = cw->code + 3;
+  gconstpointer beach = cw->code + 4;
+  const guint slot_shift = g_bit_nth_lsf (sizeof (GumCallCountSlot), -1);
+  const guint32 offset_mask = (GUM_CALL_COUNTS_CAPACITY - 1) << slot_shift;
+  gboolean inline_probe, preserve_flags;
+
+  if (!target->is_indirect && target->base == X86_REG_INVALID)
+  {
+    GumCallCountSlot * slot;
+
+    slot = gum_exec_ctx_obtain_call_count (ctx, target->absolute_address);
+    if (slot != NULL)
+    {
+      GumAddress count = GUM_ADDRESS (&slot->count);
+
+      gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+          GUM_REG_XSP, -GUM_RED_ZONE_SIZE);
+      gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
+      gum_x86_writer_put_push_reg (cw, GUM_REG_XDX);
+      gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX, count);
+      gum_x86_writer_put_mov_reg_reg_ptr (cw, GUM_REG_XDX, GUM_REG_XCX);
+      gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XDX, GUM_REG_XDX, 1);
+      gum_x86_writer_put_mov_reg_ptr_reg (cw, GUM_REG_XCX, GUM_REG_XDX);
+      gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+      gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+      gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+          GUM_REG_XSP, GUM_RED_ZONE_SIZE);
+
+      return;
+    }
+  }
+
+  inline_probe = gc->opened_prolog == GUM_PROLOG_NONE;
+  if (inline_probe)
+  {
+    preserve_flags = (gc->dead_flags & 1) == 0;
+
+    gum_exec_ctx_write_ic_prolog (ctx, preserve_flags, cw);
+    gc->opened_prolog = GUM_PROLOG_IC;
+    gc->accumulated_stack_delta = 0;
+    gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
+    gum_x86_writer_put_push_reg (cw, GUM_REG_XDX);
+
+    gum_exec_ctx_write_push_branch_target_address (ctx, target, gc);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+
+    /* Same hash as gum_exec_ctx_obtain_call_count(), as a byte offset */
+    gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XCX, GUM_REG_XDX);
+    gum_x86_writer_put_shr_reg_u8 (cw, GUM_REG_XCX, 4);
+    gum_x86_writer_put_shl_reg_u8 (cw, GUM_REG_XCX, slot_shift);
+    gum_x86_writer_put_and_reg_u32 (cw, GUM_REG_XCX, offset_mask);
+
+    gum_x86_writer_put_label (cw, probe);
+    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+        GUM_ADDRESS (ctx->call_counts));
+    gum_x86_writer_put_add_reg_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
+    gum_x86_writer_put_cmp_reg_offset_ptr_reg (cw, GUM_REG_XAX,
+        G_STRUCT_OFFSET (GumCallCountSlot, target), GUM_REG_XDX);
+    gum_x86_writer_put_jcc_short_label (cw, X86_INS_JE, hit, GUM_LIKELY);
+    gum_x86_writer_put_mov_reg_reg_ptr (cw, GUM_REG_XAX, GUM_REG_XAX);
+    gum_x86_writer_put_test_reg_reg (cw, GUM_REG_XAX, GUM_REG_XAX);
+    gum_x86_writer_put_jcc_short_label (cw, X86_INS_JE, miss, GUM_UNLIKELY);
+    gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XCX,
+        sizeof (GumCallCountSlot));
+    gum_x86_writer_put_and_reg_u32 (cw, GUM_REG_XCX, offset_mask);
+    gum_x86_writer_put_jmp_short_label (cw, probe);
+
+    gum_x86_writer_put_label (cw, hit);
+    gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XAX,
+        G_STRUCT_OFFSET (GumCallCountSlot, count));
+    gum_x86_writer_put_inc_reg_ptr (cw,
+        (GLIB_SIZEOF_VOID_P == 8) ? GUM_PTR_QWORD : GUM_PTR_DWORD,
+        GUM_REG_XAX);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+    gum_exec_ctx_write_ic_epilog (ctx, preserve_flags, cw);
+    gum_x86_writer_put_jmp_near_label (cw, beach);
+
+    gum_x86_writer_put_label (cw, miss);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+    gum_exec_ctx_write_ic_epilog (ctx, preserve_flags, cw);
+    gc->accumulated_stack_delta = 0;
+    gc->opened_prolog = GUM_PROLOG_NONE;
+  }
+
+  gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
+
+  gum_exec_ctx_write_push_branch_target_address (ctx, target, gc);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+
+  gum_x86_writer_put_call_address_with_aligned_arguments (cw, GUM_CALL_CAPI,
+      GUM_ADDRESS (gum_exec_ctx_count_call), 3,
+      GUM_ARG_ADDRESS, GUM_ADDRESS (ctx),
+      GUM_ARG_ADDRESS, GUM_ADDRESS (gc->instruction->begin),
+      GUM_ARG_REGISTER, GUM_REG_XDX);
+
+  gum_exec_block_write_unfollow_check_code (block, gc, cc);
+
+  if (inline_probe)
+  {
+    gum_exec_block_close_prolog (block, gc);
+    gum_x86_writer_put_label (cw, beach);
+  }
 }
 
 static void
@@ -3452,14 +7101,27 @@ gum_exec_block_write_ret_event_code (GumExecBlock * block,
                                      GumGeneratorContext * gc,
                                      GumCodeContext cc)
 {
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer beach = cw->code + 1;
+  gboolean buffered;
+
+  buffered = gum_exec_block_write_buffered_event_code (block, GUM_RET, NULL,
+      beach, gc);
+
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
 
-  gum_x86_writer_put_call_address_with_aligned_arguments (gc->code_writer,
+  gum_x86_writer_put_call_address_with_aligned_arguments (cw,
       GUM_CALL_CAPI, GUM_ADDRESS (gum_exec_ctx_emit_ret_event), 2,
       GUM_ARG_ADDRESS, GUM_ADDRESS (block->ctx),
       GUM_ARG_ADDRESS, GUM_ADDRESS (gc->instruction->begin));
 
   gum_exec_block_write_unfollow_check_code (block, gc, cc);
+
+  if (buffered)
+  {
+    gum_exec_block_close_prolog (block, gc);
+    gum_x86_writer_put_label (cw, beach);
+  }
 }
 
 static void
@@ -3467,14 +7129,27 @@ gum_exec_block_write_exec_event_code (GumExecBlock * block,
                                       GumGeneratorContext * gc,
                                       GumCodeContext cc)
 {
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer beach = cw->code + 1;
+  gboolean buffered;
+
+  buffered = gum_exec_block_write_buffered_event_code (block, GUM_EXEC, NULL,
+      beach, gc);
+
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
 
-  gum_x86_writer_put_call_address_with_aligned_arguments (gc->code_writer,
+  gum_x86_writer_put_call_address_with_aligned_arguments (cw,
       GUM_CALL_CAPI, GUM_ADDRESS (gum_exec_ctx_emit_exec_event), 2,
       GUM_ARG_ADDRESS, GUM_ADDRESS (block->ctx),
       GUM_ARG_ADDRESS, GUM_ADDRESS (gc->instruction->begin));
 
   gum_exec_block_write_unfollow_check_code (block, gc, cc);
+
+  if (buffered)
+  {
+    gum_exec_block_close_prolog (block, gc);
+    gum_x86_writer_put_label (cw, beach);
+  }
 }
 
 static void
@@ -3482,15 +7157,146 @@ gum_exec_block_write_block_event_code (GumExecBlock * block,
                                        GumGeneratorContext * gc,
                                        GumCodeContext cc)
 {
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer beach = cw->code + 1;
+  gboolean buffered;
+
+  buffered = gum_exec_block_write_buffered_event_code (block, GUM_BLOCK, NULL,
+      beach, gc);
+
   gum_exec_block_open_prolog (block, GUM_PROLOG_MINIMAL, gc);
 
-  gum_x86_writer_put_call_address_with_aligned_arguments (gc->code_writer,
+  gum_x86_writer_put_call_address_with_aligned_arguments (cw,
       GUM_CALL_CAPI, GUM_ADDRESS (gum_exec_ctx_emit_block_event), 3,
       GUM_ARG_ADDRESS, GUM_ADDRESS (block->ctx),
-      GUM_ARG_ADDRESS, GUM_ADDRESS (gc->relocator->input_start),
+      GUM_ARG_ADDRESS, GUM_ADDRESS (gc->basic_block_start),
       GUM_ARG_ADDRESS, GUM_ADDRESS (gc->relocator->input_cur));
 
   gum_exec_block_write_unfollow_check_code (block, gc, cc);
+
+  if (buffered)
+  {
+    gum_exec_block_close_prolog (block, gc);
+    gum_x86_writer_put_label (cw, beach);
+  }
+}
+
+/*
+ * Appends the event straight to the per-thread event buffer, only falling
+ * back to the C path when the buffer is full. Returns FALSE without writing
+ * anything if buffering isn't possible here, in which case the caller should
+ * just emit the C path. Otherwise the fast path jumps to `beach`, and the
+ * caller is expected to emit the C path followed by the `beach` label.
+ */
+static gboolean
+gum_exec_block_write_buffered_event_code (GumExecBlock * block,
+                                          GumEventType type,
+                                          const GumBranchTarget * target,
+                                          gconstpointer beach,
+                                          GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer buffer_full = cw->code + 2;
+  gpointer location, end;
+  gboolean preserve_flags;
+
+  if (ctx->event_buffer == NULL || gc->opened_prolog != GUM_PROLOG_NONE)
+    return FALSE;
+
+  if (type == GUM_BLOCK)
+  {
+    location = gc->basic_block_start;
+    end = gc->relocator->input_cur;
+  }
+  else
+  {
+    location = gc->instruction->begin;
+    end = NULL;
+  }
+
+  preserve_flags = (gc->dead_flags & 1) == 0;
+
+  gum_exec_ctx_write_ic_prolog (ctx, preserve_flags, cw);
+  gc->opened_prolog = GUM_PROLOG_IC;
+  gc->accumulated_stack_delta = 0;
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XDX);
+
+  if (type == GUM_CALL)
+  {
+    gum_exec_ctx_write_push_branch_target_address (ctx, target, gc);
+    gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+  }
+  else if (type == GUM_RET)
+  {
+    gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XDX,
+        GUM_ADDRESS (&ctx->app_stack));
+    gum_x86_writer_put_mov_reg_reg_ptr (cw, GUM_REG_XDX, GUM_REG_XDX);
+  }
+
+  /* Reserve a slot, or take the slow path if the consumer is behind */
+  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XCX,
+      GUM_ADDRESS (&ctx->event_buffer_head));
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
+  gum_x86_writer_put_sub_reg_near_ptr (cw, GUM_REG_XAX,
+      GUM_ADDRESS (&ctx->event_buffer_tail));
+  gum_x86_writer_put_cmp_reg_i32 (cw, GUM_REG_XAX, ctx->event_buffer_size);
+  gum_x86_writer_put_jcc_near_label (cw, X86_INS_JAE, buffer_full,
+      GUM_UNLIKELY);
+  gum_x86_writer_put_and_reg_u32 (cw, GUM_REG_XCX,
+      ctx->event_buffer_size - 1);
+  gum_x86_writer_put_add_reg_near_ptr (cw, GUM_REG_XCX,
+      GUM_ADDRESS (&ctx->event_buffer));
+
+  /* Fill it in */
+  gum_x86_writer_put_mov_reg_offset_ptr_u32 (cw, GUM_REG_XCX,
+      G_STRUCT_OFFSET (GumAnyEvent, type), type);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX, GUM_ADDRESS (location));
+  gum_x86_writer_put_mov_reg_offset_ptr_reg (cw, GUM_REG_XCX,
+      G_STRUCT_OFFSET (GumCallEvent, location), GUM_REG_XAX);
+
+  if (type == GUM_BLOCK)
+  {
+    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX, GUM_ADDRESS (end));
+    gum_x86_writer_put_mov_reg_offset_ptr_reg (cw, GUM_REG_XCX,
+        G_STRUCT_OFFSET (GumBlockEvent, end), GUM_REG_XAX);
+  }
+  else if (type == GUM_CALL || type == GUM_RET)
+  {
+    gum_x86_writer_put_mov_reg_offset_ptr_reg (cw, GUM_REG_XCX,
+        G_STRUCT_OFFSET (GumCallEvent, target), GUM_REG_XDX);
+
+    gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX,
+        GUM_ADDRESS (ctx->first_frame));
+    gum_x86_writer_put_sub_reg_near_ptr (cw, GUM_REG_XAX,
+        GUM_ADDRESS (&ctx->current_frame));
+    gum_x86_writer_put_shr_reg_u8 (cw, GUM_REG_XAX,
+        g_bit_nth_lsf (sizeof (GumExecFrame), -1));
+    gum_x86_writer_put_mov_reg_offset_ptr_reg (cw, GUM_REG_XCX,
+        G_STRUCT_OFFSET (GumCallEvent, depth), GUM_REG_EAX);
+  }
+
+  /* Publish it */
+  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
+      GUM_ADDRESS (&ctx->event_buffer_head));
+  gum_x86_writer_put_add_reg_imm (cw, GUM_REG_XAX, sizeof (GumEvent));
+  gum_x86_writer_put_mov_near_ptr_reg (cw,
+      GUM_ADDRESS (&ctx->event_buffer_head), GUM_REG_XAX);
+
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_exec_ctx_write_ic_epilog (ctx, preserve_flags, cw);
+  gum_x86_writer_put_jmp_near_label (cw, beach);
+
+  gum_x86_writer_put_label (cw, buffer_full);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XDX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_exec_ctx_write_ic_epilog (ctx, preserve_flags, cw);
+  gc->accumulated_stack_delta = 0;
+  gc->opened_prolog = GUM_PROLOG_NONE;
+
+  return TRUE;
 }
 
 static void
@@ -3523,6 +7329,54 @@ gum_exec_block_write_unfollow_check_code (GumExecBlock * block,
   gum_x86_writer_put_label (cw, beach);
 }
 
+/*
+ * AFL-style edge coverage: bitmap[prev_loc ^ cur_loc]++, prev_loc = cur_loc
+ * >> 1, where cur_loc is derived from the block's address at compile time.
+ */
+static void
+gum_exec_block_write_coverage_code (GumExecBlock * block,
+                                    GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumStalker * stalker = ctx->stalker;
+  GumX86Writer * cw = gc->code_writer;
+  gsize location, cur_loc;
+  gboolean flags_are_dead;
+
+  location = GPOINTER_TO_SIZE (gc->relocator->input_start);
+  cur_loc = ((location >> 4) ^ (location << 8)) &
+      (stalker->coverage_bitmap_size - 1);
+
+  flags_are_dead = (gc->dead_flags & 1) != 0;
+
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, -GUM_RED_ZONE_SIZE);
+  if (!flags_are_dead)
+    gum_x86_writer_put_pushfx (cw);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XAX);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
+
+  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XAX,
+      GUM_ADDRESS (&ctx->coverage_prev_loc));
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX, cur_loc);
+  gum_x86_writer_put_xor_reg_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XCX,
+      GUM_ADDRESS (stalker->coverage_bitmap));
+  gum_x86_writer_put_add_reg_reg (cw, GUM_REG_XAX, GUM_REG_XCX);
+  gum_x86_writer_put_inc_reg_ptr (cw, GUM_PTR_BYTE, GUM_REG_XAX);
+
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX, cur_loc >> 1);
+  gum_x86_writer_put_mov_near_ptr_reg (cw,
+      GUM_ADDRESS (&ctx->coverage_prev_loc), GUM_REG_XAX);
+
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XAX);
+  if (!flags_are_dead)
+    gum_x86_writer_put_popfx (cw);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, GUM_RED_ZONE_SIZE);
+}
+
 static void
 gum_exec_block_invoke_call_probes_for_target (GumExecBlock * block,
                                               gpointer location,
@@ -3631,6 +7485,91 @@ gum_exec_block_close_prolog (GumExecBlock * block,
   gc->opened_prolog = GUM_PROLOG_NONE;
 }
 
+/*
+ * Bumps the block's 64-bit execution counter using nothing but moves and lea,
+ * so the flags are left alone. Only the thread owning the block writes to it.
+ */
+static void
+gum_exec_block_write_execution_count_code (GumExecBlock * block,
+                                           GumGeneratorContext * gc)
+{
+  GumX86Writer * cw = gc->code_writer;
+  GumAddress count = GUM_ADDRESS (&block->execution_count);
+#if GLIB_SIZEOF_VOID_P == 4
+  gconstpointer carry = cw->code + 1;
+  gconstpointer beach = cw->code + 2;
+#endif
+
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, -GUM_RED_ZONE_SIZE);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
+
+  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XCX, count);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XCX, GUM_REG_XCX, 1);
+  gum_x86_writer_put_mov_near_ptr_reg (cw, count, GUM_REG_XCX);
+
+#if GLIB_SIZEOF_VOID_P == 4
+  gum_x86_writer_put_jcc_short_label (cw, X86_INS_JCXZ, carry, GUM_UNLIKELY);
+  gum_x86_writer_put_jmp_short_label (cw, beach);
+
+  gum_x86_writer_put_label (cw, carry);
+  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_XCX, count + 4);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XCX, GUM_REG_XCX, 1);
+  gum_x86_writer_put_mov_near_ptr_reg (cw, count + 4, GUM_REG_XCX);
+
+  gum_x86_writer_put_label (cw, beach);
+#endif
+
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, GUM_RED_ZONE_SIZE);
+}
+
+/*
+ * Counts down the executions of a block ending with a conditional branch,
+ * without touching the flags as the branch still needs them, and turns the
+ * block into a trace once it gets hot.
+ */
+static void
+gum_exec_block_write_trace_countdown_code (GumExecBlock * block,
+                                           GumGeneratorContext * gc)
+{
+  GumExecCtx * ctx = block->ctx;
+  GumX86Writer * cw = gc->code_writer;
+  gconstpointer is_hot = cw->code + 1;
+  gconstpointer beach = cw->code + 2;
+
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, -GUM_RED_ZONE_SIZE);
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XCX);
+
+  gum_x86_writer_put_mov_reg_near_ptr (cw, GUM_REG_ECX,
+      GUM_ADDRESS (&block->trace_countdown));
+  gum_x86_writer_put_jcc_short_label (cw, X86_INS_JCXZ, is_hot,
+      GUM_UNLIKELY);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XCX, GUM_REG_XCX, -1);
+  gum_x86_writer_put_mov_near_ptr_reg (cw,
+      GUM_ADDRESS (&block->trace_countdown), GUM_REG_ECX);
+
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, GUM_RED_ZONE_SIZE);
+  gum_x86_writer_put_jmp_near_label (cw, beach);
+
+  gum_x86_writer_put_label (cw, is_hot);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XCX);
+  gum_x86_writer_put_lea_reg_reg_offset (cw, GUM_REG_XSP,
+      GUM_REG_XSP, GUM_RED_ZONE_SIZE);
+
+  gum_exec_ctx_write_prolog (ctx, GUM_PROLOG_MINIMAL, cw);
+  gum_x86_writer_put_call_address_with_aligned_arguments (cw, GUM_CALL_CAPI,
+      GUM_ADDRESS (gum_exec_block_form_trace), 1,
+      GUM_ARG_ADDRESS, GUM_ADDRESS (block));
+  gum_exec_ctx_write_epilog (ctx, GUM_PROLOG_MINIMAL, cw);
+
+  gum_x86_writer_put_label (cw, beach);
+}
+
 static void
 gum_write_segment_prefix (uint8_t segment,
                           GumX86Writer * cw)
@@ -3901,14 +7840,59 @@ gum_stalker_on_exception (GumExceptionDetails * details,
 void
 gum_stalker_set_counters_enabled (gboolean enabled)
 {
+  if (enabled)
+    gum_stalker_reset_counters ();
+
   counters_enabled = enabled;
 }
 
+static void
+gum_stalker_reset_counters (void)
+{
+  total_transitions = 0;
+
+  g_atomic_int_set (&total_compiles, 0);
+  g_atomic_int_set (&total_slab_pages, 0);
+  g_atomic_int_set (&total_block_bytes, 0);
+  g_atomic_int_set (&total_code_recycles, 0);
+  g_atomic_int_set (&total_ic_promotions, 0);
+  g_atomic_int_set (&total_traces, 0);
+
+#if GLIB_SIZEOF_VOID_P == 4 && !defined (HAVE_QNX)
+  GUM_RESET_ENTRYGATE_COUNTER (sysenter_slow_path);
+#endif
+
+  GUM_RESET_ENTRYGATE_COUNTER (call_imm);
+  GUM_RESET_ENTRYGATE_COUNTER (call_reg);
+  GUM_RESET_ENTRYGATE_COUNTER (call_mem);
+  GUM_RESET_ENTRYGATE_COUNTER (post_call_invoke);
+  GUM_RESET_ENTRYGATE_COUNTER (ret_slow_path);
+
+  GUM_RESET_ENTRYGATE_COUNTER (jmp_imm);
+  GUM_RESET_ENTRYGATE_COUNTER (jmp_mem);
+  GUM_RESET_ENTRYGATE_COUNTER (jmp_reg);
+
+  GUM_RESET_ENTRYGATE_COUNTER (jmp_cond_imm);
+  GUM_RESET_ENTRYGATE_COUNTER (jmp_cond_mem);
+  GUM_RESET_ENTRYGATE_COUNTER (jmp_cond_reg);
+  GUM_RESET_ENTRYGATE_COUNTER (jmp_cond_jcxz);
+
+  GUM_RESET_ENTRYGATE_COUNTER (jmp_continuation);
+  GUM_RESET_ENTRYGATE_COUNTER (invalidated_block);
+}
+
 void
 gum_stalker_dump_counters (void)
 {
   g_printerr ("\n\ntotal_transitions: %u\n", total_transitions);
 
+  g_printerr ("\ntotal_compiles: %d\n", total_compiles);
+  g_printerr ("total_slab_pages: %d\n", total_slab_pages);
+  g_printerr ("total_block_bytes: %d\n", total_block_bytes);
+  g_printerr ("total_code_recycles: %d\n", total_code_recycles);
+  g_printerr ("total_ic_promotions: %d\n", total_ic_promotions);
+  g_printerr ("total_traces: %d\n", total_traces);
+
 #if GLIB_SIZEOF_VOID_P == 4 && !defined (HAVE_QNX)
   GUM_PRINT_ENTRYGATE_COUNTER (sysenter_slow_path);
 
@@ -3937,4 +7921,5 @@ gum_stalker_dump_counters (void)
   g_printerr ("\n");
 
   GUM_PRINT_ENTRYGATE_COUNTER (jmp_continuation);
+  GUM_PRINT_ENTRYGATE_COUNTER (invalidated_block);
 }
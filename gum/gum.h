@@ -14,9 +14,11 @@
 #include <gum/gumcloak.h>
 #include <gum/gumcodeallocator.h>
 #include <gum/gumcodesegment.h>
+#include <gum/gumcompactevent.h>
 #include <gum/gumevent.h>
 #include <gum/gumeventsink.h>
 #include <gum/gumexceptor.h>
+#include <gum/gumfileeventsink.h>
 #include <gum/gumfunction.h>
 #include <gum/guminterceptor.h>
 #include <gum/guminvocationcontext.h>
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#include "gumcompactevent.h"
+
+#include "gumleb.h"
+
+/*
+ * Each event starts with its GumEventType as a tag byte. Addresses are stored
+ * as SLEB128 deltas: the first one against where the previous event left off,
+ * the second one against the first. Traces mostly move forward in small
+ * steps, so an address typically takes one or two bytes instead of eight.
+ *
+ *   call, ret:      location, target - location, depth
+ *   exec:           location
+ *   block, compile: begin, end - begin
+ */
+
+#define GUM_DELTA(a, b) ((gint64) ((guint64) (a) - (guint64) (b)))
+
+void
+gum_compact_event_cursor_init (GumCompactEventCursor * cursor)
+{
+  cursor->previous = 0;
+}
+
+guint
+gum_compact_event_encode (GumCompactEventCursor * cursor,
+                          const GumEvent * ev,
+                          guint8 * data)
+{
+  guint8 * p = data;
+  GumAddress first, second;
+
+  *p++ = ev->type;
+
+  switch (ev->type)
+  {
+    case GUM_CALL:
+    case GUM_RET:
+      first = GUM_ADDRESS (ev->call.location);
+      second = GUM_ADDRESS (ev->call.target);
+
+      p += gum_write_sleb128 (p, GUM_DELTA (first, cursor->previous));
+      p += gum_write_sleb128 (p, GUM_DELTA (second, first));
+      p += gum_write_sleb128 (p, ev->call.depth);
+
+      cursor->previous = second;
+      break;
+    case GUM_EXEC:
+      first = GUM_ADDRESS (ev->exec.location);
+
+      p += gum_write_sleb128 (p, GUM_DELTA (first, cursor->previous));
+
+      cursor->previous = first;
+      break;
+    case GUM_BLOCK:
+    case GUM_COMPILE:
+      first = GUM_ADDRESS (ev->block.begin);
+      second = GUM_ADDRESS (ev->block.end);
+
+      p += gum_write_sleb128 (p, GUM_DELTA (first, cursor->previous));
+      p += gum_write_sleb128 (p, GUM_DELTA (second, first));
+
+      cursor->previous = second;
+      break;
+    default:
+      g_assert_not_reached ();
+  }
+
+  return p - data;
+}
+
+/*
+ * Decodes the event at `*data`, advancing past it. Returns FALSE if the data
+ * is truncated or not an event, leaving `*data` untouched.
+ */
+gboolean
+gum_compact_event_decode (GumCompactEventCursor * cursor,
+                          const guint8 ** data,
+                          const guint8 * end,
+                          GumEvent * ev)
+{
+  const guint8 * p = *data;
+  GumEventType type;
+  gint64 first, second, depth;
+  GumAddress begin;
+
+  if (p == end)
+    return FALSE;
+
+  type = *p++;
+
+  switch (type)
+  {
+    case GUM_CALL:
+    case GUM_RET:
+      if (!gum_try_read_sleb128 (&p, end, &first) ||
+          !gum_try_read_sleb128 (&p, end, &second) ||
+          !gum_try_read_sleb128 (&p, end, &depth))
+        return FALSE;
+
+      begin = cursor->previous + first;
+
+      ev->call.type = type;
+      ev->call.location = GSIZE_TO_POINTER (begin);
+      ev->call.target = GSIZE_TO_POINTER (begin + second);
+      ev->call.depth = depth;
+
+      cursor->previous = begin + second;
+      break;
+    case GUM_EXEC:
+      if (!gum_try_read_sleb128 (&p, end, &first))
+        return FALSE;
+
+      begin = cursor->previous + first;
+
+      ev->exec.type = type;
+      ev->exec.location = GSIZE_TO_POINTER (begin);
+
+      cursor->previous = begin;
+      break;
+    case GUM_BLOCK:
+    case GUM_COMPILE:
+      if (!gum_try_read_sleb128 (&p, end, &first) ||
+          !gum_try_read_sleb128 (&p, end, &second))
+        return FALSE;
+
+      begin = cursor->previous + first;
+
+      ev->block.type = type;
+      ev->block.begin = GSIZE_TO_POINTER (begin);
+      ev->block.end = GSIZE_TO_POINTER (begin + second);
+
+      cursor->previous = begin + second;
+      break;
+    default:
+      return FALSE;
+  }
+
+  *data = p;
+
+  return TRUE;
+}
+
+/*
+ * Encodes `events` into a new buffer, to be freed with g_free().
+ */
+gpointer
+gum_compact_events_encode (const GumEvent * events,
+                           guint n_events,
+                           gsize * size)
+{
+  guint8 * data, * p;
+  GumCompactEventCursor cursor;
+  guint i;
+
+  data = g_malloc ((gsize) n_events * GUM_COMPACT_EVENT_MAX_SIZE);
+
+  gum_compact_event_cursor_init (&cursor);
+
+  p = data;
+  for (i = 0; i != n_events; i++)
+    p += gum_compact_event_encode (&cursor, &events[i], p);
+
+  *size = p - data;
+
+  return g_realloc (data, MAX (*size, 1));
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#ifndef __GUM_COMPACT_EVENT_H__
+#define __GUM_COMPACT_EVENT_H__
+
+#include <gum/gumdefs.h>
+#include <gum/gumevent.h>
+
+/*
+ * Tag byte, then up to three LEB128 fields of at most ten bytes each.
+ */
+#define GUM_COMPACT_EVENT_MAX_SIZE 31
+
+G_BEGIN_DECLS
+
+typedef struct _GumCompactEventCursor GumCompactEventCursor;
+
+struct _GumCompactEventCursor
+{
+  GumAddress previous;
+};
+
+GUM_API void gum_compact_event_cursor_init (GumCompactEventCursor * cursor);
+
+GUM_API guint gum_compact_event_encode (GumCompactEventCursor * cursor,
+    const GumEvent * ev, guint8 * data);
+GUM_API gboolean gum_compact_event_decode (GumCompactEventCursor * cursor,
+    const guint8 ** data, const guint8 * end, GumEvent * ev);
+
+GUM_API gpointer gum_compact_events_encode (const GumEvent * events,
+    guint n_events, gsize * size);
+
+G_END_DECLS
+
+#endif
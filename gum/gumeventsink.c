@@ -23,6 +23,22 @@ gum_event_sink_query_mask (GumEventSink * self)
   return iface->query_mask (self);
 }
 
+/*
+ * Whether the sink would rather have its GUM_CALL events summed up per
+ * target and handed to process_call_summary(). Backends that can't count
+ * calls keep delivering GUM_CALL events, so the sink must handle both.
+ */
+gboolean
+gum_event_sink_query_call_summary (GumEventSink * self)
+{
+  GumEventSinkInterface * iface = GUM_EVENT_SINK_GET_IFACE (self);
+
+  if (iface->query_call_summary == NULL)
+    return FALSE;
+
+  return iface->query_call_summary (self);
+}
+
 void
 gum_event_sink_start (GumEventSink * self)
 {
@@ -43,6 +59,46 @@ gum_event_sink_process (GumEventSink * self,
   iface->process (self, ev);
 }
 
+/*
+ * Optional counterpart of process() that takes a run of events in one go.
+ * Sinks that don't implement it get the events one by one.
+ */
+void
+gum_event_sink_process_batch (GumEventSink * self,
+                              const GumEvent * events,
+                              guint n_events)
+{
+  GumEventSinkInterface * iface = GUM_EVENT_SINK_GET_IFACE (self);
+  guint i;
+
+  if (iface->process_batch != NULL)
+  {
+    iface->process_batch (self, events, n_events);
+    return;
+  }
+
+  g_assert (iface->process != NULL);
+
+  for (i = 0; i != n_events; i++)
+    iface->process (self, &events[i]);
+}
+
+/*
+ * Called instead of process() for GUM_CALL events when the sink asked for a
+ * call summary. Each count is how many calls were made to its target
+ * since the previous summary.
+ */
+void
+gum_event_sink_process_call_summary (GumEventSink * self,
+                                     const GumCallCount * counts,
+                                     guint n_counts)
+{
+  GumEventSinkInterface * iface = GUM_EVENT_SINK_GET_IFACE (self);
+
+  if (iface->process_call_summary != NULL)
+    iface->process_call_summary (self, counts, n_counts);
+}
+
 void
 gum_event_sink_flush (GumEventSink * self)
 {
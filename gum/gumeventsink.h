@@ -16,20 +16,38 @@ G_BEGIN_DECLS
 #define GUM_TYPE_EVENT_SINK (gum_event_sink_get_type ())
 G_DECLARE_INTERFACE (GumEventSink, gum_event_sink, GUM, EVENT_SINK, GObject)
 
+typedef struct _GumCallCount GumCallCount;
+
+struct _GumCallCount
+{
+  gpointer target;
+  guint64 count;
+};
+
 struct _GumEventSinkInterface
 {
   GTypeInterface parent;
 
   GumEventType (* query_mask) (GumEventSink * self);
+  gboolean (* query_call_summary) (GumEventSink * self);
   void (* start) (GumEventSink * self);
   void (* process) (GumEventSink * self, const GumEvent * ev);
+  void (* process_batch) (GumEventSink * self, const GumEvent * events,
+      guint n_events);
+  void (* process_call_summary) (GumEventSink * self,
+      const GumCallCount * counts, guint n_counts);
   void (* flush) (GumEventSink * self);
   void (* stop) (GumEventSink * self);
 };
 
 GUM_API GumEventType gum_event_sink_query_mask (GumEventSink * self);
+GUM_API gboolean gum_event_sink_query_call_summary (GumEventSink * self);
 GUM_API void gum_event_sink_start (GumEventSink * self);
 GUM_API void gum_event_sink_process (GumEventSink * self, const GumEvent * ev);
+GUM_API void gum_event_sink_process_batch (GumEventSink * self,
+    const GumEvent * events, guint n_events);
+GUM_API void gum_event_sink_process_call_summary (GumEventSink * self,
+    const GumCallCount * counts, guint n_counts);
 GUM_API void gum_event_sink_flush (GumEventSink * self);
 GUM_API void gum_event_sink_stop (GumEventSink * self);
 
@@ -0,0 +1,951 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#include "gumfileeventsink.h"
+
+#include "gumcompactevent.h"
+#include "gumtls.h"
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#ifdef HAVE_WINDOWS
+# include <windows.h>
+#else
+# include <errno.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+#define GUM_FILE_EVENT_MAGIC "GUMTRACE"
+#define GUM_FILE_EVENT_VERSION 1
+#define GUM_FILE_EVENT_CHUNK_SIZE (64 * 1024)
+#define GUM_FILE_EVENT_SPARE_RETRY_INTERVAL G_USEC_PER_SEC
+
+typedef struct _GumFileHeader GumFileHeader;
+typedef struct _GumFileModule GumFileModule;
+typedef struct _GumFileChunk GumFileChunk;
+typedef struct _GumFileSegment GumFileSegment;
+typedef struct _GumFileCursor GumFileCursor;
+typedef struct _GumModuleSnapshot GumModuleSnapshot;
+
+/*
+ * A segment file starts with a header, followed by a snapshot of the modules
+ * loaded when the segment was created, followed by fixed-size chunks. Each
+ * chunk belongs to one thread, which appends events to it without taking any
+ * locks, publishing how much it has written through `used`. The rest of the
+ * file is zero-filled, so a chunk with no capacity marks the end.
+ */
+struct _GumFileHeader
+{
+  gchar magic[8];
+  guint32 version;
+  guint32 format;
+  guint32 pointer_size;
+  guint32 segment_index;
+  guint64 segment_size;
+  guint32 n_modules;
+  guint32 data_offset;
+};
+
+/* Followed by the name and path, both NUL-terminated, padded to 8 bytes */
+struct _GumFileModule
+{
+  guint64 base_address;
+  guint64 size;
+  guint32 name_size;
+  guint32 path_size;
+};
+
+struct _GumFileChunk
+{
+  guint64 thread_id;
+  guint32 capacity;
+  volatile gint used;
+};
+
+struct _GumFileSegment
+{
+  volatile gint ref_count;
+
+  guint index;
+  guint8 * data;
+  gsize size;
+  gsize offset;
+
+#ifdef HAVE_WINDOWS
+  HANDLE file;
+  HANDLE mapping;
+#else
+  gint fd;
+#endif
+};
+
+struct _GumFileCursor
+{
+  GumThreadId thread_id;
+
+  GumFileSegment * segment;
+  GumFileChunk * chunk;
+  guint8 * data;
+  guint used;
+  guint capacity;
+
+  GumCompactEventCursor compact;
+};
+
+struct _GumFileEventSink
+{
+  GObject parent;
+
+  gchar * path_prefix;
+  GumEventType mask;
+  GumFileEventFormat format;
+  gsize segment_size;
+  guint max_segments;
+  guint max_event_size;
+
+  GumTlsKey cursor_key;
+
+  GMutex lock;
+  GumFileSegment * segment;
+  GumFileSegment * spare_segment;
+  gint64 spare_failed_at;
+  gboolean preparing_spare;
+  GPtrArray * cursors;
+};
+
+struct _GumFileEventReader
+{
+  GMappedFile * file;
+  const guint8 * data;
+  gsize size;
+  const GumFileHeader * header;
+};
+
+struct _GumModuleSnapshot
+{
+  GByteArray * data;
+  guint n_modules;
+};
+
+static void gum_file_event_sink_iface_init (gpointer g_iface,
+    gpointer iface_data);
+static void gum_file_event_sink_finalize (GObject * obj);
+static GumEventType gum_file_event_sink_query_mask (GumEventSink * sink);
+static void gum_file_event_sink_process (GumEventSink * sink,
+    const GumEvent * ev);
+static void gum_file_event_sink_process_batch (GumEventSink * sink,
+    const GumEvent * events, guint n_events);
+static void gum_file_event_sink_flush (GumEventSink * sink);
+static void gum_file_event_sink_stop (GumEventSink * sink);
+
+static GumFileCursor * gum_file_event_sink_get_cursor (
+    GumFileEventSink * self);
+static gboolean gum_file_event_sink_next_chunk (GumFileEventSink * self,
+    GumFileCursor * cursor);
+static gboolean gum_file_event_sink_should_prepare_spare (
+    GumFileEventSink * self);
+static void gum_file_event_sink_prepare_spare (GumFileEventSink * self);
+static GumFileSegment * gum_file_event_sink_rotate (GumFileEventSink * self);
+static void gum_file_event_sink_retire (GumFileEventSink * self,
+    GumFileSegment * previous);
+static void gum_file_event_sink_delete_segment (GumFileEventSink * self,
+    guint index);
+static GumFileSegment * gum_file_event_sink_create_segment (
+    GumFileEventSink * self, guint index, GError ** error);
+static gboolean gum_module_snapshot_add (const GumModuleDetails * details,
+    GumModuleSnapshot * snapshot);
+static void gum_file_cursor_free (GumFileCursor * cursor);
+
+static GumFileSegment * gum_file_segment_map (const gchar * path, gsize size,
+    GError ** error);
+static void gum_file_segment_ref (GumFileSegment * segment);
+static void gum_file_segment_unref (GumFileSegment * segment);
+static void gum_file_segment_flush (GumFileSegment * segment);
+
+G_DEFINE_TYPE_EXTENDED (GumFileEventSink,
+                        gum_file_event_sink,
+                        G_TYPE_OBJECT,
+                        0,
+                        G_IMPLEMENT_INTERFACE (GUM_TYPE_EVENT_SINK,
+                            gum_file_event_sink_iface_init))
+
+static void
+gum_file_event_sink_class_init (GumFileEventSinkClass * klass)
+{
+  GObjectClass * object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = gum_file_event_sink_finalize;
+}
+
+static void
+gum_file_event_sink_iface_init (gpointer g_iface,
+                                gpointer iface_data)
+{
+  GumEventSinkInterface * iface = g_iface;
+
+  iface->query_mask = gum_file_event_sink_query_mask;
+  iface->process = gum_file_event_sink_process;
+  iface->process_batch = gum_file_event_sink_process_batch;
+  iface->flush = gum_file_event_sink_flush;
+  iface->stop = gum_file_event_sink_stop;
+}
+
+static void
+gum_file_event_sink_init (GumFileEventSink * self)
+{
+  self->cursor_key = gum_tls_key_new ();
+
+  g_mutex_init (&self->lock);
+  self->cursors = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) gum_file_cursor_free);
+}
+
+static void
+gum_file_event_sink_finalize (GObject * obj)
+{
+  GumFileEventSink * self = GUM_FILE_EVENT_SINK (obj);
+
+  g_ptr_array_unref (self->cursors);
+
+  if (self->segment != NULL)
+    gum_file_segment_unref (self->segment);
+
+  if (self->spare_segment != NULL)
+  {
+    guint index = self->spare_segment->index;
+
+    gum_file_segment_unref (self->spare_segment);
+    gum_file_event_sink_delete_segment (self, index);
+  }
+
+  g_mutex_clear (&self->lock);
+
+  gum_tls_key_free (self->cursor_key);
+
+  g_free (self->path_prefix);
+
+  G_OBJECT_CLASS (gum_file_event_sink_parent_class)->finalize (obj);
+}
+
+/*
+ * Records events to `path_prefix`.0, `path_prefix`.1, and so on, moving on to
+ * the next segment once `segment_size` bytes have been handed out. Only the
+ * `max_segments` most recent segments are kept, unless it is zero, plus the
+ * next one once it has been prepared.
+ */
+GumEventSink *
+gum_file_event_sink_new (const gchar * path_prefix,
+                         GumEventType mask,
+                         GumFileEventFormat format,
+                         gsize segment_size,
+                         guint max_segments,
+                         GError ** error)
+{
+  GumFileEventSink * sink;
+
+  sink = g_object_new (GUM_TYPE_FILE_EVENT_SINK, NULL);
+  sink->path_prefix = g_strdup (path_prefix);
+  sink->mask = mask;
+  sink->format = format;
+  sink->segment_size = segment_size;
+  sink->max_segments = max_segments;
+  sink->max_event_size = (format == GUM_FILE_EVENT_FORMAT_COMPACT)
+      ? GUM_COMPACT_EVENT_MAX_SIZE
+      : sizeof (GumEvent);
+
+  sink->segment = gum_file_event_sink_create_segment (sink, 0, error);
+  if (sink->segment == NULL)
+  {
+    g_object_unref (sink);
+    return NULL;
+  }
+
+  return GUM_EVENT_SINK (sink);
+}
+
+gchar *
+gum_file_event_sink_get_segment_path (const gchar * path_prefix,
+                                      guint index)
+{
+  return g_strdup_printf ("%s.%u", path_prefix, index);
+}
+
+static GumEventType
+gum_file_event_sink_query_mask (GumEventSink * sink)
+{
+  return GUM_FILE_EVENT_SINK (sink)->mask;
+}
+
+static void
+gum_file_event_sink_process (GumEventSink * sink,
+                             const GumEvent * ev)
+{
+  gum_file_event_sink_process_batch (sink, ev, 1);
+}
+
+static void
+gum_file_event_sink_process_batch (GumEventSink * sink,
+                                   const GumEvent * events,
+                                   guint n_events)
+{
+  GumFileEventSink * self = GUM_FILE_EVENT_SINK (sink);
+  GumFileCursor * cursor;
+  guint i;
+
+  cursor = gum_file_event_sink_get_cursor (self);
+
+  for (i = 0; i != n_events; i++)
+  {
+    const GumEvent * ev = &events[i];
+    guint8 * p;
+
+    if (cursor->capacity - cursor->used < self->max_event_size &&
+        !gum_file_event_sink_next_chunk (self, cursor))
+      return;
+
+    p = cursor->data + cursor->used;
+
+    if (self->format == GUM_FILE_EVENT_FORMAT_COMPACT)
+    {
+      cursor->used += gum_compact_event_encode (&cursor->compact, ev, p);
+    }
+    else
+    {
+      memcpy (p, ev, sizeof (GumEvent));
+      cursor->used += sizeof (GumEvent);
+    }
+
+    g_atomic_int_set (&cursor->chunk->used, cursor->used);
+  }
+}
+
+static void
+gum_file_event_sink_flush (GumEventSink * sink)
+{
+  GumFileEventSink * self = GUM_FILE_EVENT_SINK (sink);
+
+  g_mutex_lock (&self->lock);
+  if (self->segment != NULL)
+    gum_file_segment_flush (self->segment);
+  g_mutex_unlock (&self->lock);
+}
+
+static void
+gum_file_event_sink_stop (GumEventSink * sink)
+{
+  gum_file_event_sink_flush (sink);
+}
+
+static GumFileCursor *
+gum_file_event_sink_get_cursor (GumFileEventSink * self)
+{
+  GumFileCursor * cursor;
+
+  cursor = gum_tls_key_get_value (self->cursor_key);
+  if (cursor != NULL)
+    return cursor;
+
+  cursor = g_slice_new0 (GumFileCursor);
+  cursor->thread_id = gum_process_get_current_thread_id ();
+
+  g_mutex_lock (&self->lock);
+  g_ptr_array_add (self->cursors, cursor);
+  g_mutex_unlock (&self->lock);
+
+  gum_tls_key_set_value (self->cursor_key, cursor);
+
+  return cursor;
+}
+
+/*
+ * Hands the cursor a fresh chunk, rotating to a new segment if the current
+ * one is full. Returns FALSE if there is nowhere left to write, in which case
+ * events are dropped.
+ *
+ * Creating a segment means snapshotting the modules and creating, sizing and
+ * mapping a file, none of which we want to do with the lock held: other
+ * threads would pile up behind it, and whoever holds the loader's lock might
+ * be one of them. So the next segment is prepared as a spare once the
+ * current one is half full, by whichever thread notices first, and rotating
+ * is just a matter of swapping it in. A thread that runs out of room while
+ * someone else is still preparing the spare drops its events rather than
+ * waiting. Should preparing it fail, e.g. because the disk is full, events
+ * are dropped while the current segment stays full, and we try again once
+ * GUM_FILE_EVENT_SPARE_RETRY_INTERVAL has passed.
+ */
+static gboolean
+gum_file_event_sink_next_chunk (GumFileEventSink * self,
+                                GumFileCursor * cursor)
+{
+  GumFileSegment * segment, * previous, * retired = NULL;
+  GumFileChunk * chunk;
+  gboolean spare_needed;
+
+  g_mutex_lock (&self->lock);
+
+  while (TRUE)
+  {
+    segment = self->segment;
+    if (segment->offset + GUM_FILE_EVENT_CHUNK_SIZE <= segment->size)
+      break;
+
+    if (self->spare_segment != NULL)
+    {
+      g_assert (retired == NULL);
+      retired = gum_file_event_sink_rotate (self);
+      continue;
+    }
+
+    if (!gum_file_event_sink_should_prepare_spare (self))
+    {
+      segment = NULL;
+      break;
+    }
+
+    g_mutex_unlock (&self->lock);
+    gum_file_event_sink_prepare_spare (self);
+    g_mutex_lock (&self->lock);
+  }
+
+  if (segment == NULL)
+  {
+    g_mutex_unlock (&self->lock);
+
+    g_assert (retired == NULL);
+
+    return FALSE;
+  }
+
+  chunk = (GumFileChunk *) (segment->data + segment->offset);
+  segment->offset += GUM_FILE_EVENT_CHUNK_SIZE;
+
+  chunk->thread_id = cursor->thread_id;
+  chunk->capacity = GUM_FILE_EVENT_CHUNK_SIZE - sizeof (GumFileChunk);
+
+  gum_file_segment_ref (segment);
+
+  spare_needed = segment->offset >= segment->size / 2 &&
+      gum_file_event_sink_should_prepare_spare (self);
+
+  g_mutex_unlock (&self->lock);
+
+  previous = cursor->segment;
+
+  cursor->segment = segment;
+  cursor->chunk = chunk;
+  cursor->data = (guint8 *) (chunk + 1);
+  cursor->used = 0;
+  cursor->capacity = chunk->capacity;
+  gum_compact_event_cursor_init (&cursor->compact);
+
+  if (previous != NULL)
+    gum_file_segment_unref (previous);
+
+  if (retired != NULL)
+    gum_file_event_sink_retire (self, retired);
+
+  if (spare_needed)
+    gum_file_event_sink_prepare_spare (self);
+
+  return TRUE;
+}
+
+/*
+ * Called with the lock held. Tells whether there is no spare yet, nobody is
+ * preparing one, and we are not backing off after failing to.
+ */
+static gboolean
+gum_file_event_sink_should_prepare_spare (GumFileEventSink * self)
+{
+  if (self->spare_segment != NULL || self->preparing_spare)
+    return FALSE;
+
+  if (self->spare_failed_at != 0 && g_get_monotonic_time () -
+      self->spare_failed_at < GUM_FILE_EVENT_SPARE_RETRY_INTERVAL)
+    return FALSE;
+
+  return TRUE;
+}
+
+/*
+ * Creates the segment after the current one, unless another thread is
+ * already on it. Called without the lock held.
+ */
+static void
+gum_file_event_sink_prepare_spare (GumFileEventSink * self)
+{
+  GumFileSegment * spare;
+  guint index;
+
+  g_mutex_lock (&self->lock);
+  if (!gum_file_event_sink_should_prepare_spare (self))
+  {
+    g_mutex_unlock (&self->lock);
+    return;
+  }
+  self->preparing_spare = TRUE;
+  index = self->segment->index + 1;
+  g_mutex_unlock (&self->lock);
+
+  spare = gum_file_event_sink_create_segment (self, index, NULL);
+
+  g_mutex_lock (&self->lock);
+  self->spare_segment = spare;
+  self->spare_failed_at = (spare == NULL) ? g_get_monotonic_time () : 0;
+  self->preparing_spare = FALSE;
+  g_mutex_unlock (&self->lock);
+}
+
+/*
+ * Called with the lock held. Swaps in the spare segment and returns the
+ * previous one to be retired once the lock is released.
+ */
+static GumFileSegment *
+gum_file_event_sink_rotate (GumFileEventSink * self)
+{
+  GumFileSegment * previous = self->segment;
+
+  self->segment = g_steal_pointer (&self->spare_segment);
+
+  return previous;
+}
+
+/*
+ * Threads still appending to chunks in the previous segment keep it mapped
+ * until they move on. The oldest segment goes once there are too many.
+ */
+static void
+gum_file_event_sink_retire (GumFileEventSink * self,
+                            GumFileSegment * previous)
+{
+  guint index = previous->index + 1;
+
+  gum_file_segment_flush (previous);
+  gum_file_segment_unref (previous);
+
+  if (self->max_segments != 0 && index >= self->max_segments)
+    gum_file_event_sink_delete_segment (self, index - self->max_segments);
+}
+
+static void
+gum_file_event_sink_delete_segment (GumFileEventSink * self,
+                                    guint index)
+{
+  gchar * path;
+
+  path = gum_file_event_sink_get_segment_path (self->path_prefix, index);
+  g_unlink (path);
+  g_free (path);
+}
+
+static GumFileSegment *
+gum_file_event_sink_create_segment (GumFileEventSink * self,
+                                    guint index,
+                                    GError ** error)
+{
+  GumFileSegment * segment;
+  GumModuleSnapshot snapshot;
+  GumFileHeader header;
+  gsize data_offset;
+  gchar * path;
+
+  snapshot.data = g_byte_array_new ();
+  snapshot.n_modules = 0;
+  gum_process_enumerate_modules ((GumFoundModuleFunc) gum_module_snapshot_add,
+      &snapshot);
+
+  data_offset = GUM_ALIGN_SIZE (sizeof (GumFileHeader) + snapshot.data->len,
+      16);
+
+  path = gum_file_event_sink_get_segment_path (self->path_prefix, index);
+  segment = gum_file_segment_map (path,
+      MAX (self->segment_size, data_offset + GUM_FILE_EVENT_CHUNK_SIZE),
+      error);
+  g_free (path);
+
+  if (segment != NULL)
+  {
+    memcpy (header.magic, GUM_FILE_EVENT_MAGIC, sizeof (header.magic));
+    header.version = GUM_FILE_EVENT_VERSION;
+    header.format = self->format;
+    header.pointer_size = GLIB_SIZEOF_VOID_P;
+    header.segment_index = index;
+    header.segment_size = segment->size;
+    header.n_modules = snapshot.n_modules;
+    header.data_offset = data_offset;
+
+    memcpy (segment->data, &header, sizeof (header));
+    memcpy (segment->data + sizeof (header), snapshot.data->data,
+        snapshot.data->len);
+
+    segment->index = index;
+    segment->offset = data_offset;
+  }
+
+  g_byte_array_unref (snapshot.data);
+
+  return segment;
+}
+
+static gboolean
+gum_module_snapshot_add (const GumModuleDetails * details,
+                         GumModuleSnapshot * snapshot)
+{
+  GumFileModule module;
+  static const guint8 padding[8] = { 0, };
+
+  module.base_address = details->range->base_address;
+  module.size = details->range->size;
+  module.name_size = strlen (details->name) + 1;
+  module.path_size = strlen (details->path) + 1;
+
+  g_byte_array_append (snapshot->data, (const guint8 *) &module,
+      sizeof (module));
+  g_byte_array_append (snapshot->data, (const guint8 *) details->name,
+      module.name_size);
+  g_byte_array_append (snapshot->data, (const guint8 *) details->path,
+      module.path_size);
+  g_byte_array_append (snapshot->data, padding,
+      GUM_ALIGN_SIZE (snapshot->data->len, 8) - snapshot->data->len);
+
+  snapshot->n_modules++;
+
+  return TRUE;
+}
+
+static void
+gum_file_cursor_free (GumFileCursor * cursor)
+{
+  if (cursor->segment != NULL)
+    gum_file_segment_unref (cursor->segment);
+
+  g_slice_free (GumFileCursor, cursor);
+}
+
+#ifdef HAVE_WINDOWS
+
+static GumFileSegment *
+gum_file_segment_map (const gchar * path,
+                      gsize size,
+                      GError ** error)
+{
+  GumFileSegment * segment;
+  WCHAR * path_utf16;
+  HANDLE file, mapping;
+  gpointer data;
+  DWORD last_error;
+
+  path_utf16 = (WCHAR *) g_utf8_to_utf16 (path, -1, NULL, NULL, NULL);
+  file = CreateFileW (path_utf16, GENERIC_READ | GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL, NULL);
+  g_free (path_utf16);
+  if (file == INVALID_HANDLE_VALUE)
+    goto create_failed;
+
+  mapping = CreateFileMappingW (file, NULL, PAGE_READWRITE,
+      (DWORD) ((guint64) size >> 32), (DWORD) size, NULL);
+  if (mapping == NULL)
+    goto map_failed;
+
+  data = MapViewOfFile (mapping, FILE_MAP_WRITE, 0, 0, size);
+  if (data == NULL)
+  {
+    last_error = GetLastError ();
+    CloseHandle (mapping);
+    SetLastError (last_error);
+    goto map_failed;
+  }
+
+  segment = g_slice_new0 (GumFileSegment);
+  segment->ref_count = 1;
+  segment->data = data;
+  segment->size = size;
+  segment->file = file;
+  segment->mapping = mapping;
+
+  return segment;
+
+map_failed:
+  {
+    last_error = GetLastError ();
+    CloseHandle (file);
+    SetLastError (last_error);
+    goto create_failed;
+  }
+create_failed:
+  {
+    g_set_error (error, G_IO_ERROR,
+        g_io_error_from_win32_error (GetLastError ()),
+        "Unable to create %s", path);
+    return NULL;
+  }
+}
+
+static void
+gum_file_segment_release (GumFileSegment * segment)
+{
+  UnmapViewOfFile (segment->data);
+  CloseHandle (segment->mapping);
+  CloseHandle (segment->file);
+}
+
+static void
+gum_file_segment_flush (GumFileSegment * segment)
+{
+  /* Starts writing dirty pages out without waiting for them */
+  FlushViewOfFile (segment->data, 0);
+}
+
+#else
+
+static GumFileSegment *
+gum_file_segment_map (const gchar * path,
+                      gsize size,
+                      GError ** error)
+{
+  GumFileSegment * segment;
+  gint fd, saved_errno;
+  gpointer data;
+
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    goto create_failed;
+
+  if (ftruncate (fd, size) != 0)
+    goto map_failed;
+
+  data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    goto map_failed;
+
+  segment = g_slice_new0 (GumFileSegment);
+  segment->ref_count = 1;
+  segment->data = data;
+  segment->size = size;
+  segment->fd = fd;
+
+  return segment;
+
+map_failed:
+  {
+    saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+    goto create_failed;
+  }
+create_failed:
+  {
+    saved_errno = errno;
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+        "Unable to create %s: %s", path, g_strerror (saved_errno));
+    return NULL;
+  }
+}
+
+static void
+gum_file_segment_release (GumFileSegment * segment)
+{
+  munmap (segment->data, segment->size);
+  close (segment->fd);
+}
+
+static void
+gum_file_segment_flush (GumFileSegment * segment)
+{
+  msync (segment->data, segment->size, MS_ASYNC);
+}
+
+#endif
+
+static void
+gum_file_segment_ref (GumFileSegment * segment)
+{
+  g_atomic_int_inc (&segment->ref_count);
+}
+
+static void
+gum_file_segment_unref (GumFileSegment * segment)
+{
+  if (!g_atomic_int_dec_and_test (&segment->ref_count))
+    return;
+
+  gum_file_segment_flush (segment);
+  gum_file_segment_release (segment);
+
+  g_slice_free (GumFileSegment, segment);
+}
+
+GumFileEventReader *
+gum_file_event_reader_open (const gchar * path,
+                            GError ** error)
+{
+  GumFileEventReader * reader;
+  GMappedFile * file;
+  const guint8 * data;
+  gsize size;
+  const GumFileHeader * header;
+
+  file = g_mapped_file_new (path, FALSE, error);
+  if (file == NULL)
+    return NULL;
+
+  data = (const guint8 *) g_mapped_file_get_contents (file);
+  size = g_mapped_file_get_length (file);
+  header = (const GumFileHeader *) data;
+
+  if (size < sizeof (GumFileHeader) ||
+      memcmp (header->magic, GUM_FILE_EVENT_MAGIC,
+          sizeof (header->magic)) != 0 ||
+      header->data_offset > size)
+  {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+        "%s is not a trace segment", path);
+    goto failure;
+  }
+
+  if (header->version != GUM_FILE_EVENT_VERSION ||
+      header->pointer_size != GLIB_SIZEOF_VOID_P)
+  {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+        "%s was recorded by an incompatible version or architecture", path);
+    goto failure;
+  }
+
+  reader = g_slice_new (GumFileEventReader);
+  reader->file = file;
+  reader->data = data;
+  reader->size = size;
+  reader->header = header;
+
+  return reader;
+
+failure:
+  {
+    g_mapped_file_unref (file);
+    return NULL;
+  }
+}
+
+void
+gum_file_event_reader_free (GumFileEventReader * reader)
+{
+  g_mapped_file_unref (reader->file);
+
+  g_slice_free (GumFileEventReader, reader);
+}
+
+guint
+gum_file_event_reader_get_segment_index (GumFileEventReader * self)
+{
+  return self->header->segment_index;
+}
+
+GumFileEventFormat
+gum_file_event_reader_get_format (GumFileEventReader * self)
+{
+  return self->header->format;
+}
+
+void
+gum_file_event_reader_enumerate_modules (GumFileEventReader * self,
+                                         GumFoundModuleFunc func,
+                                         gpointer user_data)
+{
+  const guint8 * p, * end;
+  guint i;
+
+  p = self->data + sizeof (GumFileHeader);
+  end = self->data + self->header->data_offset;
+
+  for (i = 0; i != self->header->n_modules; i++)
+  {
+    GumFileModule module;
+    const gchar * name, * path;
+    GumMemoryRange range;
+    GumModuleDetails details;
+
+    if ((gsize) (end - p) < sizeof (GumFileModule))
+      return;
+    memcpy (&module, p, sizeof (module));
+    p += sizeof (module);
+
+    if ((gsize) (end - p) < (gsize) module.name_size + module.path_size ||
+        module.name_size == 0 || module.path_size == 0)
+      return;
+    name = (const gchar *) p;
+    path = name + module.name_size;
+    if (name[module.name_size - 1] != '\0' ||
+        path[module.path_size - 1] != '\0')
+      return;
+    p = GUM_ALIGN_POINTER (const guint8 *, path + module.path_size, 8);
+
+    range.base_address = module.base_address;
+    range.size = module.size;
+
+    details.name = name;
+    details.range = &range;
+    details.path = path;
+
+    if (!func (&details, user_data))
+      return;
+  }
+}
+
+void
+gum_file_event_reader_enumerate_events (GumFileEventReader * self,
+                                        GumFoundFileEventFunc func,
+                                        gpointer user_data)
+{
+  const guint8 * p, * end;
+
+  p = self->data + self->header->data_offset;
+  end = self->data + self->size;
+
+  while ((gsize) (end - p) >= sizeof (GumFileChunk))
+  {
+    GumFileChunk chunk;
+    const guint8 * events, * events_end;
+    GumEvent ev;
+
+    memcpy (&chunk, p, sizeof (chunk));
+    if (chunk.capacity == 0 || (guint) chunk.used > chunk.capacity ||
+        (gsize) (end - p) - sizeof (GumFileChunk) < chunk.capacity)
+      return;
+
+    events = p + sizeof (GumFileChunk);
+    events_end = events + chunk.used;
+
+    if (self->header->format == GUM_FILE_EVENT_FORMAT_COMPACT)
+    {
+      GumCompactEventCursor cursor;
+
+      gum_compact_event_cursor_init (&cursor);
+
+      while (gum_compact_event_decode (&cursor, &events, events_end, &ev))
+      {
+        if (!func (chunk.thread_id, &ev, user_data))
+          return;
+      }
+    }
+    else
+    {
+      while ((gsize) (events_end - events) >= sizeof (GumEvent))
+      {
+        memcpy (&ev, events, sizeof (GumEvent));
+        events += sizeof (GumEvent);
+
+        if (!func (chunk.thread_id, &ev, user_data))
+          return;
+      }
+    }
+
+    p += sizeof (GumFileChunk) + chunk.capacity;
+  }
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#ifndef __GUM_FILE_EVENT_SINK_H__
+#define __GUM_FILE_EVENT_SINK_H__
+
+#include <glib-object.h>
+#include <gum/gumdefs.h>
+#include <gum/gumeventsink.h>
+#include <gum/gumprocess.h>
+
+G_BEGIN_DECLS
+
+#define GUM_TYPE_FILE_EVENT_SINK (gum_file_event_sink_get_type ())
+G_DECLARE_FINAL_TYPE (GumFileEventSink, gum_file_event_sink, GUM,
+    FILE_EVENT_SINK, GObject)
+
+typedef struct _GumFileEventReader GumFileEventReader;
+
+typedef enum {
+  GUM_FILE_EVENT_FORMAT_RAW,
+  GUM_FILE_EVENT_FORMAT_COMPACT
+} GumFileEventFormat;
+
+typedef gboolean (* GumFoundFileEventFunc) (GumThreadId thread_id,
+    const GumEvent * ev, gpointer user_data);
+
+GUM_API GumEventSink * gum_file_event_sink_new (const gchar * path_prefix,
+    GumEventType mask, GumFileEventFormat format, gsize segment_size,
+    guint max_segments, GError ** error);
+
+GUM_API gchar * gum_file_event_sink_get_segment_path (
+    const gchar * path_prefix, guint index);
+
+GUM_API GumFileEventReader * gum_file_event_reader_open (const gchar * path,
+    GError ** error);
+GUM_API void gum_file_event_reader_free (GumFileEventReader * reader);
+
+GUM_API guint gum_file_event_reader_get_segment_index (
+    GumFileEventReader * self);
+GUM_API GumFileEventFormat gum_file_event_reader_get_format (
+    GumFileEventReader * self);
+GUM_API void gum_file_event_reader_enumerate_modules (
+    GumFileEventReader * self, GumFoundModuleFunc func, gpointer user_data);
+GUM_API void gum_file_event_reader_enumerate_events (
+    GumFileEventReader * self, GumFoundFileEventFunc func,
+    gpointer user_data);
+
+G_END_DECLS
+
+#endif
@@ -18,6 +18,10 @@ typedef struct _GumInterceptorBackend GumInterceptorBackend;
 typedef struct _GumFunctionContext GumFunctionContext;
 typedef struct _GumFunctionContextBackendData GumFunctionContextBackendData;
 
+typedef void (* GumBeginInvocationFunc) (GumFunctionContext * function_ctx,
+    GumCpuContext * cpu_context, gpointer * caller_ret_addr,
+    gpointer * next_hop);
+
 struct _GumFunctionContextBackendData
 {
   gpointer data[2];
@@ -43,6 +47,12 @@ struct _GumFunctionContext
 
   gpointer on_leave_trampoline;
 
+  /*
+   * What the enter thunk calls. Backends that call through this get a
+   * cheaper path for functions whose listeners allow it.
+   */
+  GumBeginInvocationFunc begin_invocation;
+
   volatile GPtrArray * listener_entries;
 
   gpointer replacement_function;
@@ -86,5 +96,7 @@ G_GNUC_INTERNAL gboolean _gum_interceptor_backend_can_intercept (
 G_GNUC_INTERNAL gpointer _gum_interceptor_peek_top_caller_return_address (void);
 G_GNUC_INTERNAL gpointer _gum_interceptor_translate_top_return_address (
     gpointer return_address);
+G_GNUC_INTERNAL gboolean _gum_interceptor_is_using_enter_only_path (
+    GumInterceptor * self, gpointer function_address);
 
 #endif
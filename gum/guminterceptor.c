@@ -23,6 +23,8 @@
 #define GUM_INTERCEPTOR_CODE_SLICE_SIZE 256
 #endif
 
+#define GUM_INVOCATION_STACK_CHUNK_CAPACITY GUM_MAX_CALL_DEPTH
+
 #define GUM_INTERCEPTOR_LOCK(o) g_rec_mutex_lock (&(o)->mutex)
 #define GUM_INTERCEPTOR_UNLOCK(o) g_rec_mutex_unlock (&(o)->mutex)
 
@@ -32,6 +34,8 @@ typedef struct _GumPrologueWrite GumPrologueWrite;
 typedef struct _ListenerEntry ListenerEntry;
 typedef struct _InterceptorThreadContext InterceptorThreadContext;
 typedef struct _GumInvocationStackEntry GumInvocationStackEntry;
+typedef struct _GumInvocationStackChunk GumInvocationStackChunk;
+typedef struct _ListenerSlot ListenerSlot;
 typedef struct _ListenerDataSlot ListenerDataSlot;
 typedef struct _ListenerInvocationState ListenerInvocationState;
 
@@ -82,18 +86,28 @@ struct _ListenerEntry
   GumInvocationListenerInterface * listener_interface;
   GumInvocationListener * listener_instance;
   gpointer function_data;
+  guint thread_data_index;
+  guint invocation_data_index;
 };
 
+/*
+ * Everything the hot path needs lives here and is reached through a single
+ * TLS lookup. `guard` is the interceptor that is currently running code on
+ * this thread, so that anything it calls into bypasses its hooks.
+ * `being_created` marks the temporary context that stands in for the real
+ * one while the latter is being set up, which bypasses every interceptor.
+ */
 struct _InterceptorThreadContext
 {
-  GumInvocationBackend listener_backend;
-  GumInvocationBackend replacement_backend;
-
+  gboolean being_created;
+  GumInterceptor * guard;
   gint ignore_level;
-
   GumInvocationStack * stack;
 
-  GArray * listener_data_slots;
+  GumInvocationBackend listener_backend;
+  GumInvocationBackend replacement_backend;
+
+  GPtrArray * listener_data_slots;
 };
 
 struct _GumInvocationStackEntry
@@ -101,13 +115,46 @@ struct _GumInvocationStackEntry
   gpointer trampoline_ret_addr;
   gpointer caller_ret_addr;
   GumInvocationContext invocation_context;
-  GumCpuContext cpu_context;
+  GumCpuContext * cpu_context_copy;
   guint8 listener_invocation_data[GUM_MAX_LISTENERS_PER_FUNCTION]
       [GUM_MAX_LISTENER_DATA];
   gboolean calling_replacement;
   gint original_system_error;
 };
 
+/*
+ * Entries live in chunks that are kept around once allocated, so pushing
+ * and popping doesn't allocate in the steady state and an entry never moves
+ * while it's on the stack. Only replacements need a copy of the CPU context,
+ * so those are allocated per chunk on first use.
+ */
+struct _GumInvocationStackChunk
+{
+  GumInvocationStackChunk * previous;
+  GumInvocationStackChunk * next;
+  GumCpuContext * cpu_contexts;
+  GumInvocationStackEntry entries[GUM_INVOCATION_STACK_CHUNK_CAPACITY];
+};
+
+struct _GumInvocationStack
+{
+  guint depth;
+  GumInvocationStackChunk * top_chunk;
+  guint top_chunk_length;
+  GumInvocationStackChunk first_chunk;
+};
+
+/*
+ * Each attached listener gets a dense index into every thread's
+ * `listener_data_slots`, which is handed back out once it's no longer
+ * attached anywhere.
+ */
+struct _ListenerSlot
+{
+  guint index;
+  guint ref_count;
+};
+
 struct _ListenerDataSlot
 {
   GumInvocationListener * owner;
@@ -128,6 +175,9 @@ static void gum_interceptor_finalize (GObject * object);
 static void the_interceptor_weak_notify (gpointer data,
     GObject * where_the_object_was);
 
+static GumAttachReturn gum_interceptor_attach_one (GumInterceptor * self,
+    gpointer function_address, GumInvocationListener * listener,
+    gpointer listener_function_data);
 static GumFunctionContext * gum_interceptor_instrument (GumInterceptor * self,
     gpointer function_address);
 static void gum_interceptor_activate (GumInterceptor * self,
@@ -162,13 +212,22 @@ static void gum_function_context_add_listener (
     gpointer function_data);
 static void gum_function_context_remove_listener (
     GumFunctionContext * function_ctx, GumInvocationListener * listener);
+static void gum_function_context_update_begin_invocation (
+    GumFunctionContext * function_ctx);
+static ListenerEntry * gum_function_context_find_enter_only_listener (
+    GumFunctionContext * function_ctx);
 static void listener_entry_free (ListenerEntry * entry);
+static guint gum_function_context_find_free_invocation_data_index (
+    GumFunctionContext * function_ctx);
 static gboolean gum_function_context_has_listener (
     GumFunctionContext * function_ctx, GumInvocationListener * listener);
 static ListenerEntry ** gum_function_context_find_listener (
     GumFunctionContext * function_ctx, GumInvocationListener * listener);
 static ListenerEntry ** gum_function_context_find_taken_listener_slot (
     GumFunctionContext * function_ctx);
+static void gum_function_context_begin_enter_only_invocation (
+    GumFunctionContext * function_ctx, GumCpuContext * cpu_context,
+    gpointer * caller_ret_addr, gpointer * next_hop);
 static void gum_function_context_fixup_cpu_context (
     GumFunctionContext * function_ctx, GumCpuContext * cpu_context);
 
@@ -180,15 +239,25 @@ static void interceptor_thread_context_destroy (
     InterceptorThreadContext * context);
 static gpointer interceptor_thread_context_get_listener_data (
     InterceptorThreadContext * self, GumInvocationListener * listener,
-    gsize required_size);
+    guint index, gsize required_size);
 static void interceptor_thread_context_forget_listener_data (
-    InterceptorThreadContext * self, GumInvocationListener * listener);
+    InterceptorThreadContext * self, guint index);
+
+static guint gum_listener_slot_acquire (GumInvocationListener * listener);
+static void gum_listener_slot_release (GumInvocationListener * listener);
+static void gum_listener_slot_free (ListenerSlot * slot);
+static GumInvocationStack * gum_invocation_stack_new (void);
+static void gum_invocation_stack_free (GumInvocationStack * stack);
 static GumInvocationStackEntry * gum_invocation_stack_push (
     GumInvocationStack * stack, GumFunctionContext * function_ctx,
     gpointer caller_ret_addr);
 static gpointer gum_invocation_stack_pop (GumInvocationStack * stack);
 static GumInvocationStackEntry * gum_invocation_stack_peek_top (
     GumInvocationStack * stack);
+static GumCpuContext * gum_invocation_stack_copy_cpu_context (
+    GumInvocationStack * stack, const GumCpuContext * cpu_context);
+static guint8 * gum_invocation_stack_entry_get_listener_data (
+    GumInvocationStackEntry * entry, ListenerEntry * listener_entry);
 
 static gpointer gum_interceptor_resolve (GumInterceptor * self,
     gpointer address);
@@ -197,6 +266,8 @@ static gboolean gum_interceptor_has (GumInterceptor * self,
 
 static gpointer gum_page_address_from_pointer (gpointer ptr);
 static gint gum_page_address_compare (gconstpointer a, gconstpointer b);
+static GArray * gum_page_runs_from_sorted_pages (GList * pages,
+    guint page_size);
 
 G_DEFINE_TYPE (GumInterceptor, gum_interceptor, G_TYPE_OBJECT)
 
@@ -207,9 +278,14 @@ static GumSpinlock gum_interceptor_thread_context_lock = GUM_SPINLOCK_INIT;
 static GHashTable * gum_interceptor_thread_contexts;
 static GPrivate gum_interceptor_context_private =
     G_PRIVATE_INIT ((GDestroyNotify) release_interceptor_thread_context);
-static GumTlsKey gum_interceptor_guard_key;
+static GumTlsKey gum_interceptor_context_key;
 
-static GumInvocationStack _gum_interceptor_empty_stack = { NULL, 0 };
+static GMutex gum_listener_slot_lock;
+static GHashTable * gum_listener_slots;
+static GArray * gum_free_listener_slot_indices;
+static guint gum_next_listener_slot_index;
+
+static GumInvocationStack _gum_interceptor_empty_stack;
 
 static void
 gum_interceptor_class_init (GumInterceptorClass * klass)
@@ -226,13 +302,23 @@ _gum_interceptor_init (void)
   gum_interceptor_thread_contexts = g_hash_table_new_full (NULL, NULL,
       (GDestroyNotify) interceptor_thread_context_destroy, NULL);
 
-  gum_interceptor_guard_key = gum_tls_key_new ();
+  gum_interceptor_context_key = gum_tls_key_new ();
+
+  gum_listener_slots = g_hash_table_new_full (NULL, NULL, NULL,
+      (GDestroyNotify) gum_listener_slot_free);
+  gum_free_listener_slot_indices = g_array_new (FALSE, FALSE, sizeof (guint));
+  gum_next_listener_slot_index = 0;
 }
 
 void
 _gum_interceptor_deinit (void)
 {
-  gum_tls_key_free (gum_interceptor_guard_key);
+  g_array_free (gum_free_listener_slot_indices, TRUE);
+  gum_free_listener_slot_indices = NULL;
+  g_hash_table_unref (gum_listener_slots);
+  gum_listener_slots = NULL;
+
+  gum_tls_key_free (gum_interceptor_context_key);
 
   g_hash_table_unref (gum_interceptor_thread_contexts);
   gum_interceptor_thread_contexts = NULL;
@@ -330,53 +416,91 @@ gum_interceptor_attach (GumInterceptor * self,
                         GumInvocationListener * listener,
                         gpointer listener_function_data)
 {
-  GumAttachReturn result = GUM_ATTACH_OK;
-  GumFunctionContext * function_ctx;
+  GumAttachReturn result;
 
   if (gum_process_get_code_signing_policy () == GUM_CODE_SIGNING_REQUIRED)
-    goto policy_violation;
+    return GUM_ATTACH_POLICY_VIOLATION;
+
+  gum_interceptor_ignore_current_thread (self);
+  GUM_INTERCEPTOR_LOCK (self);
+  gum_interceptor_transaction_begin (&self->current_transaction);
+  self->current_transaction.is_dirty = TRUE;
+
+  result = gum_interceptor_attach_one (self, function_address, listener,
+      listener_function_data);
+
+  gum_interceptor_transaction_end (&self->current_transaction);
+  GUM_INTERCEPTOR_UNLOCK (self);
+  gum_interceptor_unignore_current_thread (self);
+
+  return result;
+}
+
+/*
+ * Attaches `listener` to each of the `n_functions` functions, optionally
+ * with function data for each, and returns how many of them it attached
+ * to. All of the prologues are written when the outermost transaction
+ * ends, touching each page once.
+ */
+guint
+gum_interceptor_attach_many (GumInterceptor * self,
+                             const gpointer * function_addresses,
+                             guint n_functions,
+                             GumInvocationListener * listener,
+                             const gpointer * listener_function_data)
+{
+  guint n_attached, i;
+
+  if (gum_process_get_code_signing_policy () == GUM_CODE_SIGNING_REQUIRED)
+    return 0;
 
   gum_interceptor_ignore_current_thread (self);
   GUM_INTERCEPTOR_LOCK (self);
   gum_interceptor_transaction_begin (&self->current_transaction);
   self->current_transaction.is_dirty = TRUE;
 
+  n_attached = 0;
+  for (i = 0; i != n_functions; i++)
+  {
+    gpointer function_data = (listener_function_data != NULL)
+        ? listener_function_data[i]
+        : NULL;
+
+    if (gum_interceptor_attach_one (self, function_addresses[i], listener,
+        function_data) == GUM_ATTACH_OK)
+    {
+      n_attached++;
+    }
+  }
+
+  gum_interceptor_transaction_end (&self->current_transaction);
+  GUM_INTERCEPTOR_UNLOCK (self);
+  gum_interceptor_unignore_current_thread (self);
+
+  return n_attached;
+}
+
+static GumAttachReturn
+gum_interceptor_attach_one (GumInterceptor * self,
+                            gpointer function_address,
+                            GumInvocationListener * listener,
+                            gpointer listener_function_data)
+{
+  GumFunctionContext * function_ctx;
+
   function_address = gum_interceptor_resolve (self, function_address);
 
   function_ctx = gum_interceptor_instrument (self, function_address);
   if (function_ctx == NULL)
-    goto wrong_signature;
+    return GUM_ATTACH_WRONG_SIGNATURE;
 
   if (gum_function_context_has_listener (function_ctx, listener))
-    goto already_attached;
+    return GUM_ATTACH_ALREADY_ATTACHED;
 
   gum_function_context_add_listener (function_ctx, listener,
       listener_function_data);
 
-  goto beach;
-
-policy_violation:
-  {
-    return GUM_ATTACH_POLICY_VIOLATION;
-  }
-wrong_signature:
-  {
-    result = GUM_ATTACH_WRONG_SIGNATURE;
-    goto beach;
-  }
-already_attached:
-  {
-    result = GUM_ATTACH_ALREADY_ATTACHED;
-    goto beach;
-  }
-beach:
-  {
-    gum_interceptor_transaction_end (&self->current_transaction);
-    GUM_INTERCEPTOR_UNLOCK (self);
-    gum_interceptor_unignore_current_thread (self);
-
-    return result;
-  }
+  return GUM_ATTACH_OK;
 }
 
 void
@@ -385,7 +509,6 @@ gum_interceptor_detach (GumInterceptor * self,
 {
   GHashTableIter iter;
   GumFunctionContext * function_ctx;
-  InterceptorThreadContext * thread_ctx;
 
   gum_interceptor_ignore_current_thread (self);
   GUM_INTERCEPTOR_LOCK (self);
@@ -409,12 +532,6 @@ gum_interceptor_detach (GumInterceptor * self,
     }
   }
 
-  gum_spinlock_acquire (&gum_interceptor_thread_context_lock);
-  g_hash_table_iter_init (&iter, gum_interceptor_thread_contexts);
-  while (g_hash_table_iter_next (&iter, (gpointer *) &thread_ctx, NULL))
-    interceptor_thread_context_forget_listener_data (thread_ctx, listener);
-  gum_spinlock_release (&gum_interceptor_thread_context_lock);
-
   gum_interceptor_transaction_end (&self->current_transaction);
   GUM_INTERCEPTOR_UNLOCK (self);
   gum_interceptor_unignore_current_thread (self);
@@ -447,6 +564,7 @@ gum_interceptor_replace (GumInterceptor * self,
 
   function_ctx->replacement_data = replacement_data;
   function_ctx->replacement_function = replacement_function;
+  gum_function_context_update_begin_invocation (function_ctx);
 
   goto beach;
 
@@ -492,6 +610,7 @@ gum_interceptor_revert (GumInterceptor * self,
 
   function_ctx->replacement_function = NULL;
   function_ctx->replacement_data = NULL;
+  gum_function_context_update_begin_invocation (function_ctx);
 
   if (gum_function_context_is_empty (function_ctx))
   {
@@ -559,7 +678,7 @@ gum_interceptor_get_current_stack (void)
 {
   InterceptorThreadContext * context;
 
-  context = g_private_get (&gum_interceptor_context_private);
+  context = gum_tls_key_get_value (gum_interceptor_context_key);
   if (context == NULL)
     return &_gum_interceptor_empty_stack;
 
@@ -601,15 +720,26 @@ gpointer
 gum_invocation_stack_translate (GumInvocationStack * self,
                                 gpointer return_address)
 {
-  guint i;
+  GumInvocationStackChunk * chunk;
+  guint remaining, i;
+
+  chunk = &self->first_chunk;
+  remaining = self->depth;
 
-  for (i = 0; i != self->len; i++)
+  while (remaining != 0)
   {
-    GumInvocationStackEntry * entry;
+    guint n = MIN (remaining, GUM_INVOCATION_STACK_CHUNK_CAPACITY);
 
-    entry = &g_array_index (self, GumInvocationStackEntry, i);
-    if (entry->trampoline_ret_addr == return_address)
-      return entry->caller_ret_addr;
+    for (i = 0; i != n; i++)
+    {
+      GumInvocationStackEntry * entry = &chunk->entries[i];
+
+      if (entry->trampoline_ret_addr == return_address)
+        return entry->caller_ret_addr;
+    }
+
+    chunk = chunk->next;
+    remaining -= n;
   }
 
   return return_address;
@@ -622,11 +752,10 @@ _gum_interceptor_peek_top_caller_return_address (void)
   GumInvocationStackEntry * entry;
 
   stack = gum_interceptor_get_current_stack ();
-  if (stack->len == 0)
+  entry = gum_invocation_stack_peek_top (stack);
+  if (entry == NULL)
     return NULL;
 
-  entry = &g_array_index (stack, GumInvocationStackEntry, stack->len - 1);
-
   return entry->caller_ret_addr;
 }
 
@@ -637,10 +766,10 @@ _gum_interceptor_translate_top_return_address (gpointer return_address)
   GumInvocationStackEntry * entry;
 
   stack = gum_interceptor_get_current_stack ();
-  if (stack->len == 0)
+  entry = gum_invocation_stack_peek_top (stack);
+  if (entry == NULL)
     goto fallback;
 
-  entry = &g_array_index (stack, GumInvocationStackEntry, stack->len - 1);
   if (entry->trampoline_ret_addr != return_address)
     goto fallback;
 
@@ -650,6 +779,29 @@ fallback:
   return return_address;
 }
 
+gboolean
+_gum_interceptor_is_using_enter_only_path (GumInterceptor * self,
+                                           gpointer function_address)
+{
+  gboolean result = FALSE;
+  GumFunctionContext * function_ctx;
+
+  GUM_INTERCEPTOR_LOCK (self);
+
+  function_ctx = (GumFunctionContext *) g_hash_table_lookup (
+      self->function_by_address,
+      gum_interceptor_resolve (self, function_address));
+  if (function_ctx != NULL)
+  {
+    result = function_ctx->begin_invocation ==
+        gum_function_context_begin_enter_only_invocation;
+  }
+
+  GUM_INTERCEPTOR_UNLOCK (self);
+
+  return result;
+}
+
 static GumFunctionContext *
 gum_interceptor_instrument (GumInterceptor * self,
                             gpointer function_address)
@@ -749,6 +901,8 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
   GumInterceptorTransaction transaction_copy;
   GList * addresses, * cur;
   guint page_size;
+  GArray * runs;
+  guint i;
   gboolean rwx_supported, code_segment_supported;
   GumDestroyTask * task;
 
@@ -780,6 +934,8 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
 
   page_size = gum_query_page_size ();
 
+  runs = gum_page_runs_from_sorted_pages (addresses, page_size);
+
   rwx_supported = gum_query_is_rwx_supported ();
   code_segment_supported = gum_code_segment_is_supported ();
 
@@ -789,18 +945,18 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
 
     protection = rwx_supported ? GUM_PAGE_RWX : GUM_PAGE_RW;
 
-    for (cur = addresses; cur != NULL; cur = cur->next)
+    for (i = 0; i != runs->len; i++)
     {
-      gpointer target_page = cur->data;
+      GumMemoryRange * run = &g_array_index (runs, GumMemoryRange, i);
 
-      gum_mprotect (target_page, page_size, protection);
+      gum_mprotect (GSIZE_TO_POINTER (run->base_address), run->size,
+          protection);
     }
 
     for (cur = addresses; cur != NULL; cur = cur->next)
     {
       gpointer target_page = cur->data;
       GArray * pending;
-      guint i;
 
       pending = g_hash_table_lookup (self->pending_prologue_writes,
           target_page);
@@ -819,19 +975,20 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
 
     if (!rwx_supported)
     {
-      for (cur = addresses; cur != NULL; cur = cur->next)
+      for (i = 0; i != runs->len; i++)
       {
-        gpointer target_page = cur->data;
+        GumMemoryRange * run = &g_array_index (runs, GumMemoryRange, i);
 
-        gum_mprotect (target_page, page_size, GUM_PAGE_RX);
+        gum_mprotect (GSIZE_TO_POINTER (run->base_address), run->size,
+            GUM_PAGE_RX);
       }
     }
 
-    for (cur = addresses; cur != NULL; cur = cur->next)
+    for (i = 0; i != runs->len; i++)
     {
-      gpointer target_page = cur->data;
+      GumMemoryRange * run = &g_array_index (runs, GumMemoryRange, i);
 
-      gum_clear_cache (target_page, page_size);
+      gum_clear_cache (GSIZE_TO_POINTER (run->base_address), run->size);
     }
   }
   else
@@ -860,7 +1017,6 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
     {
       guint8 * target_page = cur->data;
       GArray * pending;
-      guint i;
 
       pending = g_hash_table_lookup (self->pending_prologue_writes,
           target_page);
@@ -883,20 +1039,22 @@ gum_interceptor_transaction_end (GumInterceptorTransaction * self)
     gum_code_segment_realize (segment);
 
     source_offset = 0;
-    for (cur = addresses; cur != NULL; cur = cur->next)
+    for (i = 0; i != runs->len; i++)
     {
-      gpointer target_page = cur->data;
+      GumMemoryRange * run = &g_array_index (runs, GumMemoryRange, i);
+      gpointer target = GSIZE_TO_POINTER (run->base_address);
 
-      gum_code_segment_map (segment, source_offset, page_size, target_page);
+      gum_code_segment_map (segment, source_offset, run->size, target);
 
-      gum_clear_cache (target_page, page_size);
+      gum_clear_cache (target, run->size);
 
-      source_offset += page_size;
+      source_offset += run->size;
     }
 
     gum_code_segment_free (segment);
   }
 
+  g_array_free (runs, TRUE);
   g_list_free (addresses);
 
   while ((task = g_queue_pop_head (self->pending_destroy_tasks)) != NULL)
@@ -987,6 +1145,8 @@ gum_function_context_new (GumInterceptor * interceptor,
   ctx = g_slice_new0 (GumFunctionContext);
   ctx->function_address = function_address;
 
+  ctx->begin_invocation = _gum_function_context_begin_invocation;
+
   ctx->listener_entries =
       g_ptr_array_new_full (1, (GDestroyNotify) listener_entry_free);
 
@@ -1010,10 +1170,20 @@ gum_function_context_destroy (GumFunctionContext * function_ctx)
 {
   GumInterceptorTransaction * transaction =
       &function_ctx->interceptor->current_transaction;
+  GPtrArray * listener_entries;
+  guint i;
 
   g_assert (!function_ctx->destroyed);
   function_ctx->destroyed = TRUE;
 
+  listener_entries = g_atomic_pointer_get (&function_ctx->listener_entries);
+  for (i = 0; i != listener_entries->len; i++)
+  {
+    ListenerEntry * entry = g_ptr_array_index (listener_entries, i);
+    if (entry != NULL)
+      gum_listener_slot_release (entry->listener_instance);
+  }
+
   if (function_ctx->activated)
   {
     gum_interceptor_transaction_schedule_prologue_write (transaction,
@@ -1055,6 +1225,9 @@ gum_function_context_add_listener (GumFunctionContext * function_ctx,
   entry->listener_interface = GUM_INVOCATION_LISTENER_GET_IFACE (listener);
   entry->listener_instance = listener;
   entry->function_data = function_data;
+  entry->thread_data_index = gum_listener_slot_acquire (listener);
+  entry->invocation_data_index =
+      gum_function_context_find_free_invocation_data_index (function_ctx);
 
   old_entries = g_atomic_pointer_get (&function_ctx->listener_entries);
   new_entries = g_ptr_array_new_full (old_entries->len + 1,
@@ -1076,6 +1249,8 @@ gum_function_context_add_listener (GumFunctionContext * function_ctx,
   {
     function_ctx->has_on_leave_listener = TRUE;
   }
+
+  gum_function_context_update_begin_invocation (function_ctx);
 }
 
 static void
@@ -1084,6 +1259,36 @@ listener_entry_free (ListenerEntry * entry)
   g_slice_free (ListenerEntry, entry);
 }
 
+/*
+ * Listeners keep their index for as long as they're attached, so entries
+ * being added or removed never shuffle the invocation data of a call that
+ * is in flight.
+ */
+static guint
+gum_function_context_find_free_invocation_data_index (
+    GumFunctionContext * function_ctx)
+{
+  GPtrArray * listener_entries;
+  guint index, i;
+
+  listener_entries = g_atomic_pointer_get (&function_ctx->listener_entries);
+
+  for (index = 0; TRUE; index++)
+  {
+    gboolean taken = FALSE;
+
+    for (i = 0; i != listener_entries->len && !taken; i++)
+    {
+      ListenerEntry * entry = g_ptr_array_index (listener_entries, i);
+
+      taken = entry != NULL && entry->invocation_data_index == index;
+    }
+
+    if (!taken)
+      return index;
+  }
+}
+
 static void
 gum_function_context_remove_listener (GumFunctionContext * function_ctx,
                                       GumInvocationListener * listener)
@@ -1098,6 +1303,8 @@ gum_function_context_remove_listener (GumFunctionContext * function_ctx,
   listener_entry_free (*slot);
   *slot = NULL;
 
+  gum_listener_slot_release (listener);
+
   has_on_leave_listener = FALSE;
   listener_entries = g_atomic_pointer_get (&function_ctx->listener_entries);
   for (i = 0; i != listener_entries->len; i++)
@@ -1110,6 +1317,64 @@ gum_function_context_remove_listener (GumFunctionContext * function_ctx,
     }
   }
   function_ctx->has_on_leave_listener = has_on_leave_listener;
+
+  gum_function_context_update_begin_invocation (function_ctx);
+}
+
+static void
+gum_function_context_update_begin_invocation (
+    GumFunctionContext * function_ctx)
+{
+  if (gum_function_context_find_enter_only_listener (function_ctx) != NULL)
+  {
+    function_ctx->begin_invocation =
+        gum_function_context_begin_enter_only_invocation;
+  }
+  else
+  {
+    function_ctx->begin_invocation = _gum_function_context_begin_invocation;
+  }
+}
+
+/*
+ * Returns the listener if it's the only one and all it wants is to be told
+ * about calls, which means we don't have to trap the return. Removed
+ * listeners leave a NULL slot behind until the next one is added, so those
+ * don't count.
+ */
+static ListenerEntry *
+gum_function_context_find_enter_only_listener (
+    GumFunctionContext * function_ctx)
+{
+  GPtrArray * listener_entries;
+  ListenerEntry * entry;
+  guint i;
+
+  if (function_ctx->replacement_function != NULL)
+    return NULL;
+
+  listener_entries = g_atomic_pointer_get (&function_ctx->listener_entries);
+
+  entry = NULL;
+  for (i = 0; i != listener_entries->len; i++)
+  {
+    ListenerEntry * cur = g_ptr_array_index (listener_entries, i);
+
+    if (cur == NULL)
+      continue;
+
+    if (entry != NULL)
+      return NULL;
+
+    entry = cur;
+  }
+
+  if (entry == NULL ||
+      entry->listener_interface->on_enter == NULL ||
+      entry->listener_interface->on_leave != NULL)
+    return NULL;
+
+  return entry;
 }
 
 static gboolean
@@ -1180,14 +1445,14 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
   system_error = gum_thread_get_system_error ();
 #endif
 
-  if (gum_tls_key_get_value (gum_interceptor_guard_key) == interceptor)
+  interceptor_ctx = get_interceptor_thread_context ();
+  if (interceptor_ctx->guard == interceptor || interceptor_ctx->being_created)
   {
     *next_hop = function_ctx->on_invoke_trampoline;
     goto bypass;
   }
-  gum_tls_key_set_value (gum_interceptor_guard_key, interceptor);
+  interceptor_ctx->guard = interceptor;
 
-  interceptor_ctx = get_interceptor_thread_context ();
   stack = interceptor_ctx->stack;
 
   stack_entry = gum_invocation_stack_peek_top (stack);
@@ -1195,7 +1460,7 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
       stack_entry->invocation_context.function ==
       function_ctx->function_address)
   {
-    gum_tls_key_set_value (gum_interceptor_guard_key, NULL);
+    interceptor_ctx->guard = NULL;
     *next_hop = function_ctx->on_invoke_trampoline;
     goto bypass;
   }
@@ -1256,7 +1521,8 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
       state.point_cut = GUM_POINT_ENTER;
       state.entry = listener_entry;
       state.interceptor_ctx = interceptor_ctx;
-      state.invocation_data = stack_entry->listener_invocation_data[i];
+      state.invocation_data = gum_invocation_stack_entry_get_listener_data (
+          stack_entry, listener_entry);
       invocation_ctx->backend->data = &state;
 
       if (listener_entry->listener_interface->on_enter != NULL)
@@ -1276,7 +1542,7 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
 
   gum_thread_set_system_error (system_error);
 
-  gum_tls_key_set_value (gum_interceptor_guard_key, NULL);
+  interceptor_ctx->guard = NULL;
 
   if (will_trap_on_leave)
   {
@@ -1286,9 +1552,10 @@ _gum_function_context_begin_invocation (GumFunctionContext * function_ctx,
   if (function_ctx->replacement_function != NULL)
   {
     stack_entry->calling_replacement = TRUE;
-    stack_entry->cpu_context = *cpu_context;
+    stack_entry->cpu_context_copy =
+        gum_invocation_stack_copy_cpu_context (stack, cpu_context);
     stack_entry->original_system_error = system_error;
-    invocation_ctx->cpu_context = &stack_entry->cpu_context;
+    invocation_ctx->cpu_context = stack_entry->cpu_context_copy;
     invocation_ctx->backend = &interceptor_ctx->replacement_backend;
     invocation_ctx->backend->data = function_ctx->replacement_data;
 
@@ -1310,6 +1577,97 @@ bypass:
   g_atomic_int_dec_and_test (&function_ctx->trampoline_usage_counter);
 }
 
+/*
+ * Same as _gum_function_context_begin_invocation() for a function with a
+ * single listener that only implements on_enter, minus everything that case
+ * doesn't need. Falls back to the generic path if the listeners changed
+ * since we were picked.
+ */
+static void
+gum_function_context_begin_enter_only_invocation (
+    GumFunctionContext * function_ctx,
+    GumCpuContext * cpu_context,
+    gpointer * caller_ret_addr,
+    gpointer * next_hop)
+{
+  GumInterceptor * interceptor;
+  InterceptorThreadContext * interceptor_ctx;
+  ListenerEntry * listener_entry;
+  GumInvocationStackEntry * stack_entry;
+  GumInvocationContext * invocation_ctx;
+  ListenerInvocationState state;
+  gint system_error;
+
+  g_atomic_int_inc (&function_ctx->trampoline_usage_counter);
+
+  listener_entry = gum_function_context_find_enter_only_listener (function_ctx);
+  if (listener_entry == NULL)
+  {
+    g_atomic_int_dec_and_test (&function_ctx->trampoline_usage_counter);
+    _gum_function_context_begin_invocation (function_ctx, cpu_context,
+        caller_ret_addr, next_hop);
+    return;
+  }
+
+  interceptor = function_ctx->interceptor;
+
+  *next_hop = function_ctx->on_invoke_trampoline;
+
+#ifdef G_OS_WIN32
+  system_error = gum_thread_get_system_error ();
+#endif
+
+  interceptor_ctx = get_interceptor_thread_context ();
+  if (interceptor_ctx->guard == interceptor ||
+      interceptor_ctx->being_created ||
+      interceptor_ctx->ignore_level > 0)
+  {
+    goto beach;
+  }
+
+  if (interceptor->selected_thread_id != 0 &&
+      gum_process_get_current_thread_id () != interceptor->selected_thread_id)
+  {
+    goto beach;
+  }
+
+  interceptor_ctx->guard = interceptor;
+
+#ifndef G_OS_WIN32
+  system_error = gum_thread_get_system_error ();
+#endif
+
+  stack_entry = gum_invocation_stack_push (interceptor_ctx->stack,
+      function_ctx, function_ctx->function_address);
+  invocation_ctx = &stack_entry->invocation_context;
+  invocation_ctx->cpu_context = cpu_context;
+  invocation_ctx->system_error = system_error;
+  invocation_ctx->backend = &interceptor_ctx->listener_backend;
+
+  gum_function_context_fixup_cpu_context (function_ctx, cpu_context);
+
+  state.point_cut = GUM_POINT_ENTER;
+  state.entry = listener_entry;
+  state.interceptor_ctx = interceptor_ctx;
+  state.invocation_data = gum_invocation_stack_entry_get_listener_data (
+      stack_entry, listener_entry);
+  invocation_ctx->backend->data = &state;
+
+  listener_entry->listener_interface->on_enter (
+      listener_entry->listener_instance, invocation_ctx);
+
+  system_error = invocation_ctx->system_error;
+
+  gum_invocation_stack_pop (interceptor_ctx->stack);
+
+  gum_thread_set_system_error (system_error);
+
+  interceptor_ctx->guard = NULL;
+
+beach:
+  g_atomic_int_dec_and_test (&function_ctx->trampoline_usage_counter);
+}
+
 void
 _gum_function_context_end_invocation (GumFunctionContext * function_ctx,
                                       GumCpuContext * cpu_context,
@@ -1326,14 +1684,13 @@ _gum_function_context_end_invocation (GumFunctionContext * function_ctx,
   system_error = gum_thread_get_system_error ();
 #endif
 
-  gum_tls_key_set_value (gum_interceptor_guard_key, function_ctx->interceptor);
+  interceptor_ctx = get_interceptor_thread_context ();
+  interceptor_ctx->guard = function_ctx->interceptor;
 
 #ifndef G_OS_WIN32
   system_error = gum_thread_get_system_error ();
 #endif
 
-  interceptor_ctx = get_interceptor_thread_context ();
-
   stack_entry = gum_invocation_stack_peek_top (interceptor_ctx->stack);
   *next_hop = stack_entry->caller_ret_addr;
 
@@ -1365,7 +1722,8 @@ _gum_function_context_end_invocation (GumFunctionContext * function_ctx,
     state.point_cut = GUM_POINT_LEAVE;
     state.entry = listener_entry;
     state.interceptor_ctx = interceptor_ctx;
-    state.invocation_data = stack_entry->listener_invocation_data[i];
+    state.invocation_data = gum_invocation_stack_entry_get_listener_data (
+        stack_entry, listener_entry);
     invocation_ctx->backend->data = &state;
 
     if (listener_entry->listener_interface->on_leave != NULL)
@@ -1379,7 +1737,7 @@ _gum_function_context_end_invocation (GumFunctionContext * function_ctx,
 
   gum_invocation_stack_pop (interceptor_ctx->stack);
 
-  gum_tls_key_set_value (gum_interceptor_guard_key, NULL);
+  interceptor_ctx->guard = NULL;
 
   g_atomic_int_dec_and_test (&function_ctx->trampoline_usage_counter);
 }
@@ -1416,18 +1774,31 @@ static InterceptorThreadContext *
 get_interceptor_thread_context (void)
 {
   InterceptorThreadContext * context;
+  InterceptorThreadContext placeholder = { 0, };
 
-  context = g_private_get (&gum_interceptor_context_private);
-  if (context == NULL)
-  {
-    context = interceptor_thread_context_new ();
+  context = gum_tls_key_get_value (gum_interceptor_context_key);
+  if (G_LIKELY (context != NULL))
+    return context;
 
-    gum_spinlock_acquire (&gum_interceptor_thread_context_lock);
-    g_hash_table_add (gum_interceptor_thread_contexts, context);
-    gum_spinlock_release (&gum_interceptor_thread_context_lock);
+  /*
+   * Hooked functions called while we set things up below, e.g. malloc(),
+   * will see this placeholder and bypass their listeners. It lives on our
+   * stack so that each thread gets its own.
+   */
+  placeholder.being_created = TRUE;
+  placeholder.stack = &_gum_interceptor_empty_stack;
+  gum_tls_key_set_value (gum_interceptor_context_key, &placeholder);
 
-    g_private_set (&gum_interceptor_context_private, context);
-  }
+  context = interceptor_thread_context_new ();
+
+  gum_spinlock_acquire (&gum_interceptor_thread_context_lock);
+  g_hash_table_add (gum_interceptor_thread_contexts, context);
+  gum_spinlock_release (&gum_interceptor_thread_context_lock);
+
+  /* Only used so that we find out when the thread exits */
+  g_private_set (&gum_interceptor_context_private, context);
+
+  gum_tls_key_set_value (gum_interceptor_context_key, context);
 
   return context;
 }
@@ -1438,6 +1809,8 @@ release_interceptor_thread_context (InterceptorThreadContext * context)
   if (gum_interceptor_thread_contexts == NULL)
     return;
 
+  gum_tls_key_set_value (gum_interceptor_context_key, NULL);
+
   gum_spinlock_acquire (&gum_interceptor_thread_context_lock);
   g_hash_table_remove (gum_interceptor_thread_contexts, context);
   gum_spinlock_release (&gum_interceptor_thread_context_lock);
@@ -1469,7 +1842,7 @@ gum_interceptor_invocation_get_depth (GumInvocationContext * context)
   InterceptorThreadContext * interceptor_ctx =
       (InterceptorThreadContext *) context->backend->state;
 
-  return interceptor_ctx->stack->len - 1;
+  return interceptor_ctx->stack->depth - 1;
 }
 
 static gpointer
@@ -1481,7 +1854,8 @@ gum_interceptor_invocation_get_listener_thread_data (
       (ListenerInvocationState *) context->backend->data;
 
   return interceptor_thread_context_get_listener_data (data->interceptor_ctx,
-      data->entry->listener_instance, required_size);
+      data->entry->listener_instance, data->entry->thread_data_index,
+      required_size);
 }
 
 static gpointer
@@ -1501,7 +1875,7 @@ gum_interceptor_invocation_get_listener_invocation_data (
 
   data = (ListenerInvocationState *) context->backend->data;
 
-  if (required_size > GUM_MAX_LISTENER_DATA)
+  if (data->invocation_data == NULL || required_size > GUM_MAX_LISTENER_DATA)
     return NULL;
 
   return data->invocation_data;
@@ -1565,13 +1939,13 @@ interceptor_thread_context_new (void)
   context->listener_backend.state = context;
   context->replacement_backend.state = context;
 
+  context->being_created = FALSE;
+  context->guard = NULL;
   context->ignore_level = 0;
+  context->stack = gum_invocation_stack_new ();
 
-  context->stack = g_array_sized_new (FALSE, TRUE,
-      sizeof (GumInvocationStackEntry), GUM_MAX_CALL_DEPTH);
-
-  context->listener_data_slots = g_array_sized_new (FALSE, TRUE,
-      sizeof (ListenerDataSlot), GUM_MAX_LISTENERS_PER_FUNCTION);
+  context->listener_data_slots = g_ptr_array_sized_new (
+      GUM_MAX_LISTENERS_PER_FUNCTION);
 
   return context;
 }
@@ -1579,9 +1953,18 @@ interceptor_thread_context_new (void)
 static void
 interceptor_thread_context_destroy (InterceptorThreadContext * context)
 {
-  g_array_free (context->listener_data_slots, TRUE);
+  guint i;
+
+  for (i = 0; i != context->listener_data_slots->len; i++)
+  {
+    ListenerDataSlot * slot =
+        g_ptr_array_index (context->listener_data_slots, i);
+    if (slot != NULL)
+      g_slice_free (ListenerDataSlot, slot);
+  }
+  g_ptr_array_free (context->listener_data_slots, TRUE);
 
-  g_array_free (context->stack, TRUE);
+  gum_invocation_stack_free (context->stack);
 
   g_slice_free (InterceptorThreadContext, context);
 }
@@ -1589,60 +1972,154 @@ interceptor_thread_context_destroy (InterceptorThreadContext * context)
 static gpointer
 interceptor_thread_context_get_listener_data (InterceptorThreadContext * self,
                                               GumInvocationListener * listener,
+                                              guint index,
                                               gsize required_size)
 {
-  guint i;
-  ListenerDataSlot * available_slot = NULL;
+  GPtrArray * slots = self->listener_data_slots;
+  ListenerDataSlot * slot;
 
   if (required_size > GUM_MAX_LISTENER_DATA)
     return NULL;
 
-  for (i = 0; i != self->listener_data_slots->len; i++)
-  {
-    ListenerDataSlot * slot;
-
-    slot = &g_array_index (self->listener_data_slots, ListenerDataSlot, i);
-    if (slot->owner == listener)
-      return slot->data;
-    else if (slot->owner == NULL)
-      available_slot = slot;
-  }
+  if (index >= slots->len)
+    g_ptr_array_set_size (slots, index + 1);
 
-  if (available_slot == NULL)
+  slot = g_ptr_array_index (slots, index);
+  if (slot == NULL)
   {
-    g_array_set_size (self->listener_data_slots,
-        self->listener_data_slots->len + 1);
-    available_slot = &g_array_index (self->listener_data_slots,
-        ListenerDataSlot, self->listener_data_slots->len - 1);
+    slot = g_slice_new0 (ListenerDataSlot);
+    g_ptr_array_index (slots, index) = slot;
   }
-  else
+  else if (slot->owner != listener)
   {
-    gum_memset (available_slot->data, 0, sizeof (available_slot->data));
+    gum_memset (slot->data, 0, sizeof (slot->data));
   }
 
-  available_slot->owner = listener;
+  slot->owner = listener;
 
-  return available_slot->data;
+  return slot->data;
 }
 
 static void
 interceptor_thread_context_forget_listener_data (
     InterceptorThreadContext * self,
-    GumInvocationListener * listener)
+    guint index)
 {
-  guint i;
+  ListenerDataSlot * slot;
+
+  if (index >= self->listener_data_slots->len)
+    return;
+
+  slot = g_ptr_array_index (self->listener_data_slots, index);
+  if (slot != NULL)
+    slot->owner = NULL;
+}
 
-  for (i = 0; i != self->listener_data_slots->len; i++)
+static guint
+gum_listener_slot_acquire (GumInvocationListener * listener)
+{
+  ListenerSlot * slot;
+  guint index;
+
+  g_mutex_lock (&gum_listener_slot_lock);
+
+  slot = g_hash_table_lookup (gum_listener_slots, listener);
+  if (slot == NULL)
   {
-    ListenerDataSlot * slot;
+    slot = g_slice_new (ListenerSlot);
 
-    slot = &g_array_index (self->listener_data_slots, ListenerDataSlot, i);
-    if (slot->owner == listener)
+    if (gum_free_listener_slot_indices->len != 0)
+    {
+      slot->index = g_array_index (gum_free_listener_slot_indices, guint,
+          gum_free_listener_slot_indices->len - 1);
+      g_array_set_size (gum_free_listener_slot_indices,
+          gum_free_listener_slot_indices->len - 1);
+    }
+    else
     {
-      slot->owner = NULL;
-      return;
+      slot->index = gum_next_listener_slot_index++;
     }
+    slot->ref_count = 0;
+
+    g_hash_table_insert (gum_listener_slots, listener, slot);
+  }
+
+  slot->ref_count++;
+  index = slot->index;
+
+  g_mutex_unlock (&gum_listener_slot_lock);
+
+  return index;
+}
+
+static void
+gum_listener_slot_release (GumInvocationListener * listener)
+{
+  ListenerSlot * slot;
+  GHashTableIter iter;
+  InterceptorThreadContext * thread_ctx;
+
+  g_mutex_lock (&gum_listener_slot_lock);
+
+  slot = g_hash_table_lookup (gum_listener_slots, listener);
+  g_assert (slot != NULL);
+
+  if (--slot->ref_count == 0)
+  {
+    guint index = slot->index;
+
+    gum_spinlock_acquire (&gum_interceptor_thread_context_lock);
+    g_hash_table_iter_init (&iter, gum_interceptor_thread_contexts);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &thread_ctx, NULL))
+      interceptor_thread_context_forget_listener_data (thread_ctx, index);
+    gum_spinlock_release (&gum_interceptor_thread_context_lock);
+
+    g_array_append_val (gum_free_listener_slot_indices, index);
+
+    g_hash_table_remove (gum_listener_slots, listener);
   }
+
+  g_mutex_unlock (&gum_listener_slot_lock);
+}
+
+static void
+gum_listener_slot_free (ListenerSlot * slot)
+{
+  g_slice_free (ListenerSlot, slot);
+}
+
+static GumInvocationStack *
+gum_invocation_stack_new (void)
+{
+  GumInvocationStack * stack;
+
+  stack = g_slice_new (GumInvocationStack);
+  stack->depth = 0;
+  stack->top_chunk = &stack->first_chunk;
+  stack->top_chunk_length = 0;
+  stack->first_chunk.previous = NULL;
+  stack->first_chunk.next = NULL;
+  stack->first_chunk.cpu_contexts = NULL;
+
+  return stack;
+}
+
+static void
+gum_invocation_stack_free (GumInvocationStack * stack)
+{
+  GumInvocationStackChunk * chunk, * next;
+
+  for (chunk = &stack->first_chunk; chunk != NULL; chunk = next)
+  {
+    next = chunk->next;
+
+    g_free (chunk->cpu_contexts);
+
+    if (chunk != &stack->first_chunk)
+      g_slice_free (GumInvocationStackChunk, chunk);
+  }
+
+  g_slice_free (GumInvocationStack, stack);
 }
 
 static GumInvocationStackEntry *
@@ -1653,16 +2130,41 @@ gum_invocation_stack_push (GumInvocationStack * stack,
   GumInvocationStackEntry * entry;
   GumInvocationContext * ctx;
 
-  g_array_set_size (stack, stack->len + 1);
-  entry = (GumInvocationStackEntry *)
-      &g_array_index (stack, GumInvocationStackEntry, stack->len - 1);
+  if (stack->top_chunk_length == GUM_INVOCATION_STACK_CHUNK_CAPACITY)
+  {
+    GumInvocationStackChunk * next = stack->top_chunk->next;
+
+    if (next == NULL)
+    {
+      next = g_slice_new (GumInvocationStackChunk);
+      next->previous = stack->top_chunk;
+      next->next = NULL;
+      next->cpu_contexts = NULL;
+
+      stack->top_chunk->next = next;
+    }
+
+    stack->top_chunk = next;
+    stack->top_chunk_length = 0;
+  }
+
+  entry = &stack->top_chunk->entries[stack->top_chunk_length++];
+  stack->depth++;
+
   entry->trampoline_ret_addr = function_ctx->on_leave_trampoline;
   entry->caller_ret_addr = caller_ret_addr;
+  entry->cpu_context_copy = NULL;
+  entry->calling_replacement = FALSE;
+  entry->original_system_error = 0;
+  /* Listeners rely on GUM_IC_GET_INVOCATION_DATA() starting out zeroed */
+  gum_memset (entry->listener_invocation_data, 0,
+      sizeof (entry->listener_invocation_data));
 
   ctx = &entry->invocation_context;
   ctx->function =
       GUM_POINTER_TO_FUNCPTR (GCallback, function_ctx->function_address);
-
+  ctx->cpu_context = NULL;
+  ctx->system_error = 0;
   ctx->backend = NULL;
 
   return entry;
@@ -1672,23 +2174,61 @@ static gpointer
 gum_invocation_stack_pop (GumInvocationStack * stack)
 {
   GumInvocationStackEntry * entry;
-  gpointer caller_ret_addr;
 
-  entry = (GumInvocationStackEntry *)
-      &g_array_index (stack, GumInvocationStackEntry, stack->len - 1);
-  caller_ret_addr = entry->caller_ret_addr;
-  g_array_set_size (stack, stack->len - 1);
+  entry = &stack->top_chunk->entries[--stack->top_chunk_length];
+  stack->depth--;
+
+  if (stack->top_chunk_length == 0 && stack->top_chunk->previous != NULL)
+  {
+    stack->top_chunk = stack->top_chunk->previous;
+    stack->top_chunk_length = GUM_INVOCATION_STACK_CHUNK_CAPACITY;
+  }
 
-  return caller_ret_addr;
+  return entry->caller_ret_addr;
 }
 
 static GumInvocationStackEntry *
 gum_invocation_stack_peek_top (GumInvocationStack * stack)
 {
-  if (stack->len == 0)
+  if (stack->depth == 0)
     return NULL;
 
-  return &g_array_index (stack, GumInvocationStackEntry, stack->len - 1);
+  return &stack->top_chunk->entries[stack->top_chunk_length - 1];
+}
+
+/*
+ * Copies `cpu_context` into storage that stays put for as long as the top
+ * entry is on the stack.
+ */
+static GumCpuContext *
+gum_invocation_stack_copy_cpu_context (GumInvocationStack * stack,
+                                       const GumCpuContext * cpu_context)
+{
+  GumInvocationStackChunk * chunk = stack->top_chunk;
+  GumCpuContext * copy;
+
+  if (chunk->cpu_contexts == NULL)
+  {
+    chunk->cpu_contexts =
+        g_new (GumCpuContext, GUM_INVOCATION_STACK_CHUNK_CAPACITY);
+  }
+
+  copy = &chunk->cpu_contexts[stack->top_chunk_length - 1];
+  *copy = *cpu_context;
+
+  return copy;
+}
+
+static guint8 *
+gum_invocation_stack_entry_get_listener_data (GumInvocationStackEntry * entry,
+                                              ListenerEntry * listener_entry)
+{
+  guint index = listener_entry->invocation_data_index;
+
+  if (index >= GUM_MAX_LISTENERS_PER_FUNCTION)
+    return NULL;
+
+  return entry->listener_invocation_data[index];
 }
 
 static gpointer
@@ -1727,5 +2267,50 @@ static gint
 gum_page_address_compare (gconstpointer a,
                           gconstpointer b)
 {
-  return GPOINTER_TO_SIZE (a) - GPOINTER_TO_SIZE (b);
+  gsize page_a = GPOINTER_TO_SIZE (a);
+  gsize page_b = GPOINTER_TO_SIZE (b);
+
+  if (page_a < page_b)
+    return -1;
+  else if (page_a > page_b)
+    return 1;
+  else
+    return 0;
+}
+
+/*
+ * Coalesces adjacent pages so that each run of them can be protected,
+ * mapped and flushed with a single call.
+ */
+static GArray *
+gum_page_runs_from_sorted_pages (GList * pages,
+                                 guint page_size)
+{
+  GArray * runs;
+  GList * cur;
+
+  runs = g_array_new (FALSE, FALSE, sizeof (GumMemoryRange));
+
+  for (cur = pages; cur != NULL; cur = cur->next)
+  {
+    GumAddress page = GUM_ADDRESS (cur->data);
+    GumMemoryRange * last = (runs->len != 0)
+        ? &g_array_index (runs, GumMemoryRange, runs->len - 1)
+        : NULL;
+
+    if (last != NULL && last->base_address + last->size == page)
+    {
+      last->size += page_size;
+    }
+    else
+    {
+      GumMemoryRange run;
+
+      run.base_address = page;
+      run.size = page_size;
+      g_array_append_val (runs, run);
+    }
+  }
+
+  return runs;
 }
@@ -18,7 +18,7 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE (GumInterceptor, gum_interceptor, GUM, INTERCEPTOR,
     GObject)
 
-typedef GArray GumInvocationStack;
+typedef struct _GumInvocationStack GumInvocationStack;
 
 typedef enum
 {
@@ -41,6 +41,10 @@ GUM_API GumInterceptor * gum_interceptor_obtain (void);
 GUM_API GumAttachReturn gum_interceptor_attach (GumInterceptor * self,
     gpointer function_address, GumInvocationListener * listener,
     gpointer listener_function_data);
+GUM_API guint gum_interceptor_attach_many (GumInterceptor * self,
+    const gpointer * function_addresses, guint n_functions,
+    GumInvocationListener * listener,
+    const gpointer * listener_function_data);
 GUM_API void gum_interceptor_detach (GumInterceptor * self,
     GumInvocationListener * listener);
 
@@ -72,3 +72,120 @@ gum_skip_uleb128 (const guint8 ** data)
   p++;
   *data = p;
 }
+
+/*
+ * Like the readers above, but for data we don't trust: returns FALSE instead
+ * of asserting if the value is truncated or doesn't fit in 64 bits.
+ */
+gboolean
+gum_try_read_sleb128 (const guint8 ** data,
+                      const guint8 * end,
+                      gint64 * value)
+{
+  const guint8 * p = *data;
+  gint64 result = 0;
+  gint offset = 0;
+  guint8 byte;
+
+  do
+  {
+    if (p == end || offset > 63)
+      return FALSE;
+
+    byte = *p++;
+
+    /* The last byte only has room for the sign bit and its extension */
+    if (offset == 63 && (byte & 0x7f) != 0x00 && (byte & 0x7f) != 0x7f)
+      return FALSE;
+
+    result |= (gint64) ((guint64) (byte & 0x7f) << offset);
+    offset += 7;
+  }
+  while ((byte & 0x80) != 0);
+
+  if ((byte & 0x40) != 0 && offset < 64)
+    result |= G_GINT64_CONSTANT (-1) << offset;
+
+  *data = p;
+  *value = result;
+
+  return TRUE;
+}
+
+gboolean
+gum_try_read_uleb128 (const guint8 ** data,
+                      const guint8 * end,
+                      guint64 * value)
+{
+  const guint8 * p = *data;
+  guint64 result = 0;
+  gint offset = 0;
+  guint8 byte;
+
+  do
+  {
+    if (p == end || offset > 63)
+      return FALSE;
+
+    byte = *p++;
+
+    /* The last byte only has room for the top bit */
+    if (offset == 63 && (byte & 0x7e) != 0)
+      return FALSE;
+
+    result |= ((guint64) (byte & 0x7f) << offset);
+    offset += 7;
+  }
+  while ((byte & 0x80) != 0);
+
+  *data = p;
+  *value = result;
+
+  return TRUE;
+}
+
+guint
+gum_write_sleb128 (guint8 * data,
+                   gint64 value)
+{
+  guint8 * p = data;
+  gboolean more;
+
+  do
+  {
+    guint8 byte = value & 0x7f;
+
+    value >>= 7;
+
+    more = !((value == 0 && (byte & 0x40) == 0) ||
+        (value == -1 && (byte & 0x40) != 0));
+    if (more)
+      byte |= 0x80;
+
+    *p++ = byte;
+  }
+  while (more);
+
+  return p - data;
+}
+
+guint
+gum_write_uleb128 (guint8 * data,
+                   guint64 value)
+{
+  guint8 * p = data;
+
+  do
+  {
+    guint8 byte = value & 0x7f;
+
+    value >>= 7;
+    if (value != 0)
+      byte |= 0x80;
+
+    *p++ = byte;
+  }
+  while (value != 0);
+
+  return p - data;
+}
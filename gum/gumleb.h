@@ -14,6 +14,13 @@ G_BEGIN_DECLS
 G_GNUC_INTERNAL gint64 gum_read_sleb128 (const guint8 ** data, const guint8 * end);
 G_GNUC_INTERNAL guint64 gum_read_uleb128 (const guint8 ** data, const guint8 * end);
 G_GNUC_INTERNAL void gum_skip_uleb128 (const guint8 ** data);
+G_GNUC_INTERNAL gboolean gum_try_read_sleb128 (const guint8 ** data,
+    const guint8 * end, gint64 * value);
+G_GNUC_INTERNAL gboolean gum_try_read_uleb128 (const guint8 ** data,
+    const guint8 * end, guint64 * value);
+
+G_GNUC_INTERNAL guint gum_write_sleb128 (guint8 * data, gint64 value);
+G_GNUC_INTERNAL guint gum_write_uleb128 (guint8 * data, guint64 value);
 
 G_END_DECLS
 
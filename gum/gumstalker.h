@@ -49,6 +49,7 @@ typedef void (* GumStalkerCallout) (GumCpuContext * cpu_context,
 
 typedef guint GumProbeId;
 typedef struct _GumCallSite GumCallSite;
+typedef struct _GumBlockCount GumBlockCount;
 typedef void (* GumCallProbeCallback) (GumCallSite * site, gpointer user_data);
 
 struct _GumStalkerTransformerInterface
@@ -75,16 +76,61 @@ struct _GumCallSite
   GumCpuContext * cpu_context;
 };
 
+struct _GumBlockCount
+{
+  gpointer begin;
+  gpointer end;
+  guint64 count;
+};
+
 GUM_API gboolean gum_stalker_is_supported (void);
 
 GUM_API GumStalker * gum_stalker_new (void);
 
 GUM_API void gum_stalker_exclude (GumStalker * self,
     const GumMemoryRange * range);
+GUM_API void gum_stalker_remove_exclusion (GumStalker * self,
+    const GumMemoryRange * range);
+GUM_API void gum_stalker_exclude_module (GumStalker * self,
+    const gchar * name);
+GUM_API void gum_stalker_remove_module_exclusion (GumStalker * self,
+    const gchar * name);
+GUM_API void gum_stalker_include (GumStalker * self,
+    const GumMemoryRange * range);
+GUM_API void gum_stalker_include_module (GumStalker * self,
+    const gchar * name);
 
 GUM_API gint gum_stalker_get_trust_threshold (GumStalker * self);
 GUM_API void gum_stalker_set_trust_threshold (GumStalker * self,
     gint trust_threshold);
+GUM_API guint gum_stalker_get_ic_entries (GumStalker * self);
+GUM_API void gum_stalker_set_ic_entries (GumStalker * self, guint n);
+GUM_API guint gum_stalker_get_trace_threshold (GumStalker * self);
+GUM_API void gum_stalker_set_trace_threshold (GumStalker * self,
+    guint threshold);
+GUM_API guint gum_stalker_get_event_buffer_capacity (GumStalker * self);
+GUM_API void gum_stalker_set_event_buffer_capacity (GumStalker * self,
+    guint capacity);
+GUM_API void gum_stalker_set_coverage_bitmap (GumStalker * self,
+    guint8 * bitmap, gsize size);
+GUM_API gsize gum_stalker_get_code_budget (GumStalker * self);
+GUM_API void gum_stalker_set_code_budget (GumStalker * self, gsize budget);
+GUM_API gsize gum_stalker_get_thread_code_budget (GumStalker * self);
+GUM_API void gum_stalker_set_thread_code_budget (GumStalker * self,
+    gsize budget);
+GUM_API gboolean gum_stalker_get_code_write_protection (GumStalker * self);
+GUM_API void gum_stalker_set_code_write_protection (GumStalker * self,
+    gboolean enabled);
+GUM_API gboolean gum_stalker_get_block_counting (GumStalker * self);
+GUM_API void gum_stalker_set_block_counting (GumStalker * self,
+    gboolean enabled);
+
+GUM_API void gum_stalker_invalidate (GumStalker * self,
+    const GumMemoryRange * range);
+GUM_API void gum_stalker_invalidate_for_thread (GumStalker * self,
+    GumThreadId thread_id, const GumMemoryRange * range);
+
+GUM_API GArray * gum_stalker_collect_block_counts (GumStalker * self);
 
 GUM_API void gum_stalker_flush (GumStalker * self);
 GUM_API void gum_stalker_stop (GumStalker * self);
@@ -8,8 +8,12 @@
 #include "stalker-x86-fixture.c"
 
 #ifndef G_OS_WIN32
+# include <dlfcn.h>
 # include <lzma.h>
 #endif
+#if defined (HAVE_LINUX) && defined (__GLIBC__)
+# include <execinfo.h>
+#endif
 
 TESTLIST_BEGIN (stalker)
   TESTENTRY (no_events)
@@ -17,6 +21,22 @@ TESTLIST_BEGIN (stalker)
   TESTENTRY (ret)
   TESTENTRY (exec)
   TESTENTRY (call_depth)
+  TESTENTRY (exec_with_event_buffer)
+  TESTENTRY (exec_with_event_buffer_and_live_flags)
+  TESTENTRY (exec_with_event_buffer_in_batches)
+  TESTENTRY (call_depth_with_event_buffer)
+  TESTENTRY (coverage_bitmap)
+  TESTENTRY (invalidation_of_range)
+  TESTENTRY (repeated_invalidation_of_range)
+  TESTENTRY (self_modifying_code_with_write_protection)
+  TESTENTRY (thread_code_budget)
+  TESTENTRY (code_budget)
+  TESTENTRY (megamorphic_indirect_calls)
+  TESTENTRY (call_summary)
+  TESTENTRY (call_summary_of_direct_calls)
+  TESTENTRY (trace_formation)
+  TESTENTRY (block_counting)
+  TESTENTRY (block_counts_should_survive_invalidation)
   TESTENTRY (call_probe)
   TESTENTRY (custom_transformer)
   TESTENTRY (unfollow_should_be_allowed_before_first_transform)
@@ -36,6 +56,7 @@ TESTLIST_BEGIN (stalker)
   TESTENTRY (follow_stdcall)
   TESTENTRY (follow_repne_ret)
   TESTENTRY (follow_repne_jb)
+  TESTENTRY (return_address_mismatch)
   TESTENTRY (unfollow_deep)
   TESTENTRY (call_followed_by_junk)
   TESTENTRY (indirect_call_with_immediate)
@@ -61,13 +82,32 @@ TESTLIST_BEGIN (stalker)
 #endif
   TESTENTRY (no_red_zone_clobber)
   TESTENTRY (big_block)
+  TESTENTRY (exclude_and_remove_range)
+  TESTENTRY (exclude_module)
+  TESTENTRY (exclude_and_remove_module)
+  TESTENTRY (include_range)
+#ifndef G_OS_WIN32
+  TESTENTRY (include_module)
+  TESTENTRY (include_module_should_catch_calls_from_native_code)
+#endif
+#if defined (HAVE_LINUX) && defined (__GLIBC__)
+  TESTENTRY (native_return_should_be_unwindable)
+#endif
+  TESTENTRY (unfollow_while_running_natively)
 
   TESTENTRY (heap_api)
   TESTENTRY (follow_syscall)
   TESTENTRY (follow_thread)
 #ifndef G_OS_WIN32
   TESTENTRY (performance)
+  TESTENTRY (thread_pool_performance)
 #endif
+  TESTENTRY (event_buffer_performance)
+  TESTENTRY (write_protection_performance)
+  TESTENTRY (inline_cache_performance)
+  TESTENTRY (return_performance)
+  TESTENTRY (trace_performance)
+  TESTENTRY (exclusion_performance)
 
 #ifdef G_OS_WIN32
 # if GLIB_SIZEOF_VOID_P == 4
@@ -80,9 +120,19 @@ TESTLIST_BEGIN (stalker)
 TESTLIST_END ()
 
 #ifndef G_OS_WIN32
+typedef struct _StalkedWorkloadContext StalkedWorkloadContext;
+
+struct _StalkedWorkloadContext
+{
+  GumStalker * stalker;
+  GumEventSink * sink;
+  GumMemoryRange * runner_range;
+};
+
 static gboolean store_range_of_test_runner (const GumModuleDetails * details,
     gpointer user_data);
 static void pretend_workload (GumMemoryRange * runner_range);
+static gpointer run_stalked_workload (gpointer data);
 #endif
 static gpointer stalker_victim (gpointer data);
 static void insert_extra_increment_after_xor (GumStalkerIterator * iterator,
@@ -284,191 +334,1242 @@ TESTCASE (performance)
   gum_stalker_dump_counters ();
 }
 
-static gboolean
-store_range_of_test_runner (const GumModuleDetails * details,
-                            gpointer user_data)
+TESTCASE (thread_pool_performance)
 {
-  GumMemoryRange * runner_range = user_data;
+  GumMemoryRange runner_range;
+  StalkedWorkloadContext ctx;
+  GThread * threads[8];
+  GTimer * timer;
+  gdouble duration;
+  guint i;
 
-  if (strstr (details->name, "gum-tests") != NULL)
+  if (!g_test_slow ())
   {
-    *runner_range = *details->range;
-    return FALSE;
+    g_print ("<skipping, run in slow mode> ");
+    return;
   }
 
-  return TRUE;
-}
+  runner_range.base_address = 0;
+  runner_range.size = 0;
+  gum_process_enumerate_modules (store_range_of_test_runner, &runner_range);
+  g_assert_cmpuint (runner_range.base_address, !=, 0);
+  g_assert_cmpuint (runner_range.size, !=, 0);
 
-GUM_NOINLINE static void
-pretend_workload (GumMemoryRange * runner_range)
-{
-  lzma_stream stream = LZMA_STREAM_INIT;
-  const uint32_t preset = 9 | LZMA_PRESET_EXTREME;
-  lzma_ret ret;
-  guint8 * outbuf;
-  gsize outbuf_size;
-  const gsize outbuf_size_increment = 1024 * 1024;
+  fixture->sink->mask = GUM_NOTHING;
 
-  ret = lzma_easy_encoder (&stream, preset, LZMA_CHECK_CRC64);
-  g_assert_cmpint (ret, ==, LZMA_OK);
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
 
-  outbuf_size = outbuf_size_increment;
-  outbuf = malloc (outbuf_size);
+  ctx.stalker = fixture->stalker;
+  ctx.sink = GUM_EVENT_SINK (fixture->sink);
+  ctx.runner_range = &runner_range;
 
-  stream.next_in = GSIZE_TO_POINTER (runner_range->base_address);
-  stream.avail_in = MIN (runner_range->size, 65536);
-  stream.next_out = outbuf;
-  stream.avail_out = outbuf_size;
+  gum_stalker_set_counters_enabled (TRUE);
 
-  while (TRUE)
-  {
-    ret = lzma_code (&stream, LZMA_FINISH);
+  timer = g_timer_new ();
 
-    if (stream.avail_out == 0)
-    {
-      gsize compressed_size;
+  for (i = 0; i != G_N_ELEMENTS (threads); i++)
+  {
+    threads[i] = g_thread_new ("stalker-test-worker", run_stalked_workload,
+        &ctx);
+  }
 
-      compressed_size = outbuf_size;
+  for (i = 0; i != G_N_ELEMENTS (threads); i++)
+    g_thread_join (threads[i]);
 
-      outbuf_size += outbuf_size_increment;
-      outbuf = realloc (outbuf, outbuf_size);
+  duration = g_timer_elapsed (timer, NULL);
 
-      stream.next_out = outbuf + compressed_size;
-      stream.avail_out = outbuf_size - compressed_size;
-    }
+  g_timer_destroy (timer);
 
-    if (ret != LZMA_OK)
-    {
-      g_assert_cmpint (ret, ==, LZMA_STREAM_END);
-      break;
-    }
-  }
+  g_print ("<n_threads=%u duration=%f> ", (guint) G_N_ELEMENTS (threads),
+      duration);
 
-  lzma_end (&stream);
+  gum_stalker_dump_counters ();
 
-  free (outbuf);
+  gum_stalker_set_counters_enabled (FALSE);
 }
 
 #endif
 
-static const guint8 flat_code[] = {
-    0x33, 0xc0, /* xor eax, eax */
-    0xff, 0xc0, /* inc eax      */
-    0xff, 0xc0, /* inc eax      */
-    0xc3        /* retn         */
-};
-
-static StalkerTestFunc
-invoke_flat_expecting_return_value (TestStalkerFixture * fixture,
-                                    GumEventType mask,
-                                    guint expected_return_value)
+TESTCASE (event_buffer_performance)
 {
+  const guint8 code[] =
+  {
+    0xb9, 0x00, 0x00, 0x02, 0x00, /* mov ecx, 0x20000 */
+    0xff, 0xc9,                   /* dec ecx          */
+    0x75, 0xfc,                   /* jnz -4           */
+    0xc3,                         /* ret              */
+  };
   StalkerTestFunc func;
-  gint ret;
+  GTimer * timer;
+  gdouble duration_unbuffered, duration_buffered;
+  guint n_events;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
 
   func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
-      test_stalker_fixture_dup_code (fixture, flat_code, sizeof (flat_code)));
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
 
-  fixture->sink->mask = mask;
-  ret = test_stalker_fixture_follow_and_invoke (fixture, func, -1);
-  g_assert_cmpint (ret, ==, expected_return_value);
+  fixture->sink->mask = GUM_EXEC;
 
-  return func;
+  timer = g_timer_new ();
+
+  g_timer_reset (timer);
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+  duration_unbuffered = g_timer_elapsed (timer, NULL);
+
+  n_events = fixture->sink->events->len;
+  g_assert_cmpuint (n_events, >, 2 * 0x20000);
+  gum_fake_event_sink_reset (fixture->sink);
+
+  gum_stalker_set_event_buffer_capacity (fixture->stalker, 16384);
+
+  g_timer_reset (timer);
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+  duration_buffered = g_timer_elapsed (timer, NULL);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, n_events);
+
+  g_timer_destroy (timer);
+
+  g_print ("<n_events=%u duration_unbuffered=%f duration_buffered=%f "
+      "speedup=%f> ", n_events, duration_unbuffered, duration_buffered,
+      duration_unbuffered / duration_buffered);
 }
 
-static StalkerTestFunc
-invoke_flat (TestStalkerFixture * fixture,
-             GumEventType mask)
+static gdouble measure_stalked_loop (TestStalkerFixture * fixture,
+    StalkerTestFunc func, gint trust_threshold, gboolean protect_code);
+
+TESTCASE (write_protection_performance)
 {
-  return invoke_flat_expecting_return_value (fixture, mask, 2);
+  const guint8 code[] =
+  {
+    0xb9, 0x00, 0x00, 0x01, 0x00, /* mov ecx, 0x10000 */
+    0xff, 0xc9,                   /* dec ecx          */
+    0x75, 0xfc,                   /* jnz -4           */
+    0xc3,                         /* ret              */
+  };
+  StalkerTestFunc func;
+  gdouble duration_trust_0, duration_trust_1, duration_trust_none,
+      duration_protected;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  duration_trust_0 = measure_stalked_loop (fixture, func, 0, FALSE);
+  duration_trust_1 = measure_stalked_loop (fixture, func, 1, FALSE);
+  duration_trust_none = measure_stalked_loop (fixture, func, -1, FALSE);
+  duration_protected = measure_stalked_loop (fixture, func, 0, TRUE);
+
+  g_print ("<trust_0=%f trust_1=%f trust_none=%f protected=%f> ",
+      duration_trust_0, duration_trust_1, duration_trust_none,
+      duration_protected);
 }
 
-TESTCASE (no_events)
+static gdouble
+measure_stalked_loop (TestStalkerFixture * fixture,
+                      StalkerTestFunc func,
+                      gint trust_threshold,
+                      gboolean protect_code)
 {
-  invoke_flat (fixture, GUM_NOTHING);
-  g_assert_cmpuint (fixture->sink->events->len, ==, 0);
+  GTimer * timer;
+  gdouble duration;
+
+  gum_stalker_set_trust_threshold (fixture->stalker, trust_threshold);
+  gum_stalker_set_code_write_protection (fixture->stalker, protect_code);
+
+  timer = g_timer_new ();
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+  duration = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  gum_stalker_set_code_write_protection (fixture->stalker, FALSE);
+
+  return duration;
 }
 
-TESTCASE (call)
+static gdouble measure_polymorphic_dispatch (TestStalkerFixture * fixture,
+    guint ic_entries);
+
+TESTCASE (inline_cache_performance)
 {
-  StalkerTestFunc func;
-  GumCallEvent * ev;
+  gdouble duration_2_entries, duration_8_entries;
 
-  func = invoke_flat (fixture, GUM_CALL);
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
 
-  g_assert_cmpuint (fixture->sink->events->len, ==, 2);
-  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent, 0).type,
-      ==, GUM_CALL);
-  ev = &g_array_index (fixture->sink->events, GumEvent, 0).call;
-  GUM_ASSERT_CMPADDR (ev->location, ==, fixture->last_invoke_calladdr);
-  GUM_ASSERT_CMPADDR (ev->target, ==, func);
+  fixture->sink->mask = GUM_NOTHING;
+
+  duration_2_entries = measure_polymorphic_dispatch (fixture, 2);
+  duration_8_entries = measure_polymorphic_dispatch (fixture, 8);
+
+  g_print ("<ic_2=%f ic_8=%f speedup=%f> ", duration_2_entries,
+      duration_8_entries, duration_2_entries / duration_8_entries);
 }
 
-TESTCASE (ret)
+static gdouble
+measure_polymorphic_dispatch (TestStalkerFixture * fixture,
+                              guint ic_entries)
 {
-  StalkerTestFunc func;
-  GumRetEvent * ev;
+  GTimer * timer;
+  gdouble duration;
 
-  func = invoke_flat (fixture, GUM_RET);
+  gum_stalker_set_ic_entries (fixture->stalker, ic_entries);
 
-  g_assert_cmpuint (fixture->sink->events->len, ==, 1);
-  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent, 0).type,
-      ==, GUM_RET);
-  ev = &g_array_index (fixture->sink->events, GumEvent, 0).ret;
-  GUM_ASSERT_CMPADDR (ev->location,
-      ==, ((guint8 *) GSIZE_TO_POINTER (func)) + 6);
-  GUM_ASSERT_CMPADDR (ev->target, ==, fixture->last_invoke_retaddr);
+  timer = g_timer_new ();
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  dispatch_through_ic_targets (1000000, 6);
+  gum_stalker_unfollow_me (fixture->stalker);
+  duration = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  return duration;
 }
 
-TESTCASE (exec)
+#define IC_TARGET(n) \
+    GUM_NOINLINE static guint \
+    ic_target_##n (guint value) \
+    { \
+      return value * 3 + n; \
+    }
+
+IC_TARGET (0)
+IC_TARGET (1)
+IC_TARGET (2)
+IC_TARGET (3)
+IC_TARGET (4)
+IC_TARGET (5)
+IC_TARGET (6)
+IC_TARGET (7)
+
+static IcTargetFunc ic_targets[] =
 {
-  StalkerTestFunc func;
-  GumRetEvent * ev;
+  ic_target_0, ic_target_1, ic_target_2, ic_target_3,
+  ic_target_4, ic_target_5, ic_target_6, ic_target_7,
+};
 
-  func = invoke_flat (fixture, GUM_EXEC);
+GUM_NOINLINE static guint
+dispatch_through_ic_targets (guint n_iterations,
+                             guint n_targets)
+{
+  IcTargetFunc * volatile targets = ic_targets;
+  guint value = 0;
+  guint i;
 
-  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 4);
-  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent,
-      INVOKER_IMPL_OFFSET).type, ==, GUM_EXEC);
-  ev = &g_array_index (fixture->sink->events, GumEvent,
-      INVOKER_IMPL_OFFSET).ret;
-  GUM_ASSERT_CMPADDR (ev->location, ==, func);
+  for (i = 0; i != n_iterations; i++)
+    value = targets[i % n_targets] (value);
+
+  return value;
 }
 
-TESTCASE (call_depth)
+static guint recurse_and_return (guint depth);
+
+TESTCASE (return_performance)
 {
-  const guint8 code[] =
+  GTimer * timer;
+  gdouble duration_direct, duration_stalked;
+  guint i;
+
+  if (!g_test_slow ())
   {
-    0xb8, 0x07, 0x00, 0x00, 0x00, /* mov eax, 7 */
-    0xff, 0xc8,                   /* dec eax    */
-    0x74, 0x05,                   /* jz +5      */
-    0xe8, 0xf7, 0xff, 0xff, 0xff, /* call -9    */
-    0xc3,                         /* ret        */
-    0xcc,                         /* int3       */
-  };
-  StalkerTestFunc func;
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
 
-  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
-      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+  timer = g_timer_new ();
+  for (i = 0; i != 100000; i++)
+    recurse_and_return (32);
+  duration_direct = g_timer_elapsed (timer, NULL);
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+
+  g_timer_reset (timer);
+  for (i = 0; i != 100000; i++)
+    recurse_and_return (32);
+  duration_stalked = g_timer_elapsed (timer, NULL);
+
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_timer_destroy (timer);
+
+  g_print ("<duration_direct=%f duration_stalked=%f ratio=%f> ",
+      duration_direct, duration_stalked, duration_stalked / duration_direct);
+}
+
+GUM_NOINLINE static guint
+recurse_and_return (guint depth)
+{
+  volatile guint remaining = depth;
+
+  if (remaining == 0)
+    return 0;
+
+  return recurse_and_return (remaining - 1) + 1;
+}
+
+static gdouble measure_collatz_workload (TestStalkerFixture * fixture,
+    guint trace_threshold);
+static guint run_collatz_workload (void);
+
+TESTCASE (trace_performance)
+{
+  GTimer * timer;
+  gdouble duration_direct, duration_untraced, duration_traced;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
+
+  timer = g_timer_new ();
+  run_collatz_workload ();
+  duration_direct = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  fixture->sink->mask = GUM_NOTHING;
+
+  duration_untraced = measure_collatz_workload (fixture, 0);
+  duration_traced = measure_collatz_workload (fixture, 64);
+
+  g_print ("<duration_direct=%f ratio_untraced=%f ratio_traced=%f> ",
+      duration_direct, duration_untraced / duration_direct,
+      duration_traced / duration_direct);
+}
+
+static gdouble
+measure_collatz_workload (TestStalkerFixture * fixture,
+                          guint trace_threshold)
+{
+  GTimer * timer;
+  gdouble duration;
+
+  gum_stalker_set_trace_threshold (fixture->stalker, trace_threshold);
+
+  timer = g_timer_new ();
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  run_collatz_workload ();
+  gum_stalker_unfollow_me (fixture->stalker);
+  duration = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  return duration;
+}
+
+GUM_NOINLINE static guint
+run_collatz_workload (void)
+{
+  guint total_steps = 0;
+  guint i;
+
+  for (i = 1; i != 200000; i++)
+  {
+    volatile guint64 n = i;
+
+    while (n != 1)
+    {
+      if ((n & 1) == 0)
+        n /= 2;
+      else
+        n = 3 * n + 1;
+      total_steps++;
+    }
+  }
+
+  return total_steps;
+}
+
+static gdouble measure_exclusion_workload (TestStalkerFixture * fixture,
+    StalkerTestFunc func);
+
+TESTCASE (exclusion_performance)
+{
+  const guint n_exclusions = 1000;
+  guint8 * code, * excluded_pages;
+  GumX86Writer cw;
+  StalkerTestFunc func;
+  gsize page_size;
+  gdouble duration_without, duration_with;
+  guint i;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
+
+  code = gum_alloc_n_pages (1, GUM_PAGE_RWX);
+  gum_x86_writer_init (&cw, code);
+  gum_x86_writer_put_ret (&cw);
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc, gum_x86_writer_cur (&cw));
+  for (i = 0; i != 64; i++)
+    gum_x86_writer_put_call_address (&cw, GUM_ADDRESS (code));
+  gum_x86_writer_put_ret (&cw);
+  gum_x86_writer_clear (&cw);
+
+  fixture->sink->mask = GUM_NOTHING;
+  gum_stalker_set_trust_threshold (fixture->stalker, -1);
+
+  duration_without = measure_exclusion_workload (fixture, func);
+
+  page_size = gum_query_page_size ();
+  excluded_pages = gum_alloc_n_pages (2 * n_exclusions, GUM_PAGE_RW);
+  for (i = 0; i != n_exclusions; i++)
+  {
+    GumMemoryRange r;
+
+    r.base_address = GUM_ADDRESS (excluded_pages + (2 * i * page_size));
+    r.size = page_size;
+    gum_stalker_exclude (fixture->stalker, &r);
+  }
+
+  duration_with = measure_exclusion_workload (fixture, func);
+
+  g_print ("<duration_without=%f duration_with=%f ratio=%f> ",
+      duration_without, duration_with, duration_with / duration_without);
+
+  gum_free_pages (excluded_pages);
+  gum_free_pages (code);
+}
+
+static gdouble
+measure_exclusion_workload (TestStalkerFixture * fixture,
+                            StalkerTestFunc func)
+{
+  GTimer * timer;
+  gdouble duration;
+  guint i;
+
+  timer = g_timer_new ();
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 1000; i++)
+    func (0);
+  gum_stalker_unfollow_me (fixture->stalker);
+  duration = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  return duration;
+}
+
+#ifndef G_OS_WIN32
+
+static gpointer
+run_stalked_workload (gpointer data)
+{
+  StalkedWorkloadContext * ctx = data;
+
+  gum_stalker_follow_me (ctx->stalker, NULL, ctx->sink);
+  pretend_workload (ctx->runner_range);
+  gum_stalker_unfollow_me (ctx->stalker);
+
+  return NULL;
+}
+
+static gboolean
+store_range_of_test_runner (const GumModuleDetails * details,
+                            gpointer user_data)
+{
+  GumMemoryRange * runner_range = user_data;
+
+  if (strstr (details->name, "gum-tests") != NULL)
+  {
+    *runner_range = *details->range;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+GUM_NOINLINE static void
+pretend_workload (GumMemoryRange * runner_range)
+{
+  lzma_stream stream = LZMA_STREAM_INIT;
+  const uint32_t preset = 9 | LZMA_PRESET_EXTREME;
+  lzma_ret ret;
+  guint8 * outbuf;
+  gsize outbuf_size;
+  const gsize outbuf_size_increment = 1024 * 1024;
+
+  ret = lzma_easy_encoder (&stream, preset, LZMA_CHECK_CRC64);
+  g_assert_cmpint (ret, ==, LZMA_OK);
+
+  outbuf_size = outbuf_size_increment;
+  outbuf = malloc (outbuf_size);
+
+  stream.next_in = GSIZE_TO_POINTER (runner_range->base_address);
+  stream.avail_in = MIN (runner_range->size, 65536);
+  stream.next_out = outbuf;
+  stream.avail_out = outbuf_size;
+
+  while (TRUE)
+  {
+    ret = lzma_code (&stream, LZMA_FINISH);
+
+    if (stream.avail_out == 0)
+    {
+      gsize compressed_size;
+
+      compressed_size = outbuf_size;
+
+      outbuf_size += outbuf_size_increment;
+      outbuf = realloc (outbuf, outbuf_size);
+
+      stream.next_out = outbuf + compressed_size;
+      stream.avail_out = outbuf_size - compressed_size;
+    }
+
+    if (ret != LZMA_OK)
+    {
+      g_assert_cmpint (ret, ==, LZMA_STREAM_END);
+      break;
+    }
+  }
+
+  lzma_end (&stream);
+
+  free (outbuf);
+}
+
+#endif
+
+static const guint8 flat_code[] = {
+    0x33, 0xc0, /* xor eax, eax */
+    0xff, 0xc0, /* inc eax      */
+    0xff, 0xc0, /* inc eax      */
+    0xc3        /* retn         */
+};
+
+static StalkerTestFunc
+invoke_flat_expecting_return_value (TestStalkerFixture * fixture,
+                                    GumEventType mask,
+                                    guint expected_return_value)
+{
+  StalkerTestFunc func;
+  gint ret;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, flat_code, sizeof (flat_code)));
+
+  fixture->sink->mask = mask;
+  ret = test_stalker_fixture_follow_and_invoke (fixture, func, -1);
+  g_assert_cmpint (ret, ==, expected_return_value);
+
+  return func;
+}
+
+static StalkerTestFunc
+invoke_flat (TestStalkerFixture * fixture,
+             GumEventType mask)
+{
+  return invoke_flat_expecting_return_value (fixture, mask, 2);
+}
+
+TESTCASE (no_events)
+{
+  invoke_flat (fixture, GUM_NOTHING);
+  g_assert_cmpuint (fixture->sink->events->len, ==, 0);
+}
+
+TESTCASE (call)
+{
+  StalkerTestFunc func;
+  GumCallEvent * ev;
+
+  func = invoke_flat (fixture, GUM_CALL);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, 2);
+  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent, 0).type,
+      ==, GUM_CALL);
+  ev = &g_array_index (fixture->sink->events, GumEvent, 0).call;
+  GUM_ASSERT_CMPADDR (ev->location, ==, fixture->last_invoke_calladdr);
+  GUM_ASSERT_CMPADDR (ev->target, ==, func);
+}
+
+TESTCASE (ret)
+{
+  StalkerTestFunc func;
+  GumRetEvent * ev;
+
+  func = invoke_flat (fixture, GUM_RET);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, 1);
+  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent, 0).type,
+      ==, GUM_RET);
+  ev = &g_array_index (fixture->sink->events, GumEvent, 0).ret;
+  GUM_ASSERT_CMPADDR (ev->location,
+      ==, ((guint8 *) GSIZE_TO_POINTER (func)) + 6);
+  GUM_ASSERT_CMPADDR (ev->target, ==, fixture->last_invoke_retaddr);
+}
+
+TESTCASE (exec)
+{
+  StalkerTestFunc func;
+  GumRetEvent * ev;
+
+  func = invoke_flat (fixture, GUM_EXEC);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 4);
+  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent,
+      INVOKER_IMPL_OFFSET).type, ==, GUM_EXEC);
+  ev = &g_array_index (fixture->sink->events, GumEvent,
+      INVOKER_IMPL_OFFSET).ret;
+  GUM_ASSERT_CMPADDR (ev->location, ==, func);
+}
+
+TESTCASE (call_depth)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x07, 0x00, 0x00, 0x00, /* mov eax, 7 */
+    0xff, 0xc8,                   /* dec eax    */
+    0x74, 0x05,                   /* jz +5      */
+    0xe8, 0xf7, 0xff, 0xff, 0xff, /* call -9    */
+    0xc3,                         /* ret        */
+    0xcc,                         /* int3       */
+  };
+  StalkerTestFunc func;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_CALL | GUM_RET;
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, 7 + 7 + 1);
+  g_assert_cmpint (NTH_EVENT_AS_CALL (0)->depth, ==, 0);
+  g_assert_cmpint (NTH_EVENT_AS_CALL (1)->depth, ==, 1);
+  g_assert_cmpint (NTH_EVENT_AS_CALL (2)->depth, ==, 2);
+  g_assert_cmpint (NTH_EVENT_AS_CALL (3)->depth, ==, 3);
+  g_assert_cmpint (NTH_EVENT_AS_CALL (4)->depth, ==, 4);
+  g_assert_cmpint (NTH_EVENT_AS_CALL (5)->depth, ==, 5);
+  g_assert_cmpint (NTH_EVENT_AS_CALL (6)->depth, ==, 6);
+  g_assert_cmpint (NTH_EVENT_AS_RET (7)->depth, ==, 7);
+  g_assert_cmpint (NTH_EVENT_AS_RET (8)->depth, ==, 6);
+  g_assert_cmpint (NTH_EVENT_AS_RET (9)->depth, ==, 5);
+  g_assert_cmpint (NTH_EVENT_AS_RET (10)->depth, ==, 4);
+  g_assert_cmpint (NTH_EVENT_AS_RET (11)->depth, ==, 3);
+  g_assert_cmpint (NTH_EVENT_AS_RET (12)->depth, ==, 2);
+  g_assert_cmpint (NTH_EVENT_AS_RET (13)->depth, ==, 1);
+}
+
+TESTCASE (exec_with_event_buffer)
+{
+  StalkerTestFunc func;
+  GumExecEvent * ev;
+
+  gum_stalker_set_event_buffer_capacity (fixture->stalker, 1024);
+
+  func = invoke_flat (fixture, GUM_EXEC);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 4);
+  g_assert_cmpint (g_array_index (fixture->sink->events, GumEvent,
+      INVOKER_IMPL_OFFSET).type, ==, GUM_EXEC);
+  ev = &g_array_index (fixture->sink->events, GumEvent,
+      INVOKER_IMPL_OFFSET).exec;
+  GUM_ASSERT_CMPADDR (ev->location, ==, func);
+}
+
+TESTCASE (exec_with_event_buffer_in_batches)
+{
+  StalkerTestFunc func;
+  GumExecEvent * ev;
+
+  gum_stalker_set_event_buffer_capacity (fixture->stalker, 4);
+
+  func = invoke_flat (fixture, GUM_EXEC);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 4);
+  g_assert_cmpuint (fixture->sink->batch_count, >, 1);
+  g_assert_cmpuint (fixture->sink->batch_count, <,
+      fixture->sink->events->len);
+  ev = &g_array_index (fixture->sink->events, GumEvent,
+      INVOKER_IMPL_OFFSET).exec;
+  GUM_ASSERT_CMPADDR (ev->location, ==, func);
+}
+
+TESTCASE (exec_with_event_buffer_and_live_flags)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x01, 0x00, 0x00, 0x00, /* mov eax, 1  */
+    0xf9,                         /* stc         */
+    0x83, 0xd0, 0x00,             /* adc eax, 0  */
+    0xc3,                         /* ret         */
+  };
+  StalkerTestFunc func;
+  gint ret;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  gum_stalker_set_event_buffer_capacity (fixture->stalker, 1024);
+
+  fixture->sink->mask = GUM_EXEC;
+  ret = test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  /* The flags are dead before the stc but live before the adc */
+  g_assert_cmpint (ret, ==, 2);
+  g_assert_cmpuint (fixture->sink->events->len, ==, INVOKER_INSN_COUNT + 4);
+}
+
+TESTCASE (call_depth_with_event_buffer)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x07, 0x00, 0x00, 0x00, /* mov eax, 7 */
+    0xff, 0xc8,                   /* dec eax    */
+    0x74, 0x05,                   /* jz +5      */
+    0xe8, 0xf7, 0xff, 0xff, 0xff, /* call -9    */
+    0xc3,                         /* ret        */
+    0xcc,                         /* int3       */
+  };
+  StalkerTestFunc func;
+  guint i;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  /* Small enough that we also exercise the slow path */
+  gum_stalker_set_event_buffer_capacity (fixture->stalker, 4);
+
+  fixture->sink->mask = GUM_CALL | GUM_RET;
+  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  g_assert_cmpuint (fixture->sink->events->len, ==, 7 + 7 + 1);
+  for (i = 0; i != 7; i++)
+  {
+    g_assert_cmpint (NTH_EVENT_AS_CALL (i)->type, ==, GUM_CALL);
+    g_assert_cmpint (NTH_EVENT_AS_CALL (i)->depth, ==, i);
+  }
+  GUM_ASSERT_CMPADDR (NTH_EVENT_AS_CALL (0)->target, ==, func);
+  GUM_ASSERT_CMPADDR (NTH_EVENT_AS_CALL (1)->location, ==, fixture->code + 9);
+  for (i = 7; i != 14; i++)
+  {
+    g_assert_cmpint (NTH_EVENT_AS_RET (i)->type, ==, GUM_RET);
+    g_assert_cmpint (NTH_EVENT_AS_RET (i)->depth, ==, 14 - i);
+  }
+  GUM_ASSERT_CMPADDR (NTH_EVENT_AS_RET (7)->target, ==, fixture->code + 14);
+}
+
+TESTCASE (coverage_bitmap)
+{
+  const guint8 code[] =
+  {
+    0x31, 0xc0,                   /* xor eax, eax */
+    0xeb, 0x00,                   /* jmp +0       */
+    0x74, 0x05,                   /* jz +5        */
+    0xb8, 0x01, 0x00, 0x00, 0x00, /* mov eax, 1   */
+    0xc3,                         /* ret          */
+  };
+  StalkerTestFunc func;
+  guint8 * bitmap;
+  const gsize bitmap_size = 65536;
+  gsize i;
+  guint n_edges;
+  gint ret;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  bitmap = g_malloc0 (bitmap_size);
+  gum_stalker_set_coverage_bitmap (fixture->stalker, bitmap, bitmap_size);
+
+  fixture->sink->mask = GUM_NOTHING;
+  ret = test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+
+  /* The block holding the jz relies on flags set by the previous block */
+  g_assert_cmpint (ret, ==, 0);
+  g_assert_cmpuint (fixture->sink->events->len, ==, 0);
+
+  n_edges = 0;
+  for (i = 0; i != bitmap_size; i++)
+  {
+    if (bitmap[i] != 0)
+      n_edges++;
+  }
+  g_assert_cmpuint (n_edges, >=, 3);
+
+  gum_stalker_set_coverage_bitmap (fixture->stalker, NULL, 0);
+  g_free (bitmap);
+}
+
+TESTCASE (invalidation_of_range)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x2a, 0x00, 0x00, 0x00, /* mov eax, 42 */
+    0xc3,                         /* ret         */
+  };
+  StalkerTestFunc func;
+  GumMemoryRange range;
+  guint i, n_compiles;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+  range.base_address = GUM_ADDRESS (fixture->code);
+  range.size = sizeof (code);
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  fixture->sink->mask = GUM_COMPILE;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 3; i++)
+    g_assert_cmpint (func (0), ==, 42);
+  fixture->code[1] = 0x2b;
+  gum_stalker_invalidate (fixture->stalker, &range);
+  for (i = 0; i != 3; i++)
+    g_assert_cmpint (func (0), ==, 43);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  n_compiles = 0;
+  for (i = 0; i != fixture->sink->events->len; i++)
+  {
+    const GumEvent * ev =
+        &g_array_index (fixture->sink->events, GumEvent, i);
+
+    if (ev->compile.begin == fixture->code)
+      n_compiles++;
+  }
+  g_assert_cmpuint (n_compiles, ==, 2);
+}
+
+/*
+ * Each round calls a thunk that hasn't run before, so that the pending
+ * invalidation gets processed at its entrygate. The previous round's thunk
+ * still branches straight to the block just invalidated, which takes it
+ * through an invalidation stub.
+ */
+TESTCASE (repeated_invalidation_of_range)
+{
+  guint8 code[8 + (64 * 8)] = {
+    0xb8, 0x00, 0x00, 0x00, 0x00, /* mov eax, 0 */
+    0xc3,                         /* ret        */
+  };
+  StalkerTestFunc thunks[64];
+  GumMemoryRange range;
+  guint i;
+
+  for (i = 0; i != G_N_ELEMENTS (thunks); i++)
+  {
+    guint8 * thunk = code + 8 + (i * 8);
+    gint32 distance = -(gint32) (8 + (i * 8) + 5);
+
+    thunk[0] = 0xe8;                    /* call func */
+    memcpy (thunk + 1, &distance, sizeof (distance));
+    thunk[5] = 0xc3;                    /* ret       */
+  }
+
+  test_stalker_fixture_dup_code (fixture, code, sizeof (code));
+  for (i = 0; i != G_N_ELEMENTS (thunks); i++)
+  {
+    thunks[i] = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+        fixture->code + 8 + (i * 8));
+  }
+  range.base_address = GUM_ADDRESS (fixture->code);
+  range.size = 6;
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != G_N_ELEMENTS (thunks); i++)
+  {
+    fixture->code[1] = i;
+    gum_stalker_invalidate (fixture->stalker, &range);
+
+    g_assert_cmpint (thunks[i] (0), ==, i);
+    if (i != 0)
+      g_assert_cmpint (thunks[i - 1] (0), ==, i);
+  }
+  gum_stalker_unfollow_me (fixture->stalker);
+}
+
+TESTCASE (self_modifying_code_with_write_protection)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x2a, 0x00, 0x00, 0x00, /* mov eax, 42 */
+    0xc3,                         /* ret         */
+  };
+  StalkerTestFunc func;
+  guint i;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  gum_stalker_set_code_write_protection (fixture->stalker, TRUE);
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 3; i++)
+    g_assert_cmpint (func (0), ==, 42);
+  fixture->code[1] = 0x2b;
+  for (i = 0; i != 3; i++)
+    g_assert_cmpint (func (0), ==, 43);
+  fixture->code[1] = 0x2c;
+  g_assert_cmpint (func (0), ==, 44);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  gum_stalker_set_code_write_protection (fixture->stalker, FALSE);
+}
+
+TESTCASE (thread_code_budget)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x2a, 0x00, 0x00, 0x00, /* mov eax, 42 */
+    0xc3,                         /* ret         */
+  };
+  StalkerTestFunc func;
+  guint i, n_compiles;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  gum_stalker_set_thread_code_budget (fixture->stalker, 4096);
+  fixture->sink->mask = GUM_COMPILE;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 3; i++)
+  {
+    gchar * str;
+
+    g_assert_cmpint (func (0), ==, 42);
+
+    str = g_strdup_printf ("%u %f", i, (gdouble) i);
+    g_free (str);
+  }
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  n_compiles = 0;
+  for (i = 0; i != fixture->sink->events->len; i++)
+  {
+    const GumEvent * ev =
+        &g_array_index (fixture->sink->events, GumEvent, i);
+
+    if (ev->compile.begin == fixture->code)
+      n_compiles++;
+  }
+  g_assert_cmpuint (n_compiles, >, 1);
+}
+
+TESTCASE (code_budget)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x2a, 0x00, 0x00, 0x00, /* mov eax, 42 */
+    0xc3,                         /* ret         */
+  };
+  StalkerTestFunc func;
+  guint i, n_compiles;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  gum_stalker_set_code_budget (fixture->stalker, 4096);
+  fixture->sink->mask = GUM_COMPILE;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 3; i++)
+  {
+    gchar * str;
+
+    g_assert_cmpint (func (0), ==, 42);
+
+    str = g_strdup_printf ("%u %f", i, (gdouble) i);
+    g_free (str);
+  }
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  n_compiles = 0;
+  for (i = 0; i != fixture->sink->events->len; i++)
+  {
+    const GumEvent * ev =
+        &g_array_index (fixture->sink->events, GumEvent, i);
+
+    if (ev->compile.begin == fixture->code)
+      n_compiles++;
+  }
+  g_assert_cmpuint (n_compiles, >, 1);
+}
+
+typedef guint (* IcTargetFunc) (guint value);
+
+static guint dispatch_through_ic_targets (guint n_iterations,
+    guint n_targets);
+
+TESTCASE (megamorphic_indirect_calls)
+{
+  const guint n_iterations = 1000;
+  guint expected, actual;
+
+  expected = dispatch_through_ic_targets (n_iterations, 8);
+
+  gum_stalker_set_ic_entries (fixture->stalker, 2);
+  fixture->sink->mask = GUM_NOTHING;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  actual = dispatch_through_ic_targets (n_iterations, 8);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpuint (actual, ==, expected);
+}
+
+TESTCASE (call_summary)
+{
+  const guint n_iterations = 1000;
+  const guint n_targets = 4;
+  guint i;
+
+  fixture->sink->mask = GUM_CALL;
+  fixture->sink->call_summary = TRUE;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  dispatch_through_ic_targets (n_iterations, n_targets);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  for (i = 0; i != n_targets; i++)
+  {
+    gpointer target = GUM_FUNCPTR_TO_POINTER (ic_targets[i]);
+
+    g_assert_cmpuint (gum_fake_event_sink_get_call_count (fixture->sink,
+        target), ==, n_iterations / n_targets);
+  }
+  g_assert_cmpuint (fixture->sink->events->len, ==, 0);
+}
+
+static guint call_ic_target_directly (guint n_iterations);
+
+TESTCASE (call_summary_of_direct_calls)
+{
+  const guint n_iterations = 1000;
+  guint expected, actual;
+
+  expected = call_ic_target_directly (n_iterations);
+
+  fixture->sink->mask = GUM_CALL;
+  fixture->sink->call_summary = TRUE;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  actual = call_ic_target_directly (n_iterations);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpuint (actual, ==, expected);
+  g_assert_cmpuint (gum_fake_event_sink_get_call_count (fixture->sink,
+      GUM_FUNCPTR_TO_POINTER (ic_target_0)), ==, n_iterations);
+  g_assert_cmpuint (fixture->sink->events->len, ==, 0);
+}
+
+GUM_NOINLINE static guint
+call_ic_target_directly (guint n_iterations)
+{
+  guint value = 0;
+  guint i;
+
+  for (i = 0; i != n_iterations; i++)
+    value = ic_target_0 (value);
+
+  return value;
+}
+
+static guint count_events_of_type (GumFakeEventSink * sink,
+    GumEventType type);
+
+TESTCASE (trace_formation)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x00, 0x00, 0x00, 0x00, /* mov eax, 0   */
+    0xb9, 0x64, 0x00, 0x00, 0x00, /* mov ecx, 100 */
+                                  /* loop:        */
+    0xf6, 0xc1, 0x01,             /* test cl, 1   */
+    0x74, 0x03,                   /* jz skip      */
+    0x83, 0xc0, 0x01,             /* add eax, 1   */
+                                  /* skip:        */
+    0xff, 0xc9,                   /* dec ecx      */
+    0x75, 0xf4,                   /* jnz loop     */
+    0xc3,                         /* ret          */
+  };
+  StalkerTestFunc func;
+  guint n_blocks_untraced, n_blocks_traced, i;
+  gboolean found_trace;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  fixture->sink->mask = GUM_BLOCK | GUM_COMPILE;
+
+  g_assert_cmpint (test_stalker_fixture_follow_and_invoke (fixture, func, 0),
+      ==, 50);
+  n_blocks_untraced = count_events_of_type (fixture->sink, GUM_BLOCK);
+
+  gum_fake_event_sink_reset (fixture->sink);
+  gum_stalker_set_trace_threshold (fixture->stalker, 16);
+
+  g_assert_cmpint (test_stalker_fixture_follow_and_invoke (fixture, func, 0),
+      ==, 50);
+  n_blocks_traced = count_events_of_type (fixture->sink, GUM_BLOCK);
+
+  g_assert_cmpuint (n_blocks_traced, ==, n_blocks_untraced);
+
+  found_trace = FALSE;
+  for (i = 0; i != fixture->sink->events->len; i++)
+  {
+    const GumEvent * ev =
+        &g_array_index (fixture->sink->events, GumEvent, i);
+
+    if (ev->type == GUM_COMPILE &&
+        ev->compile.begin == fixture->code + 10 &&
+        ev->compile.end == fixture->code + sizeof (code))
+    {
+      found_trace = TRUE;
+    }
+  }
+  g_assert_true (found_trace);
+}
+
+static guint
+count_events_of_type (GumFakeEventSink * sink,
+                      GumEventType type)
+{
+  guint n, i;
+
+  n = 0;
+  for (i = 0; i != sink->events->len; i++)
+  {
+    if (g_array_index (sink->events, GumEvent, i).type == type)
+      n++;
+  }
+
+  return n;
+}
+
+TESTCASE (block_counting)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x00, 0x00, 0x00, 0x00, /* mov eax, 0   */
+    0xb9, 0x64, 0x00, 0x00, 0x00, /* mov ecx, 100 */
+                                  /* loop:        */
+    0xf6, 0xc1, 0x01,             /* test cl, 1   */
+    0x74, 0x03,                   /* jz skip      */
+    0x83, 0xc0, 0x01,             /* add eax, 1   */
+                                  /* skip:        */
+    0xff, 0xc9,                   /* dec ecx      */
+    0x75, 0xf4,                   /* jnz loop     */
+    0xc3,                         /* ret          */
+  };
+  StalkerTestFunc func;
+  GArray * counts;
+  const GumBlockCount * hottest;
+  guint i;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  fixture->sink->mask = GUM_NOTHING;
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  gum_stalker_set_block_counting (fixture->stalker, TRUE);
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  g_assert_cmpint (func (0), ==, 50);
+  g_assert_cmpint (func (0), ==, 50);
+  counts = gum_stalker_collect_block_counts (fixture->stalker);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_cmpuint (counts->len, >=, 4);
+
+  hottest = &g_array_index (counts, GumBlockCount, 0);
+  g_assert_true (hottest->begin == fixture->code + 10);
+  g_assert_true (hottest->end == fixture->code + 15);
+  g_assert_cmpuint (hottest->count, ==, 2 * 99);
+
+  for (i = 1; i != counts->len; i++)
+  {
+    g_assert_cmpuint (g_array_index (counts, GumBlockCount, i).count, <=,
+        g_array_index (counts, GumBlockCount, i - 1).count);
+  }
+
+  g_array_free (counts, TRUE);
+}
+
+TESTCASE (block_counts_should_survive_invalidation)
+{
+  const guint8 code[] =
+  {
+    0xb8, 0x2a, 0x00, 0x00, 0x00, /* mov eax, 42 */
+    0xc3,                         /* ret         */
+  };
+  StalkerTestFunc func;
+  GumMemoryRange range;
+  GArray * counts;
+  guint i, n_matches;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+  range.base_address = GUM_ADDRESS (fixture->code);
+  range.size = sizeof (code);
+
+  fixture->sink->mask = GUM_NOTHING;
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  gum_stalker_set_block_counting (fixture->stalker, TRUE);
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  for (i = 0; i != 3; i++)
+    g_assert_cmpint (func (0), ==, 42);
+  gum_stalker_invalidate (fixture->stalker, &range);
+  for (i = 0; i != 2; i++)
+    g_assert_cmpint (func (0), ==, 42);
+  counts = gum_stalker_collect_block_counts (fixture->stalker);
+  gum_stalker_unfollow_me (fixture->stalker);
 
-  fixture->sink->mask = GUM_CALL | GUM_RET;
-  test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+  n_matches = 0;
+  for (i = 0; i != counts->len; i++)
+  {
+    const GumBlockCount * bc = &g_array_index (counts, GumBlockCount, i);
 
-  g_assert_cmpuint (fixture->sink->events->len, ==, 7 + 7 + 1);
-  g_assert_cmpint (NTH_EVENT_AS_CALL (0)->depth, ==, 0);
-  g_assert_cmpint (NTH_EVENT_AS_CALL (1)->depth, ==, 1);
-  g_assert_cmpint (NTH_EVENT_AS_CALL (2)->depth, ==, 2);
-  g_assert_cmpint (NTH_EVENT_AS_CALL (3)->depth, ==, 3);
-  g_assert_cmpint (NTH_EVENT_AS_CALL (4)->depth, ==, 4);
-  g_assert_cmpint (NTH_EVENT_AS_CALL (5)->depth, ==, 5);
-  g_assert_cmpint (NTH_EVENT_AS_CALL (6)->depth, ==, 6);
-  g_assert_cmpint (NTH_EVENT_AS_RET (7)->depth, ==, 7);
-  g_assert_cmpint (NTH_EVENT_AS_RET (8)->depth, ==, 6);
-  g_assert_cmpint (NTH_EVENT_AS_RET (9)->depth, ==, 5);
-  g_assert_cmpint (NTH_EVENT_AS_RET (10)->depth, ==, 4);
-  g_assert_cmpint (NTH_EVENT_AS_RET (11)->depth, ==, 3);
-  g_assert_cmpint (NTH_EVENT_AS_RET (12)->depth, ==, 2);
-  g_assert_cmpint (NTH_EVENT_AS_RET (13)->depth, ==, 1);
+    if (bc->begin == fixture->code)
+    {
+      g_assert_cmpuint (bc->count, ==, 5);
+      n_matches++;
+    }
+  }
+  g_assert_cmpuint (n_matches, ==, 1);
+
+  g_array_free (counts, TRUE);
 }
 
 typedef struct _CallProbeContext CallProbeContext;
@@ -1137,6 +2238,40 @@ TESTCASE (follow_repne_jb)
   g_assert_cmpint (ret, ==, 0xbeef);
 }
 
+TESTCASE (return_address_mismatch)
+{
+  const guint8 mismatch_code[] =
+  {
+    0xe8, 0x0c, 0x00, 0x00, 0x00, /* call func             */
+    0xb8, 0xad, 0xde, 0x00, 0x00, /* mov eax, 0xdead       */
+    0xc3,                         /* ret                   */
+    0xb8, 0xef, 0xbe, 0x00, 0x00, /* mov eax, 0xbeef       */
+    0xc3,                         /* ret                   */
+
+                                  /* func:                 */
+    0x48,                         /* REX.W (dec eax on 32) */
+    0x83, 0x04, 0x24, 0x06,       /* add [xsp], 6          */
+    0xc3,                         /* ret                   */
+  };
+  StalkerTestFunc func;
+  gint ret;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, mismatch_code,
+          sizeof (mismatch_code)));
+
+  g_assert_cmpint (func (0), ==, 0xbeef);
+
+  gum_stalker_set_trust_threshold (fixture->stalker, 0);
+  fixture->sink->mask = GUM_NOTHING;
+
+  ret = test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+  g_assert_cmpint (ret, ==, 0xbeef);
+
+  ret = test_stalker_fixture_follow_and_invoke (fixture, func, 0);
+  g_assert_cmpint (ret, ==, 0xbeef);
+}
+
 #if GLIB_SIZEOF_VOID_P == 4
 #define UNFOLLOW_DEEP_EXTRA_INSN_COUNT 1
 #elif GLIB_SIZEOF_VOID_P == 8
@@ -1939,6 +3074,457 @@ TESTCASE (big_block)
   test_stalker_fixture_follow_and_invoke (fixture, func, -1);
 }
 
+static gboolean has_exec_event_at (GumFakeEventSink * sink,
+    gconstpointer location);
+
+TESTCASE (exclude_and_remove_range)
+{
+  const guint8 code[] =
+  {
+    0xe8, 0x01, 0x00, 0x00, 0x00, /* call func    */
+    0xc3,                         /* ret          */
+                                  /* func:        */
+    0xb8, 0x2a, 0x00, 0x00, 0x00, /* mov eax, 42  */
+    0xc3,                         /* ret          */
+  };
+  StalkerTestFunc func;
+  GumMemoryRange range;
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc,
+      test_stalker_fixture_dup_code (fixture, code, sizeof (code)));
+
+  range.base_address = GUM_ADDRESS (fixture->code + 6);
+  range.size = 6;
+  gum_stalker_exclude (fixture->stalker, &range);
+  fixture->sink->mask = GUM_EXEC;
+
+  g_assert_cmpint (test_stalker_fixture_follow_and_invoke (fixture, func, 0),
+      ==, 42);
+  g_assert_false (has_exec_event_at (fixture->sink, fixture->code + 6));
+
+  gum_fake_event_sink_reset (fixture->sink);
+  gum_stalker_remove_exclusion (fixture->stalker, &range);
+  fixture->sink->mask = GUM_EXEC;
+
+  g_assert_cmpint (test_stalker_fixture_follow_and_invoke (fixture, func, 0),
+      ==, 42);
+  g_assert_true (has_exec_event_at (fixture->sink, fixture->code + 6));
+}
+
+static gboolean store_name_of_test_runner (const GumModuleDetails * details,
+    gpointer user_data);
+static gint exclusion_target (gint value);
+
+TESTCASE (exclude_module)
+{
+  gchar * runner_name = NULL;
+  volatile gint value = 42;
+
+  gum_process_enumerate_modules (store_name_of_test_runner, &runner_name);
+  g_assert_nonnull (runner_name);
+
+  gum_stalker_exclude_module (fixture->stalker, runner_name);
+  fixture->sink->mask = GUM_EXEC;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  value = exclusion_target (value);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  /* Our call to unfollow was excluded too, so it only took effect lazily */
+  gum_stalker_garbage_collect (fixture->stalker);
+  g_assert_false (gum_stalker_is_following_me (fixture->stalker));
+
+  g_assert_cmpint (value, ==, 43);
+  g_assert_false (has_exec_event_at (fixture->sink,
+      GUM_FUNCPTR_TO_POINTER (exclusion_target)));
+
+  g_free (runner_name);
+}
+
+TESTCASE (exclude_and_remove_module)
+{
+  gchar * runner_name = NULL;
+  volatile gint value = 42;
+
+  gum_process_enumerate_modules (store_name_of_test_runner, &runner_name);
+  g_assert_nonnull (runner_name);
+
+  gum_stalker_exclude_module (fixture->stalker, runner_name);
+  gum_stalker_exclude_module (fixture->stalker, "gum-no-such-module");
+  gum_stalker_remove_module_exclusion (fixture->stalker, runner_name);
+  gum_stalker_remove_module_exclusion (fixture->stalker, "gum-no-such-module");
+  fixture->sink->mask = GUM_EXEC;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  value = exclusion_target (value);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  g_assert_false (gum_stalker_is_following_me (fixture->stalker));
+
+  g_assert_cmpint (value, ==, 43);
+  g_assert_true (has_exec_event_at (fixture->sink,
+      GUM_FUNCPTR_TO_POINTER (exclusion_target)));
+
+  g_free (runner_name);
+}
+
+TESTCASE (include_range)
+{
+  guint8 template[64] = { 0, };
+  guint8 * code, * add_location, * native_func;
+  GumX86Writer cw;
+  StalkerTestFunc func;
+  GumMemoryRange range;
+
+  code = test_stalker_fixture_dup_code (fixture, template, sizeof (template));
+  native_func = code + 32;
+
+  gum_x86_writer_init (&cw, code);
+  gum_x86_writer_put_mov_reg_address (&cw, GUM_REG_XAX,
+      GUM_ADDRESS (native_func));
+  gum_x86_writer_put_call_reg (&cw, GUM_REG_XAX);
+  add_location = gum_x86_writer_cur (&cw);
+  gum_x86_writer_put_add_reg_imm (&cw, GUM_REG_EAX, 1);
+  gum_x86_writer_put_ret (&cw);
+  gum_x86_writer_flush (&cw);
+  g_assert_cmpuint (gum_x86_writer_offset (&cw), <=, 32);
+
+  gum_x86_writer_reset (&cw, native_func);
+  gum_x86_writer_put_mov_reg_u32 (&cw, GUM_REG_EAX, 1336);
+  gum_x86_writer_put_ret (&cw);
+  gum_x86_writer_clear (&cw);
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc, code);
+
+  range.base_address = GUM_ADDRESS (code);
+  range.size = native_func - code;
+  gum_stalker_include (fixture->stalker, &range);
+  fixture->sink->mask = GUM_EXEC;
+
+  g_assert_cmpint (test_stalker_fixture_follow_and_invoke (fixture, func, 0),
+      ==, 1337);
+#ifndef G_OS_WIN32
+  /* On Windows we don't get the thread back once the native code returns */
+  g_assert_true (has_exec_event_at (fixture->sink, add_location));
+#endif
+  g_assert_false (has_exec_event_at (fixture->sink, native_func));
+  g_assert_false (has_exec_event_at (fixture->sink,
+      fixture->last_invoke_retaddr));
+
+  /* The invoker unfollowed while running natively, so it happens lazily */
+  gum_stalker_garbage_collect (fixture->stalker);
+  g_assert_false (gum_stalker_is_following_me (fixture->stalker));
+}
+
+#ifndef G_OS_WIN32
+
+typedef gpointer (* TargetFunction) (gpointer data);
+
+static gchar * load_target_functions (TargetFunction * nop_function_a,
+    TargetFunction * nop_function_c);
+static gboolean has_exec_event_within (GumFakeEventSink * sink,
+    gconstpointer begin, gsize size);
+
+TESTCASE (include_module)
+{
+  gchar * name;
+  TargetFunction nop_function_a, nop_function_c;
+  gpointer result;
+  volatile gint value = 42;
+
+  name = load_target_functions (&nop_function_a, &nop_function_c);
+
+  gum_stalker_include_module (fixture->stalker, name);
+  fixture->sink->mask = GUM_EXEC;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  result = nop_function_c (NULL);
+  value = exclusion_target (value);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  gum_stalker_garbage_collect (fixture->stalker);
+  g_assert_false (gum_stalker_is_following_me (fixture->stalker));
+
+  g_assert_cmphex (GPOINTER_TO_SIZE (result), ==, 3);
+  g_assert_cmpint (value, ==, 43);
+  g_assert_true (has_exec_event_within (fixture->sink,
+      GUM_FUNCPTR_TO_POINTER (nop_function_c), 16));
+  g_assert_true (has_exec_event_within (fixture->sink,
+      GUM_FUNCPTR_TO_POINTER (nop_function_a), 16));
+  g_assert_false (has_exec_event_at (fixture->sink,
+      GUM_FUNCPTR_TO_POINTER (exclusion_target)));
+
+  g_free (name);
+}
+
+TESTCASE (include_module_should_catch_calls_from_native_code)
+{
+  gchar * name;
+  TargetFunction nop_function_a, nop_function_c;
+  gpointer result;
+  volatile gint value = 42;
+
+  name = load_target_functions (&nop_function_a, &nop_function_c);
+
+  gum_stalker_include_module (fixture->stalker, name);
+  fixture->sink->mask = GUM_EXEC;
+
+  gum_stalker_follow_me (fixture->stalker, fixture->transformer,
+      GUM_EVENT_SINK (fixture->sink));
+  /* Hands us over to native code, which installs the entry hooks */
+  value = exclusion_target (value);
+  result = nop_function_a (NULL);
+  gum_stalker_unfollow_me (fixture->stalker);
+
+  gum_stalker_garbage_collect (fixture->stalker);
+  g_assert_false (gum_stalker_is_following_me (fixture->stalker));
+
+  g_assert_cmpint (value, ==, 43);
+  g_assert_cmphex (GPOINTER_TO_SIZE (result), ==, 0x1337);
+  g_assert_true (has_exec_event_within (fixture->sink,
+      GUM_FUNCPTR_TO_POINTER (nop_function_a), 16));
+  g_assert_false (has_exec_event_at (fixture->sink,
+      GUM_FUNCPTR_TO_POINTER (exclusion_target)));
+
+  g_free (name);
+}
+
+static gchar *
+load_target_functions (TargetFunction * nop_function_a,
+                       TargetFunction * nop_function_c)
+{
+  gchar * testdir, * name, * filename;
+  void * lib;
+
+  testdir = test_util_get_data_dir ();
+  name = g_strdup ("targetfunctions-" GUM_TEST_SHLIB_OS "-"
+      GUM_TEST_SHLIB_ARCH "." G_MODULE_SUFFIX);
+  filename = g_build_filename (testdir, name, NULL);
+
+  lib = dlopen (filename, RTLD_NOW | RTLD_GLOBAL);
+  if (lib == NULL)
+    g_print ("failed to open '%s'\n", filename);
+  g_assert_nonnull (lib);
+
+  *nop_function_a = GUM_POINTER_TO_FUNCPTR (TargetFunction,
+      dlsym (lib, "gum_test_target_nop_function_a"));
+  g_assert_nonnull (*nop_function_a);
+
+  *nop_function_c = GUM_POINTER_TO_FUNCPTR (TargetFunction,
+      dlsym (lib, "gum_test_target_nop_function_c"));
+  g_assert_nonnull (*nop_function_c);
+
+  g_free (filename);
+  g_free (testdir);
+
+  return name;
+}
+
+/*
+ * Once the entry hooks are in place, a function's first block is translated
+ * from its hook's trampoline, so only the blocks after it are reported at
+ * the function's own addresses.
+ */
+static gboolean
+has_exec_event_within (GumFakeEventSink * sink,
+                       gconstpointer begin,
+                       gsize size)
+{
+  guint i;
+
+  for (i = 0; i != sink->events->len; i++)
+  {
+    const GumEvent * ev = &g_array_index (sink->events, GumEvent, i);
+
+    if (ev->type == GUM_EXEC &&
+        (const guint8 *) ev->exec.location >= (const guint8 *) begin &&
+        (const guint8 *) ev->exec.location < (const guint8 *) begin + size)
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+#endif
+
+static guint8 * put_aligned_call (GumX86Writer * cw, gconstpointer func);
+
+#if defined (HAVE_LINUX) && defined (__GLIBC__)
+
+static gint backtrace_from_native_code (void);
+
+static gconstpointer unwind_expected_return_address;
+static gboolean unwind_found_return_address;
+
+TESTCASE (native_return_should_be_unwindable)
+{
+  guint8 template[64] = { 0, };
+  guint8 * code;
+  GumX86Writer cw;
+  StalkerTestFunc func;
+  GumMemoryRange range;
+
+  code = test_stalker_fixture_dup_code (fixture, template, sizeof (template));
+
+  gum_x86_writer_init (&cw, code);
+  unwind_expected_return_address =
+      put_aligned_call (&cw, GUM_FUNCPTR_TO_POINTER (
+          backtrace_from_native_code));
+  gum_x86_writer_put_ret (&cw);
+  gum_x86_writer_flush (&cw);
+  g_assert_cmpuint (gum_x86_writer_offset (&cw), <=, sizeof (template));
+  gum_x86_writer_clear (&cw);
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc, code);
+
+  range.base_address = GUM_ADDRESS (code);
+  range.size = sizeof (template);
+  gum_stalker_include (fixture->stalker, &range);
+  fixture->sink->mask = GUM_EXEC;
+
+  unwind_found_return_address = FALSE;
+  g_assert_cmpint (test_stalker_fixture_follow_and_invoke (fixture, func, 0),
+      ==, 1337);
+  g_assert_true (unwind_found_return_address);
+  g_assert_true (has_exec_event_at (fixture->sink,
+      unwind_expected_return_address));
+
+  gum_stalker_garbage_collect (fixture->stalker);
+}
+
+GUM_NOINLINE static gint
+backtrace_from_native_code (void)
+{
+  gpointer frames[16];
+  gint n, i;
+
+  n = backtrace (frames, G_N_ELEMENTS (frames));
+  for (i = 0; i != n; i++)
+  {
+    if (frames[i] == unwind_expected_return_address)
+      unwind_found_return_address = TRUE;
+  }
+
+  return 1337;
+}
+
+#endif
+
+static gint unfollow_from_native_code (void);
+
+static GumStalker * unfollow_stalker;
+
+TESTCASE (unfollow_while_running_natively)
+{
+  guint8 template[64] = { 0, };
+  guint8 * code, * after_unfollow;
+  GumX86Writer cw;
+  StalkerTestFunc func;
+  GumMemoryRange range;
+
+  code = test_stalker_fixture_dup_code (fixture, template, sizeof (template));
+
+  gum_x86_writer_init (&cw, code);
+  after_unfollow = put_aligned_call (&cw,
+      GUM_FUNCPTR_TO_POINTER (unfollow_from_native_code));
+  gum_x86_writer_put_add_reg_imm (&cw, GUM_REG_EAX, 1);
+  gum_x86_writer_put_ret (&cw);
+  gum_x86_writer_flush (&cw);
+  g_assert_cmpuint (gum_x86_writer_offset (&cw), <=, sizeof (template));
+  gum_x86_writer_clear (&cw);
+
+  func = GUM_POINTER_TO_FUNCPTR (StalkerTestFunc, code);
+
+  range.base_address = GUM_ADDRESS (code);
+  range.size = sizeof (template);
+  gum_stalker_include (fixture->stalker, &range);
+  fixture->sink->mask = GUM_EXEC;
+
+  unfollow_stalker = fixture->stalker;
+  g_assert_cmpint (test_stalker_fixture_follow_and_invoke (fixture, func, 0),
+      ==, 1337);
+  g_assert_true (has_exec_event_at (fixture->sink, code));
+  g_assert_false (has_exec_event_at (fixture->sink, after_unfollow));
+
+  gum_stalker_garbage_collect (fixture->stalker);
+  g_assert_false (gum_stalker_is_following_me (fixture->stalker));
+}
+
+GUM_NOINLINE static gint
+unfollow_from_native_code (void)
+{
+  gum_stalker_unfollow_me (unfollow_stalker);
+
+  return 1336;
+}
+
+/*
+ * Calls `func` with the stack aligned as the ABI demands, whatever it was on
+ * entry, and returns the return address of the call.
+ */
+static guint8 *
+put_aligned_call (GumX86Writer * cw,
+                  gconstpointer func)
+{
+  guint8 * return_address;
+
+  gum_x86_writer_put_push_reg (cw, GUM_REG_XBX);
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XBX, GUM_REG_XSP);
+  gum_x86_writer_put_and_reg_u32 (cw, GUM_REG_XSP, (guint32) ~(16 - 1));
+  /* Shadow space for the Windows x64 ABI, harmless elsewhere */
+  gum_x86_writer_put_sub_reg_imm (cw, GUM_REG_XSP, 32);
+  gum_x86_writer_put_mov_reg_address (cw, GUM_REG_XAX, GUM_ADDRESS (func));
+  gum_x86_writer_put_call_reg (cw, GUM_REG_XAX);
+  return_address = gum_x86_writer_cur (cw);
+  gum_x86_writer_put_mov_reg_reg (cw, GUM_REG_XSP, GUM_REG_XBX);
+  gum_x86_writer_put_pop_reg (cw, GUM_REG_XBX);
+
+  return return_address;
+}
+
+static gboolean
+store_name_of_test_runner (const GumModuleDetails * details,
+                           gpointer user_data)
+{
+  gchar ** runner_name = user_data;
+
+  if (strstr (details->name, "gum-tests") != NULL)
+  {
+    *runner_name = g_strdup (details->name);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+GUM_NOINLINE static gint
+exclusion_target (gint value)
+{
+  return value + 1;
+}
+
+static gboolean
+has_exec_event_at (GumFakeEventSink * sink,
+                   gconstpointer location)
+{
+  guint i;
+
+  for (i = 0; i != sink->events->len; i++)
+  {
+    const GumEvent * ev = &g_array_index (sink->events, GumEvent, i);
+
+    if (ev->type == GUM_EXEC && ev->exec.location == location)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
 #ifdef G_OS_WIN32
 
 typedef struct _TestWindow TestWindow;
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#include "gumcompactevent.h"
+#include "gumleb.h"
+
+#include "testutil.h"
+
+#include <string.h>
+
+#define TESTCASE(NAME) \
+    void test_compact_event_ ## NAME (void)
+#define TESTENTRY(NAME) \
+    TESTENTRY_SIMPLE ("Core/CompactEvent", test_compact_event, NAME)
+
+TESTLIST_BEGIN (compact_event)
+  TESTENTRY (each_event_type_should_round_trip)
+  TESTENTRY (batch_encoding_should_match_event_by_event)
+  TESTENTRY (truncated_event_should_be_rejected)
+  TESTENTRY (unknown_event_type_should_be_rejected)
+  TESTENTRY (uleb128_should_round_trip)
+  TESTENTRY (sleb128_should_round_trip)
+  TESTENTRY (overlong_leb128_should_be_rejected)
+  TESTENTRY (overflowing_leb128_should_be_rejected)
+TESTLIST_END ()
+
+static guint make_events (GumEvent * events);
+static void assert_events_equal (const GumEvent * expected,
+    const GumEvent * actual);
+
+TESTCASE (each_event_type_should_round_trip)
+{
+  GumEvent events[8], decoded;
+  guint8 data[G_N_ELEMENTS (events) * GUM_COMPACT_EVENT_MAX_SIZE];
+  GumCompactEventCursor encoder, decoder;
+  guint8 * cur;
+  const guint8 * p, * end;
+  guint n, i;
+
+  n = make_events (events);
+
+  gum_compact_event_cursor_init (&encoder);
+  cur = data;
+  for (i = 0; i != n; i++)
+  {
+    guint size;
+
+    size = gum_compact_event_encode (&encoder, &events[i], cur);
+    g_assert_cmpuint (size, >=, 2);
+    g_assert_cmpuint (size, <=, GUM_COMPACT_EVENT_MAX_SIZE);
+    cur += size;
+  }
+  end = cur;
+
+  gum_compact_event_cursor_init (&decoder);
+  p = data;
+  for (i = 0; i != n; i++)
+  {
+    memset (&decoded, 0, sizeof (decoded));
+    g_assert_true (gum_compact_event_decode (&decoder, &p, end, &decoded));
+    assert_events_equal (&events[i], &decoded);
+  }
+  g_assert_true (p == end);
+  g_assert_false (gum_compact_event_decode (&decoder, &p, end, &decoded));
+}
+
+TESTCASE (batch_encoding_should_match_event_by_event)
+{
+  GumEvent events[8];
+  guint8 expected[G_N_ELEMENTS (events) * GUM_COMPACT_EVENT_MAX_SIZE];
+  GumCompactEventCursor cursor;
+  guint8 * actual;
+  gsize expected_size, actual_size;
+  guint n, i;
+
+  n = make_events (events);
+
+  gum_compact_event_cursor_init (&cursor);
+  expected_size = 0;
+  for (i = 0; i != n; i++)
+  {
+    expected_size += gum_compact_event_encode (&cursor, &events[i],
+        expected + expected_size);
+  }
+
+  actual = gum_compact_events_encode (events, n, &actual_size);
+  g_assert_cmpuint (actual_size, ==, expected_size);
+  g_assert_cmpint (memcmp (actual, expected, expected_size), ==, 0);
+  g_free (actual);
+
+  actual = gum_compact_events_encode (events, 0, &actual_size);
+  g_assert_cmpuint (actual_size, ==, 0);
+  g_free (actual);
+}
+
+TESTCASE (truncated_event_should_be_rejected)
+{
+  GumEvent events[8], decoded;
+  guint8 data[GUM_COMPACT_EVENT_MAX_SIZE];
+  GumCompactEventCursor cursor;
+  guint n, i, size, length;
+
+  n = make_events (events);
+
+  for (i = 0; i != n; i++)
+  {
+    gum_compact_event_cursor_init (&cursor);
+    size = gum_compact_event_encode (&cursor, &events[i], data);
+
+    for (length = 0; length != size; length++)
+    {
+      const guint8 * p = data;
+
+      gum_compact_event_cursor_init (&cursor);
+      g_assert_false (gum_compact_event_decode (&cursor, &p, data + length,
+          &decoded));
+      g_assert_true (p == data);
+      g_assert_cmphex (cursor.previous, ==, 0);
+    }
+  }
+}
+
+TESTCASE (unknown_event_type_should_be_rejected)
+{
+  const guint8 data[] = { 0x00, 0x01, 0x01 };
+  const guint8 * p = data;
+  GumCompactEventCursor cursor;
+  GumEvent decoded;
+
+  gum_compact_event_cursor_init (&cursor);
+  g_assert_false (gum_compact_event_decode (&cursor, &p, data + sizeof (data),
+      &decoded));
+  g_assert_true (p == data);
+}
+
+TESTCASE (uleb128_should_round_trip)
+{
+  const struct {
+    guint64 value;
+    guint size;
+  } vectors[] = {
+    { 0, 1 },
+    { 1, 1 },
+    { 127, 1 },
+    { 128, 2 },
+    { 624485, 3 },
+    { G_MAXUINT32, 5 },
+    { G_MAXUINT64, 10 },
+  };
+  guint i;
+
+  for (i = 0; i != G_N_ELEMENTS (vectors); i++)
+  {
+    guint8 data[10];
+    const guint8 * p = data;
+    guint size;
+    guint64 value;
+
+    size = gum_write_uleb128 (data, vectors[i].value);
+    g_assert_cmpuint (size, ==, vectors[i].size);
+
+    g_assert_true (gum_try_read_uleb128 (&p, data + size, &value));
+    g_assert_cmphex (value, ==, vectors[i].value);
+    g_assert_true (p == data + size);
+  }
+}
+
+TESTCASE (sleb128_should_round_trip)
+{
+  const struct {
+    gint64 value;
+    guint size;
+  } vectors[] = {
+    { 0, 1 },
+    { 1, 1 },
+    { -1, 1 },
+    { 63, 1 },
+    { 64, 2 },
+    { -64, 1 },
+    { -65, 2 },
+    { -123456, 3 },
+    { G_MAXINT64, 10 },
+    { G_MININT64, 10 },
+  };
+  guint i;
+
+  for (i = 0; i != G_N_ELEMENTS (vectors); i++)
+  {
+    guint8 data[10];
+    const guint8 * p = data;
+    guint size;
+    gint64 value;
+
+    size = gum_write_sleb128 (data, vectors[i].value);
+    g_assert_cmpuint (size, ==, vectors[i].size);
+
+    g_assert_true (gum_try_read_sleb128 (&p, data + size, &value));
+    g_assert_cmpint (value, ==, vectors[i].value);
+    g_assert_true (p == data + size);
+  }
+}
+
+TESTCASE (overlong_leb128_should_be_rejected)
+{
+  const guint8 data[] = {
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00
+  };
+  const guint8 * p;
+  guint64 u;
+  gint64 s;
+
+  p = data;
+  g_assert_false (gum_try_read_uleb128 (&p, data + sizeof (data), &u));
+  g_assert_true (p == data);
+
+  p = data;
+  g_assert_false (gum_try_read_sleb128 (&p, data + sizeof (data), &s));
+  g_assert_true (p == data);
+}
+
+TESTCASE (overflowing_leb128_should_be_rejected)
+{
+  guint8 data[10];
+  const guint8 * p;
+  guint64 u;
+  gint64 s;
+
+  memset (data, 0xff, 9);
+
+  data[9] = 0x01;
+  p = data;
+  g_assert_true (gum_try_read_uleb128 (&p, data + sizeof (data), &u));
+  g_assert_cmphex (u, ==, G_MAXUINT64);
+
+  data[9] = 0x02;
+  p = data;
+  g_assert_false (gum_try_read_uleb128 (&p, data + sizeof (data), &u));
+  g_assert_true (p == data);
+
+  memset (data, 0x80, 9);
+
+  data[9] = 0x7f;
+  p = data;
+  g_assert_true (gum_try_read_sleb128 (&p, data + sizeof (data), &s));
+  g_assert_cmpint (s, ==, G_MININT64);
+
+  data[9] = 0x01;
+  p = data;
+  g_assert_false (gum_try_read_sleb128 (&p, data + sizeof (data), &s));
+  g_assert_true (p == data);
+
+  data[9] = 0x40;
+  p = data;
+  g_assert_false (gum_try_read_sleb128 (&p, data + sizeof (data), &s));
+  g_assert_true (p == data);
+}
+
+static guint
+make_events (GumEvent * events)
+{
+  GumEvent * ev = events;
+
+  ev->call.type = GUM_CALL;
+  ev->call.location = GSIZE_TO_POINTER (0x1000);
+  ev->call.target = GSIZE_TO_POINTER (0x1400);
+  ev->call.depth = 1;
+  ev++;
+
+  ev->exec.type = GUM_EXEC;
+  ev->exec.location = GSIZE_TO_POINTER (0x1404);
+  ev++;
+
+  ev->block.type = GUM_BLOCK;
+  ev->block.begin = GSIZE_TO_POINTER (0x1404);
+  ev->block.end = GSIZE_TO_POINTER (0x1420);
+  ev++;
+
+  ev->ret.type = GUM_RET;
+  ev->ret.location = GSIZE_TO_POINTER (0x1420);
+  ev->ret.target = GSIZE_TO_POINTER (0x1005);
+  ev->ret.depth = 0;
+  ev++;
+
+  ev->compile.type = GUM_COMPILE;
+  ev->compile.begin = GSIZE_TO_POINTER (0x10);
+  ev->compile.end = GSIZE_TO_POINTER (0x20);
+  ev++;
+
+  ev->call.type = GUM_CALL;
+  ev->call.location = GSIZE_TO_POINTER (G_MAXSIZE - 0xf);
+  ev->call.target = GSIZE_TO_POINTER (0x30);
+  ev->call.depth = -3;
+  ev++;
+
+  ev->exec.type = GUM_EXEC;
+  ev->exec.location = GSIZE_TO_POINTER (G_MAXSIZE);
+  ev++;
+
+  ev->ret.type = GUM_RET;
+  ev->ret.location = NULL;
+  ev->ret.target = GSIZE_TO_POINTER (G_MAXSIZE);
+  ev->ret.depth = G_MAXINT;
+  ev++;
+
+  return ev - events;
+}
+
+static void
+assert_events_equal (const GumEvent * expected,
+                     const GumEvent * actual)
+{
+  g_assert_cmpint (actual->type, ==, expected->type);
+
+  switch (expected->type)
+  {
+    case GUM_CALL:
+    case GUM_RET:
+      g_assert_true (actual->call.location == expected->call.location);
+      g_assert_true (actual->call.target == expected->call.target);
+      g_assert_cmpint (actual->call.depth, ==, expected->call.depth);
+      break;
+    case GUM_EXEC:
+      g_assert_true (actual->exec.location == expected->exec.location);
+      break;
+    case GUM_BLOCK:
+    case GUM_COMPILE:
+      g_assert_true (actual->block.begin == expected->block.begin);
+      g_assert_true (actual->block.end == expected->block.end);
+      break;
+    default:
+      g_assert_not_reached ();
+  }
+}
@@ -0,0 +1,455 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#include "gumfileeventsink.h"
+
+#include "testutil.h"
+
+#include <glib/gstdio.h>
+
+#define TESTCASE(NAME) \
+    void test_file_event_sink_ ## NAME (void)
+#define TESTENTRY(NAME) \
+    TESTENTRY_SIMPLE ("Core/FileEventSink", test_file_event_sink, NAME)
+
+TESTLIST_BEGIN (file_event_sink)
+  TESTENTRY (raw_events_should_be_recorded)
+  TESTENTRY (compact_events_should_be_recorded)
+  TESTENTRY (modules_should_be_recorded)
+  TESTENTRY (segments_should_rotate)
+  TESTENTRY (only_the_most_recent_segments_should_be_kept)
+  TESTENTRY (recording_should_resume_once_a_segment_can_be_created)
+TESTLIST_END ()
+
+typedef struct _TestTrace TestTrace;
+
+struct _TestTrace
+{
+  gchar * dir;
+  gchar * prefix;
+};
+
+typedef struct _TestEventCollector TestEventCollector;
+
+struct _TestEventCollector
+{
+  GArray * events;
+  GumThreadId thread_id;
+};
+
+static void test_trace_init (TestTrace * trace);
+static void test_trace_destroy (TestTrace * trace);
+static GumFileEventReader * test_trace_open_segment (TestTrace * trace,
+    guint index);
+static gboolean test_trace_has_segment (TestTrace * trace, guint index);
+static guint test_trace_count_files (TestTrace * trace);
+
+static void record_exec_events (GumEventSink * sink, gsize first, gsize n);
+static GArray * collect_events (GumFileEventReader * reader);
+static gboolean collect_event (GumThreadId thread_id, const GumEvent * ev,
+    gpointer user_data);
+static gboolean count_module (const GumModuleDetails * details,
+    gpointer user_data);
+static void check_recorded_events (GumFileEventFormat format);
+
+TESTCASE (raw_events_should_be_recorded)
+{
+  check_recorded_events (GUM_FILE_EVENT_FORMAT_RAW);
+}
+
+TESTCASE (compact_events_should_be_recorded)
+{
+  check_recorded_events (GUM_FILE_EVENT_FORMAT_COMPACT);
+}
+
+TESTCASE (modules_should_be_recorded)
+{
+  TestTrace trace;
+  GumEventSink * sink;
+  GumFileEventReader * reader;
+  GError * error = NULL;
+  guint n_modules = 0;
+
+  test_trace_init (&trace);
+
+  sink = gum_file_event_sink_new (trace.prefix, GUM_EXEC,
+      GUM_FILE_EVENT_FORMAT_RAW, 0, 0, &error);
+  g_assert_no_error (error);
+  g_object_unref (sink);
+
+  reader = test_trace_open_segment (&trace, 0);
+  gum_file_event_reader_enumerate_modules (reader, count_module, &n_modules);
+  g_assert_cmpuint (n_modules, >, 0);
+  gum_file_event_reader_free (reader);
+
+  test_trace_destroy (&trace);
+}
+
+TESTCASE (segments_should_rotate)
+{
+  TestTrace trace;
+  GumEventSink * sink;
+  GError * error = NULL;
+  const gsize n = 64 * 1024;
+  gsize next;
+  guint index;
+
+  test_trace_init (&trace);
+
+  sink = gum_file_event_sink_new (trace.prefix, GUM_EXEC,
+      GUM_FILE_EVENT_FORMAT_RAW, 256 * 1024, 0, &error);
+  g_assert_no_error (error);
+  record_exec_events (sink, 1, n);
+  g_object_unref (sink);
+
+  g_assert_true (test_trace_has_segment (&trace, 1));
+
+  next = 1;
+  for (index = 0; test_trace_has_segment (&trace, index); index++)
+  {
+    GumFileEventReader * reader;
+    GArray * events;
+    guint i;
+
+    reader = test_trace_open_segment (&trace, index);
+    g_assert_cmpuint (gum_file_event_reader_get_segment_index (reader), ==,
+        index);
+
+    events = collect_events (reader);
+    for (i = 0; i != events->len; i++)
+    {
+      g_assert_cmphex (GPOINTER_TO_SIZE (g_array_index (events, GumEvent,
+          i).exec.location), ==, next);
+      next++;
+    }
+    g_array_free (events, TRUE);
+
+    gum_file_event_reader_free (reader);
+  }
+  g_assert_cmpuint (next, ==, n + 1);
+  g_assert_cmpuint (test_trace_count_files (&trace), ==, index);
+
+  test_trace_destroy (&trace);
+}
+
+TESTCASE (only_the_most_recent_segments_should_be_kept)
+{
+  TestTrace trace;
+  GumEventSink * sink;
+  GError * error = NULL;
+  const gsize n = 64 * 1024;
+  gsize next;
+  guint first, index;
+
+  test_trace_init (&trace);
+
+  sink = gum_file_event_sink_new (trace.prefix, GUM_EXEC,
+      GUM_FILE_EVENT_FORMAT_RAW, 256 * 1024, 2, &error);
+  g_assert_no_error (error);
+  record_exec_events (sink, 1, n);
+  g_object_unref (sink);
+
+  g_assert_false (test_trace_has_segment (&trace, 0));
+  g_assert_cmpuint (test_trace_count_files (&trace), ==, 2);
+
+  for (first = 1; !test_trace_has_segment (&trace, first); first++)
+    ;
+
+  next = 0;
+  for (index = first; index != first + 2; index++)
+  {
+    GumFileEventReader * reader;
+    GArray * events;
+    guint i;
+
+    reader = test_trace_open_segment (&trace, index);
+
+    events = collect_events (reader);
+    for (i = 0; i != events->len; i++)
+    {
+      gsize location = GPOINTER_TO_SIZE (g_array_index (events, GumEvent,
+          i).exec.location);
+
+      if (next != 0)
+        g_assert_cmphex (location, ==, next);
+      next = location + 1;
+    }
+    g_array_free (events, TRUE);
+
+    gum_file_event_reader_free (reader);
+  }
+  g_assert_cmpuint (next, ==, n + 1);
+
+  test_trace_destroy (&trace);
+}
+
+TESTCASE (recording_should_resume_once_a_segment_can_be_created)
+{
+  TestTrace trace;
+  GumEventSink * sink;
+  GError * error = NULL;
+  const gsize n = 64 * 1024;
+  gchar * blocker;
+  GumFileEventReader * reader;
+  GArray * events;
+
+  test_trace_init (&trace);
+
+  blocker = gum_file_event_sink_get_segment_path (trace.prefix, 1);
+  g_assert_cmpint (g_mkdir (blocker, 0700), ==, 0);
+
+  sink = gum_file_event_sink_new (trace.prefix, GUM_EXEC,
+      GUM_FILE_EVENT_FORMAT_RAW, 256 * 1024, 0, &error);
+  g_assert_no_error (error);
+  record_exec_events (sink, 1, n);
+
+  g_assert_cmpint (g_rmdir (blocker), ==, 0);
+  g_usleep (G_USEC_PER_SEC + (G_USEC_PER_SEC / 10));
+
+  record_exec_events (sink, n + 1, 16);
+  g_object_unref (sink);
+
+  reader = test_trace_open_segment (&trace, 1);
+  events = collect_events (reader);
+  g_assert_cmpuint (events->len, ==, 16);
+  g_assert_cmphex (GPOINTER_TO_SIZE (g_array_index (events, GumEvent,
+      0).exec.location), ==, n + 1);
+  g_array_free (events, TRUE);
+  gum_file_event_reader_free (reader);
+
+  g_free (blocker);
+
+  test_trace_destroy (&trace);
+}
+
+static void
+check_recorded_events (GumFileEventFormat format)
+{
+  TestTrace trace;
+  GumEventSink * sink;
+  GumFileEventReader * reader;
+  GError * error = NULL;
+  GumEvent events[5];
+  GArray * recorded;
+  TestEventCollector collector;
+  guint i;
+
+  test_trace_init (&trace);
+
+  events[0].call.type = GUM_CALL;
+  events[0].call.location = GSIZE_TO_POINTER (0x1000);
+  events[0].call.target = GSIZE_TO_POINTER (0x2000);
+  events[0].call.depth = 0;
+
+  events[1].exec.type = GUM_EXEC;
+  events[1].exec.location = GSIZE_TO_POINTER (0x2000);
+
+  events[2].block.type = GUM_BLOCK;
+  events[2].block.begin = GSIZE_TO_POINTER (0x2000);
+  events[2].block.end = GSIZE_TO_POINTER (0x2010);
+
+  events[3].ret.type = GUM_RET;
+  events[3].ret.location = GSIZE_TO_POINTER (0x2010);
+  events[3].ret.target = GSIZE_TO_POINTER (0x1005);
+  events[3].ret.depth = 1;
+
+  events[4].compile.type = GUM_COMPILE;
+  events[4].compile.begin = GSIZE_TO_POINTER (0x1005);
+  events[4].compile.end = GSIZE_TO_POINTER (0x1010);
+
+  sink = gum_file_event_sink_new (trace.prefix,
+      GUM_CALL | GUM_RET | GUM_EXEC | GUM_BLOCK | GUM_COMPILE, format, 0, 0,
+      &error);
+  g_assert_no_error (error);
+  gum_event_sink_process (sink, &events[0]);
+  gum_event_sink_process_batch (sink, &events[1], G_N_ELEMENTS (events) - 1);
+  gum_event_sink_flush (sink);
+  g_object_unref (sink);
+
+  reader = test_trace_open_segment (&trace, 0);
+  g_assert_cmpuint (gum_file_event_reader_get_format (reader), ==, format);
+
+  recorded = g_array_new (FALSE, FALSE, sizeof (GumEvent));
+  collector.events = recorded;
+  collector.thread_id = 0;
+  gum_file_event_reader_enumerate_events (reader, collect_event, &collector);
+  g_assert_cmpuint (collector.thread_id, ==,
+      gum_process_get_current_thread_id ());
+
+  g_assert_cmpuint (recorded->len, ==, G_N_ELEMENTS (events));
+  for (i = 0; i != G_N_ELEMENTS (events); i++)
+  {
+    const GumEvent * expected = &events[i];
+    const GumEvent * actual = &g_array_index (recorded, GumEvent, i);
+
+    g_assert_cmpint (actual->type, ==, expected->type);
+    switch (expected->type)
+    {
+      case GUM_CALL:
+      case GUM_RET:
+        g_assert_true (actual->call.location == expected->call.location);
+        g_assert_true (actual->call.target == expected->call.target);
+        g_assert_cmpint (actual->call.depth, ==, expected->call.depth);
+        break;
+      case GUM_EXEC:
+        g_assert_true (actual->exec.location == expected->exec.location);
+        break;
+      case GUM_BLOCK:
+      case GUM_COMPILE:
+        g_assert_true (actual->block.begin == expected->block.begin);
+        g_assert_true (actual->block.end == expected->block.end);
+        break;
+      default:
+        g_assert_not_reached ();
+    }
+  }
+
+  g_array_free (recorded, TRUE);
+  gum_file_event_reader_free (reader);
+
+  test_trace_destroy (&trace);
+}
+
+static void
+record_exec_events (GumEventSink * sink,
+                    gsize first,
+                    gsize n)
+{
+  GumEvent batch[64];
+  gsize location, end;
+
+  location = first;
+  end = first + n;
+
+  while (location != end)
+  {
+    guint n_batch, i;
+
+    n_batch = MIN (end - location, G_N_ELEMENTS (batch));
+    for (i = 0; i != n_batch; i++)
+    {
+      batch[i].exec.type = GUM_EXEC;
+      batch[i].exec.location = GSIZE_TO_POINTER (location++);
+    }
+
+    gum_event_sink_process_batch (sink, batch, n_batch);
+  }
+}
+
+static GArray *
+collect_events (GumFileEventReader * reader)
+{
+  TestEventCollector collector;
+
+  collector.events = g_array_new (FALSE, FALSE, sizeof (GumEvent));
+  collector.thread_id = 0;
+  gum_file_event_reader_enumerate_events (reader, collect_event, &collector);
+
+  return collector.events;
+}
+
+static gboolean
+collect_event (GumThreadId thread_id,
+               const GumEvent * ev,
+               gpointer user_data)
+{
+  TestEventCollector * collector = user_data;
+
+  g_array_append_val (collector->events, *ev);
+  collector->thread_id = thread_id;
+
+  return TRUE;
+}
+
+static gboolean
+count_module (const GumModuleDetails * details,
+              gpointer user_data)
+{
+  guint * n_modules = user_data;
+
+  (*n_modules)++;
+
+  return TRUE;
+}
+
+static void
+test_trace_init (TestTrace * trace)
+{
+  GError * error = NULL;
+
+  trace->dir = g_dir_make_tmp ("file-event-sink-XXXXXX", &error);
+  g_assert_no_error (error);
+  trace->prefix = g_build_filename (trace->dir, "trace", NULL);
+}
+
+static void
+test_trace_destroy (TestTrace * trace)
+{
+  GDir * dir;
+  const gchar * name;
+
+  dir = g_dir_open (trace->dir, 0, NULL);
+  g_assert_nonnull (dir);
+  while ((name = g_dir_read_name (dir)) != NULL)
+  {
+    gchar * path;
+
+    path = g_build_filename (trace->dir, name, NULL);
+    g_unlink (path);
+    g_free (path);
+  }
+  g_dir_close (dir);
+
+  g_rmdir (trace->dir);
+
+  g_free (trace->prefix);
+  g_free (trace->dir);
+}
+
+static GumFileEventReader *
+test_trace_open_segment (TestTrace * trace,
+                         guint index)
+{
+  GumFileEventReader * reader;
+  gchar * path;
+  GError * error = NULL;
+
+  path = gum_file_event_sink_get_segment_path (trace->prefix, index);
+  reader = gum_file_event_reader_open (path, &error);
+  g_assert_no_error (error);
+  g_free (path);
+
+  return reader;
+}
+
+static gboolean
+test_trace_has_segment (TestTrace * trace,
+                        guint index)
+{
+  gchar * path;
+  gboolean exists;
+
+  path = gum_file_event_sink_get_segment_path (trace->prefix, index);
+  exists = g_file_test (path, G_FILE_TEST_EXISTS);
+  g_free (path);
+
+  return exists;
+}
+
+static guint
+test_trace_count_files (TestTrace * trace)
+{
+  GDir * dir;
+  guint n = 0;
+
+  dir = g_dir_open (trace->dir, 0, NULL);
+  g_assert_nonnull (dir);
+  while (g_dir_read_name (dir) != NULL)
+    n++;
+  g_dir_close (dir);
+
+  return n;
+}
@@ -29,6 +29,7 @@ TESTLIST_BEGIN (interceptor_darwin)
   TESTENTRY (can_attach_to_sqlite3_thread_cleanup)
 
   TESTENTRY (attach_performance)
+  TESTENTRY (attach_many_performance)
   TESTENTRY (replace_performance)
 
 #ifdef HAVE_IOS
@@ -53,6 +54,8 @@ static gpointer perform_read (gpointer data);
 
 static gboolean attach_if_function_export (const GumExportDetails * details,
     gpointer user_data);
+static gboolean collect_if_function_export (const GumExportDetails * details,
+    gpointer user_data);
 static gboolean replace_if_function_export (const GumExportDetails * details,
     gpointer user_data);
 
@@ -348,6 +351,49 @@ TESTCASE (attach_performance)
   g_object_unref (ctx.listener);
 }
 
+TESTCASE (attach_many_performance)
+{
+  gpointer sqlite;
+  GumInvocationListener * listener;
+  GArray * functions;
+  GTimer * timer;
+  guint count;
+  gdouble elapsed;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
+
+  listener = GUM_INVOCATION_LISTENER (test_callback_listener_new ());
+
+  sqlite = dlopen ("/usr/lib/libsqlite3.0.dylib", RTLD_LAZY | RTLD_GLOBAL);
+  g_assert_nonnull (sqlite);
+
+  functions = g_array_new (FALSE, FALSE, sizeof (gpointer));
+  gum_module_enumerate_exports ("libsqlite3.dylib", collect_if_function_export,
+      functions);
+
+  timer = g_timer_new ();
+
+  count = gum_interceptor_attach_many (fixture->interceptor,
+      (const gpointer *) functions->data, functions->len, listener, NULL);
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_print ("<hooked %u functions in %u ms, %u hooks per second> ", count,
+      (guint) (elapsed * 1000.0), (guint) (count / elapsed));
+  g_timer_destroy (timer);
+
+  gum_interceptor_detach (fixture->interceptor, listener);
+
+  g_array_free (functions, TRUE);
+
+  dlclose (sqlite);
+
+  g_object_unref (listener);
+}
+
 TESTCASE (replace_performance)
 {
   gpointer sqlite;
@@ -411,6 +457,22 @@ attach_if_function_export (const GumExportDetails * details,
   return TRUE;
 }
 
+static gboolean
+collect_if_function_export (const GumExportDetails * details,
+                            gpointer user_data)
+{
+  if (details->type == GUM_EXPORT_FUNCTION &&
+      strcmp (details->name, "sqlite3_thread_cleanup") != 0)
+  {
+    GArray * functions = user_data;
+    gpointer address = GSIZE_TO_POINTER (details->address);
+
+    g_array_append_val (functions, address);
+  }
+
+  return TRUE;
+}
+
 static gboolean
 replace_if_function_export (const GumExportDetails * details,
                             gpointer user_data)
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2008-2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+typedef struct {
+  GObject parent;
+
+  GString * result;
+  gchar enter_char;
+  guint on_enter_call_count;
+  gpointer last_seen_argument;
+  gboolean last_invocation_was_current;
+} TestEnterListener;
+
+typedef struct {
+  GObjectClass parent_class;
+} TestEnterListenerClass;
+
+#define TEST_TYPE_ENTER_LISTENER \
+    (test_enter_listener_get_type ())
+#define TEST_ENTER_LISTENER(obj) (G_TYPE_CHECK_INSTANCE_CAST ((obj), \
+    TEST_TYPE_ENTER_LISTENER, TestEnterListener))
+
+static void test_enter_listener_iface_init (gpointer g_iface,
+    gpointer iface_data);
+
+G_DEFINE_TYPE_EXTENDED (TestEnterListener,
+                        test_enter_listener,
+                        G_TYPE_OBJECT,
+                        0,
+                        G_IMPLEMENT_INTERFACE (GUM_TYPE_INVOCATION_LISTENER,
+                            test_enter_listener_iface_init))
+
+static void
+test_enter_listener_on_enter (GumInvocationListener * listener,
+                              GumInvocationContext * context)
+{
+  TestEnterListener * self = TEST_ENTER_LISTENER (listener);
+
+  g_assert_cmpuint (gum_invocation_context_get_point_cut (context), ==,
+      GUM_POINT_ENTER);
+
+  if (self->result != NULL)
+    g_string_append_c (self->result, self->enter_char);
+
+  self->on_enter_call_count++;
+  self->last_seen_argument =
+      gum_invocation_context_get_nth_argument (context, 0);
+  self->last_invocation_was_current =
+      gum_interceptor_get_current_invocation () == context;
+}
+
+static void
+test_enter_listener_iface_init (gpointer g_iface,
+                                gpointer iface_data)
+{
+  GumInvocationListenerInterface * iface = g_iface;
+
+  iface->on_enter = test_enter_listener_on_enter;
+  iface->on_leave = NULL;
+}
+
+static void
+test_enter_listener_class_init (TestEnterListenerClass * klass)
+{
+}
+
+static void
+test_enter_listener_init (TestEnterListener * self)
+{
+}
+
+static TestEnterListener *
+test_enter_listener_new (GString * result,
+                         gchar enter_char)
+{
+  TestEnterListener * listener;
+
+  listener = g_object_new (TEST_TYPE_ENTER_LISTENER, NULL);
+  listener->result = result;
+  listener->enter_char = enter_char;
+
+  return listener;
+}
+
+/*
+ * Implements neither callback, so attaching it next to a TestEnterListener
+ * moves the function off the enter-only path without adding any work.
+ */
+typedef struct {
+  GObject parent;
+} TestPassiveListener;
+
+typedef struct {
+  GObjectClass parent_class;
+} TestPassiveListenerClass;
+
+#define TEST_TYPE_PASSIVE_LISTENER \
+    (test_passive_listener_get_type ())
+
+static void test_passive_listener_iface_init (gpointer g_iface,
+    gpointer iface_data);
+
+G_DEFINE_TYPE_EXTENDED (TestPassiveListener,
+                        test_passive_listener,
+                        G_TYPE_OBJECT,
+                        0,
+                        G_IMPLEMENT_INTERFACE (GUM_TYPE_INVOCATION_LISTENER,
+                            test_passive_listener_iface_init))
+
+static void
+test_passive_listener_iface_init (gpointer g_iface,
+                                  gpointer iface_data)
+{
+  GumInvocationListenerInterface * iface = g_iface;
+
+  iface->on_enter = NULL;
+  iface->on_leave = NULL;
+}
+
+static void
+test_passive_listener_class_init (TestPassiveListenerClass * klass)
+{
+}
+
+static void
+test_passive_listener_init (TestPassiveListener * self)
+{
+}
@@ -5,8 +5,10 @@
  */
 
 #include "guminterceptor.h"
+#include "guminterceptor-priv.h"
 
 #include "interceptor-callbacklistener.c"
+#include "interceptor-enterlistener.c"
 #include "lowlevel-helpers.h"
 #include "testutil.h"
 #include "valgrind.h"
@@ -28,56 +30,6 @@
     TESTENTRY_WITH_FIXTURE ("Core/Interceptor", \
         test_interceptor, NAME, TestInterceptorFixture)
 
-/* TODO: fix this in GLib */
-#ifdef HAVE_DARWIN
-# undef G_MODULE_SUFFIX
-# define G_MODULE_SUFFIX "dylib"
-#endif
-
-#if defined (G_OS_WIN32)
-# define GUM_TEST_SHLIB_OS "windows"
-#elif defined (HAVE_MACOS)
-# define GUM_TEST_SHLIB_OS "macos"
-#elif defined (HAVE_LINUX) && !defined (HAVE_ANDROID)
-# define GUM_TEST_SHLIB_OS "linux"
-#elif defined (HAVE_IOS)
-# define GUM_TEST_SHLIB_OS "ios"
-#elif defined (HAVE_ANDROID)
-# define GUM_TEST_SHLIB_OS "android"
-#elif defined (HAVE_QNX)
-# define GUM_TEST_SHLIB_OS "qnx"
-#else
-# error Unknown OS
-#endif
-
-#if defined (HAVE_I386)
-# if GLIB_SIZEOF_VOID_P == 4
-#  define GUM_TEST_SHLIB_ARCH "x86"
-# else
-#  define GUM_TEST_SHLIB_ARCH "x86_64"
-# endif
-#elif defined (HAVE_ARM)
-# define GUM_TEST_SHLIB_ARCH "arm"
-#elif defined (HAVE_ARM64)
-# define GUM_TEST_SHLIB_ARCH "arm64"
-#elif defined (HAVE_MIPS)
-# if G_BYTE_ORDER == G_LITTLE_ENDIAN
-#  if GLIB_SIZEOF_VOID_P == 8
-#    define GUM_TEST_SHLIB_ARCH "mips64el"
-#  else
-#    define GUM_TEST_SHLIB_ARCH "mipsel"
-#  endif
-# else
-#  if GLIB_SIZEOF_VOID_P == 8
-#    define GUM_TEST_SHLIB_ARCH "mips64"
-#  else
-#    define GUM_TEST_SHLIB_ARCH "mips"
-#  endif
-# endif
-#else
-# error Unknown CPU
-#endif
-
 typedef struct _TestInterceptorFixture   TestInterceptorFixture;
 typedef struct _ListenerContext      ListenerContext;
 typedef struct _ListenerContextClass ListenerContextClass;
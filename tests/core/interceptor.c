@@ -25,6 +25,7 @@ TESTLIST_BEGIN (interceptor)
   TESTENTRY (attach_one)
   TESTENTRY (attach_two)
   TESTENTRY (attach_to_recursive_function)
+  TESTENTRY (attach_to_deeply_recursive_function)
   TESTENTRY (attach_to_special_function)
 #ifdef G_OS_UNIX
   TESTENTRY (attach_to_pthread_key_create)
@@ -51,6 +52,18 @@ TESTLIST_BEGIN (interceptor)
   TESTENTRY (detach)
   TESTENTRY (listener_ref_count)
   TESTENTRY (function_data)
+  TESTENTRY (listener_data_is_not_shared)
+  TESTENTRY (attach_many)
+  TESTENTRY (attach_many_performance)
+  TESTENTRY (invocation_performance)
+  TESTENTRY (enter_only_listener)
+  TESTENTRY (enter_only_listener_joined_by_another)
+  TESTENTRY (enter_only_listener_replaced)
+  TESTENTRY (enter_only_listener_on_replaced_function)
+#ifdef HAVE_I386
+  TESTENTRY (enter_only_path_selection)
+  TESTENTRY (enter_only_path_performance)
+#endif
 
   TESTENTRY (i_can_has_replaceability)
   TESTENTRY (already_replaced)
@@ -107,6 +120,31 @@ TESTCASE (attach_to_recursive_function)
   g_assert_cmpstr (fixture->result->str, ==, ">>>>>0<1<2<3<4<");
 }
 
+TESTCASE (attach_to_deeply_recursive_function)
+{
+  const gint depth = 100;
+  GString * expected;
+  guint round;
+  gint i;
+
+  expected = g_string_new ("");
+  for (i = 0; i <= depth; i++)
+    g_string_append_c (expected, '>');
+  for (i = 0; i <= depth; i++)
+    g_string_append_printf (expected, "%d<", i);
+
+  interceptor_fixture_attach (fixture, 0, recursive_function, '>', '<');
+
+  for (round = 0; round != 2; round++)
+  {
+    g_string_truncate (fixture->result, 0);
+    recursive_function (fixture->result, depth);
+    g_assert_cmpstr (fixture->result->str, ==, expected->str);
+  }
+
+  g_string_free (expected, TRUE);
+}
+
 TESTCASE (attach_to_special_function)
 {
   interceptor_fixture_attach (fixture, 0, special_function, '>', '<');
@@ -431,8 +469,439 @@ TESTCASE (function_data)
   g_object_unref (fd_listener);
 }
 
+TESTCASE (attach_many)
+{
+  TestFunctionDataListener * fd_listener;
+  GumInvocationListener * listener;
+  gpointer functions[3], function_data[3];
+
+  fd_listener = (TestFunctionDataListener *)
+      g_object_new (TEST_TYPE_FUNCTION_DATA_LISTENER, NULL);
+  listener = GUM_INVOCATION_LISTENER (fd_listener);
+
+  functions[0] = target_nop_function_a;
+  functions[1] = target_nop_function_b;
+  functions[2] = target_nop_function_a;
+  function_data[0] = "a";
+  function_data[1] = "b";
+  function_data[2] = "b";
+  g_assert_cmpuint (gum_interceptor_attach_many (fixture->interceptor,
+      functions, G_N_ELEMENTS (functions), listener, function_data), ==, 2);
+
+  target_nop_function_a ("badger");
+  g_assert_cmpuint (fd_listener->on_enter_call_count, ==, 1);
+  g_assert_true (fd_listener->last_on_enter_data.function_data ==
+      function_data[0]);
+
+  target_nop_function_b ("snake");
+  g_assert_cmpuint (fd_listener->on_enter_call_count, ==, 2);
+  g_assert_true (fd_listener->last_on_enter_data.function_data ==
+      function_data[1]);
+
+  gum_interceptor_detach (fixture->interceptor, listener);
+
+  target_nop_function_a ("mushroom");
+  g_assert_cmpuint (fd_listener->on_enter_call_count, ==, 2);
+
+  g_object_unref (fd_listener);
+}
+
+TESTCASE (attach_many_performance)
+{
+  GumInvocationListener * listener;
+  gpointer functions[3];
+  GTimer * timer;
+  guint i, j, count;
+  gdouble one_by_one, batched;
+  const guint iterations = 1000;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
+
+  listener = GUM_INVOCATION_LISTENER (test_callback_listener_new ());
+
+  functions[0] = target_nop_function_a;
+  functions[1] = target_nop_function_b;
+  functions[2] = target_nop_function_c;
+
+  timer = g_timer_new ();
+
+  for (i = 0; i != iterations; i++)
+  {
+    for (j = 0; j != G_N_ELEMENTS (functions); j++)
+    {
+      g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+          functions[j], listener, NULL), ==, GUM_ATTACH_OK);
+    }
+    gum_interceptor_detach (fixture->interceptor, listener);
+  }
+
+  one_by_one = g_timer_elapsed (timer, NULL);
+
+  g_timer_reset (timer);
+
+  for (i = 0; i != iterations; i++)
+  {
+    count = gum_interceptor_attach_many (fixture->interceptor, functions,
+        G_N_ELEMENTS (functions), listener, NULL);
+    g_assert_cmpuint (count, ==, G_N_ELEMENTS (functions));
+    gum_interceptor_detach (fixture->interceptor, listener);
+  }
+
+  batched = g_timer_elapsed (timer, NULL);
+
+  g_timer_destroy (timer);
+
+  count = iterations * G_N_ELEMENTS (functions);
+  g_print ("<one by one: %u hooks per second, batched: %u hooks per second> ",
+      (guint) (count / one_by_one), (guint) (count / batched));
+
+  g_object_unref (listener);
+}
+
+/*
+ * Measures what a listener implementing both callbacks costs per call,
+ * with callbacks that do nothing, so that what remains is mostly our own
+ * bookkeeping, including the thread context lookups on enter and leave.
+ */
+TESTCASE (invocation_performance)
+{
+  TestCallbackListener * listener;
+  GTimer * timer;
+  guint i;
+  gdouble duration_direct, duration_hooked;
+  const guint iterations = 1000000;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
+
+  listener = test_callback_listener_new ();
+
+  timer = g_timer_new ();
+
+  for (i = 0; i != iterations; i++)
+    target_nop_function_a (NULL);
+  duration_direct = g_timer_elapsed (timer, NULL);
+
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_nop_function_a, GUM_INVOCATION_LISTENER (listener), NULL),
+      ==, GUM_ATTACH_OK);
+
+  g_timer_reset (timer);
+  for (i = 0; i != iterations; i++)
+    target_nop_function_a (NULL);
+  duration_hooked = g_timer_elapsed (timer, NULL);
+
+  g_timer_destroy (timer);
+
+  g_print ("<overhead per call: %.1f ns> ",
+      (duration_hooked - duration_direct) * 1e9 / iterations);
+
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (listener));
+  g_object_unref (listener);
+}
+
+TESTCASE (listener_data_is_not_shared)
+{
+  TestFunctionDataListener * first, * second, * third;
+
+  first = (TestFunctionDataListener *)
+      g_object_new (TEST_TYPE_FUNCTION_DATA_LISTENER, NULL);
+  second = (TestFunctionDataListener *)
+      g_object_new (TEST_TYPE_FUNCTION_DATA_LISTENER, NULL);
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_nop_function_a, GUM_INVOCATION_LISTENER (first), "a"),
+      ==, GUM_ATTACH_OK);
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_nop_function_a, GUM_INVOCATION_LISTENER (second), "b"),
+      ==, GUM_ATTACH_OK);
+
+  target_nop_function_a ("badger");
+  g_assert_cmpuint (first->init_thread_state_count, ==, 1);
+  g_assert_cmpuint (second->init_thread_state_count, ==, 1);
+  g_assert_cmpstr (first->last_on_leave_data.thread_data.name, ==, "a1");
+  g_assert_cmpstr (second->last_on_leave_data.thread_data.name, ==, "b1");
+  g_assert_cmpstr (first->last_on_leave_data.invocation_data.arg,
+      ==, "badger");
+  g_assert_cmpstr (second->last_on_leave_data.invocation_data.arg,
+      ==, "badger");
+
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (first));
+  g_object_unref (first);
+
+  third = (TestFunctionDataListener *)
+      g_object_new (TEST_TYPE_FUNCTION_DATA_LISTENER, NULL);
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_nop_function_a, GUM_INVOCATION_LISTENER (third), "a"),
+      ==, GUM_ATTACH_OK);
+
+  target_nop_function_a ("snake");
+  g_assert_cmpuint (third->init_thread_state_count, ==, 1);
+  g_assert_cmpuint (second->init_thread_state_count, ==, 1);
+  g_assert_cmpstr (third->last_on_leave_data.thread_data.name, ==, "a1");
+  g_assert_cmpstr (second->last_on_leave_data.thread_data.name, ==, "b1");
+  g_assert_cmpstr (third->last_on_leave_data.invocation_data.arg,
+      ==, "snake");
+  g_assert_cmpstr (second->last_on_leave_data.invocation_data.arg,
+      ==, "snake");
+
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (third));
+  g_object_unref (third);
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (second));
+  g_object_unref (second);
+}
+
+TESTCASE (enter_only_listener)
+{
+  TestEnterListener * listener;
+
+  listener = test_enter_listener_new (fixture->result, 'e');
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_nop_function_a, GUM_INVOCATION_LISTENER (listener), NULL),
+      ==, GUM_ATTACH_OK);
+
+  g_assert_true (target_nop_function_a ("badger") == GSIZE_TO_POINTER (0x1337));
+  g_assert_cmpstr (fixture->result->str, ==, "e");
+  g_assert_cmpuint (listener->on_enter_call_count, ==, 1);
+  g_assert_cmpstr (listener->last_seen_argument, ==, "badger");
+  g_assert_true (listener->last_invocation_was_current);
+  g_assert_null (gum_interceptor_get_current_invocation ());
+
+  gum_interceptor_ignore_current_thread (fixture->interceptor);
+  target_nop_function_a ("snake");
+  gum_interceptor_unignore_current_thread (fixture->interceptor);
+  g_assert_cmpuint (listener->on_enter_call_count, ==, 1);
+
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (listener));
+
+  target_nop_function_a ("mushroom");
+  g_assert_cmpuint (listener->on_enter_call_count, ==, 1);
+
+  g_object_unref (listener);
+}
+
+TESTCASE (enter_only_listener_joined_by_another)
+{
+  TestEnterListener * listener;
+
+  listener = test_enter_listener_new (fixture->result, 'e');
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_function, GUM_INVOCATION_LISTENER (listener), NULL),
+      ==, GUM_ATTACH_OK);
+
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "e|");
+
+  interceptor_fixture_attach (fixture, 0, target_function, '>', '<');
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "e>|<");
+  g_assert_true (fixture->listener_context[0]->last_return_value ==
+      fixture->result);
+
+  interceptor_fixture_detach (fixture, 0);
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "e|");
+  g_assert_cmpuint (listener->on_enter_call_count, ==, 3);
+  g_assert_true (listener->last_invocation_was_current);
+
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (listener));
+  g_object_unref (listener);
+}
+
+TESTCASE (enter_only_listener_replaced)
+{
+  TestEnterListener * first, * second;
+
+  first = test_enter_listener_new (fixture->result, '1');
+  second = test_enter_listener_new (fixture->result, '2');
+
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_function, GUM_INVOCATION_LISTENER (first), NULL),
+      ==, GUM_ATTACH_OK);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "1|");
+
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_function, GUM_INVOCATION_LISTENER (second), NULL),
+      ==, GUM_ATTACH_OK);
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "12|");
+
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (first));
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "2|");
+  g_assert_cmpuint (first->on_enter_call_count, ==, 2);
+  g_assert_cmpuint (second->on_enter_call_count, ==, 2);
+  g_assert_true (second->last_invocation_was_current);
+
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (second));
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "|");
+
+  g_object_unref (second);
+  g_object_unref (first);
+}
+
+TESTCASE (enter_only_listener_on_replaced_function)
+{
+  TestEnterListener * listener;
+  guint target_counter = 0;
+
+  listener = test_enter_listener_new (fixture->result, 'e');
+  g_assert_cmpint (gum_interceptor_attach (fixture->interceptor,
+      target_function, GUM_INVOCATION_LISTENER (listener), NULL),
+      ==, GUM_ATTACH_OK);
+
+  g_assert_cmpint (gum_interceptor_replace (fixture->interceptor,
+      target_function, replacement_target_function, &target_counter),
+      ==, GUM_REPLACE_OK);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "e/|\\");
+
+  gum_interceptor_revert (fixture->interceptor, target_function);
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "e|");
+  g_assert_cmpuint (listener->on_enter_call_count, ==, 2);
+
+  gum_interceptor_detach (fixture->interceptor,
+      GUM_INVOCATION_LISTENER (listener));
+  g_object_unref (listener);
+}
+
 #ifdef HAVE_I386
 
+/*
+ * Only the x86 backend's enter thunk calls through the selected path, the
+ * others always take the generic one.
+ */
+TESTCASE (enter_only_path_selection)
+{
+  GumInterceptor * interceptor = fixture->interceptor;
+  TestEnterListener * first, * second;
+  guint target_counter = 0;
+
+  first = test_enter_listener_new (fixture->result, '1');
+  second = test_enter_listener_new (fixture->result, '2');
+
+  g_assert_cmpint (gum_interceptor_attach (interceptor, target_function,
+      GUM_INVOCATION_LISTENER (first), NULL), ==, GUM_ATTACH_OK);
+  g_assert_true (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_function));
+
+  interceptor_fixture_attach (fixture, 0, target_function, '>', '<');
+  g_assert_false (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_function));
+
+  interceptor_fixture_detach (fixture, 0);
+  g_assert_true (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_function));
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "1|");
+
+  g_assert_cmpint (gum_interceptor_attach (interceptor, target_function,
+      GUM_INVOCATION_LISTENER (second), NULL), ==, GUM_ATTACH_OK);
+  g_assert_false (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_function));
+
+  gum_interceptor_detach (interceptor, GUM_INVOCATION_LISTENER (first));
+  g_assert_true (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_function));
+  g_string_truncate (fixture->result, 0);
+  target_function (fixture->result);
+  g_assert_cmpstr (fixture->result->str, ==, "2|");
+
+  g_assert_cmpint (gum_interceptor_replace (interceptor, target_function,
+      replacement_target_function, &target_counter), ==, GUM_REPLACE_OK);
+  g_assert_false (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_function));
+
+  gum_interceptor_revert (interceptor, target_function);
+  g_assert_true (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_function));
+
+  gum_interceptor_detach (interceptor, GUM_INVOCATION_LISTENER (second));
+
+  g_object_unref (second);
+  g_object_unref (first);
+}
+
+TESTCASE (enter_only_path_performance)
+{
+  GumInterceptor * interceptor = fixture->interceptor;
+  TestEnterListener * listener;
+  GumInvocationListener * passive;
+  GTimer * timer;
+  guint i;
+  gdouble duration_fast, duration_generic;
+  const guint iterations = 1000000;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
+
+  listener = test_enter_listener_new (NULL, 'e');
+  passive = g_object_new (TEST_TYPE_PASSIVE_LISTENER, NULL);
+
+  g_assert_cmpint (gum_interceptor_attach (interceptor, target_nop_function_a,
+      GUM_INVOCATION_LISTENER (listener), NULL), ==, GUM_ATTACH_OK);
+  g_assert_true (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_nop_function_a));
+
+  timer = g_timer_new ();
+
+  for (i = 0; i != iterations; i++)
+    target_nop_function_a (NULL);
+  duration_fast = g_timer_elapsed (timer, NULL);
+
+  g_assert_cmpint (gum_interceptor_attach (interceptor, target_nop_function_a,
+      passive, NULL), ==, GUM_ATTACH_OK);
+  g_assert_false (_gum_interceptor_is_using_enter_only_path (interceptor,
+      target_nop_function_a));
+
+  g_timer_reset (timer);
+  for (i = 0; i != iterations; i++)
+    target_nop_function_a (NULL);
+  duration_generic = g_timer_elapsed (timer, NULL);
+
+  g_timer_destroy (timer);
+
+  g_assert_cmpuint (listener->on_enter_call_count, ==, 2 * iterations);
+
+  g_print ("<enter-only: %u calls per second, generic: %u calls per second, "
+      "ratio=%f> ",
+      (guint) (iterations / duration_fast),
+      (guint) (iterations / duration_generic),
+      duration_generic / duration_fast);
+
+  gum_interceptor_detach (interceptor, passive);
+  gum_interceptor_detach (interceptor, GUM_INVOCATION_LISTENER (listener));
+
+  g_object_unref (passive);
+  g_object_unref (listener);
+}
+
 TESTCASE (cpu_register_clobber)
 {
   GumCpuContext input, output;
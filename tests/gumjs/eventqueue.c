@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2019 Ole André Vadla Ravnås <oleavr@nowsecure.com>
+ *
+ * Licence: wxWindows Library Licence, Version 3.1
+ */
+
+#include "gumeventqueue.h"
+
+#include "testutil.h"
+
+#define TESTCASE(NAME) \
+    void test_event_queue_ ## NAME (void)
+#define TESTENTRY(NAME) \
+    TESTENTRY_SIMPLE ("GumJS/EventQueue", test_event_queue, NAME)
+
+TESTLIST_BEGIN (event_queue)
+  TESTENTRY (drop_newest_should_keep_the_oldest_events)
+  TESTENTRY (drop_oldest_should_keep_the_newest_events)
+  TESTENTRY (block_should_wait_for_the_consumer)
+  TESTENTRY (block_should_not_wait_on_the_consumer_thread)
+  TESTENTRY (block_should_stop_waiting_once_closed)
+  TESTENTRY (drops_of_exited_threads_should_be_reported)
+TESTLIST_END ()
+
+#define TEST_QUEUE_CAPACITY 4
+
+typedef struct _TestProducer TestProducer;
+
+struct _TestProducer
+{
+  GumEventQueue * queue;
+  gsize first;
+  guint n;
+  volatile GumThreadId thread_id;
+};
+
+static void push_exec_events (GumEventQueue * queue, gsize first, guint n);
+static GThread * start_producer (TestProducer * producer,
+    GumEventQueue * queue, gsize first, guint n);
+static gpointer run_producer (gpointer data);
+static void assert_drained_events (GumEventQueue * queue, gsize first,
+    guint n);
+static void assert_drops (GumEventQueue * queue, GumThreadId thread_id,
+    guint count);
+
+TESTCASE (drop_newest_should_keep_the_oldest_events)
+{
+  GumEventQueue * queue;
+
+  queue = gum_event_queue_new (TEST_QUEUE_CAPACITY,
+      GUM_EVENT_QUEUE_DROP_NEWEST);
+
+  push_exec_events (queue, 1, TEST_QUEUE_CAPACITY + 2);
+
+  assert_drained_events (queue, 1, TEST_QUEUE_CAPACITY);
+  assert_drops (queue, gum_process_get_current_thread_id (), 2);
+  assert_drops (queue, 0, 0);
+
+  gum_event_queue_free (queue);
+}
+
+TESTCASE (drop_oldest_should_keep_the_newest_events)
+{
+  GumEventQueue * queue;
+
+  queue = gum_event_queue_new (TEST_QUEUE_CAPACITY,
+      GUM_EVENT_QUEUE_DROP_OLDEST);
+
+  push_exec_events (queue, 1, TEST_QUEUE_CAPACITY + 2);
+
+  assert_drained_events (queue, 3, TEST_QUEUE_CAPACITY);
+  assert_drops (queue, gum_process_get_current_thread_id (), 2);
+  assert_drops (queue, 0, 0);
+
+  gum_event_queue_free (queue);
+}
+
+TESTCASE (block_should_wait_for_the_consumer)
+{
+  GumEventQueue * queue;
+  TestProducer producer;
+  GThread * thread;
+  const guint n = 8 * TEST_QUEUE_CAPACITY;
+  gsize next;
+
+  queue = gum_event_queue_new (TEST_QUEUE_CAPACITY, GUM_EVENT_QUEUE_BLOCK);
+
+  thread = start_producer (&producer, queue, 1, n);
+
+  next = 1;
+  while (next != n + 1)
+  {
+    GumEvent * events;
+    guint n_events, i;
+
+    events = gum_event_queue_drain (queue, &n_events);
+    if (events == NULL)
+    {
+      g_thread_yield ();
+      continue;
+    }
+
+    g_assert_cmpuint (n_events, <=, TEST_QUEUE_CAPACITY);
+    for (i = 0; i != n_events; i++)
+    {
+      g_assert_cmphex (GPOINTER_TO_SIZE (events[i].exec.location), ==, next);
+      next++;
+    }
+
+    g_free (events);
+  }
+
+  g_thread_join (thread);
+
+  assert_drained_events (queue, 0, 0);
+  assert_drops (queue, 0, 0);
+
+  gum_event_queue_free (queue);
+}
+
+TESTCASE (block_should_not_wait_on_the_consumer_thread)
+{
+  GumEventQueue * queue;
+
+  queue = gum_event_queue_new (TEST_QUEUE_CAPACITY, GUM_EVENT_QUEUE_BLOCK);
+
+  assert_drained_events (queue, 0, 0);
+
+  push_exec_events (queue, 1, TEST_QUEUE_CAPACITY + 2);
+
+  assert_drained_events (queue, 1, TEST_QUEUE_CAPACITY);
+  assert_drops (queue, gum_process_get_current_thread_id (), 2);
+
+  gum_event_queue_free (queue);
+}
+
+TESTCASE (block_should_stop_waiting_once_closed)
+{
+  GumEventQueue * queue;
+  TestProducer producer;
+  GThread * thread;
+
+  queue = gum_event_queue_new (TEST_QUEUE_CAPACITY, GUM_EVENT_QUEUE_BLOCK);
+
+  thread = start_producer (&producer, queue, 1, 2 * TEST_QUEUE_CAPACITY);
+  gum_event_queue_close (queue);
+  g_thread_join (thread);
+
+  assert_drained_events (queue, 1, TEST_QUEUE_CAPACITY);
+  assert_drops (queue, producer.thread_id, TEST_QUEUE_CAPACITY);
+
+  gum_event_queue_free (queue);
+}
+
+TESTCASE (drops_of_exited_threads_should_be_reported)
+{
+  GumEventQueue * queue;
+  TestProducer producer;
+
+  queue = gum_event_queue_new (TEST_QUEUE_CAPACITY,
+      GUM_EVENT_QUEUE_DROP_NEWEST);
+
+  g_thread_join (start_producer (&producer, queue, 1,
+      TEST_QUEUE_CAPACITY + 3));
+
+  assert_drained_events (queue, 1, TEST_QUEUE_CAPACITY);
+  assert_drops (queue, producer.thread_id, 3);
+
+  assert_drained_events (queue, 0, 0);
+  assert_drops (queue, 0, 0);
+
+  gum_event_queue_free (queue);
+}
+
+static void
+push_exec_events (GumEventQueue * queue,
+                  gsize first,
+                  guint n)
+{
+  GumEvent * events;
+  guint i;
+
+  events = g_new (GumEvent, n);
+  for (i = 0; i != n; i++)
+  {
+    events[i].exec.type = GUM_EXEC;
+    events[i].exec.location = GSIZE_TO_POINTER (first + i);
+  }
+
+  gum_event_queue_push (queue, events, n);
+
+  g_free (events);
+}
+
+static GThread *
+start_producer (TestProducer * producer,
+                GumEventQueue * queue,
+                gsize first,
+                guint n)
+{
+  producer->queue = queue;
+  producer->first = first;
+  producer->n = n;
+  producer->thread_id = 0;
+
+  return g_thread_new ("event-queue-producer", run_producer, producer);
+}
+
+static gpointer
+run_producer (gpointer data)
+{
+  TestProducer * producer = data;
+
+  producer->thread_id = gum_process_get_current_thread_id ();
+
+  push_exec_events (producer->queue, producer->first, producer->n);
+
+  return NULL;
+}
+
+static void
+assert_drained_events (GumEventQueue * queue,
+                       gsize first,
+                       guint n)
+{
+  GumEvent * events;
+  guint n_events, i;
+
+  events = gum_event_queue_drain (queue, &n_events);
+  g_assert_cmpuint (n_events, ==, n);
+  g_assert_true ((events != NULL) == (n != 0));
+
+  for (i = 0; i != n_events; i++)
+  {
+    g_assert_cmpint (events[i].type, ==, GUM_EXEC);
+    g_assert_cmphex (GPOINTER_TO_SIZE (events[i].exec.location), ==,
+        first + i);
+  }
+
+  g_free (events);
+}
+
+static void
+assert_drops (GumEventQueue * queue,
+              GumThreadId thread_id,
+              guint count)
+{
+  GArray * drops;
+
+  drops = gum_event_queue_collect_drops (queue);
+
+  if (count != 0)
+  {
+    GumEventQueueDrop * drop;
+
+    g_assert_cmpuint (drops->len, ==, 1);
+
+    drop = &g_array_index (drops, GumEventQueueDrop, 0);
+    g_assert_cmpuint (drop->thread_id, ==, thread_id);
+    g_assert_cmpuint (drop->count, ==, count);
+  }
+  else
+  {
+    g_assert_cmpuint (drops->len, ==, 0);
+  }
+
+  g_array_free (drops, TRUE);
+}
@@ -272,9 +272,14 @@ TESTLIST_BEGIN (script)
 #if defined (HAVE_I386) || defined (HAVE_ARM64)
     TESTENTRY (execution_can_be_traced)
     TESTENTRY (execution_can_be_traced_with_custom_transformer)
+#ifdef HAVE_I386
+    TESTENTRY (execution_can_be_traced_with_event_buffer)
+#endif
     TESTENTRY (call_can_be_probed)
 #endif
     TESTENTRY (stalker_events_can_be_parsed)
+    TESTENTRY (stalker_compact_events_can_be_parsed)
+    TESTENTRY (stalker_queue_overflow_policy_can_be_configured)
   TESTGROUP_END ()
 
   TESTENTRY (script_can_be_compiled_to_bytecode)
@@ -2293,6 +2298,43 @@ TESTCASE (execution_can_be_traced)
   EXPECT_SEND_MESSAGE_WITH ("\"onReceive: true\"");
 }
 
+#ifdef HAVE_I386
+
+TESTCASE (execution_can_be_traced_with_event_buffer)
+{
+  GumThreadId test_thread_id;
+
+  if (!g_test_slow ())
+  {
+    g_print ("<skipping, run in slow mode> ");
+    return;
+  }
+
+  test_thread_id = gum_process_get_current_thread_id ();
+
+  COMPILE_AND_LOAD_SCRIPT (
+    "Stalker.eventBufferCapacity = 1000;"
+    "send(Stalker.eventBufferCapacity);"
+    "Stalker.follow(%" G_GSIZE_FORMAT ", {"
+    "  events: {"
+    "    call: true"
+    "  },"
+    "  onReceive: function (events) {"
+    "    send('onReceive: ' + (events.byteLength > 0));"
+    "  }"
+    "});"
+    "recv('stop', function (message) {"
+    "  Stalker.unfollow(%" G_GSIZE_FORMAT ");"
+    "  Stalker.eventBufferCapacity = 0;"
+    "});", test_thread_id, test_thread_id);
+  EXPECT_SEND_MESSAGE_WITH ("1024");
+  g_usleep (1);
+  POST_MESSAGE ("{\"type\":\"stop\"}");
+  EXPECT_SEND_MESSAGE_WITH ("\"onReceive: true\"");
+}
+
+#endif
+
 TESTCASE (execution_can_be_traced_with_custom_transformer)
 {
   GumThreadId test_thread_id;
@@ -2387,6 +2429,60 @@ TESTCASE (stalker_events_can_be_parsed)
   EXPECT_ERROR_MESSAGE_WITH (ANY_LINE_NUMBER, "Error: invalid event type");
 }
 
+TESTCASE (stalker_compact_events_can_be_parsed)
+{
+  GumEvent events[3];
+  gpointer data;
+  gsize size;
+
+  events[0].type = GUM_CALL;
+  events[0].call.location = GSIZE_TO_POINTER (0x1000);
+  events[0].call.target = GSIZE_TO_POINTER (0x2000);
+  events[0].call.depth = 1;
+
+  events[1].type = GUM_BLOCK;
+  events[1].block.begin = GSIZE_TO_POINTER (0x2000);
+  events[1].block.end = GSIZE_TO_POINTER (0x2010);
+
+  events[2].type = GUM_RET;
+  events[2].ret.location = GSIZE_TO_POINTER (0x200c);
+  events[2].ret.target = GSIZE_TO_POINTER (0x1005);
+  events[2].ret.depth = 0;
+
+  data = gum_compact_events_encode (events, G_N_ELEMENTS (events), &size);
+  g_assert_cmpuint (size, <, sizeof (GumEvent));
+
+  COMPILE_AND_LOAD_SCRIPT ("send(Stalker.parse(" GUM_PTR_CONST ".readByteArray("
+      "%" G_GSIZE_FORMAT "), { format: 'compact', stringify: true }));",
+      data, size);
+  EXPECT_SEND_MESSAGE_WITH ("[[\"call\",\"0x1000\",\"0x2000\",1],"
+      "[\"block\",\"0x2000\",\"0x2010\"],"
+      "[\"ret\",\"0x200c\",\"0x1005\",0]]");
+
+  COMPILE_AND_LOAD_SCRIPT ("Stalker.parse(" GUM_PTR_CONST ".readByteArray("
+      "%" G_GSIZE_FORMAT "), { format: 'compact' });", data, size - 1);
+  EXPECT_ERROR_MESSAGE_WITH (ANY_LINE_NUMBER, "Error: invalid event data");
+
+  g_free (data);
+}
+
+TESTCASE (stalker_queue_overflow_policy_can_be_configured)
+{
+  COMPILE_AND_LOAD_SCRIPT (
+      "send(Stalker.queueOverflowPolicy);"
+      "Stalker.queueOverflowPolicy = 'drop-oldest';"
+      "send(Stalker.queueOverflowPolicy);"
+      "Stalker.queueOverflowPolicy = 'block';"
+      "send(Stalker.queueOverflowPolicy);");
+  EXPECT_SEND_MESSAGE_WITH ("\"drop-newest\"");
+  EXPECT_SEND_MESSAGE_WITH ("\"drop-oldest\"");
+  EXPECT_SEND_MESSAGE_WITH ("\"block\"");
+
+  COMPILE_AND_LOAD_SCRIPT ("Stalker.queueOverflowPolicy = 'discard';");
+  EXPECT_ERROR_MESSAGE_WITH (ANY_LINE_NUMBER,
+      "Error: expected 'drop-newest', 'drop-oldest' or 'block'");
+}
+
 TESTCASE (frida_version_is_available)
 {
   COMPILE_AND_LOAD_SCRIPT ("send(typeof Frida.version);");
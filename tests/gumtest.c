@@ -174,6 +174,8 @@ main (gint argc, gchar * argv[])
   TESTLIST_REGISTER (cloak);
   TESTLIST_REGISTER (memory);
   TESTLIST_REGISTER (process);
+  TESTLIST_REGISTER (compact_event);
+  TESTLIST_REGISTER (file_event_sink);
 #if !defined (HAVE_QNX) && !(defined (HAVE_ANDROID) && defined (HAVE_ARM64))
   TESTLIST_REGISTER (symbolutil);
 #endif
@@ -286,6 +288,8 @@ main (gint argc, gchar * argv[])
     if (gum_kernel_api_is_available ())
       TESTLIST_REGISTER (kscript);
 # endif
+
+    TESTLIST_REGISTER (event_queue);
   }
 #endif
 
@@ -10,8 +10,13 @@ static void gum_fake_event_sink_iface_init (gpointer g_iface,
     gpointer iface_data);
 static void gum_fake_event_sink_finalize (GObject * obj);
 static GumEventType gum_fake_event_sink_query_mask (GumEventSink * sink);
+static gboolean gum_fake_event_sink_query_call_summary (GumEventSink * sink);
 static void gum_fake_event_sink_process (GumEventSink * sink,
     const GumEvent * ev);
+static void gum_fake_event_sink_process_batch (GumEventSink * sink,
+    const GumEvent * events, guint n_events);
+static void gum_fake_event_sink_process_call_summary (GumEventSink * sink,
+    const GumCallCount * counts, guint n_counts);
 
 G_DEFINE_TYPE_EXTENDED (GumFakeEventSink,
                         gum_fake_event_sink,
@@ -35,13 +40,17 @@ gum_fake_event_sink_iface_init (gpointer g_iface,
   GumEventSinkInterface * iface = g_iface;
 
   iface->query_mask = gum_fake_event_sink_query_mask;
+  iface->query_call_summary = gum_fake_event_sink_query_call_summary;
   iface->process = gum_fake_event_sink_process;
+  iface->process_batch = gum_fake_event_sink_process_batch;
+  iface->process_call_summary = gum_fake_event_sink_process_call_summary;
 }
 
 static void
 gum_fake_event_sink_init (GumFakeEventSink * self)
 {
   self->events = g_array_sized_new (FALSE, FALSE, sizeof (GumEvent), 16384);
+  self->call_counts = g_hash_table_new_full (NULL, NULL, NULL, g_free);
 }
 
 static void
@@ -50,6 +59,7 @@ gum_fake_event_sink_finalize (GObject * obj)
   GumFakeEventSink * self = GUM_FAKE_EVENT_SINK (obj);
 
   g_array_free (self->events, TRUE);
+  g_hash_table_unref (self->call_counts);
 
   G_OBJECT_CLASS (gum_fake_event_sink_parent_class)->finalize (obj);
 }
@@ -69,6 +79,19 @@ gum_fake_event_sink_reset (GumFakeEventSink * self)
 {
   self->mask = 0;
   g_array_set_size (self->events, 0);
+  self->batch_count = 0;
+  g_hash_table_remove_all (self->call_counts);
+}
+
+guint64
+gum_fake_event_sink_get_call_count (GumFakeEventSink * self,
+                                    gpointer target)
+{
+  guint64 * count;
+
+  count = g_hash_table_lookup (self->call_counts, target);
+
+  return (count != NULL) ? *count : 0;
 }
 
 const GumCallEvent *
@@ -140,6 +163,14 @@ gum_fake_event_sink_query_mask (GumEventSink * sink)
   return self->mask;
 }
 
+static gboolean
+gum_fake_event_sink_query_call_summary (GumEventSink * sink)
+{
+  GumFakeEventSink * self = GUM_FAKE_EVENT_SINK (sink);
+
+  return self->call_summary;
+}
+
 static void
 gum_fake_event_sink_process (GumEventSink * sink,
                              const GumEvent * ev)
@@ -148,3 +179,37 @@ gum_fake_event_sink_process (GumEventSink * sink,
 
   g_array_append_val (self->events, *ev);
 }
+
+static void
+gum_fake_event_sink_process_batch (GumEventSink * sink,
+                                   const GumEvent * events,
+                                   guint n_events)
+{
+  GumFakeEventSink * self = GUM_FAKE_EVENT_SINK (sink);
+
+  g_array_append_vals (self->events, events, n_events);
+  self->batch_count++;
+}
+
+static void
+gum_fake_event_sink_process_call_summary (GumEventSink * sink,
+                                          const GumCallCount * counts,
+                                          guint n_counts)
+{
+  GumFakeEventSink * self = GUM_FAKE_EVENT_SINK (sink);
+  guint i;
+
+  for (i = 0; i != n_counts; i++)
+  {
+    guint64 * count;
+
+    count = g_hash_table_lookup (self->call_counts, counts[i].target);
+    if (count == NULL)
+    {
+      count = g_new0 (guint64, 1);
+      g_hash_table_insert (self->call_counts, counts[i].target, count);
+    }
+
+    *count += counts[i].count;
+  }
+}
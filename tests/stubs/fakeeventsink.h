@@ -21,13 +21,19 @@ struct _GumFakeEventSink
   GObject parent;
 
   GumEventType mask;
+  gboolean call_summary;
   GArray * events;
+  guint batch_count;
+  GHashTable * call_counts;
 };
 
 GumEventSink * gum_fake_event_sink_new (void);
 
 void gum_fake_event_sink_reset (GumFakeEventSink * self);
 
+guint64 gum_fake_event_sink_get_call_count (GumFakeEventSink * self,
+    gpointer target);
+
 const GumCallEvent * gum_fake_event_sink_get_nth_event_as_call (
     GumFakeEventSink * self, guint n);
 const GumRetEvent * gum_fake_event_sink_get_nth_event_as_ret (